@@ -4,6 +4,7 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
@@ -14,46 +15,140 @@
 #include <sstream>
 
 extern "C" {
-    #include "select_call.h"
+    #include "clock.h"
+    #include "fec.h"
+    #include "log.h"
+    #include "trace.h"
 }
 
-#include "cpe464.h"
-
 #include "Client.h"
+#include "Codec.h"
 #include "Exception.h"
 
 //~ #define DEBUG_CHLD
 
-Client::Client(const std::string &from, const std::string &to,
-               unsigned int bufferSize, float errorPercent,
-               unsigned int windowSize, const std::string &remoteMachine,
-               const std::string &remotePort) :
-mvFromName(from),
+#ifndef DEBUG_CHLD
+    #define RECV_TIMEOUT_US 1000000
+#else
+    #define RECV_TIMEOUT_US -1 // Wait for good while a debugger holds us
+#endif
+
+#define MTU_PROBE_TRIES 3     // Probes sent per candidate payload size
+#define MTU_PROBE_USEC 250000 // Time to wait for each probe's reply
+
+#define HANDLE_BATCH 64 // Packets taken per Handle(), so one busy download
+                        // can't hold up the rest of an event loop
+
+Client::Client(const Remote &from, const std::string &to,
+               const DownloadOptions &options) :
 mvToName(to),
-mvBufferSize(bufferSize),
-mvErrorPercent(errorPercent),
-mvWindowSize(windowSize),
-mvRemoteMachine(remoteMachine),
-mvRemotePort(atoi(remotePort.c_str())),
-mvRetries(PKT_TRNSMAX),
-mvSequence(0),
-mvState(INIT) {
-    // Get socket
-    if ((mvSocket = GetSocket(*(sockaddr_in *)&mvAddr)) == -1) {
-        throw Exception(__LINE__, "GetSocket: ", strerror(errno));
-    }
-    mvAddrLen = sizeof(mvAddr);
+mvTo(-1),
+mvBuffer(NULL),
+mvCapacity(0) {
+    setup(from, options);
     
     // Open local target file
     if ((mvTo = creat(mvToName.c_str(), S_IRWXU)) == -1) {
+        close(mvSocket);
         throw Exception(__LINE__, "creat", strerror(errno));
     }
 }
 
+Client::Client(const Remote &from, void *to, size_t size,
+               const DownloadOptions &options) :
+mvTo(-1),
+mvBuffer((char *)to),
+mvCapacity(size) {
+    setup(from, options);
+}
+
+void Client::setup(const Remote &from, const DownloadOptions &options) {
+    mvFromName = from.path;
+    mvBufferSize = options.bufferSize;
+    mvWindowSize = options.windowSize;
+    mvRemoteMachine = from.host;
+    mvRemotePort = atoi(from.port.c_str());
+    mvConnection = 0;
+    mvDeadline = UINT64_MAX;
+    mvRetries = PKT_TRNSMAX;
+    mvSequence = 0;
+    mvInitNext = 0;
+    mvCookie = 0;
+    mvProbeCeiling = 0;
+    mvProbe = 0;
+    mvProbeSize = 0;
+    mvProbeTries = 0;
+    mvProbeFound = 0;
+    mvProbed = false;
+    mvFecN = options.fecGroup;
+    mvFecK = options.fecParity;
+    mvGroupBase = 0;
+    mvDone = false;
+    mvEofSequence = 0;
+    mvStartTime = 0;
+    mvFirstByteTime = 0;
+    mvBytes = 0;
+    mvState = INIT;
+    xxh3_init(&mvHash);
+    
+    // The name has to fit the handshake's packet
+    if (mvFromName.length() >= sizeof(((packet *)NULL)->data)) {
+        throw Exception(__LINE__, "Remote file name", "too long");
+    }
+    
+    // The window size shares its packet with the ARQ policy
+    if (mvWindowSize > PKT_WIN_SIZEMASK) {
+        mvWindowSize = PKT_WIN_SIZEMASK;
+    }
+    
+    fecFit();
+    
+    // Get socket
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    if ((mvSocket = GetSocket(*(sockaddr_in *)&addr)) == -1) {
+        throw Exception(__LINE__, "GetSocket: ", strerror(errno));
+    }
+    mvLink = UdpLink(UdpSocket(mvSocket, addr, sizeof(addr)), PKT_HDRSZ);
+    if (options.busyPollUs > 0 &&
+        mvLink.GetSocket().BusyPoll(options.busyPollUs) == -1) {
+        LOG(LOGL_INFO, "SO_BUSY_POLL (%d): %s.  Spinning anyway.", __LINE__,
+            strerror(errno));
+    }
+}
+
+/* Parity only arrives once a whole group has been sent, so a group can't
+   be larger than the window */
+void Client::fecFit() {
+    if (mvFecN > mvWindowSize) {
+        mvFecN = mvWindowSize;
+    }
+    if (mvFecN > FEC_NMAX) {
+        mvFecN = FEC_NMAX;
+    }
+    if (mvFecK > mvFecN || mvFecN < 2) {
+        mvFecK = mvFecN < 2 ? 0 : mvFecN;
+    }
+    if (mvFecK == 0) {
+        mvFecN = 0;
+    }
+    mvGroup.assign(mvFecN, (packet *)NULL);
+    mvParity.assign(mvFecK, (packet *)NULL);
+}
+
 Client::~Client() {
-    close(mvTo);
+    for (uint64_t s = mvSequence; mvWindow.HeldCount() > 0 &&
+         s < mvSequence + mvWindowSize; s++) {
+        if (mvWindow.Held(s)) {
+            free(mvWindow[s]);
+            mvWindow.Unhold(s);
+        }
+    }
+    fecReset(0);
+    if (mvTo != -1) {
+        close(mvTo);
+    }
     close(mvSocket);
-    close(mvOldSocket);
 }
 
 int Client::GetSocket(sockaddr_in &remote) {
@@ -65,7 +160,11 @@ int Client::GetSocket(sockaddr_in &remote) {
     }
     
     remote.sin_family = AF_INET;
-    hp = gethostbyname(mvRemoteMachine.c_str());
+    if ((hp = gethostbyname(mvRemoteMachine.c_str())) == NULL) {
+        close(sk);
+        errno = EHOSTUNREACH;
+        return -1;
+    }
     memcpy(&remote.sin_addr, hp->h_addr, hp->h_length);
     
     remote.sin_port = htons(mvRemotePort);
@@ -73,20 +172,41 @@ int Client::GetSocket(sockaddr_in &remote) {
     return sk;
 }
 
+ssize_t Client::send(packet &pkt) {
+    ConnectionFrame::Stamp(&pkt, mvConnection);
+    return mvLink.Send(&pkt, pktlen(&pkt));
+}
+
 int Client::Run() {
-    while (mvState != DONE && mvState != ERROR && mvRetries > 0) {
-        switch (mvState) {
-            case INIT:
-                mvState = init();
-                break;
-            case RECV_PACKETS:
-                mvState = recvPackets();
-                break;
-            default:
-            break;
-        }
+    packet inpkt;
+    ssize_t len;
+    
+    TRACE_BEGIN("rcopy");
+    
+    Start();
+    while (!Done()) {
+        uint64_t now = clock_usec();
+        long wait = mvDeadline == UINT64_MAX ? -1 :
+                    mvDeadline > now ? mvDeadline - now : 0;
+        step(mvLink.Recv(inpkt, len, wait), inpkt);
     }
-
+    
+    if (mvResult.bufferSize > 0) {
+        std::cout << "Negotiated payload size: " << mvResult.bufferSize
+                  << " bytes" << std::endl;
+    }
+    if (mvState == DONE) {
+        char hex[2 * XXH128_SIZE + 1];
+        
+        xxh128_hex(&mvResult.hash, hex);
+        std::cout << "Integrity verified.  xxh128 0x" << hex << std::endl;
+    } else if (!mvResult.error.empty()) {
+        std::cerr << mvResult.error << std::endl;
+    }
+    
+    printStats();
+    TRACE_END();
+    
     if (mvState == ERROR) {
         std::cout << "Error receiving file.  Exiting." << std::endl;
         return 1;
@@ -102,206 +222,705 @@ int Client::Run() {
     return 0;
 }
 
-int Client::recvPacket(packet &buf) {
-    #ifndef DEBUG_CHLD
-        // Check for timeout
-        if (select_call(mvSocket, 1, 0) == 0) {
-            std::cerr << "Server timed out.  Retries left: " << mvRetries--
-                      << std::endl;
-            return 2;
+void Client::Start() {
+    mvStartTime = clock_usec();
+    mvState = sendInit();
+    if (Done()) {
+        finish();
+    }
+}
+
+void Client::Handle() {
+    packet inpkt;
+    ssize_t len;
+    LinkStatus status;
+    
+    for (int i = 0; i < HANDLE_BATCH && !Done() &&
+         (status = mvLink.Recv(inpkt, len, 0)) != LINK_TIMEOUT; i++) {
+        step(status, inpkt);
+    }
+    if (!Done() && clock_usec() >= mvDeadline) {
+        step(LINK_TIMEOUT, inpkt);
+    }
+}
+
+bool Client::Done() const {
+    return mvState == DONE || mvState == ERROR || mvRetries <= 0;
+}
+
+void Client::arm(long timeoutUs) {
+    mvDeadline = timeoutUs < 0 ? UINT64_MAX : clock_usec() + timeoutUs;
+}
+
+/* Moves the state machine on by one packet, or by a timeout */
+void Client::step(LinkStatus status, packet &inpkt) {
+    if (mvState == PROBE_MTU) {
+        // Probes have timeouts of their own, and don't count as retries
+        mvState = probeMtu(status, inpkt);
+    } else if (status == LINK_OK && inpkt.type == PKT_TYPE_PTH) {
+        // The server heard from us at an address it didn't know, such as
+        // a NAT's new mapping.  Sending its challenge back from here shows
+        // it that it's really us.
+        if (send(inpkt) == -1) {
+            LOG(LOGL_INFO, "sendto (%d): %s", __LINE__, strerror(errno));
         }
+    } else {
+        // Every packet, wanted or not, earns the server another full wait
+        int r = recvPacket(status, inpkt);
+        arm(RECV_TIMEOUT_US);
         
-        mvRetries = PKT_TRNSMAX;
-    #endif
-
-    // Receive packets
-    if (recvfrom(mvSocket, &buf, sizeof(packet), 0,
-                 (sockaddr *)&mvAddr, &mvAddrLen) == -1) {
-        std::cerr << "recvfrom (" << __LINE__ << "): " << strerror(errno)
-                  << std::endl;
-        return 1;
+        switch (mvState) {
+        case INIT:
+            mvState = init(r, inpkt);
+            break;
+        case RECV_PACKETS:
+            mvState = recvPackets(r, inpkt);
+            break;
+        case VERIFY:
+            mvState = verify(r, inpkt);
+            break;
+        default:
+            break;
+        }
     }
     
-    // Verify packet checksum
-    uint16_t ck = buf.checksum;
-    buf.checksum = 0;
+    if (Done()) {
+        finish();
+    }
+}
 
-    if ((buf.checksum = in_cksum((unsigned short*)&buf, sizeof(packet)))
-        != ck) {
-        std::cerr << "Received packet with bad checksum.  Expected 0x"
-                  << std::hex << ck << ", received 0x" << std::hex
-                  << buf.checksum << std::endl
-                  << "Sequence: " << std::dec << buf.sequence << std::endl
-                  << "Retries left: " << std::dec << mvRetries-- << std::endl;
+void Client::finish() {
+    uint64_t now = clock_usec();
+    
+    mvResult.status = mvState == DONE ? 0 : 1;
+    if (mvResult.status != 0 && mvResult.error.empty()) {
+        mvResult.error = mvRetries <= 0 ? "Maximum number of retries reached"
+                                        : "Error receiving file";
+    }
+    mvResult.bytes = mvBytes;
+    mvResult.hash = xxh3_digest(&mvHash);
+    mvResult.elapsedUs = now - mvStartTime;
+    mvResult.ttfbUs = mvFirstByteTime ? mvFirstByteTime - mvStartTime : 0;
+    mvDeadline = UINT64_MAX;
+}
+
+void Client::printStats() {
+    // One key=value line, for scripts like bench.sh to pick up
+    std::cout << "rcopy stats: bytes=" << mvResult.bytes
+              << " elapsed_us=" << mvResult.elapsedUs
+              << " ttfb_us=" << mvResult.ttfbUs
+              << " cpu_us=" << cpu_usec() << std::endl;
+}
+
+int Client::recvPacket(LinkStatus status, packet &buf) {
+    switch (status) {
+    case LINK_TIMEOUT:
+        TRACE_EVENT(TRACE_TIMEOUT, mvSequence, 0);
+        LOG(LOGL_WARN, "Server timed out.  Retries left: %d", mvRetries);
+        mvRetries--;
         return 2;
+    case LINK_FAILED:
+        LOG(LOGL_ERROR, "recvfrom (%d): %s", __LINE__, strerror(errno));
+        return 1;
+    case LINK_CORRUPT:
+        mvRetries = PKT_TRNSMAX;
+        TRACE_EVENT(TRACE_BADCK, buf.sequence, buf.type);
+        LOG(LOGL_INFO, "Received packet with bad checksum.  Sequence: %llu.  "
+            "Retries left: %d", (unsigned long long)buf.sequence, mvRetries);
+        mvRetries--;
+        return 3;
+    default:
+        mvRetries = PKT_TRNSMAX;
+        TRACE_EVENT(TRACE_RECV, buf.sequence, buf.type);
+        return 0;
     }
-    
-    return 0;
 }
 
 int Client::writeTo(packet &in) {
-    if (write(mvTo, in.data, in.size) == -1) {
-        std::cerr << "write (" << __LINE__ << "): " << strerror(errno)
-                  << std::endl;
+    if (mvTo == -1) {
+        if (in.size > mvCapacity - mvBytes) {
+            mvResult.error = "File doesn't fit the buffer";
+            return 1;
+        }
+        memcpy(mvBuffer + mvBytes, in.data, in.size);
+    } else if (write(mvTo, in.data, in.size) == -1) {
+        LOG(LOGL_ERROR, "write (%d): %s", __LINE__, strerror(errno));
         return 1;
     }
+    
+    if (mvFirstByteTime == 0) {
+        mvFirstByteTime = clock_usec();
+    }
+    mvBytes += in.size;
+    
+    // Packets only get here once, in order, so the hash streams along
+    xxh3_update(&mvHash, in.data, in.size);
     return 0;
 }
 
-Client::State Client::init() {
-    // Build packets
-    packet pkt[5];
-    
-    // connection packet
-    memset(&pkt[0], PKT_TYPE_CXN, sizeof(packet));
-    pkt[0].checksum = 0;
-    pkt[0].sequence = 0;
-    pkt[0].checksum = in_cksum((unsigned short *)&pkt[0], sizeof(packet));
-    
-    // 2nd stage connection response
-    memset(&pkt[1], PKT_TYPE_CXN2, sizeof(packet));
-    pkt[1].sequence = 1;
-    pkt[1].checksum = 0;
-    pkt[1].checksum = in_cksum((unsigned short *)&pkt[1], sizeof(packet));
-    
-    // buffer size packet
-    memset(&pkt[2], PKT_TYPE_BUF, sizeof(packet));
-    pkt[2].size = mvBufferSize;
-    pkt[2].sequence = 2;
-    pkt[2].checksum = 0;
-    pkt[2].checksum = in_cksum((unsigned short *)&pkt[2], sizeof(packet));
-
-    // window size packet
-    memset(&pkt[3], PKT_TYPE_WIN, sizeof(packet));
-    pkt[3].size = mvWindowSize;
-    pkt[3].sequence = 3;
-    pkt[3].checksum = 0;
-    pkt[3].checksum = in_cksum((unsigned short *)&pkt[3], sizeof(packet));
-
-    // file name packet
-    memset(&pkt[4], PKT_TYPE_FLN, sizeof(packet));
-    memcpy(pkt[4].data, mvFromName.c_str(), mvFromName.length()+1);
-    pkt[4].data[mvFromName.length()] = '\0';
-    pkt[4].sequence = 4;
-    pkt[4].checksum = 0;
-    pkt[4].checksum = in_cksum((unsigned short *)&pkt[4], sizeof(packet));
-    
-    // Send packets
-    int sk; // new socket
-    mvOldSocket = mvSocket;
-    sockaddr_storage addr;
-    for (int i = 0; i < 5 && mvRetries > 0; i++) {
-        packet inpkt;
-        int r;
-        
-        // Send packet
-        if (sendtoErr(mvSocket, &pkt[i], sizeof(packet), 0, (sockaddr *)&mvAddr,
-                      mvAddrLen) == -1) {
-            std::cerr << "sendto (" << __LINE__ << "): " << strerror(errno)
-                      << std::endl;
-            return ERROR;
+Client::State Client::deliver(packet &in) {
+    mvSequence++;
+    TRACE_EVENT(TRACE_SLIDE, mvSequence, 1);
+    
+    if (writeTo(in) == 1) {
+        return ERROR;
+    }
+    
+    if (in.type == PKT_TYPE_DAT && in.size < mvBufferSize) {
+        // A valid, less-than-maximum sized packet indicates end-of-file.
+        // Acknowledge it and wait for the hash.
+        mvEofSequence = in.sequence;
+        return VERIFY;
+    }
+    return RECV_PACKETS;
+}
+
+void Client::setPmtuDisc(int mode) {
+    #ifdef IP_MTU_DISCOVER
+        if (setsockopt(mvSocket, IPPROTO_IP, IP_MTU_DISCOVER, &mode,
+                       sizeof(mode)) == -1) {
+            LOG(LOGL_WARN, "setsockopt (%d): %s", __LINE__, strerror(errno));
         }
+    #endif
+}
+
+// Candidate payload sizes, largest first.  Anything at or below PKT_DMAX is
+// assumed to fit without asking.
+static const unsigned int probeSizes[] = { PKT_DMAX_LIMIT, PKT_DMAX_JUMBO };
+
+Client::State Client::startProbe(unsigned int ceiling) {
+    mvProbeCeiling = ceiling;
+    mvProbeFound = ceiling < PKT_DMAX ? ceiling : PKT_DMAX;
+    mvProbe = 0;
+    mvProbeSize = 0;
+    
+    if (ceiling <= PKT_DMAX) {
+        return endProbe();
+    }
+    
+    // Forbid fragmentation so oversized probes fail instead of getting
+    // quietly split up
+    #ifdef IP_PMTUDISC_DO
+        setPmtuDisc(IP_PMTUDISC_DO);
+    #endif
+    
+    return nextProbe();
+}
+
+Client::State Client::nextProbe() {
+    while (mvProbe < sizeof(probeSizes) / sizeof(probeSizes[0])) {
+        unsigned int size = probeSizes[mvProbe] < mvProbeCeiling ?
+                            probeSizes[mvProbe] : mvProbeCeiling;
+        mvProbe++;
         
-        // Receive packet
-        if ((r = recvPacket(inpkt)) == 1) {
-            return ERROR;
-        } else if (r == 2) {
-            i--;
+        if (size <= mvProbeFound || size == mvProbeSize) {
             continue;
         }
+        mvProbeSize = size;
+        mvProbeTries = 0;
+        return sendProbe();
+    }
+    
+    #ifdef IP_PMTUDISC_WANT
+        setPmtuDisc(IP_PMTUDISC_WANT);
+    #endif
+    
+    return endProbe();
+}
+
+Client::State Client::sendProbe() {
+    packet probe;
+    
+    if (mvProbeTries++ >= MTU_PROBE_TRIES) {
+        return nextProbe();
+    }
+    
+    memset(&probe, PKT_TYPE_PRB, PKT_HDRSZ + mvProbeSize);
+    probe.sequence = 0;
+    probe.size = mvProbeSize;
+    mvLink.Seal(&probe, pktlen(&probe));
+    
+    if (send(probe) == -1) {
+        // EMSGSIZE means a local interface or a cached path MTU is already
+        // smaller than the probe
+        return nextProbe();
+    }
+    
+    arm(MTU_PROBE_USEC);
+    return PROBE_MTU;
+}
+
+Client::State Client::probeMtu(LinkStatus status, packet &inpkt) {
+    if (status == LINK_OK && inpkt.type == PKT_TYPE_MTU &&
+        inpkt.size == mvProbeSize) {
+        mvProbeFound = mvProbeSize;
+        mvProbe = sizeof(probeSizes) / sizeof(probeSizes[0]);
+        return nextProbe();
+    } else if (status == LINK_OK || status == LINK_CORRUPT) {
+        // Not the answer.  Keep waiting for it.
+        arm(MTU_PROBE_USEC);
+        return PROBE_MTU;
+    }
+    return sendProbe();
+}
+
+/* Tells the server the payload size probing settled on, and carries on
+   with the handshake */
+Client::State Client::endProbe() {
+    // Parity packets carry a few bytes more than data
+    unsigned int extra = mvFecN > 0 ? PKT_FECSZ : 0;
+    
+    mvBufferSize = mvProbeFound - extra;
+    mvResult.bufferSize = mvBufferSize;
+    mvProbed = true;
+    return sendInit();
+}
+
+/* Builds the handshake's request with sequence i */
+void Client::encodeInit(int i, packet &pkt) {
+    switch (i) {
+    case 0:
+        // connection packets.  The second carries the server's cookie.
+        CxnFrame::Encode(&pkt);
+        break;
+    case 1:
+        Cxn2Frame::Encode(&pkt, mvCookie);
+        break;
+    case 2:
+        // buffer size packet, once the path MTU has been probed
+        BufFrame::Encode(&pkt, 2, mvBufferSize);
+        break;
+    case 3:
+        // window size packet, naming the ARQ policy we were built with
+        WinFrame::Encode(&pkt, 3, mvWindowSize, ArqPolicy::ID);
+        break;
+    case 4:
+        // forward error correction packet
+        FecFrame::Encode(&pkt, 4, mvFecN, mvFecK);
+        break;
+    default:
+        // file name packet
+        memset(&pkt, PKT_TYPE_FLN, PKT_HDRSZ);
+        memcpy(pkt.data, mvFromName.c_str(), mvFromName.length()+1);
+        pkt.size = mvFromName.length() + 1;
+        pkt.sequence = 5;
+        mvLink.Seal(&pkt, pktlen(&pkt));
+        break;
+    }
+}
+
+/* Sends the handshake's next request, or ends the handshake once there
+   are none left */
+Client::State Client::sendInit() {
+    packet pkt;
+    
+    if (mvInitNext >= 6) {
+        mvResult.windowSize = mvWindowSize;
+        mvSequence = 0;
         mvRetries = PKT_TRNSMAX;
-        
-        // Check for RRs
-        switch (inpkt.type) {
-        case PKT_TYPE_RR:
-            if (inpkt.sequence == i && pkt[i].type == PKT_TYPE_CXN) {
-                mvRemotePort = inpkt.size; // Extract new port number
-                if ((sk = GetSocket(*(sockaddr_in *)&addr)) == -1) {
-                    std::cerr << "GetSocket (" << __LINE__ << "): "
-                              << strerror(errno) << std::endl;
-                    return ERROR;
+        mvWindow.Reset(mvWindowSize);
+        arm(RECV_TIMEOUT_US);
+        return RECV_PACKETS;
+    }
+    
+    encodeInit(mvInitNext, pkt);
+    if (send(pkt) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+        return ERROR;
+    }
+    arm(RECV_TIMEOUT_US);
+    return INIT;
+}
+
+Client::State Client::init(int r, packet &inpkt) {
+    int i = mvInitNext;
+    
+    if (r == 1) {
+        return ERROR;
+    } else if (r >= 2) {
+        // Ask again
+        return sendInit();
+    }
+    mvRetries = PKT_TRNSMAX;
+    
+    // Check for RRs
+    switch (inpkt.type) {
+    case PKT_TYPE_RR:
+        if (inpkt.sequence == (uint64_t)i && i == 0) {
+            // Show the server we're really here
+            mvCookie = CookieFrame::Cookie(inpkt);
+        } else if (inpkt.sequence == (uint64_t)i && i == 1) {
+            // Everything from here on belongs to the session the server
+            // named
+            mvConnection = ConnectionFrame::Connection(inpkt);
+            
+            // Settle on a payload size the path can carry, then tell the
+            // server about it.  Parity packets carry a few bytes more than
+            // data, so leave room for them.
+            if (!mvProbed) {
+                unsigned int extra = mvFecN > 0 ? PKT_FECSZ : 0;
+                unsigned int ceiling = mvBufferSize + extra;
+                if (ceiling > PKT_DMAX_LIMIT) {
+                    ceiling = PKT_DMAX_LIMIT;
                 }
-                mvAddrLen = sizeof(mvAddr);
-            } else if (inpkt.sequence == i && pkt[i].type == PKT_TYPE_CXN2) {
-                // Apply new port changes
-                mvSocket = sk;
-                mvAddr = addr;
-            } else if (inpkt.sequence != i) {
-                // Incorrect sequence number: resend packet
-                i--;
-                continue;
+                mvInitNext = i + 1;
+                return startProbe(ceiling);
             }
-            break;
-        case PKT_TYPE_REJ:
-            if (inpkt.sequence <= i) {
-                i = inpkt.sequence - 1;
+        } else if (inpkt.sequence == (uint64_t)i && i == 3) {
+            // A server short of memory grants less window than we asked
+            // for.  Older ones leave the answer empty.
+            unsigned int granted = GrantFrame::Window(inpkt);
+            if (granted > 0 && granted < mvWindowSize) {
+                LOG(LOGL_INFO, "Server cut the window from %u to %u "
+                    "packets", mvWindowSize, granted);
+                mvWindowSize = granted;
+                fecFit();
             }
-            break;
+        } else if (inpkt.sequence != (uint64_t)i) {
+            // Incorrect sequence number: resend packet
+            return sendInit();
+        }
+        break;
+    case PKT_TYPE_REJ:
+        if (inpkt.sequence <= (uint64_t)i) {
+            i = inpkt.sequence - 1;
         }
+        break;
     }
     
-    if (mvRetries <= 0) {
-        return ERROR;
+    // The session can answer before our copy of its name arrives, when the
+    // server's RR is lost.  Nothing's worth going on to until we have it.
+    if (i >= 1 && mvConnection == 0) {
+        return sendInit();
     }
     
-    mvSequence = 0;
-    mvRetries = PKT_TRNSMAX;
-    
-    return RECV_PACKETS;
+    mvInitNext = i + 1;
+    return sendInit();
 }
 
-Client::State Client::recvPackets() {
-    packet inpkt;
+Client::State Client::recvPackets(int r, packet &inpkt) {
     packet outpkt;
+    State next = RECV_PACKETS;
 
     // Check for timeout
-    switch (recvPacket(inpkt)) {
+    switch (r) {
     case 1:
         // Receive error.
         return ERROR;
+    case 3:
+        // Bad checksum.  With FEC a corrupt packet is just a lost one, and
+        // parity may yet make up for it.
+        if (mvFecN > 0) {
+            return RECV_PACKETS;
+        }
+        // fall through
     case 2:
-        // Bad checksum or timeout.
-        outpkt = rejpkt(mvSequence);
+        // Timeout.
+        RejFrame::Encode(&outpkt, mvSequence);
         break;
     default:
-        // if sequence is less than or equal to our own, send RR.  Even if it's
-        // lower than it's supposed to be, we'll just send the RR to make the
-        // server feel better about itself.
-        if (inpkt.sequence <= mvSequence) {
+        if (mvFecN > 0) {
+            bool respond = false;
+            next = fecRecv(inpkt, outpkt, respond);
+            if (next == ERROR || !respond) {
+                return next;
+            }
+            break;
+        }
+        
+        switch (mvWindow.Classify(inpkt.sequence, mvSequence)) {
+        case RecvWindow<ArqPolicy, packet *>::DELIVER:
             mvRetries = PKT_TRNSMAX;
-            outpkt = rrpkt(inpkt.sequence);
+            if ((next = deliver(inpkt)) == ERROR) {
+                return ERROR;
+            }
             
-            if (inpkt.sequence == mvSequence) {
-                mvSequence++;
-                
-                if (writeTo(inpkt) == 1) {
+            // Anything held behind it can go too
+            while (next == RECV_PACKETS && mvWindow.Held(mvSequence)) {
+                packet *held = mvWindow[mvSequence];
+                mvWindow.Unhold(mvSequence);
+                next = deliver(*held);
+                free(held);
+                if (next == ERROR) {
                     return ERROR;
                 }
-                
-                if (inpkt.type == PKT_TYPE_DAT && inpkt.size < mvBufferSize) {
-                    // A valid, less-than-maximum sized packet indicates
-                    // end-of-file
-                    return DONE;
+            }
+            
+            // Still holding some means there's another gap.  Its REJ
+            // acknowledges everything before it just as well.
+            if (next == RECV_PACKETS && mvWindow.HeldCount() > 0 &&
+                mvWindow.ShouldReject(mvSequence)) {
+                RejFrame::Encode(&outpkt, mvSequence);
+            } else {
+                RrFrame::Encode(&outpkt, mvSequence - 1);
+            }
+            break;
+        case RecvWindow<ArqPolicy, packet *>::DUPLICATE:
+            // A repeat means the server missed our last answer, so tell it
+            // everything again: all of it arrived up to mvSequence, and
+            // anything held means there's a gap there.
+            mvRetries = PKT_TRNSMAX;
+            if (mvWindow.HeldCount() > 0) {
+                RejFrame::Encode(&outpkt, mvSequence);
+            } else {
+                RrFrame::Encode(&outpkt, mvSequence - 1);
+            }
+            break;
+        case RecvWindow<ArqPolicy, packet *>::HOLD:
+            // Ahead of a gap, and the policy keeps it until the gap's filled
+            if (!mvWindow.Held(inpkt.sequence)) {
+                packet *copy = (packet *)malloc(PKT_HDRSZ + inpkt.size);
+                if (copy != NULL) {
+                    memcpy(copy, &inpkt, PKT_HDRSZ + inpkt.size);
+                    mvWindow[inpkt.sequence] = copy;
+                    mvWindow.Hold(inpkt.sequence);
                 }
             }
-        } else {
+            if (!mvWindow.ShouldReject(mvSequence)) {
+                return RECV_PACKETS;
+            }
+            RejFrame::Encode(&outpkt, mvSequence);
+            break;
+        default:
             // if the sequence is outright wrong, however...
-            std::cout << "Received packet with incorrect sequence.  Expected "
-                      << mvSequence << " or lower.  Received " << inpkt.sequence
-                      << std::endl;
-            outpkt = rejpkt(mvSequence);
+            LOG(LOGL_DEBUG, "Received packet with incorrect sequence.  "
+                "Expected %llu or lower.  Received %llu",
+                (unsigned long long)mvSequence,
+                (unsigned long long)inpkt.sequence);
+            RejFrame::Encode(&outpkt, mvSequence);
+            break;
         }
     }
     
     // Send response packet
-    if (sendtoErr(mvSocket, &outpkt, sizeof(packet), 0, (sockaddr *)&mvAddr,
-                  mvAddrLen) == -1)
-    {
-        std::cerr << "sendto (" << __LINE__ << "): " << strerror(errno)
-                  << std::endl;
+    TRACE_EVENT(TRACE_SEND, outpkt.sequence, outpkt.type);
+    if (send(outpkt) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
         return ERROR;
     }
     
-    return RECV_PACKETS;
+    return next;
+}
+
+Client::State Client::verify(int r, packet &inpkt) {
+    packet outpkt;
+    
+    switch (r) {
+    case 1:
+        return ERROR;
+    case 2:
+    case 3:
+        // Ask for the hash again
+        RejFrame::Encode(&outpkt, mvEofSequence + 1);
+        break;
+    default:
+        if (inpkt.type == PKT_TYPE_HSH &&
+            inpkt.sequence == mvEofSequence + 1 &&
+            inpkt.size == XXH128_SIZE) {
+            xxh128 theirs = xxh128_get(inpkt.data);
+            xxh128 ours = xxh3_digest(&mvHash);
+            
+            RrFrame::Encode(&outpkt, inpkt.sequence);
+            if (send(outpkt) == -1) {
+                LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__,
+                    strerror(errno));
+            }
+            
+            if (theirs.high != ours.high || theirs.low != ours.low) {
+                std::ostringstream error;
+                char theirHex[2 * XXH128_SIZE + 1];
+                char ourHex[2 * XXH128_SIZE + 1];
+                
+                xxh128_hex(&theirs, theirHex);
+                xxh128_hex(&ours, ourHex);
+                error << "INTEGRITY CHECK FAILED: "
+                      << (mvTo == -1 ? "buffer" : mvToName)
+                      << " does not match " << mvFromName
+                      << ".  Server hash 0x" << theirHex
+                      << ", local hash 0x" << ourHex;
+                mvResult.error = error.str();
+                return ERROR;
+            }
+            return DONE;
+        } else if (inpkt.type == PKT_TYPE_DAT &&
+                   inpkt.sequence <= mvEofSequence) {
+            // The server missed our RR for the end of the file
+            RrFrame::Encode(&outpkt, inpkt.sequence);
+        } else {
+            return VERIFY;
+        }
+    }
+    
+    if (send(outpkt) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+        return ERROR;
+    }
+    
+    return VERIFY;
+}
+
+Client::State Client::fecRecv(packet &inpkt, packet &outpkt, bool &respond) {
+    bool parity = inpkt.type == PKT_TYPE_PAR;
+    
+    if (!parity && inpkt.sequence < mvSequence) {
+        // Old news.  RR it anyway so the server can move on.
+        RrFrame::Encode(&outpkt, inpkt.sequence);
+        respond = true;
+        return RECV_PACKETS;
+    }
+    
+    if (inpkt.sequence >= mvGroupBase + mvFecN) {
+        // The server has moved past this group, so any parity for it has
+        // already come and gone.  Fall back to ARQ.
+        if (!parity) {
+            RejFrame::Encode(&outpkt, mvSequence);
+            respond = true;
+        }
+        return RECV_PACKETS;
+    }
+    
+    if (parity) {
+        fechdr *fh = (fechdr *)inpkt.data;
+        if (inpkt.sequence != mvGroupBase || fh->index >= mvFecK ||
+            fh->count > mvFecK || fh->index >= fh->count ||
+            inpkt.size != PKT_FECSZ + mvBufferSize) {
+            return RECV_PACKETS;
+        }
+        if (mvParity[fh->index] != NULL) {
+            return RECV_PACKETS;
+        }
+        mvParity[fh->index] = (packet *)malloc(PKT_HDRSZ + inpkt.size);
+        if (mvParity[fh->index] == NULL) {
+            return RECV_PACKETS;
+        }
+        memcpy(mvParity[fh->index], &inpkt, PKT_HDRSZ + inpkt.size);
+    } else {
+        unsigned int i = inpkt.sequence - mvGroupBase;
+        if (mvGroup[i] == NULL &&
+            (mvGroup[i] = (packet *)malloc(PKT_HDRSZ + inpkt.size)) != NULL) {
+            memcpy(mvGroup[i], &inpkt, PKT_HDRSZ + inpkt.size);
+        }
+    }
+    
+    int delivered = fecDeliver();
+    if (delivered < 0) {
+        return ERROR;
+    }
+    
+    if (delivered > 0) {
+        mvRetries = PKT_TRNSMAX;
+        RrFrame::Encode(&outpkt, mvSequence - 1);
+        respond = true;
+    } else if (parity) {
+        // Parity came in and still couldn't fill the gap
+        RejFrame::Encode(&outpkt, mvSequence);
+        respond = true;
+    }
+    
+    // Otherwise a later packet of the group arrived ahead of a missing one.
+    // Stay quiet until its parity shows up.
+    return mvDone ? VERIFY : RECV_PACKETS;
+}
+
+int Client::fecDeliver() {
+    int delivered = 0;
+    
+    while (!mvDone) {
+        unsigned int i = mvSequence - mvGroupBase;
+        packet *pkt = mvGroup[i];
+        
+        if (pkt == NULL && (pkt = fecRecover(i)) == NULL) {
+            break;
+        }
+        
+        if (writeTo(*pkt) == 1) {
+            return -1;
+        }
+        mvSequence++;
+        delivered++;
+        
+        // A less-than-maximum sized packet indicates end-of-file
+        if (pkt->size < mvBufferSize) {
+            mvEofSequence = pkt->sequence;
+            mvDone = true;
+        } else if (mvSequence == mvGroupBase + mvFecN) {
+            fecReset(mvSequence);
+        }
+    }
+    
+    if (delivered > 0) {
+        TRACE_EVENT(TRACE_SLIDE, mvSequence, delivered);
+    }
+    return delivered;
+}
+
+packet *Client::fecRecover(unsigned int i) {
+    packet *par = NULL;
+    
+    // Find the parity packet covering this index
+    for (unsigned int j = 0; j < mvFecK && par == NULL; j++) {
+        fechdr *fh;
+        if (mvParity[j] == NULL) {
+            continue;
+        }
+        fh = (fechdr *)mvParity[j]->data;
+        if (i % fh->count == fh->index) {
+            par = mvParity[j];
+        }
+    }
+    if (par == NULL) {
+        return NULL;
+    }
+    
+    // Every other packet it covers has to be here
+    unsigned int count = ((fechdr *)par->data)->count;
+    for (unsigned int m = i % count; m < mvFecN; m += count) {
+        if (m != i && mvGroup[m] == NULL) {
+            return NULL;
+        }
+    }
+    
+    packet *out = (packet *)malloc(PKT_HDRSZ + PKT_FECSZ + mvBufferSize);
+    if (out == NULL) {
+        return NULL;
+    }
+    memcpy(out, par, PKT_HDRSZ + PKT_FECSZ + mvBufferSize);
+    
+    uint8_t *data = out->data + PKT_FECSZ;
+    uint32_t size = ((fechdr *)par->data)->sizes;
+    for (unsigned int m = i % count; m < mvFecN; m += count) {
+        if (m != i) {
+            size ^= mvGroup[m]->size;
+            fec_xor(data, mvGroup[m]->data, mvGroup[m]->size);
+        }
+    }
+    
+    if (size > mvBufferSize) {
+        // Parity or a member was bogus despite the checksums
+        free(out);
+        return NULL;
+    }
+    
+    memmove(out->data, data, size);
+    out->type = PKT_TYPE_DAT;
+    out->sequence = mvGroupBase + i;
+    out->size = size;
+    mvGroup[i] = out;
+    
+    LOG(LOGL_DEBUG, "Recovered packet %llu from parity",
+        (unsigned long long)out->sequence);
+    
+    return out;
 }
 
+void Client::fecReset(uint64_t base) {
+    for (unsigned int i = 0; i < mvGroup.size(); i++) {
+        free(mvGroup[i]);
+        mvGroup[i] = NULL;
+    }
+    for (unsigned int j = 0; j < mvParity.size(); j++) {
+        free(mvParity[j]);
+        mvParity[j] = NULL;
+    }
+    mvGroupBase = base;
+}
@@ -9,52 +9,198 @@
 #include <deque>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 extern "C" {
     #include "packet.h"
+    #include "xxhash.h"
 }
 
+#include "UdpLink.h"
+
+/** A file on a server */
+struct Remote {
+    std::string host;
+    std::string port;
+    std::string path;
+};
+
+/** What a download asks the server for.  The server and the path may
+ * settle on less. */
+struct DownloadOptions {
+    DownloadOptions() : bufferSize(PKT_DMAX), windowSize(64), fecGroup(0),
+    fecParity(0), busyPollUs(0) {}
+    
+    unsigned int bufferSize;
+    unsigned int windowSize;
+    /** Forward error correction group and parity; zero disables it */
+    unsigned int fecGroup;
+    unsigned int fecParity;
+    /** How long to spin on the socket before sleeping, or 0 */
+    long busyPollUs;
+};
+
+/** How a download went */
+struct DownloadResult {
+    DownloadResult() : status(1), bufferSize(0), windowSize(0), bytes(0),
+    hash(0), elapsedUs(0), ttfbUs(0) {}
+    
+    /** 0 once every byte has arrived and the server's hash matches */
+    int status;
+    /** Why it failed, when it did */
+    std::string error;
+    /** Payload size settled on with the server */
+    unsigned int bufferSize;
+    /** Window the server granted, which is less than asked for when it's
+     * short of memory */
+    unsigned int windowSize;
+    uint64_t bytes;
+    /** XXH3-128 of everything received */
+    xxh128 hash;
+    uint64_t elapsedUs;
+    /** Time to the first byte, or 0 if none came */
+    uint64_t ttfbUs;
+};
+
+/** One download, as a state machine driven by its socket and a deadline.
+ * Run() drives it to the end by itself.  An event loop can drive many
+ * instead: Start() each, wait for Fd() to be readable or Deadline() to
+ * pass, and Handle() it, until Done(). */
 class Client {
     public:
-        Client(const std::string &from, const std::string &to,
-               unsigned int bufferSize, float errorPercent,
-               unsigned int windowSize, const std::string &remoteMachine,
-               const std::string &remotePort);
+        /** Downloads into a local file, created or truncated now */
+        Client(const Remote &from, const std::string &to,
+               const DownloadOptions &options);
+        /** Downloads into memory.  A file bigger than size fails. */
+        Client(const Remote &from, void *to, size_t size,
+               const DownloadOptions &options);
         ~Client();
-    
+        
         int GetSocket(sockaddr_in &remote);
         
+        /** Downloads, waiting on the socket, and prints how it went
+         * @return 0 on success, 1 on failure
+         */
         int Run();
-
+        
+        /** Sends the first request */
+        void Start();
+        /** Takes whatever's arrived, and times out if Deadline() has
+         * passed */
+        void Handle();
+        bool Done() const;
+        int Fd() const { return mvSocket; }
+        /** When Handle() has to be called by even if nothing arrives, on the
+         * clock_usec() clock */
+        uint64_t Deadline() const { return mvDeadline; }
+        /** Final once Done() */
+        const DownloadResult &Result() const { return mvResult; }
+    
     private:
         std::string mvFromName;
         std::string mvToName;
         unsigned int mvBufferSize;
-        float mvErrorPercent;
         unsigned int mvWindowSize;
         std::string mvRemoteMachine;
         unsigned short mvRemotePort;
-
+        
         int mvSocket;
-        int mvOldSocket;
+        /** The target: a file descriptor, or -1 and a buffer of mvCapacity
+         * bytes */
         int mvTo;
-        sockaddr_storage mvAddr;
-        socklen_t mvAddrLen;
-
+        char *mvBuffer;
+        size_t mvCapacity;
+        /** Aimed at the server's one port for the whole session */
+        UdpLink mvLink;
+        /** Named by the server in the handshake, and stamped on everything
+         * sent after */
+        uint32_t mvConnection;
+        /** Handle() times out at this clock_usec() */
+        uint64_t mvDeadline;
+        
         int mvRetries;
-        unsigned int mvSequence;
-
+        uint64_t mvSequence;
+        /** Packets held ahead of a gap, when the ARQ policy keeps them */
+        RecvWindow<ArqPolicy, packet *> mvWindow;
+        
+        /** The handshake request awaiting an answer, numbered by its
+         * sequence, and the server's cookie once it's sent one */
+        int mvInitNext;
+        uint32_t mvCookie;
+        /** Path MTU probing: the largest payload wanted, the next candidate
+         * to try, the size being tried and attempts at it so far, and the
+         * best found */
+        unsigned int mvProbeCeiling;
+        unsigned int mvProbe;
+        unsigned int mvProbeSize;
+        int mvProbeTries;
+        unsigned int mvProbeFound;
+        bool mvProbed;
+        
+        /** Forward error correction group and maximum parity sizes.  Zero
+         * disables it. */
+        unsigned int mvFecN;
+        unsigned int mvFecK;
+        /** Sequence of the first packet in the group containing mvSequence */
+        uint64_t mvGroupBase;
+        /** Copies of the group's data packets, delivered or not, and of the
+         * parity received for it */
+        std::vector<packet *> mvGroup;
+        std::vector<packet *> mvParity;
+        bool mvDone;
+        
+        /** Hash of everything written to the target */
+        xxh3 mvHash;
+        /** Sequence of the short packet that ended the file */
+        uint64_t mvEofSequence;
+        
+        /** Timing for the summary, and the summary itself */
+        uint64_t mvStartTime;
+        uint64_t mvFirstByteTime;
+        uint64_t mvBytes;
+        DownloadResult mvResult;
+        
         enum State {
             INIT,
             ERROR,
-            DONE,            RECV_PACKETS
+            DONE,
+            PROBE_MTU,
+            RECV_PACKETS,
+            VERIFY
         } mvState;
         
-        int recvPacket(packet &buf);
+        void setup(const Remote &from, const DownloadOptions &options);
+        void arm(long timeoutUs);
+        void step(LinkStatus status, packet &inpkt);
+        void finish();
+        
+        int recvPacket(LinkStatus status, packet &buf);
+        ssize_t send(packet &pkt);
         int writeTo(packet &in);
+        State deliver(packet &in);
+        
+        /** Finds the largest payload, up to the requested buffer size, that
+         * reaches the server without fragmenting */
+        State startProbe(unsigned int ceiling);
+        State nextProbe();
+        State sendProbe();
+        State probeMtu(LinkStatus status, packet &inpkt);
+        State endProbe();
+        void setPmtuDisc(int mode);
+        
+        void fecFit();
+        packet *fecRecover(unsigned int i);
+        int fecDeliver();
+        void fecReset(uint64_t base);
+        State fecRecv(packet &inpkt, packet &outpkt, bool &respond);
+        
+        void encodeInit(int i, packet &pkt);
+        State sendInit();
+        State init(int r, packet &inpkt);
+        State recvPackets(int r, packet &inpkt);
+        State verify(int r, packet &inpkt);
         
-        State init();
-        State recvPackets();
+        void printStats();
 };
 
 #endif // CLIENT_H
@@ -0,0 +1,262 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+extern "C" {
+    #include "packet.h"
+}
+
+/* Serializers and parsers for the header-only packets: acknowledgments and
+   the handshake.  Each type gets its own, so what a control packet's size
+   field means is spelled out in one place.
+
+   None of them run in_cksum.  The Internet checksum is a one's complement
+   sum of 16-bit words, so it can be put together a field at a time, and in
+   either byte order (RFC 1071).  The type byte's share is a compile-time
+   constant; encoding a frame stores the sequence and size little-endian and
+   folds their words into it.  The sequence, size and connection ID all
+   start at odd offsets, which pairs each of their bytes with the other half
+   of a word; that comes out as swapping the bytes of their folded sum.
+   Frames whose fields never change are built whole at compile time,
+   checksum and all.  A client stamps its connection ID on afterwards,
+   patching the checksum for just that field (RFC 1624). */
+
+/** A header as it goes on the wire */
+struct HeaderBytes {
+    uint8_t bytes[PKT_HDRSZ];
+};
+
+#define PKT_SEQ_AT offsetof(struct packet, sequence)
+#define PKT_CKSUM_AT offsetof(struct packet, checksum)
+#define PKT_SIZE_AT offsetof(struct packet, size)
+#define PKT_CXN_AT offsetof(struct packet, connection)
+
+/** Folds a sum of 16-bit words down to 16 bits, end-around carry and all */
+constexpr uint16_t CksumFold(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (sum & 0xFFFF) + (sum >> 16);
+}
+
+/** Sums an integer's little-endian 16-bit words */
+constexpr uint64_t CksumWords(uint64_t value) {
+    return (value & 0xFFFF) + (value >> 16 & 0xFFFF) +
+           (value >> 32 & 0xFFFF) + (value >> 48);
+}
+
+/** Builds a header at compile time, checksummed as in_cksum would */
+constexpr HeaderBytes MakeHeader(uint8_t type, uint64_t sequence,
+                                 uint32_t size) {
+    HeaderBytes h = {};
+    uint64_t sum = 0;
+    uint16_t checksum = 0;
+
+    h.bytes[0] = type;
+    for (unsigned int i = 0; i < sizeof(sequence); i++) {
+        h.bytes[PKT_SEQ_AT + i] = sequence >> 8 * i;
+    }
+    for (unsigned int i = 0; i < sizeof(size); i++) {
+        h.bytes[PKT_SIZE_AT + i] = size >> 8 * i;
+    }
+
+    // in_cksum pairs bytes in memory order; an odd byte out is padded
+    for (unsigned int i = 0; i < PKT_HDRSZ; i++) {
+        sum += i % 2 ? h.bytes[i] << 8 : h.bytes[i];
+    }
+    checksum = ~CksumFold(sum);
+    h.bytes[PKT_CKSUM_AT] = checksum;
+    h.bytes[PKT_CKSUM_AT + 1] = checksum >> 8;
+
+    return h;
+}
+
+/** The serializer for a header-only packet of one type */
+template <uint8_t Type>
+struct HeaderFrame {
+    enum { TYPE = Type };
+
+    /** Fills in a header.  Send it with pktlen(), which is PKT_HDRSZ. */
+    static void Encode(packet *pkt, uint64_t sequence, uint32_t size) {
+        uint16_t fields = CksumFold(CksumWords(sequence) + CksumWords(size));
+        uint16_t checksum = ~CksumFold(Type + (uint16_t)(fields << 8 |
+                                                         fields >> 8));
+
+        pkt->type = Type;
+        pkt->sequence = sequence;
+        pkt->size = size;
+        pkt->connection = 0;
+        // stored in memory order, the way in_cksum's result is
+        ((uint8_t *)pkt)[PKT_CKSUM_AT] = checksum;
+        ((uint8_t *)pkt)[PKT_CKSUM_AT + 1] = checksum >> 8;
+    }
+};
+
+/** A header-only packet whose fields are fixed, built at compile time */
+template <uint8_t Type, uint64_t Sequence, uint32_t Size>
+struct ConstFrame {
+    static constexpr HeaderBytes HEADER = MakeHeader(Type, Sequence, Size);
+
+    static void Encode(packet *pkt) {
+        memcpy(pkt, HEADER.bytes, PKT_HDRSZ);
+    }
+};
+
+template <uint8_t Type, uint64_t Sequence, uint32_t Size>
+constexpr HeaderBytes ConstFrame<Type, Sequence, Size>::HEADER;
+
+/** Acknowledges everything up to and including a sequence */
+struct RrFrame : HeaderFrame<PKT_TYPE_RR> {
+    static void Encode(packet *pkt, uint64_t sequence) {
+        HeaderFrame<PKT_TYPE_RR>::Encode(pkt, sequence, 0);
+    }
+};
+
+/** Asks for everything from a sequence on again, or as the ARQ policy has
+ * it */
+struct RejFrame : HeaderFrame<PKT_TYPE_REJ> {
+    static void Encode(packet *pkt, uint64_t sequence) {
+        HeaderFrame<PKT_TYPE_REJ>::Encode(pkt, sequence, 0);
+    }
+};
+
+/** The client's first handshake packet, which never changes */
+typedef ConstFrame<PKT_TYPE_CXN, 0, 0> CxnFrame;
+
+/** The server's answer to a connection request: an RR carrying a cookie,
+ * which the client has to send back before the server keeps any state */
+struct CookieFrame : HeaderFrame<PKT_TYPE_RR> {
+    static void Encode(packet *pkt, uint64_t sequence, uint32_t cookie) {
+        HeaderFrame<PKT_TYPE_RR>::Encode(pkt, sequence, cookie);
+    }
+
+    static uint32_t Cookie(const packet &pkt) { return pkt.size; }
+};
+
+/** The second handshake packet, returning the server's cookie */
+struct Cxn2Frame : HeaderFrame<PKT_TYPE_CXN2> {
+    static void Encode(packet *pkt, uint32_t cookie) {
+        HeaderFrame<PKT_TYPE_CXN2>::Encode(pkt, 1, cookie);
+    }
+
+    static uint32_t Cookie(const packet &pkt) { return pkt.size; }
+};
+
+/** The server's challenge to a packet in a session from an address it
+ * hasn't seen the client at: a cookie for that address, which the client
+ * echoes back from it.  The server only moves the session once it has. */
+struct PathFrame : HeaderFrame<PKT_TYPE_PTH> {
+    static void Encode(packet *pkt, uint64_t sequence, uint32_t cookie) {
+        HeaderFrame<PKT_TYPE_PTH>::Encode(pkt, sequence, cookie);
+    }
+
+    static uint32_t Cookie(const packet &pkt) { return pkt.size; }
+};
+
+/** The server's answer to a good cookie: an RR naming the session's
+ * connection ID in its connection field */
+struct ConnectionFrame : HeaderFrame<PKT_TYPE_RR> {
+    static void Encode(packet *pkt, uint64_t sequence, uint32_t connection) {
+        HeaderFrame<PKT_TYPE_RR>::Encode(pkt, sequence, 0);
+        Stamp(pkt, connection);
+    }
+
+    static uint32_t Connection(const packet &pkt) { return pkt.connection; }
+
+    /** Puts any packet, encoded or sealed, in a session.  Only the
+     * connection ID's share of the checksum changes, so it's patched rather
+     * than summed again: HC' = ~(~HC + ~m + m'), m being the field's share
+     * before and m' after. */
+    static void Stamp(packet *pkt, uint32_t connection) {
+        uint8_t *bytes = (uint8_t *)pkt;
+        uint32_t old = pkt->connection;
+        uint16_t before = CksumFold(CksumWords(old));
+        uint16_t after = CksumFold(CksumWords(connection));
+        uint16_t checksum = bytes[PKT_CKSUM_AT] | bytes[PKT_CKSUM_AT + 1] << 8;
+
+        if (old == connection) {
+            return;
+        }
+        checksum = ~CksumFold((uint16_t)~checksum +
+                              (uint16_t)~(before << 8 | before >> 8) +
+                              (uint16_t)(after << 8 | after >> 8));
+        pkt->connection = connection;
+        bytes[PKT_CKSUM_AT] = checksum;
+        bytes[PKT_CKSUM_AT + 1] = checksum >> 8;
+    }
+};
+
+/** Payload bytes per data packet */
+struct BufFrame : HeaderFrame<PKT_TYPE_BUF> {
+    static unsigned int BufferSize(const packet &pkt) { return pkt.size; }
+};
+
+/** Window size, with the ARQ policy's ID (see Arq.h) in the top byte so
+ * both ends are sure to agree on it */
+struct WinFrame : HeaderFrame<PKT_TYPE_WIN> {
+    static void Encode(packet *pkt, uint64_t sequence, unsigned int window,
+                       unsigned int arq) {
+        HeaderFrame<PKT_TYPE_WIN>::Encode(pkt, sequence,
+                                          (window & PKT_WIN_SIZEMASK) |
+                                          arq << PKT_WIN_ARQSHIFT);
+    }
+
+    static unsigned int Window(const packet &pkt) {
+        return pkt.size & PKT_WIN_SIZEMASK;
+    }
+
+    /** The ARQ policy's ID; zero, from older clients, means go-back-n */
+    static unsigned int Arq(const packet &pkt) {
+        return pkt.size >> PKT_WIN_ARQSHIFT;
+    }
+};
+
+/** The server's answer to the window size: an RR carrying the window it
+ * accepted, which may be less than asked for.  Older servers leave it 0. */
+struct GrantFrame : HeaderFrame<PKT_TYPE_RR> {
+    static void Encode(packet *pkt, uint64_t sequence, unsigned int window) {
+        HeaderFrame<PKT_TYPE_RR>::Encode(pkt, sequence, window);
+    }
+
+    static unsigned int Window(const packet &pkt) { return pkt.size; }
+};
+
+/** Forward error correction: group size high, parity count low */
+struct FecFrame : HeaderFrame<PKT_TYPE_FEC> {
+    static void Encode(packet *pkt, uint64_t sequence, unsigned int n,
+                       unsigned int k) {
+        HeaderFrame<PKT_TYPE_FEC>::Encode(pkt, sequence,
+                                          (n & 0xFFFF) << 16 | (k & 0xFFFF));
+    }
+
+    static unsigned int GroupSize(const packet &pkt) { return pkt.size >> 16; }
+    static unsigned int Parity(const packet &pkt) { return pkt.size & 0xFFFF; }
+};
+
+/** The server's answer to a path MTU probe: the probe's payload size */
+typedef HeaderFrame<PKT_TYPE_MTU> MtuFrame;
+
+/** Multicast: the sender's heartbeat, naming the next new sequence it will
+ * send and the payload bytes per data packet */
+struct AnnFrame : HeaderFrame<PKT_TYPE_ANN> {
+    static uint64_t Next(const packet &pkt) { return pkt.sequence; }
+    static unsigned int BufferSize(const packet &pkt) { return pkt.size; }
+};
+
+/** Multicast: a receiver asking to be counted in, which never changes */
+typedef ConstFrame<PKT_TYPE_JON, 0, 0> JoinFrame;
+
+/** Multicast: a receiver has everything through the last data packet,
+ * and says whether the file's hash matched */
+struct FinFrame : HeaderFrame<PKT_TYPE_FIN> {
+    static void Encode(packet *pkt, uint64_t eofSequence, bool verified) {
+        HeaderFrame<PKT_TYPE_FIN>::Encode(pkt, eofSequence, verified);
+    }
+
+    static bool Verified(const packet &pkt) { return pkt.size != 0; }
+};
+
+#endif // CODEC_H
@@ -0,0 +1,140 @@
+#include <errno.h>
+
+#include <memory>
+
+extern "C" {
+    #include "clock.h"
+}
+
+#include "Downloader.h"
+
+Downloader::Downloader() {
+}
+
+Downloader::~Downloader() {
+    for (size_t i = 0; i < mvTransfers.size(); i++) {
+        delete mvTransfers[i].client;
+    }
+}
+
+void Downloader::Download(const Remote &from, const std::string &to,
+                          const DownloadOptions &options, Callback done) {
+    start(new Client(from, to, options), done);
+}
+
+void Downloader::Download(const Remote &from, void *to, size_t size,
+                          const DownloadOptions &options, Callback done) {
+    start(new Client(from, to, size, options), done);
+}
+
+std::future<DownloadResult> Downloader::Download(
+        const Remote &from, const std::string &to,
+        const DownloadOptions &options) {
+    std::shared_ptr<std::promise<DownloadResult> > promise(
+        new std::promise<DownloadResult>());
+    std::future<DownloadResult> result = promise->get_future();
+
+    Download(from, to, options, [promise](const DownloadResult &r) {
+        promise->set_value(r);
+    });
+    return result;
+}
+
+std::future<DownloadResult> Downloader::Download(
+        const Remote &from, void *to, size_t size,
+        const DownloadOptions &options) {
+    std::shared_ptr<std::promise<DownloadResult> > promise(
+        new std::promise<DownloadResult>());
+    std::future<DownloadResult> result = promise->get_future();
+
+    Download(from, to, size, options, [promise](const DownloadResult &r) {
+        promise->set_value(r);
+    });
+    return result;
+}
+
+void Downloader::start(Client *client, Callback done) {
+    Transfer transfer = { client, done };
+
+    client->Start();
+    mvTransfers.push_back(transfer);
+}
+
+/* Lets go of a finished download before calling back, so the callback
+   finds its file closed and can start another in its place */
+void Downloader::finish(size_t i) {
+    Transfer transfer = mvTransfers[i];
+    DownloadResult result = transfer.client->Result();
+
+    mvTransfers[i] = mvTransfers.back();
+    mvTransfers.pop_back();
+    delete transfer.client;
+
+    if (transfer.done) {
+        transfer.done(result);
+    }
+}
+
+size_t Downloader::Poll(long timeoutUs) {
+    uint64_t now = clock_usec();
+    uint64_t deadline = UINT64_MAX;
+    size_t count = mvTransfers.size();
+    int waitMs = -1;
+    int ready;
+
+    // Wait for a socket, or the soonest timeout
+    mvPoll.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        Client *client = mvTransfers[i].client;
+
+        mvPoll[i].fd = client->Fd();
+        mvPoll[i].events = POLLIN;
+        mvPoll[i].revents = 0;
+        if (client->Done()) {
+            deadline = now;
+        } else if (client->Deadline() < deadline) {
+            deadline = client->Deadline();
+        }
+    }
+    if (deadline != UINT64_MAX) {
+        uint64_t waitUs = deadline > now ? deadline - now : 0;
+        if (timeoutUs < 0 || waitUs < (uint64_t)timeoutUs) {
+            timeoutUs = waitUs;
+        }
+    }
+    if (timeoutUs >= 0) {
+        waitMs = (timeoutUs + 999) / 1000;
+    }
+    if (count == 0 && waitMs < 0) {
+        return 0;
+    }
+
+    if ((ready = poll(mvPoll.data(), count, waitMs)) == -1 &&
+        errno != EINTR) {
+        return mvTransfers.size();
+    }
+
+    // Callbacks may start more downloads, which the next round will poll
+    now = clock_usec();
+    for (size_t i = 0; i < count; i++) {
+        Client *client = mvTransfers[i].client;
+
+        if (mvPoll[i].revents != 0 || client->Deadline() <= now) {
+            client->Handle();
+        }
+    }
+    for (size_t i = 0; i < mvTransfers.size(); ) {
+        if (mvTransfers[i].client->Done()) {
+            finish(i);
+        } else {
+            i++;
+        }
+    }
+
+    return mvTransfers.size();
+}
+
+void Downloader::Run() {
+    while (Poll(-1) > 0) {
+    }
+}
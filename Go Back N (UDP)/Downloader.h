@@ -0,0 +1,87 @@
+#ifndef DOWNLOADER_H
+#define DOWNLOADER_H
+
+#include <poll.h>
+#include <stddef.h>
+
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "Client.h"
+
+/** Runs any number of downloads from one thread: one poll(2) over all their
+ * sockets, and their timeouts, per round.  Each download is a Client with
+ * a socket of its own.  The server knows a session by the connection ID it
+ * hands out, and the address only has to match during the cookie
+ * handshake, before there is one.  But two handshakes from one address
+ * would look to it like one sent twice.
+ *
+ * Nothing here is thread-safe.  Start downloads and run the loop from the
+ * same thread, which is also the one the callbacks run on.  A future only
+ * becomes ready while something runs the loop.
+ *
+ * Link with librcopy.a and libcpe464, which has the checksum, and call
+ * impair_init() and log_init() first if the program wants impairments or
+ * logging. */
+class Downloader {
+public:
+    typedef std::function<void (const DownloadResult &)> Callback;
+
+    Downloader();
+    /** Abandons anything unfinished, without calling back */
+    ~Downloader();
+
+    /** Starts downloading into a local file, created or truncated now.
+     * @param done called from the loop once it's finished, either way
+     * @throws Exception if the file or the socket can't be set up
+     */
+    void Download(const Remote &from, const std::string &to,
+                  const DownloadOptions &options, Callback done);
+
+    /** Starts downloading into memory, which has to stay put until it's
+     * finished.  A file bigger than size fails.
+     * @param done called from the loop once it's finished, either way
+     * @throws Exception if the socket can't be set up
+     */
+    void Download(const Remote &from, void *to, size_t size,
+                  const DownloadOptions &options, Callback done);
+
+    /** As above, with a future for the result instead of a callback */
+    std::future<DownloadResult> Download(const Remote &from,
+                                         const std::string &to,
+                                         const DownloadOptions &options);
+    std::future<DownloadResult> Download(const Remote &from, void *to,
+                                         size_t size,
+                                         const DownloadOptions &options);
+
+    /** Runs one round of the loop.  For embedding it in a caller's own.
+     * @param timeoutUs longest to wait for something to happen, or -1 to
+     *        wait until it does
+     * @return downloads still going
+     */
+    size_t Poll(long timeoutUs);
+
+    /** Runs the loop until every download has finished */
+    void Run();
+
+    size_t Active() const { return mvTransfers.size(); }
+
+private:
+    struct Transfer {
+        Client *client;
+        Callback done;
+    };
+
+    std::vector<Transfer> mvTransfers;
+    std::vector<pollfd> mvPoll;
+
+    void start(Client *client, Callback done);
+    void finish(size_t i);
+
+    Downloader(const Downloader &);
+    Downloader &operator=(const Downloader &);
+};
+
+#endif // DOWNLOADER_H
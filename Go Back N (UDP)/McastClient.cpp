@@ -0,0 +1,571 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+    #include "clock.h"
+    #include "impair.h"
+    #include "log.h"
+}
+
+#include "McastClient.h"
+#include "Codec.h"
+#include "Exception.h"
+
+#define MC_DRAIN 256 // Most packets taken off a socket between timer checks
+
+McastClient::McastClient(const std::string &to, const std::string &group,
+                         unsigned short port, const std::string &interface) :
+mvToName(to),
+mvTo(-1),
+mvGroupSocket(-1),
+mvSocket(-1),
+mvSenderKnown(false),
+mvJoined(false),
+mvBufferSize(0),
+mvHigh(0),
+mvNakNext(0),
+mvEof(false),
+mvEofSequence(0),
+mvHashKnown(false),
+mvHash(),
+mvVerified(false),
+mvFinAcked(false),
+mvTokens(MC_NAK_BURST),
+mvTokenTime(0),
+mvRetries(PKT_TRNSMAX),
+mvHeard(0),
+mvStartTime(0),
+mvBytes(0),
+mvDuplicates(0),
+mvNaks(0),
+mvSuppressed(0),
+mvState(RECV_PACKETS) {
+    // Receivers started together still wait different times before a NAK
+    srand48(getpid() ^ clock_usec());
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, group.c_str(), &addr.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(addr.sin_addr.s_addr))) {
+        throw Exception(__LINE__, group, "not an IPv4 multicast group");
+    }
+
+    ip_mreq mreq;
+    mreq.imr_multiaddr = addr.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (!interface.empty() &&
+        inet_pton(AF_INET, interface.c_str(), &mreq.imr_interface) != 1) {
+        throw Exception(__LINE__, interface, "not an IPv4 address");
+    }
+
+    // Any number of receivers on this host share the group's port
+    int on = 1;
+    int rcvbuf = MC_RCVBUF;
+    if ((mvGroupSocket = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        setsockopt(mvGroupSocket, SOL_SOCKET, SO_REUSEADDR, &on,
+                   sizeof(on)) < 0 ||
+        bind(mvGroupSocket, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(mvGroupSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) < 0) {
+        throw Exception(__LINE__, "group socket", strerror(errno));
+    }
+
+    // The kernel caps this at net.core.rmem_max, which is fine
+    setsockopt(mvGroupSocket, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+               sizeof(rcvbuf));
+    mvGroup = UdpLink(UdpSocket(mvGroupSocket), PKT_HDRSZ);
+
+    if ((mvSocket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        throw Exception(__LINE__, "socket", strerror(errno));
+    }
+
+    // Written wherever packets land, then read back to check the hash
+    if ((mvTo = open(mvToName.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                     S_IRWXU)) == -1) {
+        throw Exception(__LINE__, "open", strerror(errno));
+    }
+}
+
+McastClient::~McastClient() {
+    close(mvTo);
+    close(mvSocket);
+    close(mvGroupSocket);
+}
+
+int McastClient::Run() {
+    mvStartTime = clock_usec();
+    mvHeard = mvStartTime;
+    mvTokenTime = mvStartTime;
+
+    while (mvState != DONE && mvState != ERROR && mvRetries > 0) {
+        switch (mvState) {
+            case RECV_PACKETS:
+                mvState = recv();
+                break;
+            case VERIFY:
+                mvState = verify();
+                break;
+            default:
+                break;
+        }
+    }
+
+    printStats();
+
+    if (mvState == ERROR) {
+        std::cout << "Error receiving file.  Exiting." << std::endl;
+        return 1;
+    }
+
+    if (mvRetries <= 0) {
+        std::cout << "Maximum number of retries reached.  Exiting."
+                  << std::endl;
+        return 1;
+    }
+
+    if (!mvVerified) {
+        return 1;
+    }
+    std::cout << "File transfer successful.  Exiting." << std::endl;
+    return 0;
+}
+
+int McastClient::recvPackets(long timeoutUs) {
+    pollfd fds[2] = { { mvGroupSocket, POLLIN, 0 }, { mvSocket, POLLIN, 0 } };
+    UdpLink *links[2] = { &mvGroup, &mvLink };
+    int ready;
+
+    while ((ready = poll(fds, 2, (timeoutUs + 999) / 1000)) == -1 &&
+           errno == EINTR) {
+    }
+    if (ready < 0) {
+        LOG(LOGL_ERROR, "poll (%d): %s", __LINE__, strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        packet pkt;
+        ssize_t len;
+
+        if (!(fds[i].revents & POLLIN)) {
+            continue;
+        }
+        for (int n = 0; n < MC_DRAIN; n++) {
+            LinkStatus status = links[i]->Recv(pkt, len, 0);
+
+            if (status == LINK_TIMEOUT) {
+                break;
+            } else if (status == LINK_FAILED) {
+                LOG(LOGL_ERROR, "recvfrom (%d): %s", __LINE__,
+                    strerror(errno));
+                return 1;
+            }
+
+            // Each receiver loses packets of its own, as if on its own
+            // path from the sender
+            if (status == LINK_CORRUPT ||
+                (size_t)pktlen(&pkt) > (size_t)len ||
+                (i == 0 && impair_recv_drop())) {
+                continue;
+            }
+            if (handle(pkt)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int McastClient::handle(const packet &pkt) {
+    packet outpkt;
+
+    // Whoever sends to the group is the sender; everything else goes
+    // straight back to it
+    if (!mvSenderKnown) {
+        const UdpSocket &sk = mvGroup.GetSocket();
+        mvLink = UdpLink(UdpSocket(mvSocket, sk.Peer(), sk.PeerLen()),
+                         PKT_HDRSZ);
+        mvSenderKnown = true;
+    }
+    mvHeard = clock_usec();
+    mvRetries = PKT_TRNSMAX;
+
+    switch (pkt.type) {
+    case PKT_TYPE_ANN:
+        if (mvBufferSize == 0) {
+            mvBufferSize = AnnFrame::BufferSize(pkt);
+            if (mvBufferSize == 0 || mvBufferSize > PKT_DMAX_LIMIT) {
+                std::cerr << "Invalid buffer size announced: "
+                          << mvBufferSize << std::endl;
+                return 1;
+            }
+        }
+
+        // Ask to be counted in until the sender says so
+        if (!mvJoined) {
+            JoinFrame::Encode(&outpkt);
+            if (mvLink.Send(&outpkt, PKT_HDRSZ) == -1) {
+                LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__,
+                    strerror(errno));
+                return 1;
+            }
+        }
+
+        // Anything announced and not here is lost
+        if (AnnFrame::Next(pkt) > mvHigh) {
+            missing(mvHigh, AnnFrame::Next(pkt));
+            mvHigh = AnnFrame::Next(pkt);
+        }
+        break;
+    case PKT_TYPE_DAT:
+        return data(pkt);
+    case PKT_TYPE_NAK:
+        // Someone else's NAK, echoed.  Wait for the repairs it brings.
+        for (uint64_t i = 0; i < 8 * (uint64_t)pkt.size; i++) {
+            uint64_t run = i;
+            while (i < 8 * (uint64_t)pkt.size && PKT_NAK_MISSING(&pkt, i)) {
+                i++;
+            }
+            if (i > run) {
+                suppress(pkt.sequence + run, pkt.sequence + i);
+            }
+        }
+        break;
+    case PKT_TYPE_HSH:
+        // Follows the last data packet, so it ends the file too
+        if (pkt.size != XXH128_SIZE || pkt.sequence == 0) {
+            break;
+        }
+        mvHash = xxh128_get(pkt.data);
+        mvHashKnown = true;
+        mvEof = true;
+        mvEofSequence = pkt.sequence - 1;
+        if (pkt.sequence > mvHigh) {
+            missing(mvHigh, pkt.sequence);
+            mvHigh = pkt.sequence;
+        }
+        break;
+    case PKT_TYPE_RR:
+        // Answers our join, and later our finish
+        if (pkt.sequence == 0) {
+            mvJoined = true;
+        }
+        if (mvState == VERIFY && pkt.sequence == mvEofSequence) {
+            mvFinAcked = true;
+        }
+        break;
+    }
+    return 0;
+}
+
+int McastClient::data(const packet &pkt) {
+    uint64_t sequence = pkt.sequence;
+
+    // Without an announcement, there's no knowing where it goes.  It'll be
+    // asked for again once there is one.
+    if (mvBufferSize == 0 || pkt.size > mvBufferSize ||
+        (mvEof && sequence > mvEofSequence)) {
+        return 0;
+    }
+    if (sequence < mvHave.size() && mvHave[sequence]) {
+        mvDuplicates++;
+        return 0;
+    }
+
+    if (pwrite(mvTo, pkt.data, pkt.size,
+               pkt_offset(sequence, mvBufferSize)) != (ssize_t)pkt.size) {
+        LOG(LOGL_ERROR, "pwrite (%d): %s", __LINE__, strerror(errno));
+        return 1;
+    }
+    if (sequence >= mvHave.size()) {
+        mvHave.resize(sequence + 1);
+    }
+    mvHave[sequence] = true;
+    mvBytes += pkt.size;
+
+    if (sequence >= mvHigh) {
+        missing(mvHigh, sequence);
+        mvHigh = sequence + 1;
+    } else {
+        found(sequence);
+    }
+
+    // A short packet ends the file
+    if (pkt.size < mvBufferSize) {
+        mvEof = true;
+        mvEofSequence = sequence;
+    }
+    return 0;
+}
+
+void McastClient::missing(uint64_t first, uint64_t end) {
+    if (first >= end) {
+        return;
+    }
+
+    // Wait a little before asking, in case someone else asks first
+    Gap gap = { end, clock_usec() +
+                     (uint64_t)(drand48() * MC_NAK_BACKOFF_US), 0 };
+    mvGaps[first] = gap;
+    if (gap.nakAt < mvNakNext || mvGaps.size() == 1) {
+        mvNakNext = gap.nakAt;
+    }
+}
+
+void McastClient::found(uint64_t sequence) {
+    std::map<uint64_t, Gap>::iterator it = mvGaps.upper_bound(sequence);
+
+    if (it == mvGaps.begin()) {
+        return;
+    }
+    --it;
+    if (sequence >= it->second.end) {
+        return;
+    }
+
+    // Whatever's left on either side keeps its timer
+    uint64_t first = it->first;
+    Gap gap = it->second;
+    mvGaps.erase(it);
+    if (first < sequence) {
+        Gap before = gap;
+        before.end = sequence;
+        mvGaps[first] = before;
+    }
+    if (sequence + 1 < gap.end) {
+        mvGaps[sequence + 1] = gap;
+    }
+}
+
+void McastClient::suppress(uint64_t first, uint64_t end) {
+    uint64_t until = clock_usec() + MC_NAK_HOLDOFF_US;
+    std::map<uint64_t, Gap>::iterator it = mvGaps.upper_bound(first);
+
+    if (it != mvGaps.begin()) {
+        --it;
+    }
+    for (; it != mvGaps.end() && it->first < end; ++it) {
+        Gap gap = it->second;
+
+        if (gap.end <= first) {
+            continue;
+        }
+
+        // Only the part that was asked for waits
+        if (it->first < first) {
+            it->second.end = first;
+            it = mvGaps.insert(std::make_pair(first, gap)).first;
+        }
+        if (gap.end > end) {
+            mvGaps[end] = gap;
+            it->second.end = end;
+        }
+        if (it->second.nakAt < until) {
+            if (it->second.naks == 0) {
+                mvSuppressed++;
+            }
+            it->second.nakAt = until;
+        }
+    }
+}
+
+int McastClient::sendNaks() {
+    uint64_t now = clock_usec();
+    uint64_t next = UINT64_MAX;
+    std::map<uint64_t, Gap>::iterator it;
+
+    if (!mvSenderKnown || mvGaps.empty() || now < mvNakNext) {
+        return 0;
+    }
+
+    // Top up the bucket
+    mvTokens += (now - mvTokenTime) * (double)MC_NAK_RATE / 1000000;
+    if (mvTokens > MC_NAK_BURST) {
+        mvTokens = MC_NAK_BURST;
+    }
+    mvTokenTime = now;
+
+    // Each NAK starts at the first gap that's due and takes in every other
+    // due gap its bitmap reaches
+    it = mvGaps.begin();
+    while (it != mvGaps.end()) {
+        packet outpkt;
+        uint64_t base;
+
+        if (it->second.nakAt > now || mvTokens < 1) {
+            if (it->second.nakAt < next) {
+                next = it->second.nakAt;
+            }
+            ++it;
+            continue;
+        }
+
+        base = it->first;
+        memset(&outpkt, 0, PKT_HDRSZ + MC_NAK_SPAN / 8);
+        for (; it != mvGaps.end() && it->first < base + MC_NAK_SPAN; ++it) {
+            if (it->second.nakAt > now) {
+                if (it->second.nakAt < next) {
+                    next = it->second.nakAt;
+                }
+                continue;
+            }
+
+            // A gap running past the bitmap is split, and the rest asked
+            // for in the next NAK
+            if (it->second.end > base + MC_NAK_SPAN) {
+                mvGaps[base + MC_NAK_SPAN] = it->second;
+                it->second.end = base + MC_NAK_SPAN;
+            }
+            for (uint64_t s = it->first; s < it->second.end; s++) {
+                outpkt.data[(s - base) / 8] |= 1 << ((s - base) % 8);
+            }
+            it->second.nakAt = now + MC_NAK_HOLDOFF_US +
+                               (uint64_t)(drand48() * MC_NAK_BACKOFF_US);
+            it->second.naks++;
+            if (it->second.nakAt < next) {
+                next = it->second.nakAt;
+            }
+        }
+
+        outpkt.type = PKT_TYPE_NAK;
+        outpkt.sequence = base;
+        outpkt.size = MC_NAK_SPAN / 8;
+        mvLink.Seal(&outpkt, pktlen(&outpkt));
+        if (mvLink.Send(&outpkt, pktlen(&outpkt)) == -1) {
+            LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+            return 1;
+        }
+        mvNaks++;
+        mvTokens -= 1;
+    }
+
+    // Out of tokens, the next one is due when the bucket has one again
+    if (mvTokens < 1) {
+        uint64_t refill = now + (uint64_t)((1 - mvTokens) * 1000000 /
+                                           MC_NAK_RATE);
+        if (refill > next) {
+            next = refill;
+        }
+    }
+    mvNakNext = next;
+    return 0;
+}
+
+bool McastClient::complete() const {
+    return mvEof && mvHashKnown && mvGaps.empty() &&
+           mvHigh == mvEofSequence + 1;
+}
+
+int McastClient::hashFile(xxh128 &digest) {
+    xxh3 hash;
+    char buf[65536];
+    off_t offset = 0;
+    ssize_t rd;
+
+    // Written out of order, so hashed once it's all there
+    xxh3_init(&hash);
+    while ((rd = pread(mvTo, buf, sizeof(buf), offset)) > 0) {
+        xxh3_update(&hash, buf, rd);
+        offset += rd;
+    }
+    if (rd < 0) {
+        LOG(LOGL_ERROR, "pread (%d): %s", __LINE__, strerror(errno));
+        return 1;
+    }
+    digest = xxh3_digest(&hash);
+    return 0;
+}
+
+McastClient::State McastClient::recv() {
+    uint64_t now;
+    long timeout = MC_RECV_TIMEOUT_US;
+
+    if (complete()) {
+        xxh128 digest;
+        char ours[2 * XXH128_SIZE + 1];
+        char theirs[2 * XXH128_SIZE + 1];
+
+        if (hashFile(digest)) {
+            return ERROR;
+        }
+        xxh128_hex(&digest, ours);
+        xxh128_hex(&mvHash, theirs);
+        mvVerified = digest.high == mvHash.high && digest.low == mvHash.low;
+        if (mvVerified) {
+            std::cout << "Integrity verified.  xxh128 0x" << ours
+                      << std::endl;
+        } else {
+            std::cout << "Integrity check failed.  xxh128 0x" << ours
+                      << ", expected 0x" << theirs << std::endl;
+        }
+        return VERIFY;
+    }
+
+    if (sendNaks()) {
+        return ERROR;
+    }
+
+    now = clock_usec();
+    if (!mvGaps.empty() && mvNakNext < now + timeout) {
+        timeout = mvNakNext > now ? mvNakNext - now : 0;
+    }
+    if (recvPackets(timeout)) {
+        return ERROR;
+    }
+
+    if (clock_usec() - mvHeard >= MC_RECV_TIMEOUT_US) {
+        LOG(LOGL_WARN, "Sender timed out.  Retries left: %d", mvRetries);
+        mvRetries--;
+        mvHeard = clock_usec();
+    }
+    return RECV_PACKETS;
+}
+
+McastClient::State McastClient::verify() {
+    packet outpkt;
+    uint64_t until = clock_usec() + MC_RECV_TIMEOUT_US;
+
+    // Tell the sender until it answers, saying whether the hash matched
+    FinFrame::Encode(&outpkt, mvEofSequence, mvVerified);
+    if (mvLink.Send(&outpkt, PKT_HDRSZ) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+        return ERROR;
+    }
+
+    for (uint64_t now = clock_usec(); now < until && !mvFinAcked;
+         now = clock_usec()) {
+        if (recvPackets(until - now)) {
+            return ERROR;
+        }
+    }
+    if (mvFinAcked) {
+        return DONE;
+    }
+
+    LOG(LOGL_WARN, "Sender timed out.  Retries left: %d", mvRetries);
+    mvRetries--;
+    return VERIFY;
+}
+
+void McastClient::printStats() {
+    uint64_t now = clock_usec();
+
+    // One key=value line, for scripts like bench.sh to pick up
+    std::cout << "mcopy stats: bytes=" << mvBytes << " elapsed_us="
+              << now - mvStartTime << " duplicates=" << mvDuplicates
+              << " naks=" << mvNaks << " suppressed=" << mvSuppressed
+              << " cpu_us=" << cpu_usec() << std::endl;
+}
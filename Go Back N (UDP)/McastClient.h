@@ -0,0 +1,111 @@
+#ifndef MCASTCLIENT_H
+#define MCASTCLIENT_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include "packet.h"
+    #include "xxhash.h"
+}
+
+#include "UdpLink.h"
+
+#define MC_RECV_TIMEOUT_US 1000000 // Longest wait for the sender
+#define MC_NAK_BACKOFF_US 10000    // Longest random wait before a first NAK
+#define MC_NAK_HOLDOFF_US 100000   // Wait for a repair before asking again
+#define MC_NAK_RATE 100            // NAKs per second, at most
+#define MC_NAK_BURST 16            // NAKs sent at once, at most
+#define MC_NAK_SPAN 1024           // Sequences one NAK's bitmap covers
+#define MC_RCVBUF (4 << 20)        // Socket buffer asked for, so bursts fit
+
+/** Receives a file multicast by McastServer.  Data lands straight in the
+ * file at its offset, whatever order it comes in, and gaps are tracked
+ * until repairs fill them.  Each gap is NAKed after a random delay, unless
+ * the sender echoes someone else's NAK for it first. */
+class McastClient {
+    public:
+        McastClient(const std::string &to, const std::string &group,
+                    unsigned short port, const std::string &interface);
+        ~McastClient();
+
+        int Run();
+
+    private:
+        /** Missing sequences [first, end), keyed by first, and when to
+         * ask for them.  naks counts the times this receiver asked. */
+        struct Gap {
+            uint64_t end;
+            uint64_t nakAt;
+            unsigned int naks;
+        };
+
+        std::string mvToName;
+        int mvTo;
+
+        /** The group's socket only listens; the other one talks to the
+         * sender, so it knows receivers on one host apart */
+        int mvGroupSocket;
+        int mvSocket;
+        UdpLink mvGroup;
+        UdpLink mvLink;
+        bool mvSenderKnown;
+        bool mvJoined;
+
+        unsigned int mvBufferSize;
+        /** The sequence after the highest one known to have been sent */
+        uint64_t mvHigh;
+        std::vector<bool> mvHave;
+        std::map<uint64_t, Gap> mvGaps;
+        /** No gap's NAK is due before this */
+        uint64_t mvNakNext;
+        bool mvEof;
+        uint64_t mvEofSequence;
+        bool mvHashKnown;
+        xxh128 mvHash;
+        bool mvVerified;
+        bool mvFinAcked;
+
+        /** NAK rate limiting: tokens left, and when they were last topped
+         * up */
+        double mvTokens;
+        uint64_t mvTokenTime;
+
+        int mvRetries;
+        uint64_t mvHeard;
+
+        /** Counters for the summary */
+        uint64_t mvStartTime;
+        uint64_t mvBytes;
+        uint64_t mvDuplicates;
+        uint64_t mvNaks;
+        uint64_t mvSuppressed;
+
+        enum State {
+            RECV_PACKETS,
+            VERIFY,
+            ERROR,
+            DONE
+        } mvState;
+
+        int recvPackets(long timeoutUs);
+        int handle(const packet &pkt);
+        int data(const packet &pkt);
+        void missing(uint64_t first, uint64_t end);
+        void found(uint64_t sequence);
+        void suppress(uint64_t first, uint64_t end);
+        int sendNaks();
+        bool complete() const;
+        int hashFile(xxh128 &digest);
+
+        State recv();
+        State verify();
+
+        void printStats();
+};
+
+#endif // MCASTCLIENT_H
@@ -0,0 +1,452 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+    #include "clock.h"
+    #include "log.h"
+}
+
+#include "McastServer.h"
+#include "Codec.h"
+#include "Exception.h"
+
+McastServer::McastServer(const std::string &from, const std::string &group,
+                         unsigned short port, unsigned int bufferSize,
+                         unsigned int rateMbit, unsigned int receivers,
+                         const std::string &interface) :
+mvFromName(from),
+mvBufferSize(bufferSize),
+mvRate(rateMbit),
+mvReceivers(receivers),
+mvSocket(-1),
+mvFrom(-1),
+mvPrefetch(NULL),
+mvNext(0),
+mvEof(false),
+mvEofSequence(0),
+mvPaceNext(0),
+mvAnnNext(0),
+mvHeard(0),
+mvStartTime(0),
+mvPackets(0),
+mvRepaired(0),
+mvNaks(0),
+mvState(WAIT_JOIN) {
+    xxh3_init(&mvHash);
+
+    if (mvBufferSize == 0 || mvBufferSize > PKT_DMAX_LIMIT) {
+        throw Exception(__LINE__, "buffer-size", "out of range");
+    }
+    if (mvRate == 0) {
+        throw Exception(__LINE__, "rate", "must be at least 1 Mbit/s");
+    }
+
+    sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    if (inet_pton(AF_INET, group.c_str(), &to.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(to.sin_addr.s_addr))) {
+        throw Exception(__LINE__, group, "not an IPv4 multicast group");
+    }
+
+    if ((mvSocket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        throw Exception(__LINE__, "socket", strerror(errno));
+    }
+
+    // Send through the given interface, if any; 127.0.0.1 keeps the group
+    // on this host.  Receivers here hear it either way.
+    if (!interface.empty()) {
+        in_addr ifaddr;
+        if (inet_pton(AF_INET, interface.c_str(), &ifaddr) != 1) {
+            throw Exception(__LINE__, interface, "not an IPv4 address");
+        }
+        if (setsockopt(mvSocket, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr,
+                       sizeof(ifaddr)) < 0) {
+            throw Exception(__LINE__, "setsockopt", strerror(errno));
+        }
+    }
+    unsigned char loop = 1;
+    if (setsockopt(mvSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                   sizeof(loop)) < 0) {
+        throw Exception(__LINE__, "setsockopt", strerror(errno));
+    }
+
+    sockaddr_storage addr;
+    memcpy(&addr, &to, sizeof(to));
+    mvGroup = UdpLink(UdpSocket(mvSocket, addr, sizeof(to)), PKT_HDRSZ);
+    mvLink = UdpLink(UdpSocket(mvSocket), PKT_HDRSZ);
+
+    if ((mvFrom = open(mvFromName.c_str(), O_RDONLY)) == -1) {
+        throw Exception(__LINE__, "open", strerror(errno));
+    }
+    mvPrefetch = prefetch_open(mvFrom, 0, mvBufferSize, PKT_HDRSZ,
+                               MC_PREFETCH, 1);
+    if (mvPrefetch == NULL) {
+        throw Exception(__LINE__, "prefetch", strerror(errno));
+    }
+}
+
+McastServer::~McastServer() {
+    prefetch_close(mvPrefetch);
+    close(mvFrom);
+    close(mvSocket);
+}
+
+int McastServer::Run() {
+    std::cout << "Waiting for " << mvReceivers << " receiver"
+              << (mvReceivers == 1 ? "" : "s") << "..." << std::endl;
+
+    mvHeard = clock_usec();
+    while (mvState != DONE && mvState != ERROR) {
+        switch (mvState) {
+        case WAIT_JOIN:
+            mvState = waitJoin();
+            break;
+        case SEND:
+            mvState = send();
+            break;
+        case REPAIR:
+            mvState = repair();
+            break;
+        default:
+            break;
+        }
+    }
+
+    printStats();
+
+    if (mvState == ERROR) {
+        std::cout << "Error sending file.  Exiting." << std::endl;
+        return 1;
+    }
+    for (std::map<Address, Member>::const_iterator it = mvMembers.begin();
+         it != mvMembers.end(); ++it) {
+        if (!it->second.verified) {
+            std::cout << "Not every receiver has the file.  Exiting."
+                      << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "File transfer successful.  Exiting." << std::endl;
+    return 0;
+}
+
+int McastServer::recvPackets(long timeoutUs) {
+    packet pkt;
+    ssize_t len;
+
+    // Wait for the first, then take whatever else has arrived
+    while (1) {
+        switch (mvLink.Recv(pkt, len, timeoutUs)) {
+        case LINK_FAILED:
+            LOG(LOGL_ERROR, "recvfrom (%d): %s", __LINE__, strerror(errno));
+            return 1;
+        case LINK_TIMEOUT:
+            return 0;
+        case LINK_CORRUPT:
+            break;
+        case LINK_OK:
+            // Payloads have to be all there
+            if ((size_t)pktlen(&pkt) <= (size_t)len) {
+                handle(pkt);
+            }
+            break;
+        }
+        timeoutUs = 0;
+    }
+}
+
+void McastServer::handle(const packet &pkt) {
+    const sockaddr_in *from = (const sockaddr_in *)&mvLink.GetSocket().Peer();
+    Address who(from->sin_addr.s_addr, from->sin_port);
+    std::map<Address, Member>::iterator it = mvMembers.find(who);
+    packet outpkt;
+
+    if (pkt.type != PKT_TYPE_JON && pkt.type != PKT_TYPE_NAK &&
+        pkt.type != PKT_TYPE_FIN) {
+        return;
+    }
+    mvHeard = clock_usec();
+
+    // Anyone asking for repairs or finishing has joined, even if its join
+    // was lost
+    if (it == mvMembers.end()) {
+        Member member = { false, false, 0, mvHeard, 0 };
+        char host[INET_ADDRSTRLEN];
+
+        it = mvMembers.insert(std::make_pair(who, member)).first;
+        std::cout << "Receiver joined: "
+                  << inet_ntop(AF_INET, &from->sin_addr, host, sizeof(host))
+                  << ":" << ntohs(from->sin_port) << std::endl;
+    }
+
+    switch (pkt.type) {
+    case PKT_TYPE_JON:
+        RrFrame::Encode(&outpkt, 0);
+        break;
+    case PKT_TYPE_NAK:
+        it->second.naks++;
+        mvNaks++;
+
+        // Echo it to the group, so everyone missing these waits for the
+        // repair instead of asking too
+        if (mvGroup.Send(&pkt, pktlen(&pkt)) == -1) {
+            LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+        }
+
+        // Queue what's been sent and not just repaired; anything later is
+        // still coming anyway
+        for (uint64_t i = 0; i < 8 * (uint64_t)pkt.size; i++) {
+            uint64_t s = pkt.sequence + i;
+            if (s >= mvNext) {
+                break;
+            }
+            if (PKT_NAK_MISSING(&pkt, i) && mvSentAt[s] != MC_QUEUED &&
+                mvHeard - mvSentAt[s] >= MC_REPAIR_HOLDOFF_US) {
+                mvSentAt[s] = MC_QUEUED;
+                mvRepairs.push_back(s);
+            }
+        }
+        return;
+    case PKT_TYPE_FIN:
+        if (!it->second.done) {
+            it->second.done = true;
+            it->second.verified = FinFrame::Verified(pkt);
+            it->second.finished = mvHeard;
+        }
+        RrFrame::Encode(&outpkt, pkt.sequence);
+        break;
+    }
+
+    if (mvLink.Send(&outpkt, PKT_HDRSZ) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+    }
+}
+
+int McastServer::announce() {
+    uint64_t now = clock_usec();
+    packet outpkt;
+
+    if (now < mvAnnNext) {
+        return 0;
+    }
+    mvAnnNext = now + MC_ANN_US;
+
+    // Tells receivers what's been sent, so they find losses at the tail
+    AnnFrame::Encode(&outpkt, mvNext, mvBufferSize);
+    if (mvGroup.Send(&outpkt, PKT_HDRSZ) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+        return 1;
+    }
+
+    // and once it's all been sent, the hash, following the last data packet
+    // in sequence, big-endian
+    if (sentAll()) {
+        xxh128 digest = xxh3_digest(&mvHash);
+
+        memset(&outpkt, PKT_TYPE_HSH, PKT_HDRSZ);
+        outpkt.sequence = mvEofSequence + 1;
+        outpkt.size = XXH128_SIZE;
+        xxh128_put(&digest, outpkt.data);
+        mvGroup.Seal(&outpkt, pktlen(&outpkt));
+        if (mvGroup.Send(&outpkt, pktlen(&outpkt)) == -1) {
+            LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int McastServer::sendData(uint64_t sequence) {
+    bool fresh = sequence == mvNext;
+    packet repair;
+    packet *pkt;
+    ssize_t rd;
+
+    // New data was read ahead; repairs were sent a moment ago, so they're
+    // read back from the page cache
+    if (fresh) {
+        pkt = (packet *)prefetch_take(mvPrefetch, &rd, 1);
+    } else {
+        pkt = &repair;
+        rd = pread(mvFrom, pkt->data, mvBufferSize,
+                   pkt_offset(sequence, mvBufferSize));
+    }
+    if (rd < 0 || pkt == NULL) {
+        LOG(LOGL_ERROR, "pread (%d): %s", __LINE__, strerror(errno));
+        return 1;
+    }
+
+    pkt->type = PKT_TYPE_DAT;
+    pkt->sequence = sequence;
+    pkt->size = rd;
+    mvGroup.Seal(pkt, pktlen(pkt));
+    if (mvGroup.Send(pkt, pktlen(pkt)) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+        if (fresh) {
+            prefetch_release(mvPrefetch, pkt);
+        }
+        return 1;
+    }
+    mvPackets++;
+    mvPaceNext += (uint64_t)pktlen(pkt) * 8 / mvRate;
+
+    if (fresh) {
+        xxh3_update(&mvHash, pkt->data, rd);
+        mvSentAt.push_back(clock_usec());
+        mvNext++;
+        if ((unsigned int)rd < mvBufferSize) {
+            mvEof = true;
+            mvEofSequence = sequence;
+        }
+        prefetch_release(mvPrefetch, pkt);
+    } else {
+        mvSentAt[sequence] = clock_usec();
+        mvRepaired++;
+    }
+    return 0;
+}
+
+int McastServer::pace() {
+    uint64_t now = clock_usec();
+    uint64_t burst = (uint64_t)MC_BURST * (PKT_HDRSZ + mvBufferSize) * 8 /
+                     mvRate;
+
+    // Time spent with nothing to send isn't saved up past one burst
+    if (mvPaceNext + burst < now) {
+        mvPaceNext = now - burst;
+    }
+
+    // Repairs go first; new data only while there's some left to send
+    for (unsigned int n = 0; n < MC_BURST && mvPaceNext <= now; n++) {
+        if (!mvRepairs.empty()) {
+            uint64_t s = mvRepairs.front();
+            mvRepairs.pop_front();
+            if (sendData(s)) {
+                return 1;
+            }
+        } else if (mvState == SEND && !sentAll()) {
+            if (sendData(mvNext)) {
+                return 1;
+            }
+        } else {
+            break;
+        }
+    }
+    return 0;
+}
+
+bool McastServer::sentAll() const {
+    return mvEof && mvNext > mvEofSequence;
+}
+
+bool McastServer::finished() const {
+    if (mvMembers.size() < mvReceivers) {
+        return false;
+    }
+    for (std::map<Address, Member>::const_iterator it = mvMembers.begin();
+         it != mvMembers.end(); ++it) {
+        if (!it->second.done) {
+            return false;
+        }
+    }
+    return true;
+}
+
+McastServer::State McastServer::waitJoin() {
+    uint64_t now;
+
+    if (announce()) {
+        return ERROR;
+    }
+    now = clock_usec();
+    if (mvMembers.size() >= mvReceivers) {
+        mvStartTime = now;
+        mvPaceNext = now;
+        return SEND;
+    }
+    if (recvPackets(mvAnnNext > now ? mvAnnNext - now : 0)) {
+        return ERROR;
+    }
+    return WAIT_JOIN;
+}
+
+McastServer::State McastServer::send() {
+    uint64_t now;
+
+    if (announce() || pace()) {
+        return ERROR;
+    }
+    if (sentAll()) {
+        return REPAIR;
+    }
+
+    // Listen until the next packet's due
+    now = clock_usec();
+    if (recvPackets(mvPaceNext > now ? mvPaceNext - now : 0)) {
+        return ERROR;
+    }
+    return SEND;
+}
+
+McastServer::State McastServer::repair() {
+    uint64_t now;
+    uint64_t until;
+
+    if (announce() || pace()) {
+        return ERROR;
+    }
+    if (finished()) {
+        return DONE;
+    }
+
+    now = clock_usec();
+    if (now - mvHeard > MC_IDLE_US) {
+        std::cout << "Receivers stopped answering." << std::endl;
+        return DONE;
+    }
+
+    // Listen until the next repair's due, or the next announcement
+    until = mvRepairs.empty() ? mvAnnNext : mvPaceNext;
+    if (recvPackets(until > now ? until - now : 0)) {
+        return ERROR;
+    }
+    return REPAIR;
+}
+
+void McastServer::printStats() {
+    uint64_t now = clock_usec();
+
+    // One line per receiver, then one key=value line for scripts
+    for (std::map<Address, Member>::const_iterator it = mvMembers.begin();
+         it != mvMembers.end(); ++it) {
+        const Member &m = it->second;
+        in_addr addr;
+        char host[INET_ADDRSTRLEN];
+
+        addr.s_addr = it->first.first;
+        std::cout << "receiver "
+                  << inet_ntop(AF_INET, &addr, host, sizeof(host)) << ":"
+                  << ntohs(it->first.second) << ": "
+                  << (!m.done ? "unfinished" :
+                      m.verified ? "verified" : "hash mismatch")
+                  << " naks=" << m.naks << " elapsed_us="
+                  << (m.done && mvStartTime ? m.finished - mvStartTime : 0)
+                  << std::endl;
+    }
+    std::cout << "mcserver stats: receivers=" << mvMembers.size()
+              << " data=" << mvNext << " sent=" << mvPackets
+              << " repairs=" << mvRepaired << " naks=" << mvNaks
+              << " elapsed_us=" << (mvStartTime ? now - mvStartTime : 0)
+              << " cpu_us=" << cpu_usec() << std::endl;
+}
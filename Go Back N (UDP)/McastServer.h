@@ -0,0 +1,119 @@
+#ifndef MCASTSERVER_H
+#define MCASTSERVER_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+    #include "packet.h"
+    #include "prefetch.h"
+    #include "xxhash.h"
+}
+
+#include "UdpLink.h"
+
+#define MC_ANN_US 100000          // How often the sender announces itself
+#define MC_REPAIR_HOLDOFF_US 50000 // A packet sent this recently isn't again
+#define MC_IDLE_US 10000000       // Silence after which receivers are
+                                  // given up on
+#define MC_PREFETCH 256           // Data packets read ahead of the sender
+#define MC_BURST 64               // Most packets sent back to back
+#define MC_QUEUED UINT64_MAX      // Sent time of a packet awaiting repair
+
+/** Sends one file to a multicast group, once, however many receivers there
+ * are.  Receivers join and report completion over unicast; each one finds
+ * its own gaps and asks for them with NAKs, which the sender echoes to the
+ * group so others missing the same packets hold back, and answers by
+ * multicasting the packets again. */
+class McastServer {
+public:
+    McastServer(const std::string &from, const std::string &group,
+                unsigned short port, unsigned int bufferSize,
+                unsigned int rateMbit, unsigned int receivers,
+                const std::string &interface);
+    ~McastServer();
+
+    int Run();
+private:
+    /** A receiver, counted in from its first join and done once it says it
+     * has the whole file */
+    struct Member {
+        bool done;
+        bool verified;
+        uint64_t naks;
+        uint64_t joined;
+        uint64_t finished;
+    };
+    typedef std::pair<uint32_t, uint16_t> Address;
+
+    std::string mvFromName;
+    unsigned int mvBufferSize;
+    /** Megabits per second, which is bits per microsecond */
+    unsigned int mvRate;
+    /** Receivers to wait for before sending any data */
+    unsigned int mvReceivers;
+
+    int mvSocket;
+    int mvFrom;
+    /** Both on mvSocket: one aimed at the group, the other at whichever
+     * receiver was heard from last */
+    UdpLink mvGroup;
+    UdpLink mvLink;
+
+    std::map<Address, Member> mvMembers;
+
+    struct prefetch *mvPrefetch;
+    /** The next sequence never sent */
+    uint64_t mvNext;
+    bool mvEof;
+    uint64_t mvEofSequence;
+    xxh3 mvHash;
+
+    /** Sequences asked for again, oldest first, and when each sequence was
+     * last sent, or MC_QUEUED while it waits in mvRepairs */
+    std::deque<uint64_t> mvRepairs;
+    std::vector<uint64_t> mvSentAt;
+
+    /** When the next packet may go, for pacing, and the next
+     * announcement */
+    uint64_t mvPaceNext;
+    uint64_t mvAnnNext;
+    /** Last time any receiver was heard from */
+    uint64_t mvHeard;
+
+    /** Counters for the summary */
+    uint64_t mvStartTime;
+    uint64_t mvPackets;
+    uint64_t mvRepaired;
+    uint64_t mvNaks;
+
+    enum State {
+        WAIT_JOIN,
+        SEND,
+        REPAIR,
+        ERROR,
+        DONE
+    } mvState;
+
+    int recvPackets(long timeoutUs);
+    void handle(const packet &pkt);
+    int announce();
+    int sendData(uint64_t sequence);
+    int pace();
+    bool sentAll() const;
+    bool finished() const;
+
+    State waitJoin();
+    State send();
+    State repair();
+
+    void printStats();
+};
+
+#endif // MCASTSERVER_H
@@ -1,4 +1,6 @@
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <errno.h>
@@ -7,6 +9,7 @@
 #include <signal.h>
 #include <unistd.h>
 
+#include <climits>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
@@ -16,24 +19,94 @@
 extern "C" {
     #include "select_call.h"
 }
-#include "cpe464.h"
+
+extern "C" {
+    #include "clock.h"
+    #include "fec.h"
+    #include "impair.h"
+    #include "log.h"
+    #include "trace.h"
+}
 
 #include "Server.h"
+#include "Codec.h"
 #include "Exception.h"
 
 #define CXN_THRESH 100
+#define FEC_MARGIN 2.0f // Parity packets sent per expected loss
+#define STATS_INTERVAL_US 100000 // How often sessions publish statistics
+#define RTO_MIN_US 20000 // Floor on the retransmission timeout
 //~ #define DEBUG_CHLD
 
-void sigchld_handler(int s) {
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+/* Steers each datagram to the socket in the slot its connection ID names,
+   which is the ID's low 16 bits, little-endian like the rest of the
+   header.  The kernel runs it on the UDP payload for the listening port's
+   whole reuseport group.  A packet too short for an ID goes to slot 0, and
+   a slot past the end to whichever socket the kernel's hash picks, which
+   drops it. */
+static sock_filter steer[] = {
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, PKT_CXN_AT + 1),
+    BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+    BPF_STMT(BPF_MISC | BPF_TAX, 0),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, PKT_CXN_AT),
+    BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+    BPF_STMT(BPF_RET | BPF_A, 0)
+};
+
+/* What a window of this many packets costs a session: the buffers for the
+   packets in it and the file read ahead of it, and the bookkeeping for
+   each slot */
+static uint64_t windowBytes(unsigned int window, unsigned int bufferSize) {
+    return prefetch_size(bufferSize, PKT_HDRSZ, PREFETCH_WINDOWS * window,
+                         window) +
+           window * (uint64_t)(2 * sizeof(packet *) + sizeof(int64_t) +
+                               sizeof(wheel_timer));
 }
 
-Server::Server(float errorPercent) :
+/* What a session is held to from when it's admitted until it asks for a
+   window: the least window at the largest buffer it could ask for, since
+   the buffer size comes later */
+static uint64_t admitBytes() {
+    return windowBytes(POOL_MIN_WINDOW, PKT_DMAX_LIMIT);
+}
+
+Server::Server(float errorPercent, long busyPollUs, uint64_t poolBytes,
+               uint64_t sessionBytes) :
 mvErrorPercent(errorPercent),
+mvBusyPollUs(busyPollUs),
 mvFrom(0),
+mvFiles(NULL),
+mvFile(NULL),
+mvConnection(0),
+mvSlot(0),
+mvPool(NULL),
+mvSessionBytes(sessionBytes),
+mvSecret(0),
+mvPort(0),
 mvSequence(0),
+mvPrefetch(NULL),
 mvRetries(PKT_TRNSMAX),
-mvInitialized(false) {
+mvBackoff(0),
+mvInitialized(false),
+mvFecN(0),
+mvFecK(0),
+mvFecCount(0),
+mvFecFolded(0),
+mvFecValid(false),
+mvFecRejs(0),
+mvFecLoss(1.0f),
+mvHashNext(0),
+mvEof(false),
+mvEofSequence(0),
+mvStatsSlot(NULL),
+mvStatsNext(0),
+mvSendHigh(0) {
+    xxh3_init(&mvHash);
+    memset(&mvStats, 0, sizeof(mvStats));
+    memset(&mvRtt, 0, sizeof(mvRtt));
+    wheel_init(&mvTimers, 0, TIMER_TICK_US);
+    memset(&mvIdle, 0, sizeof(mvIdle));
+    
     // Get socket
     sockaddr_in local;
     socklen_t len;
@@ -42,48 +115,90 @@ mvInitialized(false) {
         throw Exception(__LINE__, "GetSocket: ", strerror(errno));
     }
     
+    // Cookies are keyed with a secret that dies with the server
+    if (getrandom(&mvSecret, sizeof(mvSecret), 0) != sizeof(mvSecret)) {
+        throw Exception(__LINE__, "getrandom", strerror(errno));
+    }
+    
+    // Sessions get sockets of their own on the same port, and the kernel
+    // hands each one its own packets
+    sock_fprog prog = { sizeof(steer) / sizeof(steer[0]), steer };
+    if (setsockopt(mvSocket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                   sizeof(prog)) < 0) {
+        throw Exception(__LINE__, "SO_ATTACH_REUSEPORT_CBPF",
+                        strerror(errno));
+    }
+    mvPort = ntohs(local.sin_port);
+    
     // Print port number
-    std::cout << "Socket created on Port " << ntohs(local.sin_port)
-              << std::endl;
+    std::cout << "Socket created on Port " << mvPort << std::endl;
     
-    // Configure signaling for forking
-    struct sigaction sa;
-    int t;
-
-    sa.sa_handler = sigchld_handler; // reap all dead processes
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        throw Exception(__LINE__, "sigaction", strerror(errno));
+    // Map the statistics segment before forking so every child shares it
+    if (stats_attach(1) == NULL) {
+        std::cerr << "Statistics unavailable: " << strerror(errno)
+                  << std::endl;
+    }
+    
+    // So do the files, kept open and statted for the next session
+    if ((mvFiles = fdcache_open(FDCACHE_LIMIT)) == NULL) {
+        throw Exception(__LINE__, "fdcache_open: ", strerror(errno));
     }
+    if (pipe2(mvOpened, O_NONBLOCK | O_CLOEXEC) == -1) {
+        throw Exception(__LINE__, "pipe2: ", strerror(errno));
+    }
+    
+    // And the memory their windows come out of, accounted by slot
+    if ((mvPool = budget_open(poolBytes, MAX_SESSIONS + 1)) == NULL) {
+        throw Exception(__LINE__, "budget_open: ", strerror(errno));
+    }
+    stats_pool(poolBytes, 0, 0);
 }
 
 Server::~Server()
 {
     close(mvSocket);
-    if (mvFrom != 0) {
+    clearWindow();
+    prefetch_close(mvPrefetch);
+    if (mvFrom != 0 && mvFile == NULL) {
         close(mvFrom);
     }
+    fdcache_close(mvFiles);
+    close(mvOpened[0]);
+    close(mvOpened[1]);
+    budget_close(mvPool);
+    for (unsigned int i = 0; i < mvFecParity.size(); i++) {
+        free(mvFecParity[i]);
+    }
 }
 
-int Server::GetSocket(sockaddr_in &local, socklen_t &len) {
+int Server::GetSocket(sockaddr_in &local, socklen_t &len,
+                      unsigned short port) {
     int sk;
+    int on = 1;
     if ((sk = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         return -1;
     }
     
+    // Every session's socket shares the listening one's port
+    if (setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        close(sk);
+        return -1;
+    }
+    
     local.sin_family = AF_INET;
     local.sin_addr.s_addr = htonl(INADDR_ANY);
-    local.sin_port = htons(0); // Let system choose port
+    local.sin_port = htons(port); // 0 lets the system choose
     
     // Bind the name to a port
     if (bind(sk, (sockaddr *)&local, sizeof(local)) < 0) {
+        close(sk);
         return -1;
     }
     
     // get port name
     len = sizeof(local);
     if (getsockname(sk, (sockaddr *)&local, &len) < 0) {
+        close(sk);
         return -1;
     }
     
@@ -94,103 +209,275 @@ int Server::Run() {
     packet outpkt;
     packet inpkt;
     
-    sockaddr_storage theirAddr;
-    socklen_t addrLen = sizeof(sockaddr_storage);
+    // Answers go to whoever sent the last request
+    UdpLink link(UdpSocket(mvSocket), PKT_HDRSZ);
+    
+    // Sockets for sessions, in the order they joined the port's reuseport
+    // group, which is the order the kernel numbers them in.  Closing one
+    // moves the last into its number, so only free slots at the end are
+    // closed.  One further in keeps its socket until it's reused or those
+    // after it go: a descriptor, and up to a receive buffer of whatever the
+    // last session's client sent after it ended.
+    std::vector<Slot> slots(1);
+    memset(&slots[0], 0, sizeof(slots[0]));
+    slots[0].fd = mvSocket;
     
-    bool cxn2 = false;
-    bool sending;
-    int sk;
-    sockaddr_in local;
-    socklen_t len;
-        
     std::cout << "Awaiting connections..." << std::endl;
 
     while (1) {
-        sending = false;
-        if (recvfrom(mvSocket, &inpkt, sizeof(packet), 0,
-                     (sockaddr *)&theirAddr, &addrLen) == -1) {
+        ssize_t inlen;
+        LinkStatus status = link.Recv(inpkt, inlen, RECV_TIMEOUT_US);
+        
+        // Free the slots of sessions that have finished.  A quiet port
+        // still wakes us now and then, so none lingers as a zombie.
+        pid_t done;
+        while ((done = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (unsigned int i = 1; i < slots.size(); i++) {
+                if (slots[i].pid == done) {
+                    slots[i].pid = 0;
+                    fdcache_put(mvFiles, slots[i].file);
+                    slots[i].file = NULL;
+                    budget_release(mvPool, i);
+                }
+            }
+        }
+        while (slots.size() > 1 && slots.back().pid == 0) {
+            close(slots.back().fd);
+            slots.pop_back();
+        }
+        
+        // Hold the files new sessions are sending, and forget any that
+        // have changed, so the next fork hands out only current ones
+        noteOpened(slots);
+        fdcache_update(mvFiles);
+        
+        // Show how much window memory is out, now reaped sessions have
+        // given theirs back
+        stats_pool(budget_limit(mvPool), budget_used(mvPool),
+                   budget_cuts(mvPool));
+        
+        switch (status) {
+        case LINK_FAILED:
             std::cerr << "recvfrom (" << __LINE__ << "): "<< strerror(errno)
                       << std::endl;
             return 1;
+        case LINK_OK:
+            break;
+        default:
+            continue;
         }
         
-        unsigned short ck = inpkt.checksum;
-        inpkt.checksum = 0;
-
-        if (ck != in_cksum((unsigned short *)&inpkt, sizeof(packet))) {
+        // Only the handshake comes here.  Anything else is a session's
+        // packet that the kernel couldn't steer: its slot is gone, or its
+        // ID was damaged.
+        if (ConnectionFrame::Connection(inpkt) != 0) {
             continue;
         }
         
-        switch (inpkt.type) {
-        case PKT_TYPE_CXN:
+        const sockaddr_storage &theirAddr = link.GetSocket().Peer();
+        const sockaddr_in &client = *(const sockaddr_in *)&theirAddr;
+        uint64_t period = clock_usec() / COOKIE_PERIOD_US;
+        uint32_t theirs = Cxn2Frame::Cookie(inpkt);
+        unsigned int slot = slots.size();
+        
+        if (inpkt.type == PKT_TYPE_CXN2) {
+            for (slot = 1; slot < slots.size(); slot++) {
+                if (slots[slot].pid != 0 && slots[slot].cookie == theirs &&
+                    slots[slot].client.sin_addr.s_addr ==
+                    client.sin_addr.s_addr &&
+                    slots[slot].client.sin_port == client.sin_port) {
+                    break;
+                }
+            }
+        }
+        
+        if (inpkt.type == PKT_TYPE_CXN) {
+            // Answered from the secret and the client's address alone, so
+            // a flood of these costs a hash and a send apiece, and nothing
+            // to remember
+            CookieFrame::Encode(&outpkt, inpkt.sequence,
+                                cookie(client, period));
+        } else if (inpkt.type != PKT_TYPE_CXN2 ||
+                   !cookieGood(client, theirs)) {
+            // Forged, stale, or from an address the cookie wasn't sent to
+            continue;
+        } else if (slot < slots.size()) {
+            // Our answer was lost.  The session's already started.
+            ConnectionFrame::Encode(&outpkt, inpkt.sequence,
+                                    slots[slot].connection);
+        } else if (budget_free(mvPool) < admitBytes()) {
+            // No room for even a small window.  The client asks again
+            // after a timeout, by when a session may have finished.
+            LOG(LOGL_WARN, "Window pool spent: %llu of %llu bytes.  "
+                "Holding off a new connection.",
+                (unsigned long long)budget_used(mvPool),
+                (unsigned long long)budget_limit(mvPool));
+            continue;
+        } else {
             char str[INET_ADDRSTRLEN];
-            int pid;
+            uint32_t connection;
+            uint16_t random;
+            pid_t pid;
             
             // New connection found
             std::cout << "Connection received from "
-                      << inet_ntop(theirAddr.ss_family,
-                                   (void *)&(((struct sockaddr_in*)&theirAddr)->
-                                             sin_addr),
-                                   str, sizeof(str)) << std::endl;
+                      << inet_ntop(AF_INET, &client.sin_addr, str,
+                                   sizeof(str)) << std::endl;
             
-            // Set up a new socket for child process                
-            sk = GetSocket(local, len);
+            // Take a free slot, or add one to the group
+            for (slot = 1; slot < slots.size() && slots[slot].pid != 0;
+                 slot++) {
+            }
+            if (slot == slots.size()) {
+                Slot added;
+                sockaddr_in local;
+                socklen_t len;
+                
+                memset(&added, 0, sizeof(added));
+                if (slot > MAX_SESSIONS ||
+                    (added.fd = GetSocket(local, len, mvPort)) == -1) {
+                    std::cerr << "GetSocket (" << __LINE__ << "): "
+                              << (slot > MAX_SESSIONS ? "too many sessions" :
+                                  strerror(errno)) << std::endl;
+                    continue;
+                }
+                slots.push_back(added);
+            } else {
+                // Drop what's queued for the slot's last session
+                char stale;
+                while (recv(slots[slot].fd, &stale, sizeof(stale),
+                            MSG_DONTWAIT) >= 0) {
+                }
+            }
             
-            // Send RR for connection
-            packet rr;
-            memset(&rr, PKT_TYPE_RR, sizeof(packet));
-            rr.sequence = inpkt.sequence;
-            rr.size = htons(local.sin_port);
-            rr.checksum = 0;
-            rr.checksum = in_cksum((unsigned short *)&rr, sizeof(packet));
-            outpkt = rr;
-            sending = true;
-            cxn2 = true;
-            break;
-        case PKT_TYPE_CXN2:
-            if (!cxn2) { break; }
-            cxn2 = false;
-            // Send RR for connection stage 2
-            outpkt = rrpkt(inpkt.sequence);
-            sending = true;
+            // The slot in the low half, where steer looks for it, and a
+            // random high half, so a stranger can't easily guess their way
+            // into a session.  The kernel's generator, since mrand48's
+            // next output follows from the last.
+            if (getrandom(&random, sizeof(random), 0) != sizeof(random)) {
+                std::cerr << "getrandom (" << __LINE__ << "): "
+                          << strerror(errno) << std::endl;
+                continue;
+            }
+            connection = (uint32_t)random << 16 | slot;
+            
+            // Set the least it'll need aside now, so sessions admitted
+            // before the last one's taken its window can't overdraw the pool
+            budget_grant(mvPool, slot, admitBytes(), admitBytes());
             
-            // Create child process
-            if ((pid = fork()) == 0) {                
+            // Create child process.  The handshake's been acknowledged
+            // through CXN2, so it starts at the buffer size.
+            if ((pid = fork()) == 0) {
                 #ifdef DEBUG_CHLD
                     select_call(-1, 10, 0); // Gives us some time to gdb the
                                             // child process
                 #endif
-                close(mvSocket);    // Close parent socket
-                mvSocket = sk;
-                mvAddr = theirAddr;
-                mvAddrLen = sizeof(mvAddr);
-                mvSequence = 1;
-                mvPort = local.sin_port;
+                for (unsigned int i = 0; i < slots.size(); i++) {
+                    if (i != slot) {
+                        close(slots[i].fd);
+                    }
+                }
+                close(mvOpened[0]);
+                mvSocket = slots[slot].fd;
+                mvLink = UdpLink(UdpSocket(mvSocket, theirAddr,
+                                           sizeof(theirAddr)), PKT_HDRSZ);
+                if (mvBusyPollUs > 0 &&
+                    mvLink.GetSocket().BusyPoll(mvBusyPollUs) == -1) {
+                    LOG(LOGL_INFO, "SO_BUSY_POLL (%d): %s.  Spinning "
+                        "anyway.", __LINE__, strerror(errno));
+                }
+                mvConnection = connection;
+                mvSlot = slot;
+                mvSequence = 2;
                 mvState = INIT;
                 
                 Child();
-            } else if (pid > 0) {
-                std::cout << "Starting new process [" << pid << "]"
+            } else if (pid < 0) {
+                std::cerr << "fork (" << __LINE__ << "): " << strerror(errno)
                           << std::endl;
+                budget_release(mvPool, slot);
+                continue;
             }
-            break;
-        case PKT_TYPE_REJ:
-            sending = true;
-            break;
+            std::cout << "Starting new process [" << pid << "] for "
+                         "connection " << std::hex << connection << std::dec
+                      << std::endl;
+            slots[slot].pid = pid;
+            slots[slot].connection = connection;
+            slots[slot].cookie = theirs;
+            slots[slot].client = client;
+            
+            // Send RR for connection stage 2, naming the session
+            ConnectionFrame::Encode(&outpkt, inpkt.sequence, connection);
         }
         
-        if (sending) {
-            if (sendtoErr(mvSocket, &outpkt, sizeof(packet), 0,
-                          (sockaddr *)&theirAddr, addrLen) == -1) {
-                std::cerr << "open (" << __LINE__ << "): " << strerror(errno);
-                return 1;
-            }
+        if (link.Send(&outpkt, pktlen(&outpkt)) == -1) {
+            std::cerr << "sendto (" << __LINE__ << "): " << strerror(errno)
+                      << std::endl;
+            return 1;
         }
     }
 }
 
+/* What a child writes to mvOpened.  It's no bigger than PIPE_BUF, so
+   children writing at once can't interleave. */
+struct OpenedNote {
+    pid_t pid;
+    char path[PIPE_BUF - sizeof(pid_t)];
+};
+
+void Server::noteOpened(std::vector<Slot> &slots) {
+    OpenedNote note;
+    
+    while (read(mvOpened[0], &note, sizeof(note)) == sizeof(note)) {
+        fdcache_entry *file;
+        unsigned int i;
+        
+        note.path[sizeof(note.path) - 1] = '\0';
+        if ((file = fdcache_get(mvFiles, note.path)) == NULL) {
+            LOG(LOGL_INFO, "fdcache_get (%d): %s: %s", __LINE__, note.path,
+                strerror(errno));
+            continue;
+        }
+        
+        // Held for as long as the session lasts.  One that's finished
+        // already leaves the file open for the next.
+        for (i = 1; i < slots.size() && slots[i].pid != note.pid; i++) {
+        }
+        if (i < slots.size() && slots[i].file == NULL) {
+            slots[i].file = file;
+        } else {
+            fdcache_put(mvFiles, file);
+        }
+    }
+}
+
+uint32_t Server::cookie(const sockaddr_in &client, uint64_t period) const {
+    xxh64 hash;
+    
+    // Only the server knows the seed, so only the server can make one.
+    // The period makes each cookie expire.
+    xxh64_init(&hash, mvSecret);
+    xxh64_update(&hash, &client.sin_addr, sizeof(client.sin_addr));
+    xxh64_update(&hash, &client.sin_port, sizeof(client.sin_port));
+    xxh64_update(&hash, &period, sizeof(period));
+    return xxh64_digest(&hash);
+}
+
+bool Server::cookieGood(const sockaddr_in &client, uint32_t theirs) const {
+    uint64_t period = clock_usec() / COOKIE_PERIOD_US;
+    
+    // Made this period or the last
+    return theirs == cookie(client, period) ||
+           theirs == cookie(client, period - 1);
+}
+
 inline int Server::Child() {
-    packet buf;
+    TRACE_BEGIN("server");
+    
+    // The client gets a full timeout to say something, and another every
+    // time it does
+    wheel_init(&mvTimers, clock_usec(), TIMER_TICK_US);
+    wheel_schedule(&mvTimers, &mvIdle, clock_usec() + RECV_TIMEOUT_US);
     
     // Main child loop
     while (mvState != DONE && mvState != ERROR && mvRetries > 0) {
@@ -207,9 +494,19 @@ inline int Server::Child() {
         case WAIT_RR:
             mvState = waitRR();
             break;
+        case SEND_HASH:
+            mvState = sendHash();
+            break;
+        default:
+            break;
         }
     }
     
+    printStats();
+    publishStats(true);
+    stats_close(mvStatsSlot);
+    TRACE_END();
+    
     if (mvState == ERROR) {
         std::cout << "Error receiving file.  Exiting." << std::endl;
         exit(1);
@@ -226,38 +523,204 @@ inline int Server::Child() {
 }
 
 int Server::recvPacket(packet &buf) {
-    #ifndef DEBUG_CHLD
-        // Check for timeout
-        if (select_call(mvSocket, 1, 0) <= 0) {
-            std::cerr << "Client timed out.  Retries left: " << mvRetries--
-                      << std::endl;
-            return 2;
+    ssize_t len;
+    sockaddr_storage client = mvLink.GetSocket().Peer();
+    socklen_t clientLen = mvLink.GetSocket().PeerLen();
+    LinkStatus status;
+    
+    // Wait for a packet or the next timer, whichever's first.  The wheel
+    // sometimes wakes us only to move timers down a level, and then we
+    // just wait again.
+    do {
+        uint64_t now = clock_usec();
+        uint64_t next = wheel_next(&mvTimers);
+        long timeoutUs = next > now ? next - now : 0;
+        
+        #ifdef DEBUG_CHLD
+            timeoutUs = -1; // Wait for good while a debugger holds us
+        #endif
+        
+        // Only a good packet in our session says where the client is now,
+        // so a client that moves keeps its session.  Anything else, whether
+        // corrupt, left on this socket by the session before ours, or
+        // steered here by a damaged ID, leaves the client where it was.
+        while ((status = mvLink.Recv(buf, len, timeoutUs)) == LINK_OK &&
+               !fromClient(buf, client, clientLen)) {
+            mvLink.GetSocket().SetPeer(client, clientLen);
         }
+        if (status == LINK_CORRUPT) {
+            mvLink.GetSocket().SetPeer(client, clientLen);
+        }
+    } while (status == LINK_TIMEOUT && expire() == 0);
+    
+    switch (status) {
+    case LINK_TIMEOUT:
+        return 2;
+    case LINK_FAILED:
+        LOG(LOGL_ERROR, "recvfrom (%d): %s", __LINE__, strerror(errno));
+        return 1;
+    case LINK_CORRUPT:
+        mvRetries = PKT_TRNSMAX;
+        TRACE_EVENT(TRACE_BADCK, buf.sequence, buf.type);
+        LOG(LOGL_INFO, "Received packet with bad checksum.  Recv Sequence: "
+            "%llu.  Retries left: %d", (unsigned long long)buf.sequence,
+            mvRetries);
+        mvRetries--;
+        return 2;
+    default:
         mvRetries = PKT_TRNSMAX;
-    #endif
+        mvBackoff = 0;
+        wheel_schedule(&mvTimers, &mvIdle, clock_usec() + RECV_TIMEOUT_US);
+        TRACE_EVENT(TRACE_RECV, buf.sequence, buf.type);
+        return 0;
+    }
+}
 
-    // Receive packets
-    if (recvfrom(mvSocket, &buf, sizeof(packet), 0,
-                 (sockaddr *)&mvAddr, &mvAddrLen) == -1) {
-        std::cerr << "recvfrom (" << __LINE__ << "): " << strerror(errno);
-        return 1;
+bool Server::fromClient(const packet &buf, sockaddr_storage &client,
+                        socklen_t &clientLen) {
+    const sockaddr_storage &theirAddr = mvLink.GetSocket().Peer();
+    const sockaddr_in &was = *(const sockaddr_in *)&client;
+    const sockaddr_in &now = *(const sockaddr_in *)&theirAddr;
+    char str[INET_ADDRSTRLEN];
+    packet outpkt;
+    
+    if (ConnectionFrame::Connection(buf) != mvConnection) {
+        return false;
+    }
+    if (now.sin_addr.s_addr == was.sin_addr.s_addr &&
+        now.sin_port == was.sin_port) {
+        // An answer to a challenge that's already been met, or to one sent
+        // before the client moved back, is nothing to the session
+        return buf.type != PKT_TYPE_PTH;
+    }
+    
+    // Anyone who's seen the connection ID could send from somewhere else.
+    // Only the client can answer at the new address with the cookie sent
+    // there, and until it does, what comes from there is dropped.
+    if (buf.type == PKT_TYPE_PTH && cookieGood(now, PathFrame::Cookie(buf))) {
+        LOG(LOGL_INFO, "Client moved to %s:%u",
+            inet_ntop(AF_INET, &now.sin_addr, str, sizeof(str)),
+            ntohs(now.sin_port));
+        client = theirAddr;
+        clientLen = mvLink.GetSocket().PeerLen();
+        return false;
+    }
+    PathFrame::Encode(&outpkt, buf.sequence,
+                      cookie(now, clock_usec() / COOKIE_PERIOD_US));
+    if (mvLink.Send(&outpkt, pktlen(&outpkt)) == -1) {
+        LOG(LOGL_INFO, "sendto (%d): %s", __LINE__, strerror(errno));
     }
+    return false;
+}
+
+unsigned int Server::expire() {
+    uint64_t now = clock_usec();
+    unsigned int fired = 0;
+    wheel_timer *t;
     
-    // Verify packet checksum
-    uint16_t ck = buf.checksum;
-    buf.checksum = 0;
+    while ((t = wheel_expire(&mvTimers, now)) != NULL) {
+        if (t == &mvIdle) {
+            // Nothing from the client in a full timeout.  Only these count
+            // against it.
+            mvStats.timeouts++;
+            TRACE_EVENT(TRACE_TIMEOUT, mvSequence, 0);
+            LOG(LOGL_WARN, "Client timed out.  Retries left: %d", mvRetries);
+            mvRetries--;
+            wheel_schedule(&mvTimers, &mvIdle, now + RECV_TIMEOUT_US);
+            fired++;
+            continue;
+        }
+        
+        // A packet's retransmission timer, which only the oldest packet's
+        // can mean much: acknowledgments are cumulative, so nothing after
+        // it can be acknowledged until it is.  Later ones wait another
+        // timeout.
+        unsigned int size = mvRetransmit.size();
+        uint64_t base = mvWindow.Base();
+        uint64_t sequence = base + (t - &mvRetransmit[0] + size - base % size) %
+                            size;
+        if (sequence != base) {
+            wheel_schedule(&mvTimers, t, now + retransmitTimeout());
+            continue;
+        }
+        
+        // Routine under loss.  Send again whatever the ARQ policy says its
+        // loss costs.
+        mvStats.timeouts++;
+        TRACE_EVENT(TRACE_TIMEOUT, sequence, 0);
+        LOG(LOGL_DEBUG, "No answer for %llu in %ld us.  Retransmitting.",
+            (unsigned long long)sequence, retransmitTimeout());
+        mvBackoff++;
+        resend(sequence);
+        fired++;
+    }
+    
+    return fired;
+}
 
-    if ((buf.checksum = in_cksum((unsigned short*)&buf, sizeof(packet)))
-        != ck) {
-        std::cerr << "Received packet with bad checksum.  Expected 0x"
-                  << std::hex << ck << ", received 0x" << std::hex
-                  << buf.checksum << std::endl
-                  << "Recv Sequence: " << std::dec << buf.sequence << std::endl
-                  << "Retries left: " << std::dec << mvRetries-- << std::endl;
-        return 2;
+long Server::retransmitTimeout() {
+    // A few round trips, once there's been one to measure, doubling with
+    // each timeout in a row (RFC 6298), but never longer than the client
+    // gets to answer at all
+    long rto = mvStats.srtt_us > 0 ? 4 * mvStats.srtt_us : RECV_TIMEOUT_US;
+    if (rto < RTO_MIN_US) {
+        rto = RTO_MIN_US;
+    }
+    for (unsigned int i = 0; i < mvBackoff && rto < RECV_TIMEOUT_US; i++) {
+        rto *= 2;
     }
+    return rto < RECV_TIMEOUT_US ? rto : RECV_TIMEOUT_US;
+}
+
+/* Takes memory for the window the client asked for out of the pool: no
+   more than a session's share, and less as the pool fills, but always
+   enough for POOL_MIN_WINDOW packets.  That much was set aside when the
+   session was admitted, so only the rest is asked for.  The window is
+   whatever it all buys. */
+unsigned int Server::grantWindow(unsigned int want) {
+    unsigned int least;
+    unsigned int low;
+    unsigned int high;
+    uint64_t ask;
+    uint64_t granted;
+    uint64_t minimum;
+    
+    want = ArqPolicy::Window(want);
+    least = want < POOL_MIN_WINDOW ? want : POOL_MIN_WINDOW;
+    minimum = windowBytes(least, mvBufferSize);
+    ask = windowBytes(want, mvBufferSize);
+    if (ask > mvSessionBytes) {
+        ask = mvSessionBytes;
+    }
+    if (ask < minimum) {
+        ask = minimum;
+    }
+    granted = budget_held(mvPool, mvSlot);
+    if (ask > granted) {
+        granted += budget_grant(mvPool, mvSlot, ask - granted,
+                                minimum > granted ? minimum - granted : 0);
+    }
+    
+    // The largest window the grant covers, keeping only what it costs
+    low = least;
+    high = want;
+    while (low < high) {
+        unsigned int mid = low + (high - low + 1) / 2;
+        if (windowBytes(mid, mvBufferSize) <= granted) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    budget_trim(mvPool, mvSlot, windowBytes(low, mvBufferSize));
     
-    return 0;
+    if (low < want) {
+        LOG(LOGL_INFO, "Window cut from %u to %u packets.  Pool: %llu of "
+            "%llu bytes in use.", want, low,
+            (unsigned long long)budget_used(mvPool),
+            (unsigned long long)budget_limit(mvPool));
+    }
+    return low;
 }
 
 Server::State Server::init() {
@@ -266,109 +729,275 @@ Server::State Server::init() {
     
     bool winszSet = false;
     bool bufszSet = false;
+    bool fecSet = false;
     bool fnSet = false;
+    bool timed = false;
+    int64_t sentAt = 0;
+    int64_t fastest = 0;
     
-    // Wait for initialization packets
-    while ((!winszSet || !bufszSet || !fnSet) && mvRetries > 0) {
-        int r;
+    // Wait for initialization packets.  The client sends each as soon as
+    // the last was acknowledged, so the gaps time round trips the way the
+    // handshake does for TCP, and the data starts with a useful timeout.
+    // A gap as long as the client's own timeout probably hides a resend,
+    // so only the fastest shorter one counts.
+    while ((!winszSet || !bufszSet || !fecSet || !fnSet) && mvRetries > 0) {
+        bool clean = timed;
+        timed = false;
         switch (recvPacket(inpkt)) {
         case 1:
             // Receive failed.  Terminate.
             return ERROR;
         case 2:
             // Bad checksum or timeout.  Send a Reject.
-            outpkt = rejpkt(mvSequence);
+            RejFrame::Encode(&outpkt, mvSequence);
             break;
         default:
-            // If proper sequence, send RR.  Otherwise, send reject.
+            // MTU probes sit outside the sequence space.  Echo the payload
+            // size back so the client knows this many bytes made it.
+            if (inpkt.type == PKT_TYPE_PRB) {
+                MtuFrame::Encode(&outpkt, inpkt.sequence, inpkt.size);
+                break;
+            }
+            
+            // If proper sequence, send RR.  Otherwise, send reject.  A
+            // repeat gets its own number back, not the one we're up to, or
+            // the client takes it for the next request's answer.
             if (inpkt.sequence <= mvSequence) {
                 mvRetries = PKT_TRNSMAX;
-                outpkt = rrpkt(mvSequence);
+                RrFrame::Encode(&outpkt, inpkt.sequence);
                 
                 // Process packet
                 if (inpkt.sequence == mvSequence) {
+                    if (clean) {
+                        int64_t gap = clock_usec() - sentAt;
+                        if (gap < RECV_TIMEOUT_US &&
+                            (fastest == 0 || gap < fastest)) {
+                            fastest = gap;
+                        }
+                    }
+                    timed = true;
                     mvSequence++;
                     switch (inpkt.type) {
                     case PKT_TYPE_BUF:
-                        mvBufferSize = inpkt.size;
+                        mvBufferSize = BufFrame::BufferSize(inpkt);
+                        if (mvBufferSize == 0 ||
+                            mvBufferSize > PKT_DMAX_LIMIT) {
+                            std::cerr << "Invalid buffer size requested: "
+                                      << mvBufferSize << std::endl;
+                            return ERROR;
+                        }
                         bufszSet = true;
                         break;
-                    case PKT_TYPE_WIN:
-                        mvWindowSize = inpkt.size;
+                    case PKT_TYPE_WIN: {
+                        // Both ends have to be built for the same ARQ
+                        unsigned int arq = WinFrame::Arq(inpkt);
+                        if (arq == 0) {
+                            arq = GoBackN::ID;
+                        }
+                        if (arq != ArqPolicy::ID) {
+                            const char *name = ArqName(arq);
+                            std::cerr << "Client uses "
+                                      << (name != NULL ? name : "unknown")
+                                      << " ARQ, but this server was built "
+                                         "for " << ArqPolicy::Name()
+                                      << std::endl;
+                            return ERROR;
+                        }
+                        mvWindowSize = grantWindow(WinFrame::Window(inpkt));
                         winszSet = true;
                         break;
+                    }
+                    case PKT_TYPE_FEC:
+                        mvFecN = FecFrame::GroupSize(inpkt);
+                        mvFecK = FecFrame::Parity(inpkt);
+                        if (mvFecK == 0 || mvFecN > FEC_NMAX ||
+                            mvFecK > mvFecN) {
+                            mvFecN = mvFecK = 0;
+                        }
+                        fecSet = true;
+                        break;
                     case PKT_TYPE_FLN:
                         mvFromName = (char *)inpkt.data;
                         fnSet = true;
                         break;
                     }
                 }
+                
+                // The window's answer, repeats and all, says how much of
+                // it was granted
+                if (inpkt.type == PKT_TYPE_WIN && winszSet) {
+                    GrantFrame::Encode(&outpkt, inpkt.sequence,
+                                       mvWindowSize);
+                }
             } else {
                 std::cerr << "Received initialization packet with incorrect "
                              "sequence.  Expected " << mvSequence << ", got "
                           << inpkt.sequence << std::endl;
                 mvRetries--;
-                outpkt = rejpkt(mvSequence);
+                RejFrame::Encode(&outpkt, mvSequence);
             }
             break;
         }
         
         // Send REJ or RR
-        if (sendtoErr(mvSocket, &outpkt, sizeof(packet), 0, (sockaddr *)&mvAddr,
-                      mvAddrLen) == -1) {
+        TRACE_EVENT(TRACE_SEND, outpkt.sequence, outpkt.type);
+        if (mvLink.Send(&outpkt, pktlen(&outpkt)) == -1) {
             std::cerr << "sendto (" << __LINE__ << "): " << strerror(errno);
             return ERROR;
         }
+        sentAt = clock_usec();
     }
+    mvStats.srtt_us = fastest;
     
     if (mvRetries <= 0) {
         return ERROR;
     }
     
-    // Open file
-    if ((mvFrom = open(mvFromName.c_str(), O_RDONLY)) == -1) {
+    // Open file, unless the parent had it open already at the fork
+    struct stat st;
+    if ((mvFile = fdcache_find(mvFiles, mvFromName.c_str())) != NULL) {
+        mvFrom = mvFile->fd;
+        st = mvFile->st;
+    } else if ((mvFrom = open(mvFromName.c_str(), O_RDONLY)) == -1 ||
+               fstat(mvFrom, &st) == -1) {
         std::cerr << "open (" << __LINE__ << "): " << strerror(errno);
         return ERROR;
-    }       
+    }
+    if (!S_ISREG(st.st_mode)) {
+        std::cerr << "open (" << __LINE__ << "): " << mvFromName
+                  << " isn't a regular file";
+        return ERROR;
+    }
+    
+    // Tell the parent, who holds it in the cache while we're sending it.
+    // A name too long for the note just isn't cached.
+    OpenedNote note;
+    if (mvFromName.size() < sizeof(note.path)) {
+        note.pid = getpid();
+        strcpy(note.path, mvFromName.c_str());
+        if (write(mvOpened[1], &note, sizeof(note)) == -1) {
+            LOG(LOGL_DEBUG, "write (%d): %s", __LINE__, strerror(errno));
+        }
+    }
+    
+    // Publish statistics under the client's address and the file name
+    const sockaddr_in *addr = (const sockaddr_in *)&mvLink.GetSocket().Peer();
+    char host[INET6_ADDRSTRLEN];
+    std::ostringstream peer;
+    if (inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host)) != NULL) {
+        peer << host << ":" << ntohs(addr->sin_port);
+    }
+    mvStatsSlot = stats_open(peer.str().c_str(), mvFromName.c_str());
     
     // Reset our values for sliding window
     mvSequence = 0;
     mvRetries = PKT_TRNSMAX;
+    mvWindow.Reset(mvWindowSize, mvSequence);
+    mvSentAt.assign(mvWindow.Size(), 0);
+    mvRetransmit.assign(mvWindow.Size(), wheel_timer());
+    mvStats.window_max = mvWindow.Size();
+    
+    // Start reading ahead, the packet header left free in front of each
+    // chunk so it can go out as it is.  The window holds the chunks taken
+    // until they're acknowledged.
+    mvPrefetch = prefetch_open(mvFrom, 0, mvBufferSize, PKT_HDRSZ,
+                               PREFETCH_WINDOWS * mvWindow.Size(),
+                               mvWindow.Size());
+    if (mvPrefetch == NULL) {
+        std::cerr << "prefetch (" << __LINE__ << "): " << strerror(errno);
+        return ERROR;
+    }
+    
+    // Allocate parity accumulators
+    for (unsigned int i = 0; i < mvFecK; i++) {
+        packet *par = (packet *)malloc(PKT_HDRSZ + PKT_FECSZ + mvBufferSize);
+        if (par == NULL) {
+            std::cerr << "malloc (" << __LINE__ << "): " << strerror(errno);
+            return ERROR;
+        }
+        mvFecParity.push_back(par);
+    }
     
     return FILL_WINDOW;
 }
 
 Server::State Server::fillWindow() {
-    // Read packets from file to fill the window
-    while (mvWindow.size() < mvWindowSize) {
-        packet buf = { 0 };
-        int rd;
-        if ((rd = read(mvFrom, buf.data, mvBufferSize)) < 0) {
+    // Read packets from file to fill the window, stopping after the packet
+    // that marks end-of-file
+    while (!mvWindow.Full() && !(mvEof && mvSequence > mvEofSequence)) {
+        // Take only what's been read already, unless there's nothing else
+        // to do.  Chunks are sized to the negotiated payload.
+        ssize_t rd;
+        packet *buf = (packet *)prefetch_take(mvPrefetch, &rd,
+                                              mvWindow.Empty());
+        if (rd < 0) {
             // Read error.  Can't do anything about this.
-            std::cerr << "read (" << __LINE__ << "): " << strerror(errno);
+            LOG(LOGL_ERROR, "pread (%d): %s", __LINE__, strerror(errno));
             return ERROR;
         }
+        if (buf == NULL) {
+            break;
+        }
         
-        buf.type = PKT_TYPE_DAT;
-        buf.sequence = mvSequence++;
-        buf.size = rd;
-        buf.checksum = in_cksum((unsigned short *)&buf, sizeof(packet));
+        buf->type = PKT_TYPE_DAT;
+        buf->sequence = mvSequence++;
+        buf->size = rd;
+        
+        // Hash each sequence the first time it's read, never on a rewind
+        if (buf->sequence == mvHashNext) {
+            xxh3_update(&mvHash, buf->data, rd);
+            mvHashNext++;
+        }
+        
+        if (!mvEof && (unsigned int)rd < mvBufferSize) {
+            mvEof = true;
+            mvEofSequence = buf->sequence;
+        }
+        mvLink.Seal(buf, pktlen(buf));
         
-        mvWindow.push_back(buf);
+        mvWindow.Push() = buf;
         mvOutBuf.push_back(buf);
+        
+        if (mvFecN > 0) {
+            fecFold(buf);
+        }
     }
     
     return SEND_WINDOW;
 }
 
 Server::State Server::sendWindow() {    
+    long rto = retransmitTimeout();
+    
     while (!mvOutBuf.empty()) {
-        if (sendtoErr(mvSocket, &mvOutBuf.front(), sizeof(packet), 0,
-                      (sockaddr *)&mvAddr, mvAddrLen) == -1) {
-            std::cerr << "sendto " << __LINE__ << ": " << strerror(errno);
+        packet *pkt = mvOutBuf.front();
+        if (mvLink.Send(pkt, pktlen(pkt)) == -1) {
+            LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
             return ERROR;
         }
         mvOutBuf.pop_front();
+        TRACE_EVENT(TRACE_SEND, pkt->sequence, pkt->type);
+        mvStats.packets++;
+        mvStats.bytes += pktlen(pkt);
+        
+        if (pkt->type == PKT_TYPE_DAT) {
+            int64_t &sentAt = mvSentAt[pkt->sequence % mvSentAt.size()];
+            if (pkt->sequence < mvSendHigh) {
+                mvStats.retransmits++;
+                sentAt = -clock_usec();
+            } else {
+                mvSendHigh = pkt->sequence + 1;
+                sentAt = clock_usec();
+            }
+            wheel_schedule(&mvTimers,
+                           &mvRetransmit[pkt->sequence % mvRetransmit.size()],
+                           llabs(sentAt) + rto);
+        }
+        
+        // Parity is sent once and never retransmitted
+        if (pkt->type == PKT_TYPE_PAR) {
+            free(pkt);
+        }
     }
     
     return WAIT_RR;
@@ -377,58 +1006,274 @@ Server::State Server::sendWindow() {
 Server::State Server::waitRR() {
     packet buf;
     
+    mvStats.window = mvWindow.Count();
+    publishStats(false);
+    
     switch (recvPacket(buf)) {
     case 1:
         return ERROR;
     case 2:
+        // A timer went off and queued what's to go again, or a corrupt
+        // packet came in.  That was likely a REJ, so the oldest packet goes
+        // again without waiting for its timer.
+        if (mvOutBuf.empty() && !mvWindow.Empty()) {
+            resend(mvWindow.Base());
+        }
         return FILL_WINDOW;
     }
     
+    State next = WAIT_RR;
     switch (buf.type) {
     case PKT_TYPE_RR:
-        if (buf.sequence >= mvWindow.front().sequence) {
+        if (buf.sequence >= mvWindow.Base()) {
+            TRACE_EVENT(TRACE_RR, buf.sequence, 0);
+            
             // If we receive RRs for our expected sequence or greater, shift
             // the window.  If the RR is greater, then we can assume that
             // previous RRs were sent, but were lost in transit.  We'll
             // simply shift the window over the distance.
-            for (unsigned int i = mvWindow.front().sequence;
-                 !mvWindow.empty() && i <= buf.sequence; i++)
-            {
-                mvWindow.pop_front();
-            }
+            acknowledge(buf.sequence + 1);
+            TRACE_EVENT(TRACE_SLIDE, buf.sequence + 1,
+                        mvStats.window - mvWindow.Count());
             
             // Reset our retry counter
             mvRetries = PKT_TRNSMAX;
             
-            return FILL_WINDOW;
+            // Everything through end-of-file is acknowledged
+            if (mvWindow.Empty() && mvEof && mvSequence > mvEofSequence) {
+                return SEND_HASH;
+            }
+            
+            next = FILL_WINDOW;
         }
         // We ignore older RRs
         break;
     case PKT_TYPE_REJ:
-        // If we receive REJ with our expected sequence or greater,
-        // we resend the whole window.  Client should re-send old RRs if our
-        // sequence is lower than its own.
-        if (buf.sequence >= mvWindow.front().sequence) {
-            std::cerr << "Received REJ" << buf.sequence
-                      << ".  Window sequence: " << mvWindow.front().sequence
-                      //~ << ".  Retries left: " << mvRetries--
-                      << std::endl;
-            mvOutBuf = mvWindow;
-            return FILL_WINDOW;
+        mvFecRejs++;
+        mvStats.rejs++;
+        TRACE_EVENT(TRACE_REJ, buf.sequence, 0);
+        
+        // A REJ with our expected sequence or greater says everything before
+        // it arrived.  The ARQ policy decides what goes again: the rest of
+        // the window for go-back-n, just the rejected packet for selective
+        // repeat.  Client should re-send old RRs if our sequence is lower
+        // than its own.
+        if (buf.sequence >= mvWindow.Base()) {
+            LOG(LOGL_DEBUG, "Received REJ%llu.  Window sequence: %llu",
+                (unsigned long long)buf.sequence,
+                (unsigned long long)mvWindow.Base());
+            acknowledge(buf.sequence);
+            if (mvWindow.Empty() && mvEof && mvSequence > mvEofSequence) {
+                // It's the hash being asked for
+                return SEND_HASH;
+            }
+            
+            resend(buf.sequence);
+            next = FILL_WINDOW;
         } else {
             // If we receive a REJ for a lower sequence, we'll need to
-            // rewind our window to an earlier point in the file
+            // rewind our window to an earlier point in the file.
             mvSequence = buf.sequence;
-            if (lseek(mvFrom, mvBufferSize * mvSequence, SEEK_SET) == -1) {
-                std::cerr << "lseek (" << __LINE__ << "): " << strerror(errno);
+            if (prefetch_seek(mvPrefetch,
+                              pkt_offset(mvSequence, mvBufferSize)) == -1) {
+                LOG(LOGL_ERROR, "prefetch (%d): %s", __LINE__,
+                    strerror(errno));
                 return ERROR;
             }
-            mvOutBuf.clear();
-            mvWindow.clear();
+            mvFecValid = false;
+            clearWindow();
+            mvWindow.Restart(mvSequence);
             return FILL_WINDOW;
         }
         break;
     }
     
-    return WAIT_RR;
+    // Timers come due while packets are still arriving, too
+    expire();
+    return next == WAIT_RR && !mvOutBuf.empty() ? FILL_WINDOW : next;
+}
+
+Server::State Server::sendHash() {
+    packet outpkt;
+    packet inpkt;
+    xxh128 digest = xxh3_digest(&mvHash);
+    
+    // The hash follows the last data packet in sequence, big-endian
+    memset(&outpkt, PKT_TYPE_HSH, PKT_HDRSZ);
+    outpkt.sequence = mvEofSequence + 1;
+    outpkt.size = XXH128_SIZE;
+    xxh128_put(&digest, outpkt.data);
+    mvLink.Seal(&outpkt, pktlen(&outpkt));
+    
+    TRACE_EVENT(TRACE_SEND, outpkt.sequence, outpkt.type);
+    if (mvLink.Send(&outpkt, pktlen(&outpkt)) == -1) {
+        LOG(LOGL_ERROR, "sendto (%d): %s", __LINE__, strerror(errno));
+        return ERROR;
+    }
+    
+    switch (recvPacket(inpkt)) {
+    case 1:
+        return ERROR;
+    case 2:
+        return SEND_HASH;
+    }
+    
+    if (inpkt.type == PKT_TYPE_RR && inpkt.sequence == outpkt.sequence) {
+        return DONE;
+    }
+    
+    // Stale RRs or a REJ for the hash.  Send it again.
+    return SEND_HASH;
+}
+
+void Server::printStats() {
+    // One key=value line, for scripts like bench.sh to pick up
+    std::cout << "server stats: pid=" << getpid() << " sent="
+              << mvStats.packets << " data=" << mvSendHigh << " retransmits="
+              << mvStats.retransmits << " rejs=" << mvStats.rejs
+              << " timeouts=" << mvStats.timeouts << " srtt_us="
+              << mvStats.srtt_us << " rtt_p50_us="
+              << stats_hist_quantile(&mvRtt, 0.50) << " rtt_p99_us="
+              << stats_hist_quantile(&mvRtt, 0.99) << " cpu_us=" << cpu_usec()
+              << std::endl;
+}
+
+void Server::publishStats(bool force) {
+    uint64_t now = clock_usec();
+    
+    // Publishing is cheap, but not cheap enough for every packet
+    if (mvStatsSlot == NULL || (!force && now < mvStatsNext)) {
+        return;
+    }
+    mvStatsNext = now + STATS_INTERVAL_US;
+    stats_publish(mvStatsSlot, &mvStats);
+}
+
+void Server::rttSample(int64_t sentAt) {
+    // A packet sent again can't be timed (Karn's algorithm), since the
+    // answer might be to the first send.  Until there's a first sample,
+    // take it anyway: a loss is what usually gets a packet resent, and
+    // timing the last send beats guessing a second.
+    if (sentAt < 0 && mvStats.srtt_us == 0) {
+        sentAt = -sentAt;
+    }
+    if (sentAt <= 0) {
+        return;
+    }
+    
+    // An answer that took as long as the client's timeout was probably
+    // the client giving up on us, not the round trip
+    int64_t sample = clock_usec() - sentAt;
+    if (sample >= RECV_TIMEOUT_US) {
+        return;
+    }
+    stats_hist_add(&mvRtt, sample);
+    
+    // Smooth like TCP does (RFC 6298), an eighth of each new sample
+    if (mvStats.srtt_us == 0) {
+        mvStats.srtt_us = sample;
+    } else {
+        mvStats.srtt_us += (sample - (int64_t)mvStats.srtt_us) / 8;
+    }
+}
+
+void Server::acknowledge(uint64_t sequence) {
+    // Releases everything before sequence.  The acknowledgment went out
+    // once the last of them to be sent arrived, so that one's round trip
+    // just finished.
+    int64_t last = 0;
+    while (!mvWindow.Empty() && mvWindow.Base() < sequence) {
+        int64_t sentAt = mvSentAt[mvWindow.Base() % mvSentAt.size()];
+        if (llabs(sentAt) > llabs(last)) {
+            last = sentAt;
+        }
+        mvStats.acked += mvWindow.Front()->size;
+        wheel_cancel(&mvTimers,
+                     &mvRetransmit[mvWindow.Base() % mvRetransmit.size()]);
+        prefetch_release(mvPrefetch, mvWindow.Front());
+        mvWindow.PopFront();
+    }
+    rttSample(last);
+}
+
+void Server::resend(uint64_t sequence) {
+    uint64_t from;
+    uint64_t to;
+    
+    // Each is timed again once it's actually sent
+    mvWindow.Resend(sequence, from, to);
+    for (; from < to && mvWindow.Contains(from); from++) {
+        wheel_cancel(&mvTimers, &mvRetransmit[from % mvRetransmit.size()]);
+        mvOutBuf.push_back(mvWindow[from]);
+    }
+}
+
+void Server::clearWindow() {
+    // Apart from parity, mvOutBuf only points into mvWindow, so the window
+    // holds the packets, which go back to the reader
+    while (!mvOutBuf.empty()) {
+        if (mvOutBuf.front()->type == PKT_TYPE_PAR) {
+            free(mvOutBuf.front());
+        }
+        mvOutBuf.pop_front();
+    }
+    while (!mvWindow.Empty()) {
+        wheel_cancel(&mvTimers,
+                     &mvRetransmit[mvWindow.Base() % mvRetransmit.size()]);
+        prefetch_release(mvPrefetch, mvWindow.Front());
+        mvWindow.PopFront();
+    }
+}
+
+void Server::fecFold(const packet *buf) {
+    unsigned int i = buf->sequence % mvFecN;
+    
+    if (i == 0) {
+        // Start a new group, sizing its parity to the recent REJ rate
+        float sample = (float)mvFecRejs / mvFecN;
+        mvFecLoss = 0.75f * mvFecLoss + 0.25f * sample;
+        mvFecRejs = 0;
+        mvFecCount = 1 + (unsigned int)(mvFecLoss * mvFecN * FEC_MARGIN);
+        if (mvFecCount > mvFecK) {
+            mvFecCount = mvFecK;
+        }
+        
+        for (unsigned int j = 0; j < mvFecCount; j++) {
+            memset(mvFecParity[j], 0, PKT_HDRSZ + PKT_FECSZ + mvBufferSize);
+        }
+        mvFecFolded = 0;
+        mvFecValid = true;
+    }
+    
+    if (!mvFecValid) {
+        return;
+    }
+    
+    packet *par = mvFecParity[i % mvFecCount];
+    fechdr *fh = (fechdr *)par->data;
+    fh->sizes = fh->sizes ^ buf->size;
+    fec_xor(par->data + PKT_FECSZ, buf->data, buf->size);
+    
+    if (++mvFecFolded < mvFecN) {
+        return;
+    }
+    
+    // Group complete.  Queue its parity right behind the last data packet.
+    for (unsigned int j = 0; j < mvFecCount; j++) {
+        unsigned int len = PKT_HDRSZ + PKT_FECSZ + mvBufferSize;
+        packet *out = (packet *)malloc(len);
+        if (out == NULL) {
+            // Parity is best-effort.  ARQ will cover for it.
+            break;
+        }
+        memcpy(out, mvFecParity[j], len);
+        out->type = PKT_TYPE_PAR;
+        out->sequence = buf->sequence - i;
+        out->size = PKT_FECSZ + mvBufferSize;
+        ((fechdr *)out->data)->index = j;
+        ((fechdr *)out->data)->count = mvFecCount;
+        mvLink.Seal(out, pktlen(out));
+        mvOutBuf.push_back(out);
+    }
+    mvFecValid = false;
 }
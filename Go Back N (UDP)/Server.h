@@ -7,57 +7,189 @@
 
 #include <deque>
 #include <string>
+#include <vector>
 
 extern "C" {
+    #include "budget.h"
+    #include "fdcache.h"
     #include "packet.h"
+    #include "prefetch.h"
+    #include "stats.h"
+    #include "wheel.h"
+    #include "xxhash.h"
 }
 
+#include "UdpLink.h"
+
+#define RECV_TIMEOUT_US 1000000 // Longest wait for the client
+#define MAX_SESSIONS 0xFFFF // Sessions at once; a slot fits in 16 bits
+#define COOKIE_PERIOD_US 10000000 // A cookie's good for one to two of these
+#define PREFETCH_WINDOWS 2 // Windows' worth of file read ahead
+#define TIMER_TICK_US 1000 // Resolution of a session's timers
+#define FDCACHE_LIMIT 256 // Files kept open between sessions
+#define WINDOW_POOL_BYTES (512ULL << 20) // Window memory for all sessions
+#define WINDOW_SESSION_BYTES (64ULL << 20) // Most one session's window gets
+#define POOL_MIN_WINDOW 4 // Packets a session gets however full the pool
+
 class Server {
 public:
-    Server(float errorPercent);
+    /** @param poolBytes memory every session's window shares
+     *  @param sessionBytes most any one session's window may take
+     */
+    Server(float errorPercent, long busyPollUs = 0,
+           uint64_t poolBytes = WINDOW_POOL_BYTES,
+           uint64_t sessionBytes = WINDOW_SESSION_BYTES);
     ~Server();
 
-    int GetSocket(sockaddr_in &local, socklen_t &len);
+    int GetSocket(sockaddr_in &local, socklen_t &len,
+                  unsigned short port = 0);
     
     int Run();
     int Child();
 private:
+    /** A socket in the listening port's reuseport group, and the child
+     * using it, or 0 while it's free.  The kernel steers each datagram to
+     * the slot named in its connection ID (see steer in Server.cpp); slot 0
+     * is the listening socket, which takes new connections.  The client's
+     * address and cookie are kept so a resent CXN2 gets the same session.
+     * The file it's sending is held in the cache until it exits.  A free
+     * slot's socket is closed once no slot after it is in use. */
+    struct Slot {
+        int fd;
+        pid_t pid;
+        uint32_t connection;
+        uint32_t cookie;
+        sockaddr_in client;
+        fdcache_entry *file;
+    };
+
     float mvErrorPercent;
+    /** How long a session spins on its socket before sleeping, or 0 */
+    long mvBusyPollUs;
 
     int mvSocket;
     int mvFrom;
-    sockaddr_storage mvAddr;
-    socklen_t mvAddrLen;
+    /** Files open in the parent, which children inherit, and the entry
+     * mvFrom came from, or NULL if the child opened it itself */
+    fdcache *mvFiles;
+    const fdcache_entry *mvFile;
+    /** Children write the name of the file they're sending here, so the
+     * parent can hold it, or open it for the next session */
+    int mvOpened[2];
+    /** The child's socket, aimed at its client */
+    UdpLink mvLink;
+    uint32_t mvConnection;
+    /** The child's slot, which is also its number in the window pool */
+    unsigned int mvSlot;
+    /** Memory for windows, shared by every session.  A child takes what
+     * its window needs in the handshake; the parent gives it back once
+     * the child's exited. */
+    budget *mvPool;
+    uint64_t mvSessionBytes;
+    /** Keys the handshake's cookies, so only the server can make them */
+    uint64_t mvSecret;
 
     std::string mvFromName;
     unsigned int mvBufferSize;
     unsigned int mvWindowSize;
 
-    /** Outgoing window */
-    std::deque<packet> mvWindow;
-    std::deque<packet> mvOutBuf;
+    /** Outgoing window.  Packets are allocated at the negotiated payload size
+     * and owned by mvWindow; mvOutBuf points at the ones left to send, and
+     * owns any parity packets queued among them. */
+    SendWindow<ArqPolicy, packet *> mvWindow;
+    std::deque<packet *> mvOutBuf;
     
+    /** The port every session shares */
     unsigned short mvPort;
-    unsigned int mvSequence;
+    uint64_t mvSequence;
+    /** Reads the file ahead on a thread of its own, so filling the window
+     * never waits on the disk unless the window's empty */
+    struct prefetch *mvPrefetch;
     int mvRetries;
+    /** Retransmission timeouts in a row, each doubling the next */
+    unsigned int mvBackoff;
     bool mvInitialized;
     
+    /** Forward error correction.  Up to mvFecK parity packets follow every
+     * group of mvFecN data packets; zero disables it. */
+    unsigned int mvFecN;
+    unsigned int mvFecK;
+    /** Parity actually sent for the current group, adapted to loss */
+    unsigned int mvFecCount;
+    /** Data packets folded into the current group so far */
+    unsigned int mvFecFolded;
+    /** False after a rewind lands mid-group, until the next group starts */
+    bool mvFecValid;
+    /** REJs received since the last group started, and a running average of
+     * REJs per data packet */
+    unsigned int mvFecRejs;
+    float mvFecLoss;
+    /** Parity accumulators for the current group */
+    std::vector<packet *> mvFecParity;
+    
+    /** Hash of the file, folded in as each sequence is first read */
+    xxh3 mvHash;
+    uint64_t mvHashNext;
+    /** Set once a short read has found the end of the file */
+    bool mvEof;
+    uint64_t mvEofSequence;
+    
+    /** Counters published to the shared statistics segment, and when they
+     * were last published */
+    stats_session mvStats;
+    stats_slot *mvStatsSlot;
+    uint64_t mvStatsNext;
+    /** The sequence after the highest one sent so far */
+    uint64_t mvSendHigh;
+    /** When each window slot's packet was last sent, negated once it's been
+     * sent again, for round trip timing */
+    std::vector<int64_t> mvSentAt;
+    /** Every round trip timed, for its percentiles */
+    stats_hist mvRtt;
+    
+    /** The session's timers: a retransmission timer for each window slot,
+     * pending while its packet's out and unacknowledged, and one for the
+     * client going quiet */
+    wheel mvTimers;
+    std::vector<wheel_timer> mvRetransmit;
+    wheel_timer mvIdle;
+    
     enum State {
         INIT,
         ERROR,
         DONE,
         FILL_WINDOW,
         SEND_WINDOW,
-        WAIT_RR
+        WAIT_RR,
+        SEND_HASH
     } mvState;
     
+    uint32_t cookie(const sockaddr_in &client, uint64_t period) const;
+    bool cookieGood(const sockaddr_in &client, uint32_t theirs) const;
+    /** Whether a packet is the session's, from where the client is known to
+     * be.  Challenges one from anywhere else, and moves the session there
+     * once the challenge is met. */
+    bool fromClient(const packet &buf, sockaddr_storage &client,
+                    socklen_t &clientLen);
+    void noteOpened(std::vector<Slot> &slots);
     int recvPacket(packet &buf);
+    unsigned int grantWindow(unsigned int want);
+    unsigned int expire();
+    long retransmitTimeout();
     
     State init();
     State fillWindow();
     State sendWindow();
     State waitRR();
+    State sendHash();
     
+    void acknowledge(uint64_t sequence);
+    void resend(uint64_t sequence);
+    void clearWindow();
+    void printStats();
+    void publishStats(bool force);
+    void rttSample(int64_t sentAt);
+    void fecFold(const packet *buf);
 };
 
 #endif // SERVER_H
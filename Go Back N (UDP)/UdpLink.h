@@ -0,0 +1,17 @@
+#ifndef UDPLINK_H
+#define UDPLINK_H
+
+extern "C" {
+    #include "impair.h"
+    #include "packet.h"
+}
+
+#include "Arq.h"
+#include "Link.h"
+
+/** Packets go out through the impairment layer and are checked with the
+ * Internet checksum; see ../Transport */
+typedef DatagramSocket<impair_sendto> UdpSocket;
+typedef Link<packet, UdpSocket, InetChecksum> UdpLink;
+
+#endif // UDPLINK_H
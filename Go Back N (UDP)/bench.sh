@@ -0,0 +1,196 @@
+#!/bin/bash
+
+# Loopback throughput benchmark for server/rcopy.
+#
+# Usage: $0 [baseline.json]
+#
+# Runs every combination of the matrix below, prints a table, and writes the
+# results as JSON to $BENCH_OUT.  If a baseline file is given (or
+# bench_baseline.json exists), each run's goodput is compared against it and
+# anything more than $BENCH_TOLERANCE slower is flagged as a regression.
+#
+# Override the matrix from the environment, e.g.
+#     BENCH_SIZES="1048576" BENCH_ERRORS="0 0.05" make bench
+#
+# BENCH_BUSYPOLLS lists busy-poll budgets in microseconds (RCBUSY_POLL_US),
+# with 0 for plain sleeping receives.  p50 and p99 are the server's
+# per-packet round trips.
+
+SIZES=${BENCH_SIZES:-"1048576 16777216"}
+BUFSZS=${BENCH_BUFSZS:-"1400 8000"}
+WINSZS=${BENCH_WINSZS:-"16 64"}
+ERRORS=${BENCH_ERRORS:-"0 0.01"}
+BUSYPOLLS=${BENCH_BUSYPOLLS:-"0 50"}
+RUNS=${BENCH_RUNS:-1}
+OUT=${BENCH_OUT:-bench.json}
+TOLERANCE=${BENCH_TOLERANCE:-0.10}
+TIMEOUT=${BENCH_TIMEOUT:-120}
+BASELINE=${1:-bench_baseline.json}
+
+APP_SERVER=./server
+APP_CLIENT=./rcopy
+
+# ===============================
+
+if [ ! -x $APP_SERVER ] || [ ! -x $APP_CLIENT ]; then
+    echo "Build server and rcopy first"
+    exit 2
+fi
+
+WORK=`mktemp -d /tmp/rcbench.XXXXXX`
+SERV_PID=
+
+cleanup() {
+    if [ -n "$SERV_PID" ]; then
+        kill $SERV_PID 2> /dev/null
+        wait $SERV_PID 2> /dev/null
+    fi
+    rm -rf $WORK
+}
+trap cleanup EXIT
+
+# Pull a key=value field out of a stats line
+field() {
+    echo "$1" | sed -n "s/.* $2=\([0-9]*\).*/\1/p"
+}
+
+start_server() {
+    if [ -n "$SERV_PID" ]; then
+        kill $SERV_PID 2> /dev/null
+        wait $SERV_PID 2> /dev/null
+    fi
+    RCBUSY_POLL_US=$2 $APP_SERVER $1 > $WORK/server.log 2>&1 &
+    SERV_PID=$!
+
+    PORT=
+    for i in {1..50}; do
+        PORT=`sed -n 's/.*Port \([0-9]*\).*/\1/p' $WORK/server.log`
+        [ -n "$PORT" ] && break
+        sleep 0.1
+    done
+    if [ -z "$PORT" ]; then
+        echo "- Server didn't start"
+        exit 1
+    fi
+}
+
+printf "%10s %6s %5s %6s %4s | %10s %9s %8s %10s %7s %7s %s\n" \
+       SIZE BUF WIN ERR BUSY "MB/s" "TTFB ms" RETRANS "CPU s/GB" "p50 us" \
+       "p99 us" STATUS
+echo "[" > $OUT
+FIRST=1
+
+for ERR in $ERRORS; do
+  for BUSY in $BUSYPOLLS; do
+    start_server $ERR $BUSY
+    for SIZE in $SIZES; do
+        head -c $SIZE /dev/urandom > $WORK/in.bin
+        for BUF in $BUFSZS; do
+            for WIN in $WINSZS; do
+                for RUN in `seq 1 $RUNS`; do
+                    rm -f $WORK/out.bin
+                    NSTATS=`grep -c "server stats" $WORK/server.log`
+
+                    RCBUSY_POLL_US=$BUSY timeout $TIMEOUT $APP_CLIENT \
+                        $WORK/in.bin $WORK/out.bin $BUF $ERR $WIN localhost \
+                        $PORT > $WORK/client.log 2>&1
+                    RES=$?
+
+                    # Wait for the server's child to report
+                    for i in {1..30}; do
+                        [ `grep -c "server stats" $WORK/server.log` -gt \
+                          $NSTATS ] && break
+                        sleep 0.1
+                    done
+
+                    CSTATS=`grep "rcopy stats" $WORK/client.log | tail -1`
+                    SSTATS=`grep "server stats" $WORK/server.log | tail -1`
+
+                    STATUS=ok
+                    if [ $RES -ne 0 ]; then
+                        STATUS="client-returned-$RES"
+                    elif ! cmp -s $WORK/in.bin $WORK/out.bin; then
+                        STATUS=corrupt
+                    fi
+
+                    LINE=`awk -v size=$SIZE -v buf=$BUF -v win=$WIN \
+                        -v err=$ERR -v busy=$BUSY -v status=$STATUS \
+                        -v bytes="$(field "$CSTATS" bytes)" \
+                        -v elapsed="$(field "$CSTATS" elapsed_us)" \
+                        -v ttfb="$(field "$CSTATS" ttfb_us)" \
+                        -v ccpu="$(field "$CSTATS" cpu_us)" \
+                        -v scpu="$(field "$SSTATS" cpu_us)" \
+                        -v data="$(field "$SSTATS" data)" \
+                        -v retrans="$(field "$SSTATS" retransmits)" \
+                        -v p50="$(field "$SSTATS" rtt_p50_us)" \
+                        -v p99="$(field "$SSTATS" rtt_p99_us)" '
+                        BEGIN {
+                            goodput = elapsed > 0 ? bytes / elapsed : 0
+                            ratio = data > 0 ? retrans / data : 0
+                            cpu = bytes > 0 ? \
+                                  (ccpu + scpu) / 1e6 / (bytes / 1e9) : 0
+                            printf "{\"size\": %d, \"buf\": %d, " \
+                                   "\"win\": %d, \"err\": %s, " \
+                                   "\"busy_poll_us\": %d, " \
+                                   "\"goodput_mbps\": %.3f, " \
+                                   "\"ttfb_ms\": %.3f, " \
+                                   "\"retrans_ratio\": %.4f, " \
+                                   "\"cpu_s_per_gb\": %.3f, " \
+                                   "\"rtt_p50_us\": %d, " \
+                                   "\"rtt_p99_us\": %d, " \
+                                   "\"status\": \"%s\"}", \
+                                   size, buf, win, err, busy, goodput, \
+                                   ttfb / 1000, ratio, cpu, p50, p99, status
+                        }'`
+
+                    [ $FIRST -eq 0 ] && echo "," >> $OUT
+                    echo -n "  $LINE" >> $OUT
+                    FIRST=0
+
+                    echo "$LINE" | awk -F'[:,}]' '{
+                        printf "%10d %6d %5d %6s %4d | %10.2f %9.2f %8.4f " \
+                               "%10.3f %7d %7d %s\n", $2, $4, $6, $8, $10, \
+                               $12, $14, $16, $18, $20, $22, $24
+                    }' | tr -d '"'
+                done
+            done
+        done
+    done
+  done
+done
+
+echo "" >> $OUT
+echo "]" >> $OUT
+echo "========== Results written to $OUT ==========="
+
+# ===============================
+
+if [ ! -f "$BASELINE" ]; then
+    echo "No baseline to compare against (save one with 'make bench-baseline')"
+    exit 0
+fi
+
+echo "========== COMPARE ($BASELINE) ==========="
+REGRESSIONS=0
+while read -r LINE; do
+    KEY=`echo "$LINE" | grep -o '"size": [0-9]*, "buf": [0-9]*, "win": [0-9]*, "err": [0-9.]*, "busy_poll_us": [0-9]*'`
+    [ -z "$KEY" ] && continue
+    CUR=`echo "$LINE" | sed -n 's/.*"goodput_mbps": \([0-9.]*\).*/\1/p'`
+    BASE=`grep -F "$KEY" "$BASELINE" | head -1 | \
+          sed -n 's/.*"goodput_mbps": \([0-9.]*\).*/\1/p'`
+    [ -z "$BASE" ] && continue
+
+    VERDICT=`awk -v cur=$CUR -v base=$BASE -v tol=$TOLERANCE 'BEGIN {
+        if (base > 0 && cur < base * (1 - tol)) print "REGRESSION";
+        else print "ok";
+    }'`
+    echo "- $KEY: $BASE -> $CUR MB/s $VERDICT"
+    [ "$VERDICT" != "ok" ] && REGRESSIONS=$((REGRESSIONS + 1))
+done < $OUT
+
+if [ $REGRESSIONS -gt 0 ]; then
+    echo "- $REGRESSIONS regression(s) beyond ${TOLERANCE} tolerance"
+    exit 1
+fi
+
+exit 0
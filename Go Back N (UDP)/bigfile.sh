@@ -0,0 +1,104 @@
+#!/bin/bash
+
+# Copies a sparse file past 16 TiB over loopback and checks it arrives
+# intact, so offsets and sequence numbers both run past 2^32.
+#
+# Usage: $0
+#
+# This takes hours, so it's only run by hand with 'make bigfile'.  The
+# source is made with truncate and holds random blocks just past the 4 GiB
+# offset, just past the 2^32nd packet, and at the end, so a rewind or read
+# that wrapped would land zeros where they are.  rcopy writes into a FIFO
+# that cmp reads against the source, so the copy never touches the disk.
+#
+# Override from the environment, e.g.
+#     BIG_SIZE=64G BIG_BUFSZ=1400 make bigfile
+#
+# BIG_DIR must hold a file of BIG_SIZE: ext4 stops at 16 TiB, while tmpfs
+# and XFS go further.  Only the random blocks take up any space.
+
+SIZE=${BIG_SIZE:-17T}
+BUFSZ=${BIG_BUFSZ:-1024}
+WINSZ=${BIG_WINSZ:-64}
+DIR=${BIG_DIR:-/dev/shm}
+
+APP_SERVER=./server
+APP_CLIENT=./rcopy
+
+# ===============================
+
+if [ ! -x $APP_SERVER ] || [ ! -x $APP_CLIENT ]; then
+    echo "Build server and rcopy first"
+    exit 2
+fi
+
+WORK=`mktemp -d $DIR/rcbig.XXXXXX` || exit 2
+SERV_PID=
+CMP_PID=
+
+cleanup() {
+    for PID in $SERV_PID $CMP_PID; do
+        kill $PID 2> /dev/null
+        wait $PID 2> /dev/null
+    done
+    rm -rf $WORK
+}
+trap cleanup EXIT
+
+if ! truncate -s $SIZE $WORK/in.bin; then
+    echo "- $DIR can't hold a $SIZE file; set BIG_DIR"
+    exit 2
+fi
+BYTES=`stat -c %s $WORK/in.bin`
+
+# A 4 KiB random block at each offset that fits
+mark() {
+    if [ $1 -ge 0 ] && [ $(($1 + 4096)) -le $BYTES ]; then
+        dd if=/dev/urandom of=$WORK/in.bin bs=4096 count=1 seek=$1 \
+           oflag=seek_bytes conv=notrunc status=none
+    fi
+}
+mark $(((1 << 32) - 1024))
+mark $(((1 << 32) * BUFSZ - 1024))
+mark $((BYTES - 4096))
+
+$APP_SERVER 0 > $WORK/server.log 2>&1 &
+SERV_PID=$!
+PORT=
+for i in {1..50}; do
+    PORT=`sed -n 's/.*Port \([0-9]*\).*/\1/p' $WORK/server.log`
+    [ -n "$PORT" ] && break
+    sleep 0.1
+done
+if [ -z "$PORT" ]; then
+    echo "- Server didn't start"
+    exit 1
+fi
+
+echo "Copying $BYTES bytes, $((BYTES / BUFSZ + 1)) packets of $BUFSZ..."
+mkfifo $WORK/out.bin
+cmp $WORK/in.bin $WORK/out.bin > $WORK/cmp.log 2>&1 &
+CMP_PID=$!
+
+START=`date +%s`
+$APP_CLIENT $WORK/in.bin $WORK/out.bin $BUFSZ 0 $WINSZ localhost $PORT \
+    > $WORK/client.log 2>&1
+RES=$?
+wait $CMP_PID
+SAME=$?
+CMP_PID=
+ELAPSED=$((`date +%s` - START))
+
+grep "rcopy stats" $WORK/client.log
+if [ $RES -ne 0 ]; then
+    echo "- rcopy returned $RES after ${ELAPSED}s"
+    tail -5 $WORK/client.log
+    exit 1
+elif [ $SAME -ne 0 ]; then
+    echo "- copy differs after ${ELAPSED}s:"
+    cat $WORK/cmp.log
+    exit 1
+fi
+
+echo "========== $SIZE copied intact in ${ELAPSED}s ==========="
+exit 0
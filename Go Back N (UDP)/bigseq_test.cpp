@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Arq.h"
+
+extern "C" {
+    #include "packet.h"
+    #include "prefetch.h"
+}
+
+/* Runs the sequence and offset arithmetic past 2^32 packets, where a
+   32-bit sequence or offset would wrap, without sending any of them: the
+   file offsets of packets there, the ARQ windows sliding across the
+   boundary, the sequence field on the wire, and the prefetch reader
+   reading and rewinding a sparse file at those offsets.  bigfile.sh does
+   the same end to end, but takes hours.  Run with 'make check'.
+
+   The file goes in TMPDIR, or /tmp, and only its written blocks take up
+   space.  It's a little over 4 TiB long, which ext4, XFS and tmpfs all
+   allow. */
+
+#define WRAP ((uint64_t)1 << 32)
+#define CHUNK 1024u
+#define MARKS 4           /* chunks written from WRAP - 2 on */
+
+static unsigned long g_checks = 0;
+static unsigned long g_failures = 0;
+
+static bool check(bool ok, const char *what, uint64_t sequence) {
+    g_checks++;
+    if (!ok) {
+        g_failures++;
+        printf("FAIL %s: sequence %llu\n", what,
+               (unsigned long long)sequence);
+    }
+    return ok;
+}
+
+static void checkOffsets() {
+    static const uint32_t SIZES[] = { 1, 512, CHUNK, 1400, 65507 };
+
+    for (unsigned int i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); i++) {
+        for (uint64_t sequence = WRAP - 3; sequence <= WRAP + 3; sequence++) {
+            // What the offset is, worked out without a multiply to wrap
+            uint64_t want = 0;
+            for (uint32_t bit = 0; bit < 32; bit++) {
+                if (SIZES[i] >> bit & 1) {
+                    want += sequence << bit;
+                }
+            }
+            check(pkt_offset(sequence, SIZES[i]) == (off_t)want,
+                  "pkt_offset", sequence);
+            check(pkt_offset(sequence + 1, SIZES[i]) -
+                  pkt_offset(sequence, SIZES[i]) == SIZES[i],
+                  "pkt_offset step", sequence);
+        }
+    }
+}
+
+/** The sequence field, byte by byte, as it goes on the wire */
+static void checkWire() {
+    packet pkt;
+
+    for (uint64_t sequence = WRAP - 2; sequence <= WRAP + 2; sequence++) {
+        const uint8_t *bytes = (const uint8_t *)&pkt + 1;
+        uint64_t got = 0;
+
+        memset(&pkt, 0, PKT_HDRSZ);
+        pkt.sequence = sequence;
+        for (unsigned int i = 0; i < sizeof(uint64_t); i++) {
+            got |= (uint64_t)bytes[i] << 8 * i;
+        }
+        check(got == sequence, "sequence on the wire", sequence);
+        check(pkt.sequence == sequence, "sequence read back", sequence);
+    }
+}
+
+template <class Policy>
+static void checkWindows(const char *name) {
+    SendWindow<Policy, uint64_t> send;
+    RecvWindow<Policy, uint64_t> recv;
+    uint64_t from, to;
+
+    // Fill the window just short of the boundary and slide it across
+    send.Reset(8, WRAP - 4);
+    while (!send.Full()) {
+        uint64_t sequence = send.Next();
+        send.Push() = sequence;
+    }
+    check(send.Count() == send.Size(), name, send.Base());
+    for (uint64_t sequence = WRAP - 4; sequence < send.Next(); sequence++) {
+        check(send.Contains(sequence) && send[sequence] == sequence, name,
+              sequence);
+    }
+    check(!send.Contains(WRAP - 5) && !send.Contains(send.Next()), name,
+          send.Next());
+    check(!send.Contains(send.Next() - WRAP), name, send.Next() - WRAP);
+
+    send.Resend(WRAP, from, to);
+    check(from == WRAP && to == (Policy::SELECTIVE ? WRAP + 1 : send.Next()),
+          name, WRAP);
+
+    while (send.Base() < WRAP + 1) {
+        send.PopFront();
+        uint64_t sequence = send.Next();
+        send.Push() = sequence;
+    }
+    for (uint64_t sequence = send.Base(); sequence < send.Next();
+         sequence++) {
+        check(send.Contains(sequence) && send[sequence] == sequence, name,
+              sequence);
+    }
+    check(!send.Contains(WRAP) && send.Count() == send.Size(), name, WRAP);
+
+    // The receiver on either side of the boundary
+    recv.Reset(8);
+    check(recv.Classify(WRAP, WRAP) == RecvWindow<Policy, uint64_t>::DELIVER,
+          name, WRAP);
+    check(recv.Classify(WRAP - 1, WRAP) ==
+          RecvWindow<Policy, uint64_t>::DUPLICATE, name, WRAP - 1);
+    check(recv.Classify(0, WRAP) == RecvWindow<Policy, uint64_t>::DUPLICATE,
+          name, 0);
+    check(recv.Classify(WRAP + 1, WRAP - 1) ==
+          (Policy::SELECTIVE ? RecvWindow<Policy, uint64_t>::HOLD :
+                               RecvWindow<Policy, uint64_t>::REJECT),
+          name, WRAP + 1);
+    check(recv.Classify(WRAP + 64, WRAP - 1) ==
+          RecvWindow<Policy, uint64_t>::REJECT, name, WRAP + 64);
+    if (Policy::SELECTIVE) {
+        recv.Hold(WRAP + 1);
+        check(recv.Held(WRAP + 1) && !recv.Held(1) && !recv.Held(WRAP - 7),
+              name, WRAP + 1);
+        recv.Unhold(WRAP + 1);
+        check(!recv.Held(WRAP + 1) && recv.HeldCount() == 0, name, WRAP + 1);
+    }
+}
+
+/** The byte at offset i of chunk sequence, different in every chunk */
+static uint8_t mark(uint64_t sequence, unsigned int i) {
+    return (uint8_t)(sequence * 131 + i * 7 + (sequence >> 32) * 29);
+}
+
+/** Takes chunks starting at sequence, and checks each against what was
+ * written there.  The file ends half way into the chunk after the marks. */
+static void takeFrom(prefetch *pf, uint64_t sequence, uint64_t last) {
+    for (; sequence <= last; sequence++) {
+        ssize_t len;
+        uint8_t *chunk = (uint8_t *)prefetch_take(pf, &len, 1);
+        ssize_t want = sequence < WRAP - 2 + MARKS ? CHUNK : CHUNK / 2;
+        bool same = chunk != NULL && len == want;
+
+        for (unsigned int i = 0; same && i < (size_t)len; i++) {
+            same = chunk[PKT_HDRSZ + i] == mark(sequence, i);
+        }
+        check(same, "prefetch chunk", sequence);
+        prefetch_release(pf, chunk);
+        if (!same) {
+            return;
+        }
+    }
+}
+
+static void checkPrefetch() {
+    const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char path[4096];
+    uint8_t chunk[CHUNK];
+    prefetch *pf;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/bigseq_test.XXXXXX", dir);
+    if ((fd = mkstemp(path)) == -1) {
+        printf("FAIL mkstemp %s: %s\n", path, strerror(errno));
+        g_failures++;
+        return;
+    }
+    unlink(path);
+
+    // Marks from just before the boundary to the half chunk that ends it
+    for (uint64_t sequence = WRAP - 2; sequence <= WRAP - 2 + MARKS;
+         sequence++) {
+        size_t len = sequence < WRAP - 2 + MARKS ? CHUNK : CHUNK / 2;
+
+        for (unsigned int i = 0; i < len; i++) {
+            chunk[i] = mark(sequence, i);
+        }
+        if (pwrite(fd, chunk, len, pkt_offset(sequence, CHUNK)) !=
+            (ssize_t)len) {
+            printf("FAIL pwrite at %llu: %s\n",
+                   (unsigned long long)pkt_offset(sequence, CHUNK),
+                   strerror(errno));
+            g_failures++;
+            close(fd);
+            return;
+        }
+    }
+
+    if ((pf = prefetch_open(fd, pkt_offset(WRAP - 2, CHUNK), CHUNK,
+                            PKT_HDRSZ, 4, 1)) == NULL) {
+        printf("FAIL prefetch_open: %s\n", strerror(errno));
+        g_failures++;
+        close(fd);
+        return;
+    }
+    takeFrom(pf, WRAP - 2, WRAP - 2 + MARKS);
+
+    // A rewind to either side of the boundary, as a REJ would make
+    for (uint64_t sequence = WRAP + 1; sequence >= WRAP - 1; sequence--) {
+        if (!check(prefetch_seek(pf, pkt_offset(sequence, CHUNK)) == 0,
+                   "prefetch_seek", sequence)) {
+            break;
+        }
+        takeFrom(pf, sequence, WRAP - 2 + MARKS);
+    }
+
+    prefetch_close(pf);
+    close(fd);
+}
+
+int main() {
+    checkOffsets();
+    checkWire();
+    checkWindows<StopAndWait>("stop-and-wait window");
+    checkWindows<GoBackN>("go-back-n window");
+    checkWindows<SelectiveRepeat>("selective-repeat window");
+    checkPrefetch();
+
+    printf("bigseq: %lu checks, %lu failed\n", g_checks, g_failures);
+    return g_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
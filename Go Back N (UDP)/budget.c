@@ -0,0 +1,112 @@
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "budget.h"
+
+struct budget {
+    uint64_t limit;
+    uint64_t used;
+    uint64_t cuts;
+    unsigned int holders;
+    uint64_t held[];            /* what each holder owns */
+};
+
+static size_t size(unsigned int holders) {
+    return sizeof(struct budget) + holders * sizeof(uint64_t);
+}
+
+struct budget *budget_open(uint64_t limit, unsigned int holders) {
+    struct budget *b;
+
+    /* Zero-filled, and only touched pages of held[] cost anything */
+    b = (struct budget *)mmap(NULL, size(holders), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) {
+        return NULL;
+    }
+    b->limit = limit;
+    b->holders = holders;
+    return b;
+}
+
+uint64_t budget_grant(struct budget *b, unsigned int holder, uint64_t want,
+                      uint64_t least) {
+    uint64_t used = __atomic_load_n(&b->used, __ATOMIC_RELAXED);
+    uint64_t grant;
+
+    if (holder >= b->holders) {
+        return 0;
+    }
+    if (least > want) {
+        least = want;
+    }
+
+    do {
+        uint64_t left = used < b->limit ? b->limit - used : 0;
+        grant = want < left / 2 ? want : left / 2;
+        if (grant < least) {
+            grant = least;
+        }
+    } while (!__atomic_compare_exchange_n(&b->used, &used, used + grant, 0,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&b->held[holder], grant, __ATOMIC_RELAXED);
+    if (grant < want) {
+        __atomic_fetch_add(&b->cuts, 1, __ATOMIC_RELAXED);
+    }
+    return grant;
+}
+
+void budget_trim(struct budget *b, unsigned int holder, uint64_t keep) {
+    uint64_t held;
+
+    if (holder >= b->holders) {
+        return;
+    }
+
+    held = __atomic_load_n(&b->held[holder], __ATOMIC_RELAXED);
+    do {
+        if (held <= keep) {
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&b->held[holder], &held, keep, 0,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    __atomic_fetch_sub(&b->used, held - keep, __ATOMIC_RELEASE);
+}
+
+void budget_release(struct budget *b, unsigned int holder) {
+    budget_trim(b, holder, 0);
+}
+
+uint64_t budget_held(const struct budget *b, unsigned int holder) {
+    if (holder >= b->holders) {
+        return 0;
+    }
+    return __atomic_load_n(&b->held[holder], __ATOMIC_RELAXED);
+}
+
+uint64_t budget_limit(const struct budget *b) {
+    return b->limit;
+}
+
+uint64_t budget_used(const struct budget *b) {
+    return __atomic_load_n(&b->used, __ATOMIC_ACQUIRE);
+}
+
+uint64_t budget_free(const struct budget *b) {
+    uint64_t used = budget_used(b);
+
+    return used < b->limit ? b->limit - used : 0;
+}
+
+uint64_t budget_cuts(const struct budget *b) {
+    return __atomic_load_n(&b->cuts, __ATOMIC_RELAXED);
+}
+
+void budget_close(struct budget *b) {
+    if (b != NULL) {
+        munmap(b, size(b->holders));
+    }
+}
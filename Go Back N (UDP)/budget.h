@@ -0,0 +1,53 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdint.h>
+
+/* A byte budget shared by forked processes, for memory they can't give
+   back to each other.  Each holder, numbered by the caller, is granted
+   bytes against a common limit and keeps them until released.  The
+   accounting lives in a shared anonymous mapping, made before forking, and
+   dies with the last process to use it.
+
+   Grants shrink as the pool fills: never more than half of what's left, so
+   a newcomer always finds some.  The least a holder can work with is
+   granted regardless, so the pool can overdraw by that much per holder;
+   callers that would rather wait check budget_free() first. */
+
+struct budget;
+
+/** Maps an empty pool.
+ * @param limit bytes to share
+ * @param holders holder numbers go from 0 up to this, exclusive
+ * @return the pool, or NULL with errno set
+ */
+struct budget *budget_open(uint64_t limit, unsigned int holders);
+
+/** Grants a holder up to want more bytes, or least if the pool's too full
+ * for more.
+ * @return the bytes granted, which the holder now owns on top of any it had
+ */
+uint64_t budget_grant(struct budget *b, unsigned int holder, uint64_t want,
+                      uint64_t least);
+
+/** Gives back all but keep bytes of what a holder owns */
+void budget_trim(struct budget *b, unsigned int holder, uint64_t keep);
+
+/** Gives back everything a holder owns.  Releasing twice does nothing, so
+ * both a holder and whoever cleans up after it can. */
+void budget_release(struct budget *b, unsigned int holder);
+
+/** Bytes a holder owns */
+uint64_t budget_held(const struct budget *b, unsigned int holder);
+
+uint64_t budget_limit(const struct budget *b);
+uint64_t budget_used(const struct budget *b);
+/** Bytes left before the limit, or 0 once it's been reached or overdrawn */
+uint64_t budget_free(const struct budget *b);
+/** Grants that came to less than was wanted */
+uint64_t budget_cuts(const struct budget *b);
+
+/** Unmaps the pool in this process */
+void budget_close(struct budget *b);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+/* in_cksum() still comes from libcpe464.  It's declared on its own so the
+   library's socket hooks in cpe464.h stay out of the build; impair.h takes
+   their place. */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned short in_cksum(unsigned short *addr, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
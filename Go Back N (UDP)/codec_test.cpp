@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Codec.h"
+#include "checksum.h"
+
+/* Checks Codec.h's checksums against in_cksum, which the receiving end
+   still runs.  Link.h compares the two exactly, so a frame whose sum comes
+   out as 0xFFFF where in_cksum says 0x0000 (one's complement has two
+   zeros) would be dropped as corrupt.  Run with 'make check'. */
+
+static unsigned long g_checks = 0;
+static unsigned long g_failures = 0;
+
+static uint64_t g_rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next() {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+/** The checksum as stored */
+static uint16_t stored(const packet &pkt) {
+    uint16_t checksum;
+
+    memcpy(&checksum, (const uint8_t *)&pkt + PKT_CKSUM_AT, sizeof(checksum));
+    return checksum;
+}
+
+/** What in_cksum makes of the first len bytes, checksum zeroed */
+static uint16_t reference(const packet &pkt, unsigned int len) {
+    static packet copy;
+
+    memcpy(&copy, &pkt, len);
+    copy.checksum = 0;
+    return in_cksum((unsigned short *)&copy, len);
+}
+
+static bool check(const packet &pkt, unsigned int len, const char *what) {
+    uint16_t want = reference(pkt, len);
+
+    g_checks++;
+    if (stored(pkt) != want) {
+        g_failures++;
+        printf("FAIL %s: type 0x%02X sequence %llu size %u connection %u "
+               "length %u: checksum 0x%04X, in_cksum 0x%04X\n", what,
+               pkt.type, (unsigned long long)pkt.sequence,
+               (unsigned int)pkt.size, (unsigned int)pkt.connection, len,
+               stored(pkt), want);
+        return false;
+    }
+    return true;
+}
+
+static void checkConst() {
+    packet pkt;
+
+    CxnFrame::Encode(&pkt);
+    check(pkt, PKT_HDRSZ, "CxnFrame");
+    JoinFrame::Encode(&pkt);
+    check(pkt, PKT_HDRSZ, "JoinFrame");
+
+    // ConstFrame is MakeHeader at compile time; try it on fields it's
+    // never instantiated with
+    for (unsigned int i = 0; i < 100000; i++) {
+        uint64_t sequence = rng_next();
+        HeaderBytes h = MakeHeader(rng_next(), i % 2 ? sequence : i,
+                                   rng_next());
+
+        memcpy(&pkt, h.bytes, PKT_HDRSZ);
+        check(pkt, PKT_HDRSZ, "MakeHeader");
+    }
+}
+
+/* every field value that's all zeros or all ones, in every combination */
+static const uint64_t EDGES[] = {
+    0, 0xFFFF, 0xFFFF0000, 0xFFFFFFFF, 0xFFFFFFFF00000000ULL,
+    0xFFFFFFFFFFFFFFFFULL, 1, 0xFFFE
+};
+#define NUM_EDGES (sizeof(EDGES) / sizeof(EDGES[0]))
+
+static void checkEncode() {
+    packet pkt;
+    unsigned long zeros = 0;
+
+    for (unsigned int i = 0; i < NUM_EDGES; i++) {
+        for (unsigned int j = 0; j < NUM_EDGES; j++) {
+            RrFrame::Encode(&pkt, EDGES[i]);
+            check(pkt, PKT_HDRSZ, "RrFrame edge");
+            RejFrame::Encode(&pkt, EDGES[i]);
+            check(pkt, PKT_HDRSZ, "RejFrame edge");
+            GrantFrame::Encode(&pkt, EDGES[i], EDGES[j]);
+            check(pkt, PKT_HDRSZ, "GrantFrame edge");
+            HeaderFrame<0x00>::Encode(&pkt, EDGES[i], EDGES[j]);
+            check(pkt, PKT_HDRSZ, "type 0x00 edge");
+            HeaderFrame<0xFF>::Encode(&pkt, EDGES[i], EDGES[j]);
+            check(pkt, PKT_HDRSZ, "type 0xFF edge");
+        }
+    }
+
+    // Sweeping a sequence's low word walks the sum through every value, so
+    // this meets the frames that checksum to 0x0000.  None can come out
+    // 0xFFFF: that needs every byte zero, and these have a type.
+    for (uint64_t sequence = 0; sequence < 0x20000; sequence++) {
+        RrFrame::Encode(&pkt, sequence);
+        if (check(pkt, PKT_HDRSZ, "RrFrame sweep") && stored(pkt) == 0) {
+            zeros++;
+        }
+        if (stored(pkt) == 0xFFFF) {
+            g_failures++;
+            printf("FAIL RrFrame sweep: 0xFFFF for sequence %llu\n",
+                   (unsigned long long)pkt.sequence);
+        }
+    }
+    if (zeros == 0) {
+        g_failures++;
+        printf("FAIL RrFrame sweep: no frame checksummed to 0x0000\n");
+    }
+
+    // All zeros is the one header in_cksum gives 0xFFFF
+    HeaderFrame<0x00>::Encode(&pkt, 0, 0);
+    check(pkt, PKT_HDRSZ, "all-zero header");
+
+    for (unsigned int i = 0; i < 100000; i++) {
+        uint64_t sequence = rng_next();
+        uint32_t size = rng_next();
+
+        WinFrame::Encode(&pkt, sequence, size, size >> 24);
+        check(pkt, PKT_HDRSZ, "WinFrame");
+        FecFrame::Encode(&pkt, sequence, size >> 16, size);
+        check(pkt, PKT_HDRSZ, "FecFrame");
+        MtuFrame::Encode(&pkt, sequence, size);
+        check(pkt, PKT_HDRSZ, "MtuFrame");
+        CookieFrame::Encode(&pkt, sequence, size);
+        check(pkt, PKT_HDRSZ, "CookieFrame");
+        PathFrame::Encode(&pkt, sequence, size);
+        check(pkt, PKT_HDRSZ, "PathFrame");
+        Cxn2Frame::Encode(&pkt, size);
+        check(pkt, PKT_HDRSZ, "Cxn2Frame");
+        FinFrame::Encode(&pkt, sequence, size & 1);
+        check(pkt, PKT_HDRSZ, "FinFrame");
+    }
+}
+
+/* a data packet of len bytes all told, sealed the way Link.h does */
+static void seal(packet *pkt, unsigned int len) {
+    memset(pkt, 0, PKT_HDRSZ);
+    pkt->type = PKT_TYPE_DAT;
+    pkt->sequence = rng_next();
+    pkt->size = len - PKT_HDRSZ;
+    for (unsigned int i = PKT_HDRSZ; i < len; i++) {
+        ((uint8_t *)pkt)[i] = rng_next();
+    }
+    pkt->checksum = in_cksum((unsigned short *)pkt, len);
+}
+
+static void checkStamp() {
+    static packet pkt;
+    unsigned long zeros = 0;
+
+    // From each edge to each other, and back to none
+    for (unsigned int i = 0; i < NUM_EDGES; i++) {
+        for (unsigned int j = 0; j < NUM_EDGES; j++) {
+            ConnectionFrame::Encode(&pkt, i, EDGES[i]);
+            check(pkt, PKT_HDRSZ, "ConnectionFrame edge");
+            ConnectionFrame::Stamp(&pkt, EDGES[j]);
+            check(pkt, PKT_HDRSZ, "Stamp edge");
+            ConnectionFrame::Stamp(&pkt, 0);
+            check(pkt, PKT_HDRSZ, "Stamp back to 0");
+        }
+    }
+
+    // Patching a checksum of 0x0000, and patching to one
+    for (uint64_t sequence = 0; sequence < 0x10000; sequence++) {
+        RrFrame::Encode(&pkt, sequence);
+        if (stored(pkt) == 0) {
+            zeros++;
+            ConnectionFrame::Stamp(&pkt, 0xFFFFFFFF);
+            check(pkt, PKT_HDRSZ, "Stamp from 0x0000");
+        }
+    }
+    for (uint32_t connection = 0; connection < 0x10000; connection++) {
+        RrFrame::Encode(&pkt, 12345);
+        ConnectionFrame::Stamp(&pkt, connection * 0x10001);
+        if (check(pkt, PKT_HDRSZ, "Stamp sweep") && stored(pkt) == 0) {
+            zeros++;
+        }
+    }
+    if (zeros < 2) {
+        g_failures++;
+        printf("FAIL Stamp: met 0x0000 only %lu times\n", zeros);
+    }
+
+    // Sealed data packets of odd and even lengths, stamped repeatedly
+    for (unsigned int i = 0; i < 20000; i++) {
+        unsigned int len = PKT_HDRSZ + rng_next() % 64;
+
+        seal(&pkt, len);
+        for (unsigned int j = 0; j < 4; j++) {
+            ConnectionFrame::Stamp(&pkt, j == 3 ? 0 : rng_next());
+            check(pkt, len, "Stamp sealed");
+        }
+    }
+}
+
+int main() {
+    checkConst();
+    checkEncode();
+    checkStamp();
+
+    printf("codec: %lu checks, %lu failed\n", g_checks, g_failures);
+    return g_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
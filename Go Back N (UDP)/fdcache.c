@@ -0,0 +1,280 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "fdcache.h"
+#include "xxhash.h"
+
+/* What makes an open descriptor stale: new contents or attributes, or the
+   name now meaning another file.  Replacing or removing the file shows up
+   as IN_ATTRIB, since its link count drops, even while we hold it open. */
+#define FDCACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                        IN_MOVE_SELF | IN_DELETE_SELF)
+
+struct fdcache {
+    struct fdcache_entry **buckets;
+    unsigned int mask;
+    unsigned int count;         /* entries that aren't stale */
+    unsigned int limit;
+    struct fdcache_entry *newest;
+    struct fdcache_entry *oldest;
+    int inotify;
+};
+
+static unsigned long hash(const char *path) {
+    struct xxh64 h;
+
+    xxh64_init(&h, 0);
+    xxh64_update(&h, path, strlen(path));
+    return xxh64_digest(&h);
+}
+
+static void unlink_lru(struct fdcache *c, struct fdcache_entry *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        c->newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        c->oldest = e->newer;
+    }
+    e->newer = e->older = NULL;
+}
+
+static void push_lru(struct fdcache *c, struct fdcache_entry *e) {
+    e->older = c->newest;
+    e->newer = NULL;
+    if (c->newest != NULL) {
+        c->newest->newer = e;
+    } else {
+        c->oldest = e;
+    }
+    c->newest = e;
+}
+
+/* Stops watching an entry's file, unless another name for the same file
+   shares the watch */
+static void unwatch(struct fdcache *c, struct fdcache_entry *e) {
+    struct fdcache_entry *other;
+    unsigned int i;
+
+    for (i = 0; i <= c->mask; i++) {
+        for (other = c->buckets[i]; other != NULL; other = other->chain) {
+            if (other != e && other->wd == e->wd) {
+                return;
+            }
+        }
+    }
+    inotify_rm_watch(c->inotify, e->wd);
+}
+
+static void destroy(struct fdcache *c, struct fdcache_entry *e) {
+    unwatch(c, e);
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/* Takes an entry out of lookups.  It's freed now if nobody's using it, or
+   by the last fdcache_put() if somebody is. */
+static void drop(struct fdcache *c, struct fdcache_entry *e) {
+    struct fdcache_entry **p = &c->buckets[e->hash & c->mask];
+
+    while (*p != e) {
+        p = &(*p)->chain;
+    }
+    *p = e->chain;
+    e->chain = NULL;
+    unlink_lru(c, e);
+    e->stale = 1;
+    c->count--;
+
+    if (e->refs == 0) {
+        destroy(c, e);
+    }
+}
+
+/* Closes the least recently used entries nobody's using, down to the
+   limit */
+static void evict(struct fdcache *c) {
+    struct fdcache_entry *e = c->oldest;
+
+    while (c->count > c->limit && e != NULL) {
+        struct fdcache_entry *newer = e->newer;
+        if (e->refs == 0) {
+            drop(c, e);
+        }
+        e = newer;
+    }
+}
+
+struct fdcache *fdcache_open(unsigned int limit) {
+    struct fdcache *c = calloc(1, sizeof(*c));
+    unsigned int buckets = 16;
+
+    if (c == NULL) {
+        return NULL;
+    }
+    while (buckets < 2 * limit) {
+        buckets *= 2;
+    }
+    if ((c->buckets = calloc(buckets, sizeof(*c->buckets))) == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->mask = buckets - 1;
+    c->limit = limit;
+
+    if ((c->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        int err = errno;
+        free(c->buckets);
+        free(c);
+        errno = err;
+        return NULL;
+    }
+
+    return c;
+}
+
+const struct fdcache_entry *fdcache_find(const struct fdcache *c,
+                                         const char *path) {
+    unsigned long h = hash(path);
+    const struct fdcache_entry *e;
+
+    for (e = c->buckets[h & c->mask]; e != NULL; e = e->chain) {
+        if (e->hash == h && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+struct fdcache_entry *fdcache_get(struct fdcache *c, const char *path) {
+    struct fdcache_entry *e = (struct fdcache_entry *)fdcache_find(c, path);
+    int err;
+
+    if (e != NULL) {
+        unlink_lru(c, e);
+        push_lru(c, e);
+        e->refs++;
+        return e;
+    }
+
+    if ((e = calloc(1, sizeof(*e))) == NULL) {
+        return NULL;
+    }
+    e->fd = -1;
+    e->wd = -1;
+
+    /* Watch before opening, so a change in between can't be missed */
+    if ((e->path = strdup(path)) == NULL ||
+        (e->wd = inotify_add_watch(c->inotify, path, FDCACHE_EVENTS)) == -1 ||
+        (e->fd = open(path, O_RDONLY)) == -1 ||
+        fstat(e->fd, &e->st) == -1) {
+        err = errno;
+        if (e->fd != -1) {
+            close(e->fd);
+        }
+        if (e->wd != -1) {
+            unwatch(c, e);
+        }
+        free(e->path);
+        free(e);
+        errno = err;
+        return NULL;
+    }
+
+    e->hash = hash(path);
+    e->refs = 1;
+    e->chain = c->buckets[e->hash & c->mask];
+    c->buckets[e->hash & c->mask] = e;
+    push_lru(c, e);
+    c->count++;
+    evict(c);
+
+    return e;
+}
+
+void fdcache_put(struct fdcache *c, struct fdcache_entry *e) {
+    if (e == NULL || --e->refs > 0) {
+        return;
+    }
+    if (e->stale) {
+        destroy(c, e);
+    } else {
+        evict(c);
+    }
+}
+
+unsigned int fdcache_update(struct fdcache *c) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    unsigned int dropped = 0;
+    ssize_t len;
+
+    while ((len = read(c->inotify, buf, sizeof(buf))) > 0) {
+        char *p;
+
+        for (p = buf; p < buf + len;
+             p += sizeof(struct inotify_event) +
+                  ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (struct inotify_event *)p;
+            unsigned int i;
+
+            /* Events were lost, so nothing can be trusted */
+            if (ev->mask & IN_Q_OVERFLOW) {
+                for (i = 0; i <= c->mask; i++) {
+                    while (c->buckets[i] != NULL) {
+                        drop(c, c->buckets[i]);
+                        dropped++;
+                    }
+                }
+                continue;
+            }
+
+            /* Every name for the file goes */
+            for (i = 0; i <= c->mask; i++) {
+                struct fdcache_entry *e = c->buckets[i];
+                while (e != NULL) {
+                    struct fdcache_entry *next = e->chain;
+                    if (e->wd == ev->wd) {
+                        drop(c, e);
+                        dropped++;
+                    }
+                    e = next;
+                }
+            }
+        }
+    }
+
+    return dropped;
+}
+
+int fdcache_fd(const struct fdcache *c) {
+    return c->inotify;
+}
+
+void fdcache_close(struct fdcache *c) {
+    unsigned int i;
+
+    if (c == NULL) {
+        return;
+    }
+    for (i = 0; i <= c->mask; i++) {
+        while (c->buckets[i] != NULL) {
+            struct fdcache_entry *e = c->buckets[i];
+            c->buckets[i] = e->chain;
+            close(e->fd);
+            free(e->path);
+            free(e);
+        }
+    }
+    close(c->inotify);
+    free(c->buckets);
+    free(c);
+}
@@ -0,0 +1,67 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <sys/stat.h>
+
+/* Read-only descriptors for the files being served, kept open with their
+   stat(2) between sessions.  An entry in use is never closed.  Among the
+   rest, the least recently used go first once there are more than the
+   limit.  inotify watches every file, and an entry for one that changes
+   is dropped, so the next lookup opens it again.
+
+   The server keeps the cache in the parent.  Forked sessions inherit the
+   descriptors with it, so a hit costs a child one hash lookup and no
+   system calls at all. */
+
+struct fdcache_entry {
+    int fd;
+    struct stat st;           /* as of when it was opened */
+    /* the rest is the cache's */
+    char *path;
+    unsigned long hash;
+    int wd;                   /* inotify watch */
+    unsigned int refs;
+    int stale;                /* changed since; closed once unused */
+    struct fdcache_entry *chain;
+    struct fdcache_entry *newer;
+    struct fdcache_entry *older;
+};
+
+struct fdcache;
+
+/** Starts an empty cache.
+ * @param limit entries kept; more stay open only while they're in use
+ * @return the cache, or NULL with errno set
+ */
+struct fdcache *fdcache_open(unsigned int limit);
+
+/** Looks a file up, opening, statting and watching it if it isn't cached.
+ * Each successful call holds a reference until fdcache_put().
+ * @return the entry, or NULL with errno set if the file couldn't be opened
+ */
+struct fdcache_entry *fdcache_get(struct fdcache *c, const char *path);
+
+/** Only looks a file up.  For a forked child reading its copy of the
+ * cache: no system calls, and nothing it does reaches the parent.
+ * @return the entry as it was at the fork, or NULL if it wasn't cached
+ */
+const struct fdcache_entry *fdcache_find(const struct fdcache *c,
+                                         const char *path);
+
+/** Lets go of a reference from fdcache_get() */
+void fdcache_put(struct fdcache *c, struct fdcache_entry *e);
+
+/** Drops entries for files that have changed, reading inotify without
+ * waiting.  Call it before anything that relies on the cache being
+ * current, like a fork.
+ * @return entries dropped
+ */
+unsigned int fdcache_update(struct fdcache *c);
+
+/** The inotify descriptor, which is readable when there are changes */
+int fdcache_fd(const struct fdcache *c);
+
+/** Closes every entry, in use or not, and frees the cache */
+void fdcache_close(struct fdcache *c);
+
+#endif
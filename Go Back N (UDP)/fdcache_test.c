@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+
+/* Runs the file cache against real files in a scratch directory: files
+   modified, renamed and unlinked while sessions hold them, reference
+   counts, which entries eviction picks, and the inotify watches left
+   behind, which it reads back from /proc/self/fdinfo.  Run with
+   'make check'. */
+
+#define LIMIT 3
+
+static unsigned long g_checks = 0;
+static unsigned long g_failures = 0;
+
+static char g_dir[PATH_MAX];
+
+static int check(int ok, const char *what, const char *name) {
+    g_checks++;
+    if (!ok) {
+        g_failures++;
+        printf("FAIL %s: %s\n", what, name);
+    }
+    return ok;
+}
+
+static const char *path(const char *name) {
+    static char buf[4][sizeof(g_dir) + NAME_MAX + 1];
+    static unsigned int next = 0;
+    char *p = buf[next++ % 4];
+
+    snprintf(p, sizeof(buf[0]), "%s/%s", g_dir, name);
+    return p;
+}
+
+static void put_file(const char *name, const char *contents) {
+    int fd = open(path(name), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1 || write(fd, contents, strlen(contents)) == -1) {
+        printf("FAIL writing %s: %s\n", name, strerror(errno));
+        g_failures++;
+    }
+    close(fd);
+}
+
+/** Watches the cache's inotify descriptor has, as the kernel lists them */
+static int watches(const struct fdcache *c) {
+    char name[64];
+    char line[512];
+    FILE *f;
+    int n = 0;
+
+    snprintf(name, sizeof(name), "/proc/self/fdinfo/%d", fdcache_fd(c));
+    if ((f = fopen(name, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        n += strncmp(line, "inotify wd:", 11) == 0;
+    }
+    fclose(f);
+    return n;
+}
+
+static int cached(const struct fdcache *c, const char *name) {
+    return fdcache_find(c, path(name)) != NULL;
+}
+
+/** Whether an entry's descriptor still reads the contents it was opened
+ * with */
+static int reads(const struct fdcache_entry *e, const char *contents) {
+    char buf[64];
+    ssize_t len = pread(e->fd, buf, sizeof(buf), 0);
+
+    return len == (ssize_t)strlen(contents) &&
+           memcmp(buf, contents, len) == 0;
+}
+
+static void checkRefs(struct fdcache *c) {
+    struct fdcache_entry *a, *again;
+
+    put_file("a", "alpha");
+    a = fdcache_get(c, path("a"));
+    again = fdcache_get(c, path("a"));
+    if (!check(a != NULL && again == a, "second get shares the entry", "a")) {
+        return;
+    }
+    check(a->refs == 2, "two references", "a");
+    check(reads(a, "alpha"), "reads", "a");
+    check(a->st.st_size == 5, "stat kept", "a");
+    check(watches(c) == 1, "one watch", "a");
+
+    fdcache_put(c, again);
+    fdcache_put(c, a);
+    check(a->refs == 0 && cached(c, "a"), "kept once released", "a");
+    check(fdcache_update(c) == 0, "nothing changed", "a");
+
+    errno = 0;
+    check(fdcache_get(c, path("missing")) == NULL && errno == ENOENT,
+          "missing file", "missing");
+    check(watches(c) == 1, "no watch left for a missing file", "missing");
+
+    a = fdcache_get(c, path("a"));
+    fdcache_put(c, a);
+    check(cached(c, "a") && watches(c) == 1, "hit", "a");
+}
+
+static void checkEviction(struct fdcache *c) {
+    static const char *NAMES[] = { "e0", "e1", "e2", "e3", "e4" };
+    struct fdcache_entry *e, *held;
+    unsigned int i;
+
+    // a is cached from checkRefs, and is the oldest
+    for (i = 0; i < 2; i++) {
+        put_file(NAMES[i], NAMES[i]);
+        fdcache_put(c, fdcache_get(c, path(NAMES[i])));
+    }
+    check(cached(c, "a") && cached(c, "e0") && cached(c, "e1"), "full",
+          "a");
+
+    // Using a makes e0 the oldest, so it goes first
+    fdcache_put(c, fdcache_get(c, path("a")));
+    put_file(NAMES[2], NAMES[2]);
+    fdcache_put(c, fdcache_get(c, path(NAMES[2])));
+    check(!cached(c, "e0"), "least recently used evicted", "e0");
+    check(cached(c, "a") && cached(c, "e1") && cached(c, "e2"),
+          "the rest kept", "e2");
+    check(watches(c) == LIMIT, "evicted entry's watch removed", "e0");
+
+    // One in use is passed over, even as the oldest, and stays over the
+    // limit until it's released
+    held = fdcache_get(c, path("e1"));
+    fdcache_put(c, fdcache_get(c, path("a")));
+    fdcache_put(c, fdcache_get(c, path("e2")));
+    put_file(NAMES[3], NAMES[3]);
+    e = fdcache_get(c, path(NAMES[3]));
+    check(cached(c, "e1") && held->refs == 1, "held entry kept", "e1");
+    check(!cached(c, "a"), "oldest unused evicted instead", "a");
+    fdcache_put(c, e);
+    put_file(NAMES[4], NAMES[4]);
+    fdcache_put(c, fdcache_get(c, path(NAMES[4])));
+    check(cached(c, "e1") && !cached(c, "e2") && cached(c, "e3") &&
+          cached(c, "e4"), "held entry kept again", "e1");
+    check(watches(c) == LIMIT, "watches follow the entries", "e2");
+
+    fdcache_put(c, held);
+    check(cached(c, "e1"), "released entry kept while under the limit",
+          "e1");
+    check(reads(held, "e1"), "released entry still open", "e1");
+}
+
+/** Holds a file, changes it, and checks the entry goes stale but stays
+ * readable until it's released */
+static void checkChange(struct fdcache *c, const char *name,
+                        const char *how) {
+    struct fdcache_entry *e, *fresh;
+    char contents[64];
+    int fd;
+
+    snprintf(contents, sizeof(contents), "%s before", name);
+    put_file(name, contents);
+    if (!check((e = fdcache_get(c, path(name))) != NULL, "get", name)) {
+        return;
+    }
+    fd = e->fd;
+
+    if (strcmp(how, "modify") == 0) {
+        int w = open(path(name), O_WRONLY | O_APPEND);
+        check(w != -1 && write(w, "!", 1) == 1, "append", name);
+        close(w);
+        strcat(contents, "!");
+    } else if (strcmp(how, "rename") == 0) {
+        char to[PATH_MAX];
+        snprintf(to, sizeof(to), "%s.moved", path(name));
+        check(rename(path(name), to) == 0, "rename", name);
+    } else if (strcmp(how, "unlink") == 0) {
+        check(unlink(path(name)) == 0, "unlink", name);
+    } else {
+        // Replaced by another file under the same name, as an editor or
+        // rsync would
+        char tmp[PATH_MAX];
+        int w;
+        snprintf(tmp, sizeof(tmp), "%s.new", path(name));
+        w = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        check(w != -1 && write(w, "new", 3) == 3, "write replacement", name);
+        close(w);
+        check(rename(tmp, path(name)) == 0, "replace", name);
+    }
+
+    check(fdcache_update(c) >= 1, "change noticed", name);
+    check(!cached(c, name), "changed entry dropped", name);
+    check(e->stale && e->refs == 1, "held entry marked stale", name);
+    check(reads(e, contents), "held entry still reads", name);
+
+    // The name now opens whatever it means now, if anything
+    fresh = fdcache_get(c, path(name));
+    if (strcmp(how, "modify") == 0) {
+        check(fresh != NULL && fresh != e && reads(fresh, contents),
+              "reopened", name);
+    } else if (strcmp(how, "replace") == 0) {
+        check(fresh != NULL && fresh != e && reads(fresh, "new"),
+              "replacement opened", name);
+    } else {
+        check(fresh == NULL && errno == ENOENT, "gone", name);
+    }
+
+    fdcache_put(c, e);
+    check(fcntl(fd, F_GETFD) == -1 && errno == EBADF,
+          "stale entry closed once released", name);
+    fdcache_put(c, fresh);
+    check(cached(c, name) == (fresh != NULL), "reopened entry cached", name);
+}
+
+/** Two names for one file share a watch, which stays until neither is
+ * cached */
+static void checkLinks(void) {
+    struct fdcache *c = fdcache_open(LIMIT);
+    struct fdcache_entry *one, *two;
+
+    put_file("l1", "linked");
+    if (!check(link(path("l1"), path("l2")) == 0, "link", "l2")) {
+        fdcache_close(c);
+        return;
+    }
+    one = fdcache_get(c, path("l1"));
+    two = fdcache_get(c, path("l2"));
+    check(one != NULL && two != NULL && one != two && one->wd == two->wd,
+          "one watch for two names", "l2");
+    check(watches(c) == 1, "one watch listed", "l2");
+    fdcache_put(c, one);
+    fdcache_put(c, two);
+
+    // Push l1 out: the watch stays for l2
+    put_file("x1", "x1");
+    put_file("x2", "x2");
+    put_file("x3", "x3");
+    fdcache_put(c, fdcache_get(c, path("x1")));
+    fdcache_put(c, fdcache_get(c, path("x2")));
+    check(!cached(c, "l1") && cached(c, "l2"), "l1 evicted first", "l1");
+    check(watches(c) == LIMIT, "shared watch kept for l2", "l2");
+    fdcache_put(c, fdcache_get(c, path("x3")));
+    check(!cached(c, "l2") && watches(c) == LIMIT,
+          "shared watch removed with l2", "l2");
+
+    // Changing the file through one name drops both, held or not, and
+    // their watch goes with the last of them
+    one = fdcache_get(c, path("l1"));
+    two = fdcache_get(c, path("l2"));
+    fdcache_put(c, two);
+    check(watches(c) == 2, "x3 and the shared watch", "l1");
+    put_file("l2", "changed");
+    check(fdcache_update(c) == 2, "both names dropped", "l1");
+    check(!cached(c, "l1") && !cached(c, "l2") && one->stale,
+          "neither name cached", "l1");
+    check(reads(one, "changed"), "held name reads the one file", "l1");
+    fdcache_put(c, one);
+    check(watches(c) == 1, "shared watch removed", "l1");
+
+    fdcache_close(c);
+}
+
+int main(void) {
+    const char *tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    struct fdcache *c;
+    char cmd[PATH_MAX + 16];
+
+    snprintf(g_dir, sizeof(g_dir), "%s/fdcache_test.XXXXXX", tmp);
+    if (mkdtemp(g_dir) == NULL || (c = fdcache_open(LIMIT)) == NULL) {
+        printf("FAIL setup: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    checkRefs(c);
+    checkEviction(c);
+    checkChange(c, "m", "modify");
+    checkChange(c, "r", "rename");
+    checkChange(c, "u", "unlink");
+    checkChange(c, "p", "replace");
+    fdcache_close(c);
+    checkLinks();
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", g_dir);
+    if (system(cmd) != 0) {
+        printf("Couldn't remove %s\n", g_dir);
+    }
+
+    printf("fdcache: %lu checks, %lu failed\n", g_checks, g_failures);
+    return g_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,27 @@
+#include <string.h>
+
+#include "fec.h"
+
+typedef uint64_t fec_vec __attribute__((vector_size(32)));
+
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("O3")))
+#endif
+void fec_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    
+    /* memcpy keeps unaligned loads legal, and compiles to plain vector
+       moves */
+    for (; i + sizeof(fec_vec) <= len; i += sizeof(fec_vec)) {
+        fec_vec a;
+        fec_vec b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FEC_NMAX 255 // Largest group; parity indices and counts fit a byte
+
+/** XORs a run of bytes into another.
+ * Works 32 bytes at a time so encoding a parity packet costs less than
+ * checksumming the data packet it covers.
+ * @param dst bytes to fold into
+ * @param src bytes to fold
+ * @param len number of bytes to fold
+ */
+void fec_xor(uint8_t *dst, const uint8_t *src, size_t len);
+
+#endif
@@ -0,0 +1,430 @@
+/* sendmmsg and struct mmsghdr */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "impair.h"
+
+/* a datagram waiting for its delivery time */
+struct deferred {
+    struct deferred *next;
+    uint64_t due;
+    int s;
+    int flags;
+    struct sockaddr_storage to;
+    socklen_t tolen;
+    size_t len;
+    uint8_t data[];
+};
+
+static struct impair_config g_cfg;
+static int g_active = 0;
+static uint64_t g_rng = 1;
+
+/* when the bottleneck link finishes sending what it already has */
+static uint64_t g_link_free = 0;
+
+static struct impair_stats {
+    unsigned long long sent;
+    unsigned long long dropped;
+    unsigned long long overflowed;
+    unsigned long long corrupted;
+    unsigned long long reordered;
+    unsigned long long duplicated;
+    unsigned long long delayed;
+    unsigned long long lost;      /* received, then thrown away */
+} g_stats;
+
+/* deferred datagrams sorted by due time, and the thread that sends them */
+static struct deferred *g_queue = NULL;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond;
+static pid_t g_thread_pid = 0;
+
+static uint64_t rng_next(void) {
+    /* xorshift64* */
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 0x2545F4914F6CDD1DULL;
+}
+
+static int chance(double p) {
+    if (p <= 0) {
+        return 0;
+    }
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+static double env_double(const char *name, double def) {
+    const char *v = getenv(name);
+    return (v != NULL && *v != '\0') ? atof(v) : def;
+}
+
+static unsigned long long env_ulong(const char *name, unsigned long long def) {
+    const char *v = getenv(name);
+    return (v != NULL && *v != '\0') ? strtoull(v, NULL, 0) : def;
+}
+
+void impair_config_env(struct impair_config *cfg, double error_rate) {
+    cfg->drop = env_double("IMPAIR_DROP", error_rate / 2);
+    cfg->corrupt = env_double("IMPAIR_CORRUPT", error_rate / 2);
+    cfg->reorder = env_double("IMPAIR_REORDER", 0);
+    cfg->duplicate = env_double("IMPAIR_DUPLICATE", 0);
+    cfg->delay_us = env_ulong("IMPAIR_DELAY_US", 0);
+    cfg->jitter_us = env_ulong("IMPAIR_JITTER_US", 0);
+    cfg->reorder_us = env_ulong("IMPAIR_REORDER_US", 1000);
+    cfg->rate_kbps = env_ulong("IMPAIR_RATE_KBPS", 0);
+    cfg->queue_bytes = env_ulong("IMPAIR_QUEUE_BYTES", 0);
+    cfg->seed = env_ulong("IMPAIR_SEED", 1);
+}
+
+static void *sender(void *arg) {
+    pthread_mutex_lock(&g_lock);
+
+    while (1) {
+        struct deferred *d = g_queue;
+        uint64_t now;
+
+        if (d == NULL) {
+            pthread_cond_wait(&g_cond, &g_lock);
+            continue;
+        }
+
+        now = clock_usec();
+        if (d->due > now) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += (d->due - now) / 1000000;
+            ts.tv_nsec += ((d->due - now) % 1000000) * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&g_cond, &g_lock, &ts);
+            continue;
+        }
+
+        /* like a real network, nobody hears about failures from here */
+        g_queue = d->next;
+        pthread_mutex_unlock(&g_lock);
+        sendto(d->s, d->data, d->len, d->flags, (struct sockaddr *)&d->to,
+               d->tolen);
+        free(d);
+        pthread_mutex_lock(&g_lock);
+    }
+
+    return arg;
+}
+
+static void atfork_prepare(void) {
+    pthread_mutex_lock(&g_lock);
+}
+
+static void atfork_parent(void) {
+    pthread_mutex_unlock(&g_lock);
+}
+
+static void atfork_child(void) {
+    pthread_condattr_t attr;
+
+    /* the parent's datagrams and sender thread stay with the parent */
+    while (g_queue != NULL) {
+        struct deferred *d = g_queue;
+        g_queue = d->next;
+        free(d);
+    }
+    g_thread_pid = 0;
+
+    pthread_mutex_init(&g_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void impair_init(const struct impair_config *cfg) {
+    pthread_condattr_t attr;
+
+    g_cfg = *cfg;
+    g_active = cfg->drop > 0 || cfg->corrupt > 0 || cfg->reorder > 0 ||
+               cfg->duplicate > 0 || cfg->delay_us > 0 ||
+               cfg->jitter_us > 0 || cfg->rate_kbps > 0;
+
+    /* run the seed through splitmix64 so small seeds still mix well */
+    g_rng = cfg->seed + 0x9E3779B97F4A7C15ULL;
+    g_rng = (g_rng ^ (g_rng >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    g_rng = (g_rng ^ (g_rng >> 27)) * 0x94D049BB133111EBULL;
+    g_rng ^= g_rng >> 31;
+    if (g_rng == 0) {
+        g_rng = 1;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+
+    if (g_active) {
+        atexit(impair_report);
+    }
+}
+
+/* decides when a datagram leaves.  Returns -1 if it never does, 0 if it
+   goes now, or otherwise the monotonic time to send it at. */
+static int64_t schedule(size_t len, uint64_t now) {
+    uint64_t due = now;
+
+    if (chance(g_cfg.drop)) {
+        g_stats.dropped++;
+        return -1;
+    }
+
+    if (g_cfg.rate_kbps > 0) {
+        uint64_t start = g_link_free > now ? g_link_free : now;
+        uint64_t backlog = (start - now) * g_cfg.rate_kbps / 8000;
+
+        if (g_cfg.queue_bytes > 0 && backlog + len > g_cfg.queue_bytes) {
+            g_stats.overflowed++;
+            return -1;
+        }
+        g_link_free = start + (uint64_t)len * 8000 / g_cfg.rate_kbps;
+        due = g_link_free;
+    }
+
+    due += g_cfg.delay_us;
+    if (g_cfg.jitter_us > 0) {
+        due += rng_next() % (g_cfg.jitter_us + 1);
+    }
+    if (chance(g_cfg.reorder)) {
+        due += g_cfg.reorder_us;
+        g_stats.reordered++;
+    }
+
+    return due > now ? (int64_t)due : 0;
+}
+
+/* copies a datagram, flipping a bit if asked, and either sends it or queues
+   it for the sender thread */
+static void defer(int s, const struct iovec *iov, size_t iovlen, size_t len,
+                  int flags, const struct sockaddr *to, socklen_t tolen,
+                  int64_t due, int corrupt) {
+    struct deferred *d = (struct deferred *)malloc(sizeof(*d) + len);
+    struct deferred **iter;
+    size_t off = 0;
+    size_t i;
+
+    if (d == NULL) {
+        return;
+    }
+
+    for (i = 0; i < iovlen; i++) {
+        memcpy(d->data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    if (corrupt && len > 0) {
+        uint64_t bit = rng_next() % (len * 8);
+        d->data[bit / 8] ^= 1 << (bit % 8);
+        g_stats.corrupted++;
+    }
+
+    d->s = s;
+    d->flags = flags;
+    d->len = len;
+    d->tolen = tolen;
+    if (to != NULL && tolen <= sizeof(d->to)) {
+        memcpy(&d->to, to, tolen);
+    } else {
+        d->tolen = 0;
+    }
+
+    if (due == 0) {
+        sendto(d->s, d->data, d->len, d->flags,
+               d->tolen ? (struct sockaddr *)&d->to : NULL, d->tolen);
+        free(d);
+        return;
+    }
+
+    d->due = due;
+    g_stats.delayed++;
+
+    pthread_mutex_lock(&g_lock);
+    if (g_thread_pid != getpid()) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, sender, NULL) == 0) {
+            pthread_detach(thread);
+            g_thread_pid = getpid();
+        }
+    }
+    for (iter = &g_queue; *iter != NULL && (*iter)->due <= d->due;
+         iter = &(*iter)->next) { }
+    d->next = *iter;
+    *iter = d;
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* what the impairments do to one datagram: the copies that survive, when
+   each goes, and whether it's corrupted.  direct is the copy that can go
+   out untouched right now, if any, which the caller sends itself so
+   nothing is copied. */
+struct plan {
+    int copies;
+    int direct;
+    int64_t due[2];
+    int corrupt[2];
+};
+
+static void plan_one(size_t len, struct plan *p) {
+    int copies = 1;
+    int i;
+
+    g_stats.sent++;
+    if (chance(g_cfg.duplicate)) {
+        g_stats.duplicated++;
+        copies = 2;
+    }
+
+    p->copies = 0;
+    p->direct = -1;
+    for (i = 0; i < copies; i++) {
+        int64_t due = schedule(len, clock_usec());
+        int corrupt;
+
+        if (due < 0) {
+            continue;
+        }
+        corrupt = chance(g_cfg.corrupt);
+        if (due == 0 && !corrupt && p->direct < 0) {
+            p->direct = p->copies;
+        }
+        p->due[p->copies] = due;
+        p->corrupt[p->copies] = corrupt;
+        p->copies++;
+    }
+}
+
+/* copies out every copy in a plan but the direct one */
+static void carry_out(const struct plan *p, int s, const struct iovec *iov,
+                      size_t iovlen, size_t len, int flags,
+                      const struct sockaddr *to, socklen_t tolen) {
+    int i;
+
+    for (i = 0; i < p->copies; i++) {
+        if (i != p->direct) {
+            defer(s, iov, iovlen, len, flags, to, tolen, p->due[i],
+                  p->corrupt[i]);
+        }
+    }
+}
+
+ssize_t impair_sendto(int s, const void *msg, size_t len, int flags,
+                      const struct sockaddr *to, socklen_t tolen) {
+    struct iovec iov;
+    struct plan plan;
+
+    if (!g_active) {
+        return sendto(s, msg, len, flags, to, tolen);
+    }
+
+    iov.iov_base = (void *)msg;
+    iov.iov_len = len;
+    plan_one(len, &plan);
+    carry_out(&plan, s, &iov, 1, len, flags, to, tolen);
+    if (plan.direct >= 0) {
+        return sendto(s, msg, len, flags, to, tolen);
+    }
+
+    return len;
+}
+
+/* how many messages impair_sendmmsg() has consumed when the socket takes
+   sent of a run starting at start, which sendmmsg(2) reports the same way:
+   -1 only if nothing at all went */
+static int consumed(unsigned int start, int sent) {
+    if (sent > 0) {
+        return start + sent;
+    }
+    return start > 0 ? (int)start : -1;
+}
+
+int impair_sendmmsg(int s, struct mmsghdr *msgs, unsigned int vlen,
+                    int flags) {
+    unsigned int start = 0;   /* first message of the run not yet sent */
+    unsigned int i;
+    int sent;
+
+    if (!g_active) {
+        return sendmmsg(s, msgs, vlen, flags);
+    }
+
+    /* Untouched messages go out in runs, one sendmmsg(2) each.  A run is
+       sent before the impaired message after it is dealt with, so nothing
+       overtakes it, and so when the socket takes only part of a run, none
+       of the messages after it have been sent, copied or counted. */
+    for (i = 0; i < vlen; i++) {
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        struct impair_stats before = g_stats;
+        struct plan plan;
+        size_t len = 0;
+        size_t j;
+
+        for (j = 0; j < hdr->msg_iovlen; j++) {
+            len += hdr->msg_iov[j].iov_len;
+        }
+        msgs[i].msg_len = len;
+
+        plan_one(len, &plan);
+        if (plan.copies == 1 && plan.direct == 0) {
+            continue;
+        }
+
+        if (i > start) {
+            sent = sendmmsg(s, msgs + start, i - start, flags);
+            if (sent < (int)(i - start)) {
+                /* this message and the rest of the run are planned again
+                   when they're sent again */
+                g_stats = before;
+                g_stats.sent -= i - start - (sent > 0 ? sent : 0);
+                return consumed(start, sent);
+            }
+        }
+
+        carry_out(&plan, s, hdr->msg_iov, hdr->msg_iovlen, len, flags,
+                  (struct sockaddr *)hdr->msg_name, hdr->msg_namelen);
+        start = plan.direct >= 0 ? i : i + 1;
+    }
+
+    if (vlen > start) {
+        sent = sendmmsg(s, msgs + start, vlen - start, flags);
+        if (sent < (int)(vlen - start)) {
+            g_stats.sent -= vlen - start - (sent > 0 ? sent : 0);
+            return consumed(start, sent);
+        }
+    }
+
+    return vlen;
+}
+
+int impair_recv_drop(void) {
+    if (g_active && (chance(g_cfg.drop) || chance(g_cfg.corrupt))) {
+        g_stats.lost++;
+        return 1;
+    }
+    return 0;
+}
+
+void impair_report(void) {
+    fprintf(stderr, "impair stats: pid=%d seed=%llu sent=%llu dropped=%llu "
+            "overflowed=%llu corrupted=%llu reordered=%llu duplicated=%llu "
+            "delayed=%llu lost=%llu\n", (int)getpid(),
+            (unsigned long long)g_cfg.seed, g_stats.sent, g_stats.dropped,
+            g_stats.overflowed, g_stats.corrupted, g_stats.reordered,
+            g_stats.duplicated, g_stats.delayed, g_stats.lost);
+}
@@ -0,0 +1,67 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct mmsghdr;
+
+/** Network impairments applied to outgoing datagrams.  Every decision comes
+ * from a seeded generator, so the same seed and the same sequence of sends
+ * give the same drops, flips and delays on every run. */
+struct impair_config {
+    double drop;              /* chance a datagram is dropped */
+    double corrupt;           /* chance one bit of a datagram is flipped */
+    double reorder;           /* chance a datagram is held back so later ones
+                                 overtake it */
+    double duplicate;         /* chance a datagram is sent twice */
+    unsigned int delay_us;    /* fixed one-way delay */
+    unsigned int jitter_us;   /* extra delay, uniform in [0, jitter_us] */
+    unsigned int reorder_us;  /* how long a reordered datagram is held */
+    unsigned int rate_kbps;   /* bottleneck bandwidth, 0 for unlimited */
+    unsigned int queue_bytes; /* bottleneck queue; tail drop beyond this */
+    uint64_t seed;
+};
+
+/** Fills in a configuration from an error rate and the environment.
+ * The error rate is split evenly between drops and bit flips, like the old
+ * sendErr_init(rate, DROP_ON, FLIP_ON, ...).  IMPAIR_DROP, IMPAIR_CORRUPT,
+ * IMPAIR_REORDER, IMPAIR_DUPLICATE, IMPAIR_DELAY_US, IMPAIR_JITTER_US,
+ * IMPAIR_REORDER_US, IMPAIR_RATE_KBPS, IMPAIR_QUEUE_BYTES and IMPAIR_SEED
+ * override individual settings.
+ * @param cfg configuration to fill in
+ * @param error_rate combined drop and corruption rate, 0 to 1
+ */
+void impair_config_env(struct impair_config *cfg, double error_rate);
+
+/** Applies a configuration.  Call once per program, before sending. */
+void impair_init(const struct impair_config *cfg);
+
+/** sendto(2) through the impairment layer.  Datagrams that pass untouched go
+ * straight to the socket without being copied. */
+ssize_t impair_sendto(int s, const void *msg, size_t len, int flags,
+                      const struct sockaddr *to, socklen_t tolen);
+
+/** sendmmsg(2) through the impairment layer.  Untouched datagrams still go
+ * out in batches, one for each run of them between impaired ones.
+ * @return number of messages consumed, the first that many of msgs, which
+ *         is fewer than vlen if the socket takes only part of a batch; or -1
+ *         if it takes none of the first
+ */
+int impair_sendmmsg(int s, struct mmsghdr *msgs, unsigned int vlen,
+                    int flags);
+
+/** Decides whether a datagram just received is lost, by the same drop and
+ * corruption rates as sends.  For a multicast group, where one send
+ * reaches every receiver, each receiver calls this to have losses of its
+ * own.
+ * @return 1 to throw the datagram away
+ */
+int impair_recv_drop(void);
+
+/** Prints what the layer did to stderr.  Registered with atexit() when any
+ * impairment is enabled. */
+void impair_report(void);
+
+#endif
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_BATCH 65536   // Bytes gathered into each write(2)
+#define LOG_IDLE_NS 2000000 // How long the writer sleeps when there's nothing
+
+/* A queued message.  seq says whose turn the slot is: it equals the
+   position a producer may claim, or that position plus one once the
+   message is ready for the writer. */
+struct log_slot {
+    uint64_t seq;
+    uint64_t usec;        /* wall clock, for the prefix */
+    int level;
+    uint32_t suppressed;
+    char msg[LOG_MSGLEN];
+};
+
+int log_threshold = LOGL_WARN;
+
+static struct log_slot g_slots[LOG_SLOTS];
+static uint64_t g_tail = 0;       /* next position producers claim */
+static uint64_t g_head = 0;       /* next position the writer takes */
+static uint64_t g_dropped = 0;    /* messages lost to a full queue */
+static unsigned int g_rate = 10;
+static int g_ready = 0;
+static int g_started = 0;
+static pthread_mutex_t g_writer = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *g_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void reset(void) {
+    unsigned int i;
+
+    for (i = 0; i < LOG_SLOTS; i++) {
+        g_slots[i].seq = i;
+    }
+    g_head = g_tail = 0;
+    g_dropped = 0;
+}
+
+/* Adds one message to a batch, prefixed with time, level and pid */
+static size_t format(char *out, size_t room, const struct log_slot *slot) {
+    time_t sec = slot->usec / 1000000;
+    struct tm tm;
+    int n;
+
+    localtime_r(&sec, &tm);
+    n = snprintf(out, room, "%02d:%02d:%02d.%06u %-5s [%d] %s",
+                 tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 (unsigned int)(slot->usec % 1000000),
+                 g_names[slot->level], (int)getpid(), slot->msg);
+    if (n > 0 && (size_t)n < room && slot->suppressed > 0) {
+        n += snprintf(out + n, room - n, " (%u similar suppressed)",
+                      slot->suppressed);
+    }
+    if (n > 0 && (size_t)n < room - 1) {
+        out[n++] = '\n';
+        return n;
+    }
+    return 0;
+}
+
+/* Takes everything that's ready off the queue and writes it */
+static int drain(void) {
+    static char batch[LOG_BATCH];
+    size_t len = 0;
+    int taken = 0;
+    uint64_t dropped;
+
+    pthread_mutex_lock(&g_writer);
+    while (1) {
+        struct log_slot *slot = &g_slots[g_head & (LOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != g_head + 1) {
+            break;
+        }
+        if (LOG_BATCH - len < LOG_MSGLEN + 128) {
+            write(STDERR_FILENO, batch, len);
+            len = 0;
+        }
+        len += format(batch + len, LOG_BATCH - len, slot);
+        __atomic_store_n(&slot->seq, g_head + LOG_SLOTS, __ATOMIC_RELEASE);
+        g_head++;
+        taken++;
+    }
+
+    if ((dropped = __atomic_exchange_n(&g_dropped, 0, __ATOMIC_RELAXED))) {
+        len += snprintf(batch + len, LOG_BATCH - len,
+                        "log: queue full, %llu messages dropped\n",
+                        (unsigned long long)dropped);
+    }
+    if (len > 0) {
+        write(STDERR_FILENO, batch, len);
+    }
+    pthread_mutex_unlock(&g_writer);
+
+    return taken;
+}
+
+static void *writer(void *arg) {
+    struct timespec idle = { 0, LOG_IDLE_NS };
+
+    while (1) {
+        if (drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return arg;
+}
+
+static void atfork_child(void) {
+    /* The writer thread stays with the parent, and so do its messages */
+    pthread_mutex_init(&g_writer, NULL);
+    reset();
+    g_started = 0;
+}
+
+void log_init(void) {
+    const char *level = getenv("RCLOG_LEVEL");
+    const char *rate = getenv("RCLOG_RATE");
+    int i;
+
+    for (i = 0; level != NULL && i <= LOGL_DEBUG; i++) {
+        if (strcasecmp(level, g_names[i]) == 0) {
+            log_threshold = i;
+        }
+    }
+    if (rate != NULL && *rate != '\0') {
+        g_rate = atoi(rate);
+    }
+
+    reset();
+    pthread_atfork(NULL, NULL, atfork_child);
+    atexit(log_flush);
+    g_ready = 1;
+}
+
+/* Returns how many messages were suppressed before this one, or -1 if this
+   one should be too */
+static int64_t limit(struct log_site *site, uint64_t usec) {
+    uint64_t second = usec / 1000000;
+
+    if (g_rate == 0) {
+        return 0;
+    }
+    if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != second) {
+        __atomic_store_n(&site->window, second, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > g_rate) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+void log_write(struct log_site *site, int level, const char *fmt, ...) {
+    uint64_t usec = now_usec();
+    struct log_slot *slot;
+    int64_t suppressed;
+    uint64_t pos;
+    va_list ap;
+
+    if ((suppressed = limit(site, usec)) < 0) {
+        return;
+    }
+
+    /* Before log_init, or if the writer won't start, write directly */
+    if (!g_ready) {
+        va_start(ap, fmt);
+        fprintf(stderr, "%s: ", g_names[level]);
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+        va_end(ap);
+        return;
+    }
+
+    if (!__atomic_exchange_n(&g_started, 1, __ATOMIC_ACQ_REL)) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, writer, NULL) == 0) {
+            pthread_detach(thread);
+        }
+    }
+
+    /* Claim a slot.  Never wait for the writer; drop instead. */
+    pos = __atomic_load_n(&g_tail, __ATOMIC_RELAXED);
+    while (1) {
+        int64_t diff;
+        slot = &g_slots[pos & (LOG_SLOTS - 1)];
+        diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&g_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&g_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* The message body is formatted here because the arguments don't
+       outlive the call; everything else waits for the writer */
+    va_start(ap, fmt);
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    va_end(ap);
+    slot->usec = usec;
+    slot->level = level;
+    slot->suppressed = suppressed;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void log_flush(void) {
+    if (g_ready) {
+        drain();
+    }
+}
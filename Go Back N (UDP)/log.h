@@ -0,0 +1,48 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#define LOG_SLOTS 1024    // Queued messages; must be a power of two
+#define LOG_MSGLEN 232    // Longest message, excluding the prefix
+
+enum log_level {
+    LOGL_ERROR,
+    LOGL_WARN,
+    LOGL_INFO,
+    LOGL_DEBUG
+};
+
+/** Rate limiting state for one LOG() call site */
+struct log_site {
+    uint64_t window;      /* second the count applies to */
+    uint32_t count;       /* messages let through in that second */
+    uint32_t suppressed;  /* messages dropped since the last one through */
+};
+
+/** Most verbose level that's written.  Anything above it costs one
+ * comparison at the call site. */
+extern int log_threshold;
+
+/** Reads RCLOG_LEVEL (error, warn, info or debug; default warn) and
+ * RCLOG_RATE (messages per second per call site; default 10, 0 for no
+ * limit), and switches logging to the background thread. */
+void log_init(void);
+
+/** Queues a message.  Use LOG() instead, which skips this entirely for
+ * levels that are turned off and keeps per-site rate limits. */
+void log_write(struct log_site *site, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/** Writes out everything queued so far.  Runs at exit. */
+void log_flush(void);
+
+#define LOG(level, ...)                                                     \
+    do {                                                                    \
+        if ((level) <= log_threshold) {                                     \
+            static struct log_site log_site_;                               \
+            log_write(&log_site_, (level), __VA_ARGS__);                    \
+        }                                                                   \
+    } while (0)
+
+#endif
@@ -0,0 +1,55 @@
+#include <iostream>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "McastClient.h"
+#include "Exception.h"
+
+extern "C" {
+    #include "impair.h"
+    #include "log.h"
+}
+
+#define NUM_ARGS 5
+#define NUM_ARGS_INTERFACE 6
+#define ARG_TO 1
+#define ARG_GROUP 2
+#define ARG_PORT 3
+#define ARG_PERR 4
+#define ARG_INTERFACE 5
+
+int main(int argc, char *argv[]) {
+    // check arguments
+    if (argc != NUM_ARGS && argc != NUM_ARGS_INTERFACE) {
+        std::cerr << "usage: " << argv[0] << " to-local-file group port "
+                     "error-percent [interface]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Initialize errors.  Receivers on one host would otherwise all lose
+    // the same packets, so each gets its own seed unless one is given.
+    impair_config impair;
+    impair_config_env(&impair, atof(argv[ARG_PERR]));
+    if (!getenv("IMPAIR_SEED")) {
+        impair.seed ^= (uint64_t)getpid() << 32;
+    }
+    impair_init(&impair);
+
+    // Logging level and rate limits come from the environment
+    log_init();
+
+    try {
+        McastClient mcopy(argv[ARG_TO], argv[ARG_GROUP], atoi(argv[ARG_PORT]),
+                          argc == NUM_ARGS_INTERFACE ?
+                              argv[ARG_INTERFACE] : "");
+        if (mcopy.Run()) {
+            return EXIT_FAILURE;
+        }
+    } catch (Exception &e) {
+        std::cerr << e.What() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "McastServer.h"
+#include "Exception.h"
+
+extern "C" {
+    #include "impair.h"
+    #include "log.h"
+}
+
+#define NUM_ARGS 7
+#define NUM_ARGS_RECEIVERS 8
+#define NUM_ARGS_INTERFACE 9
+#define ARG_FROM 1
+#define ARG_GROUP 2
+#define ARG_PORT 3
+#define ARG_BUFSZ 4
+#define ARG_PERR 5
+#define ARG_RATE 6
+#define ARG_RECEIVERS 7
+#define ARG_INTERFACE 8
+
+int main(int argc, char *argv[]) {
+    // check arguments
+    if (argc < NUM_ARGS || argc > NUM_ARGS_INTERFACE) {
+        std::cerr << "usage: " << argv[0] << " from-file group port "
+                     "buffer-size error-percent rate-mbit [receivers "
+                     "[interface]]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Initialize errors
+    impair_config impair;
+    impair_config_env(&impair, atof(argv[ARG_PERR]));
+    impair_init(&impair);
+
+    // Logging level and rate limits come from the environment
+    log_init();
+
+    try {
+        McastServer server(argv[ARG_FROM], argv[ARG_GROUP],
+                           atoi(argv[ARG_PORT]), atoi(argv[ARG_BUFSZ]),
+                           atoi(argv[ARG_RATE]),
+                           argc >= NUM_ARGS_RECEIVERS ?
+                               atoi(argv[ARG_RECEIVERS]) : 1,
+                           argc == NUM_ARGS_INTERFACE ?
+                               argv[ARG_INTERFACE] : "");
+        if (server.Run()) {
+            return EXIT_FAILURE;
+        }
+    } catch (Exception &e) {
+        std::cerr << e.What() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
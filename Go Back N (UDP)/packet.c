@@ -1,14 +1,13 @@
-#include <arpa/inet.h>
-#include <string.h>
+#include <endian.h>
 
 #include "packet.h"
-#include "select_call.h"
-#include "cpe464.h"
 
 const char *pkttypestr(uint8_t type) {
     switch (type) {
         case PKT_TYPE_CXN:
             return "Connection Request";
+        case PKT_TYPE_CXN2:
+            return "Connection Request 2";
         case PKT_TYPE_RR:
             return "Receive Ready";
         case PKT_TYPE_REJ:
@@ -21,53 +20,45 @@ const char *pkttypestr(uint8_t type) {
             return "Data";
         case PKT_TYPE_WIN:
             return "Window Size";
+        case PKT_TYPE_PRB:
+            return "MTU Probe";
+        case PKT_TYPE_MTU:
+            return "MTU Probe Reply";
+        case PKT_TYPE_FEC:
+            return "FEC Group Size";
+        case PKT_TYPE_PAR:
+            return "Parity";
+        case PKT_TYPE_HSH:
+            return "File Hash";
+        case PKT_TYPE_ANN:
+            return "Announcement";
+        case PKT_TYPE_JON:
+            return "Join";
+        case PKT_TYPE_NAK:
+            return "Negative Acknowledgment";
+        case PKT_TYPE_FIN:
+            return "Finished";
+        case PKT_TYPE_PTH:
+            return "Path Challenge";
         default:
             return "";
     }
 }
 
-struct packet retransmitpkt(uint32_t sequence) {
-    struct packet ret = { 0 };
-
-    ret.type = PKT_TYPE_REJ;
-    ret.sequence = htonl(sequence);
-    ret.size = 0;
-    memset(ret.data, PKT_TYPE_REJ, PKT_DMAX);
-    ret.checksum = in_cksum((unsigned short *)&ret, sizeof(ret));
-
-    return ret;
-}
-
-struct packet ackpkt(const struct packet *src) {
-    struct packet ret = { 0 };
-
-    if (src != NULL) {
-        memcpy(&ret, src, sizeof(*src));
-        ret.type = PKT_TYPE_RR;
-        ret.checksum = 0;
-        ret.checksum = in_cksum((unsigned short *)&ret, sizeof(ret));
-        memset(ret.data, PKT_TYPE_RR, PKT_DMAX);
+int pktlen(const struct packet *pkt) {
+    switch (pkt->type) {
+        case PKT_TYPE_DAT:
+        case PKT_TYPE_PAR:
+        case PKT_TYPE_HSH:
+        case PKT_TYPE_FLN:
+        case PKT_TYPE_PRB:
+        case PKT_TYPE_NAK:
+            return PKT_HDRSZ + le32toh(pkt->size);
+        default:
+            return PKT_HDRSZ;
     }
-
-    return ret;
 }
 
-struct packet rrpkt(uint32_t sequence) {
-    struct packet ret = { 0 };
-    memset(&ret, PKT_TYPE_RR, sizeof(struct packet));
-    ret.sequence = sequence;
-    ret.checksum = 0;
-    ret.checksum = in_cksum((unsigned short *)&ret, sizeof(struct packet));
-
-    return ret;
+off_t pkt_offset(uint64_t sequence, uint32_t size) {
+    return (off_t)sequence * size;
 }
-
-struct packet rejpkt(uint32_t sequence) {
-    struct packet ret = { 0 };
-    memset(&ret, PKT_TYPE_REJ, sizeof(struct packet));
-    ret.sequence = sequence;
-    ret.checksum = 0;
-    ret.checksum = in_cksum((unsigned short *)&ret, sizeof(struct packet));
-
-    return ret;
-}
\ No newline at end of file
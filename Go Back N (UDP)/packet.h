@@ -2,6 +2,7 @@
 #define PACKET_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #define PKT_TYPE_CXN  0xFF // Connection request
 #define PKT_TYPE_CXN2 0xEE // Connection request stage 2
@@ -11,29 +12,89 @@
 #define PKT_TYPE_FLN  0x33 // Filename
 #define PKT_TYPE_DAT  0xBB // Data
 #define PKT_TYPE_WIN  0xCC // Window size
+#define PKT_TYPE_PRB  0x66 // Path MTU probe
+#define PKT_TYPE_MTU  0x77 // Path MTU probe reply
+#define PKT_TYPE_FEC  0x44 // Forward error correction group size
+#define PKT_TYPE_PAR  0x22 // Parity over a group of data packets
+#define PKT_TYPE_HSH  0x11 // Whole-file hash, sent after the last data
+#define PKT_TYPE_ANN  0x88 // Multicast sender announcement
+#define PKT_TYPE_JON  0x3C // Multicast receiver joining
+#define PKT_TYPE_NAK  0x5A // Multicast repair request, echoed by the sender
+#define PKT_TYPE_FIN  0xC3 // Multicast receiver has the whole file
+#define PKT_TYPE_PTH  0x69 // Challenge to a client seen at a new address
 
-#define PKT_DMAX 1400
+/* a window size packet carries the ARQ policy's ID (see Arq.h) in its top
+   byte, so both ends are sure to agree on it.  Zero means go-back-n. */
+#define PKT_WIN_ARQSHIFT 24
+#define PKT_WIN_SIZEMASK 0xFFFFFF
+
+#define PKT_HDRSZ 19         // Bytes preceding the data field
+#define PKT_DMAX 1400        // Payload that always fits an Ethernet frame
+#define PKT_DMAX_JUMBO 8953  // Payload that fits a 9000-byte jumbo frame
+#define PKT_DMAX_LIMIT 65488 // Largest payload a single UDP datagram holds
 #define PKT_TRNSMAX 10
 
+/* Header integers go on the wire little-endian.  In C++ the fields convert
+   to and from host integers by themselves (see ByteOrder.h); C code reads
+   them with le32toh() and friends.  The checksum is whatever in_cksum
+   computes, stored as it returns it. */
+#ifdef __cplusplus
+extern "C++" {
+    #include "ByteOrder.h"
+}
+typedef LittleEndian<uint32_t> pkt_le32;
+typedef LittleEndian<uint64_t> pkt_le64;
+#else
+typedef uint32_t pkt_le32;
+typedef uint64_t pkt_le64;
+#endif
+
 #pragma pack(push, 1)
 struct packet {
     uint8_t type;
-    uint32_t sequence;
+    pkt_le64 sequence; // 64 bits so long transfers never wrap
     uint16_t checksum;
-    uint16_t size;
-    uint8_t data[PKT_DMAX];
+    pkt_le32 size;     // Payload length, or a negotiated value for control
+                       // packets.  Wide enough for large windows.
+    pkt_le32 connection; // Session a client's packet belongs to; see below
+    uint8_t data[PKT_DMAX_LIMIT];
+};
+
+/* leads the payload of a parity packet.  Parity packet j of a group covers
+   every data packet whose index i within the group has i % count == j, and
+   carries the XOR of their sizes and of their zero-padded payloads. */
+struct fechdr {
+    uint8_t index;
+    uint8_t count;
+    pkt_le32 sizes;
 };
 #pragma pack(pop)
 
-const char *pkttypestr(uint8_t type);
+#define PKT_FECSZ sizeof(struct fechdr)
+
+/* every session shares the server's one port.  The server answers a
+   connection request (CXN) with a cookie in its size field, keeping no
+   state; the client sends it back in CXN2's, proving it can be reached at
+   its address.  Only then does the server set up a session, naming its
+   connection ID in its answer's connection field.  The client puts the ID
+   in everything it sends from then on, so the server can route packets by
+   it whatever address they come from.  Zero means no session: the
+   handshake itself, the server's other packets, and multicast. */
 
-/* returns a retransmission packet */
-struct packet retransmitpkt(uint32_t sequence);
+/* a NAK's payload is a bitmap of missing packets: bit i, least significant
+   first, stands for the NAK's sequence plus i */
+#define PKT_NAK_MISSING(pkt, i) ((pkt)->data[(i) / 8] >> ((i) % 8) & 1)
+
+const char *pkttypestr(uint8_t type);
 
-/* returns an acknowledgment packet */
-struct packet ackpkt(const struct packet *src);
+/* returns the number of bytes of a packet that go on the wire.  Only data,
+   parity, hash, file name, probe and NAK packets carry a payload; everything
+   else is sent as a bare header. */
+int pktlen(const struct packet *pkt);
 
-struct packet rrpkt(uint32_t sequence);
-struct packet rejpkt(uint32_t sequence);
+/* returns where data packet sequence starts in the file, for a payload size
+   of size.  The sequence is widened before multiplying, so the offset
+   doesn't wrap past 4 GiB. */
+off_t pkt_offset(uint64_t sequence, uint32_t size);
 
 #endif
@@ -0,0 +1,310 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+#define PREFETCH_ALIGN 64 // Each chunk buffer starts on a cache line
+
+/* A chunk that's been read.  Only the reader writes one, and only before
+   it moves tail past it. */
+struct prefetch_slot {
+    void *buf;
+    ssize_t len;
+    int err;
+};
+
+/* Everything from head on is guarded by lock.  Neither side holds it while
+   reading or sending, and neither signals unless the other is asleep, so
+   when nobody waits a chunk costs two uncontended locks.  A reader that ran
+   out of room sleeps until it can refill half the ring, so it isn't woken
+   for every chunk taken; unless the taker is waiting, when one will do. */
+struct prefetch {
+    int fd;
+    size_t chunk;
+    size_t header;
+    unsigned int depth;          /* power of two */
+    struct prefetch_slot *slots;
+    char *pool;                  /* every chunk buffer, in one block */
+    void **spare;                /* buffers nobody's using */
+    unsigned int buffers;
+    pthread_t thread;
+    int running;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;        /* a chunk was read, or the reader quit */
+    pthread_cond_t room;         /* a slot or buffer came free, or stop */
+    uint64_t head;               /* next chunk taken */
+    uint64_t tail;               /* next chunk read */
+    unsigned int spares;
+    int reading;                 /* the reader has a buffer out */
+    int idle;                    /* the reader is waiting on room */
+    int hungry;                  /* the taker is waiting on ready */
+    off_t offset;                /* where the reader starts */
+    int stop;
+    int done;                    /* the reader won't read any more */
+};
+
+static size_t stride(size_t chunk, size_t header) {
+    size_t mask = PREFETCH_ALIGN - 1;
+
+    return (header + chunk + mask) & ~mask;
+}
+
+static unsigned int ring(unsigned int depth) {
+    unsigned int ring = 1;
+
+    while (ring < depth) {
+        ring <<= 1;
+    }
+    return ring;
+}
+
+size_t prefetch_size(size_t chunk, size_t header, unsigned int depth,
+                     unsigned int held) {
+    return ((size_t)ring(depth) + held) * stride(chunk, header);
+}
+
+/* Chunks the reader could read now: free slots it has spares for */
+static unsigned int room(const struct prefetch *pf) {
+    unsigned int slots = pf->depth - (pf->tail - pf->head);
+
+    return slots < pf->spares ? slots : pf->spares;
+}
+
+/* Room a sleeping reader waits for */
+static unsigned int enough(const struct prefetch *pf) {
+    return pf->hungry || pf->depth < 2 ? 1 : pf->depth / 2;
+}
+
+/* Wakes the reader if it's asleep and has room enough; call locked */
+static void wake(struct prefetch *pf) {
+    if (pf->idle && room(pf) >= enough(pf)) {
+        pthread_cond_signal(&pf->room);
+    }
+}
+
+static void *reader(void *arg) {
+    struct prefetch *pf = arg;
+    off_t offset = pf->offset;
+    off_t ahead = pf->depth * pf->chunk;
+    off_t hinted = offset;
+
+    while (1) {
+        struct prefetch_slot *slot;
+        void *buf;
+        ssize_t len;
+        int err = 0;
+
+        pthread_mutex_lock(&pf->lock);
+        if (room(pf) == 0) {
+            pf->idle = 1;
+            while (!pf->stop && room(pf) < enough(pf)) {
+                pthread_cond_wait(&pf->room, &pf->lock);
+            }
+            pf->idle = 0;
+        }
+        if (pf->stop) {
+            pthread_mutex_unlock(&pf->lock);
+            break;
+        }
+        buf = pf->spare[--pf->spares];
+        pf->reading = 1;
+        pthread_mutex_unlock(&pf->lock);
+
+        /* Keep the kernel fetching a ring's worth past what's been read,
+           so the disk works while this thread waits for room */
+        if (offset + ahead > hinted) {
+            posix_fadvise(pf->fd, hinted, offset + 2 * ahead - hinted,
+                          POSIX_FADV_WILLNEED);
+            hinted = offset + 2 * ahead;
+        }
+
+        if ((len = pread(pf->fd, (char *)buf + pf->header, pf->chunk,
+                         offset)) < 0) {
+            err = errno;
+        }
+
+        pthread_mutex_lock(&pf->lock);
+        slot = &pf->slots[pf->tail & (pf->depth - 1)];
+        slot->len = len;
+        slot->err = err;
+        if (len < 0) {
+            pf->spare[pf->spares++] = buf;
+            slot->buf = NULL;
+        } else {
+            slot->buf = buf;
+        }
+        pf->tail++;
+        pf->reading = 0;
+        if (pf->hungry) {
+            pthread_cond_signal(&pf->ready);
+        }
+        pthread_mutex_unlock(&pf->lock);
+
+        /* End of file or an error; either way there's nothing after it */
+        if (len < (ssize_t)pf->chunk) {
+            break;
+        }
+        offset += len;
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    pf->done = 1;
+    pthread_cond_signal(&pf->ready);
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static int start(struct prefetch *pf, off_t offset) {
+    int err;
+
+    pf->offset = offset;
+    pf->stop = 0;
+    pf->done = 0;
+    if ((err = pthread_create(&pf->thread, NULL, reader, pf)) != 0) {
+        pf->done = 1;
+    }
+    pf->running = err == 0;
+    return err;
+}
+
+/* Stops the reader and takes back what it read ahead */
+static void halt(struct prefetch *pf) {
+    if (pf->running) {
+        pthread_mutex_lock(&pf->lock);
+        pf->stop = 1;
+        pthread_cond_signal(&pf->room);
+        pthread_mutex_unlock(&pf->lock);
+        pthread_join(pf->thread, NULL);
+        pf->running = 0;
+    }
+    for (; pf->head < pf->tail; pf->head++) {
+        void *buf = pf->slots[pf->head & (pf->depth - 1)].buf;
+        if (buf != NULL) {
+            pf->spare[pf->spares++] = buf;
+        }
+    }
+}
+
+struct prefetch *prefetch_open(int fd, off_t offset, size_t chunk,
+                               size_t header, unsigned int depth,
+                               unsigned int held) {
+    struct prefetch *pf = calloc(1, sizeof(*pf));
+    size_t each = stride(chunk, header);
+    unsigned int i;
+    int err;
+
+    if (pf == NULL) {
+        return NULL;
+    }
+    pf->fd = fd;
+    pf->chunk = chunk;
+    pf->header = header;
+    pf->depth = ring(depth);
+    pf->buffers = pf->depth + held;
+    pf->slots = calloc(pf->depth, sizeof(*pf->slots));
+    pf->spare = calloc(pf->buffers, sizeof(*pf->spare));
+    if (pf->slots == NULL || pf->spare == NULL ||
+        (err = posix_memalign((void **)&pf->pool, PREFETCH_ALIGN,
+                              pf->buffers * each)) != 0) {
+        err = pf->slots == NULL || pf->spare == NULL ? ENOMEM : err;
+        free(pf->spare);
+        free(pf->slots);
+        free(pf);
+        errno = err;
+        return NULL;
+    }
+    for (i = 0; i < pf->buffers; i++) {
+        pf->spare[i] = pf->pool + (size_t)i * each;
+    }
+    pf->spares = pf->buffers;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->ready, NULL);
+    pthread_cond_init(&pf->room, NULL);
+
+    /* Readahead in the kernel sizes itself by the access pattern */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if ((err = start(pf, offset)) != 0) {
+        prefetch_close(pf);
+        errno = err;
+        return NULL;
+    }
+    return pf;
+}
+
+void *prefetch_take(struct prefetch *pf, ssize_t *len, int wait) {
+    struct prefetch_slot *slot;
+    void *buf;
+
+    pthread_mutex_lock(&pf->lock);
+    while (pf->tail == pf->head) {
+        if (!wait || pf->done) {
+            pthread_mutex_unlock(&pf->lock);
+            *len = 0;
+            return NULL;
+        }
+        /* With nothing read ahead or being read, no spare buffer means
+           the caller has them all, and waiting would never end */
+        if (pf->spares == 0 && !pf->reading) {
+            pthread_mutex_unlock(&pf->lock);
+            *len = -1;
+            errno = ENOBUFS;
+            return NULL;
+        }
+        pf->hungry = 1;
+        wake(pf);
+        pthread_cond_wait(&pf->ready, &pf->lock);
+        pf->hungry = 0;
+    }
+
+    slot = &pf->slots[pf->head & (pf->depth - 1)];
+    buf = slot->buf;
+    *len = slot->len;
+    if (slot->len < 0) {
+        errno = slot->err;
+    }
+    pf->head++;
+    wake(pf);
+    pthread_mutex_unlock(&pf->lock);
+    return buf;
+}
+
+void prefetch_release(struct prefetch *pf, void *chunk) {
+    if (chunk == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pf->lock);
+    pf->spare[pf->spares++] = chunk;
+    wake(pf);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+int prefetch_seek(struct prefetch *pf, off_t offset) {
+    int err;
+
+    halt(pf);
+    if ((err = start(pf, offset)) != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void prefetch_close(struct prefetch *pf) {
+    if (pf == NULL) {
+        return;
+    }
+    halt(pf);
+    pthread_cond_destroy(&pf->room);
+    pthread_cond_destroy(&pf->ready);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf->pool);
+    free(pf->spare);
+    free(pf->slots);
+    free(pf);
+}
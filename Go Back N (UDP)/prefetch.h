@@ -0,0 +1,57 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Reads a file ahead of the sender on a thread of its own, so a slow disk
+   stalls the reader instead of the packets.  Chunks come back in file order
+   through a ring.  Every chunk buffer is allocated when the reader opens,
+   and the caller hands each one back once it's done with it; the reader
+   refills it.  Either side that has to wait for the other sleeps until
+   it's woken, rather than polling. */
+
+struct prefetch;
+
+/** Starts reading.
+ * @param fd file to read; stays open and owned by the caller
+ * @param offset where to start
+ * @param chunk bytes per read
+ * @param header bytes left free in front of each chunk
+ * @param depth chunks to read ahead, rounded up to a power of two
+ * @param held most chunks the caller keeps taken at once
+ * @return the reader, or NULL with errno set
+ */
+struct prefetch *prefetch_open(int fd, off_t offset, size_t chunk,
+                               size_t header, unsigned int depth,
+                               unsigned int held);
+
+/** Bytes of chunk buffers prefetch_open allocates for these arguments */
+size_t prefetch_size(size_t chunk, size_t header, unsigned int depth,
+                     unsigned int held);
+
+/** Takes the next chunk: header + chunk bytes, the caller's until it
+ * releases them.  Reading stops after a short chunk, which marks end of
+ * file.
+ * @param pf the reader
+ * @param len set to the bytes read into the chunk, 0 if nothing was ready
+ *        or there's nothing more, or -1 with errno set if the read failed,
+ *        or ENOBUFS if the caller holds every buffer and still waits
+ * @param wait whether to wait for a chunk that isn't ready yet
+ * @return the chunk, or NULL
+ */
+void *prefetch_take(struct prefetch *pf, ssize_t *len, int wait);
+
+/** Hands a taken chunk back to be read into again.  NULL does nothing. */
+void prefetch_release(struct prefetch *pf, void *chunk);
+
+/** Throws away whatever was read ahead and starts again at offset.  Chunks
+ * already taken stay the caller's to release.
+ * @return 0, or -1 with errno set if the reader couldn't restart
+ */
+int prefetch_seek(struct prefetch *pf, off_t offset);
+
+/** Stops reading and frees every chunk, taken or not */
+void prefetch_close(struct prefetch *pf);
+
+#endif
@@ -0,0 +1,141 @@
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "checksum.h"
+#include "clock.h"
+#include "packet.h"
+
+#define DEFAULT_SOCKETS 64
+#define BURST 32 /* requests sent between checks of the clock */
+
+/* Floods a server with connection requests, for seeing that real clients
+   still get through.  Half are CXNs from many source ports, as if
+   thousands of clients started at once; the rest are CXN2s with made-up
+   cookies, as from someone trying to skip the first step.  Nothing sent
+   here should leave the server holding any state. */
+
+static int g_socks[DEFAULT_SOCKETS * 16];
+
+static void header(struct packet *pkt, uint8_t type, uint64_t sequence,
+                   uint32_t size) {
+    memset(pkt, 0, PKT_HDRSZ);
+    pkt->type = type;
+    pkt->sequence = htole64(sequence);
+    pkt->size = htole32(size);
+    pkt->checksum = in_cksum((unsigned short *)pkt, PKT_HDRSZ);
+}
+
+/* takes whatever the server sent back, so replies don't pile up, and
+   counts it */
+static unsigned long long drain(int sk) {
+    char buf[PKT_HDRSZ];
+    unsigned long long n = 0;
+
+    while (recv(sk, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in to;
+    struct hostent *hp;
+    struct packet cxn;
+    struct packet cxn2;
+    unsigned long long sent = 0, failed = 0, replies = 0;
+    uint64_t start, until, now;
+    double rate;
+    int sockets = DEFAULT_SOCKETS;
+    int i;
+
+    if (argc < 5 || argc > 6) {
+        fprintf(stderr, "usage: %s remote-machine remote-port "
+                "requests-per-second seconds [sockets]\n", argv[0]);
+        fprintf(stderr, "a rate of 0 sends as fast as possible\n");
+        return EXIT_FAILURE;
+    }
+    rate = atof(argv[3]);
+    if (argc > 5) {
+        sockets = atoi(argv[5]);
+    }
+    if (sockets < 1 ||
+        sockets > (int)(sizeof(g_socks) / sizeof(g_socks[0]))) {
+        fprintf(stderr, "sockets must be 1 to %d\n",
+                (int)(sizeof(g_socks) / sizeof(g_socks[0])));
+        return EXIT_FAILURE;
+    }
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(atoi(argv[2]));
+    if ((hp = gethostbyname(argv[1])) == NULL) {
+        fprintf(stderr, "%s: unknown host\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    memcpy(&to.sin_addr, hp->h_addr, hp->h_length);
+
+    /* each socket is another source port, so another client as far as the
+       server can tell */
+    for (i = 0; i < sockets; i++) {
+        if ((g_socks[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            perror("socket");
+            return EXIT_FAILURE;
+        }
+    }
+
+    header(&cxn, PKT_TYPE_CXN, 0, 0);
+    start = clock_usec();
+    until = start + atof(argv[4]) * 1000000;
+    srand48(start);
+
+    for (now = start; now < until; now = clock_usec()) {
+        /* behind schedule sends a burst; ahead of it waits */
+        if (rate > 0 && sent + failed >= (now - start) * rate / 1000000) {
+            usleep(1000);
+            continue;
+        }
+
+        for (i = 0; i < BURST; i++) {
+            int sk = g_socks[(sent + failed) % sockets];
+            const struct packet *pkt = &cxn;
+
+            if ((sent + failed) % 2) {
+                header(&cxn2, PKT_TYPE_CXN2, 1, mrand48());
+                pkt = &cxn2;
+            }
+            if (sendto(sk, pkt, PKT_HDRSZ, 0, (struct sockaddr *)&to,
+                       sizeof(to)) == -1) {
+                failed++;
+            } else {
+                sent++;
+            }
+        }
+
+        for (i = 0; i < sockets; i++) {
+            replies += drain(g_socks[i]);
+        }
+    }
+
+    /* stragglers */
+    usleep(100000);
+    for (i = 0; i < sockets; i++) {
+        replies += drain(g_socks[i]);
+        close(g_socks[i]);
+    }
+
+    now = clock_usec();
+    printf("rcflood stats: sent=%llu failed=%llu replies=%llu elapsed_us=%llu "
+           "rate=%.0f\n", sent, failed, replies,
+           (unsigned long long)(now - start),
+           sent * 1e6 / (now - start));
+    return EXIT_SUCCESS;
+}
@@ -1,10 +1,25 @@
-#include <iostream>
+#include <cerrno>
+#include <coroutine>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
 #include "Client.h"
+#include "Downloader.h"
 #include "Exception.h"
-#include "cpe464.h"
+
+extern "C" {
+    #include "clock.h"
+    #include "impair.h"
+    #include "log.h"
+}
 
 #define NUM_ARGS 8
+#define NUM_ARGS_FEC 10
 #define ARG_FROM 1
 #define ARG_TO 2
 #define ARG_BUFSZ 3
@@ -12,29 +27,215 @@
 #define ARG_WINSZ 5
 #define ARG_REMNAME 6
 #define ARG_REMPORT 7
+#define ARG_FECN 8
+#define ARG_FECK 9
+
+#define MANIFEST_FLAG "-m" // in place of from-remote-file
+#define DEFAULT_CONCURRENCY 32 // Downloads at once from a manifest
+
+/* Batch mode: a manifest of files fetched from one process, a few at a
+   time, each by a coroutine of its own.  A worker takes the next line,
+   waits on its download, reports it and takes another, so there are never
+   more downloads running than workers. */
+
+/** One line of the manifest */
+struct Entry {
+    std::string from;
+    std::string to;
+};
+
+/** What the workers share */
+struct Batch {
+    Downloader loop;
+    Remote server;
+    DownloadOptions options;
+    std::vector<Entry> entries;
+    size_t next;
+    unsigned int failed;
+    uint64_t bytes;
+};
+
+/** A coroutine nobody waits on.  It runs as soon as it's called, until it
+ * first suspends, and frees itself when it returns. */
+struct Worker {
+    struct promise_type {
+        Worker get_return_object() { return Worker(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept {
+            return std::suspend_never();
+        }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/** Starts a download and suspends until the loop reports it finished.
+ * A download that can't start throws from the co_await. */
+struct Fetch {
+    Batch &batch;
+    const Entry &entry;
+    DownloadResult result;
+    
+    Fetch(Batch &b, const Entry &e) : batch(b), entry(e) {}
+    
+    bool await_ready() { return false; }
+    
+    void await_suspend(std::coroutine_handle<> worker) {
+        Remote from = batch.server;
+        from.path = entry.from;
+        batch.loop.Download(from, entry.to, batch.options,
+                            [this, worker](const DownloadResult &r) {
+            result = r;
+            worker.resume();
+        });
+    }
+    
+    DownloadResult await_resume() { return result; }
+};
+
+static Worker work(Batch &batch) {
+    while (batch.next < batch.entries.size()) {
+        const Entry &entry = batch.entries[batch.next++];
+        DownloadResult result;
+        
+        try {
+            result = co_await Fetch(batch, entry);
+        } catch (Exception &e) {
+            result.error = e.What();
+        }
+        
+        if (result.status == 0) {
+            char hex[2 * XXH128_SIZE + 1];
+            
+            xxh128_hex(&result.hash, hex);
+            std::cout << entry.from << " -> " << entry.to << ": "
+                      << result.bytes << " bytes, xxh128 0x" << hex
+                      << std::endl;
+            batch.bytes += result.bytes;
+        } else {
+            std::cerr << entry.from << " -> " << entry.to << ": "
+                      << result.error << std::endl;
+            batch.failed++;
+        }
+    }
+}
+
+/** Reads "from-remote-file to-local-file" lines.  Blank lines and ones
+ * starting with # are skipped. */
+static int readManifest(const char *name, std::vector<Entry> &entries) {
+    std::ifstream in(name);
+    std::string line;
+    unsigned int n = 0;
+    
+    if (!in) {
+        std::cerr << name << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        
+        n++;
+        if (!(fields >> entry.from) || entry.from[0] == '#') {
+            continue;
+        }
+        if (!(fields >> entry.to)) {
+            std::cerr << name << ":" << n << ": no local file" << std::endl;
+            return 1;
+        }
+        entries.push_back(entry);
+    }
+    return 0;
+}
+
+static int runBatch(const char *manifest, const Remote &server,
+                    const DownloadOptions &options) {
+    const char *limit = getenv("RCCONCURRENCY");
+    unsigned int workers = limit != NULL ? atoi(limit) : DEFAULT_CONCURRENCY;
+    uint64_t start = clock_usec();
+    Batch batch;
+    
+    batch.server = server;
+    batch.options = options;
+    batch.next = 0;
+    batch.failed = 0;
+    batch.bytes = 0;
+    if (readManifest(manifest, batch.entries)) {
+        return EXIT_FAILURE;
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    
+    for (unsigned int i = 0; i < workers && i < batch.entries.size(); i++) {
+        work(batch);
+    }
+    batch.loop.Run();
+    
+    // One key=value line, like a single download's
+    std::cout << "rcopy batch stats: files=" << batch.entries.size()
+              << " failed=" << batch.failed << " bytes=" << batch.bytes
+              << " elapsed_us=" << clock_usec() - start
+              << " cpu_us=" << cpu_usec() << std::endl;
+    
+    return batch.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[]) {
     // check arguments
-    if (argc != NUM_ARGS) {
-        std::cerr << "usage: " << argv[0] << "from-remote-file to-local-file "
+    if (argc != NUM_ARGS && argc != NUM_ARGS_FEC) {
+        std::cerr << "usage: " << argv[0] << " from-remote-file to-local-file "
+                     "buffer-size error-percent window-size remote-machine "
+                     "remote-port [fec-group fec-parity]" << std::endl;
+        std::cerr << "       " << argv[0] << " " MANIFEST_FLAG " manifest "
                      "buffer-size error-percent window-size remote-machine "
-                     "remote-port" << std::endl;
+                     "remote-port [fec-group fec-parity]" << std::endl;
+        std::cerr << "A manifest lists from-remote-file to-local-file "
+                     "pairs, one per line, fetched RCCONCURRENCY at a time "
+                     "(default " << DEFAULT_CONCURRENCY << ")" << std::endl;
         return EXIT_FAILURE;
     }
     
     // Initialize errors
-    sendErr_init(atof(argv[ARG_PERR]), DROP_ON, FLIP_ON, DEBUG_ON, RSEED_OFF);
+    impair_config impair;
+    impair_config_env(&impair, atof(argv[ARG_PERR]));
+    impair_init(&impair);
+    
+    // Logging level and rate limits come from the environment
+    log_init();
+    
+    // So does busy polling, for latency inside a rack: how long to spin on
+    // the socket before sleeping
+    const char *busy = getenv("RCBUSY_POLL_US");
+    
+    Remote from;
+    from.host = argv[ARG_REMNAME];
+    from.port = argv[ARG_REMPORT];
+    from.path = argv[ARG_FROM];
+    
+    DownloadOptions options;
+    options.bufferSize = atoi(argv[ARG_BUFSZ]);
+    options.windowSize = atoi(argv[ARG_WINSZ]);
+    if (argc == NUM_ARGS_FEC) {
+        options.fecGroup = atoi(argv[ARG_FECN]);
+        options.fecParity = atoi(argv[ARG_FECK]);
+    }
+    options.busyPollUs = busy != NULL ? atol(busy) : 0;
+    
+    if (strcmp(argv[ARG_FROM], MANIFEST_FLAG) == 0) {
+        return runBatch(argv[ARG_TO], from, options);
+    }
     
     // Create client
     try {
-        Client rcopy(argv[ARG_FROM], argv[ARG_TO], atoi(argv[ARG_BUFSZ]),
-                     atof(argv[ARG_PERR]),atoi(argv[ARG_WINSZ]),
-                     argv[ARG_REMNAME], argv[ARG_REMPORT]);
-        rcopy.Run();
+        Client rcopy(from, argv[ARG_TO], options);
+        if (rcopy.Run()) {
+            return EXIT_FAILURE;
+        }
     } catch (Exception &e) {
         std::cerr << e.What() << std::endl;
         return EXIT_FAILURE;
     }
-
+    
     return EXIT_SUCCESS;
 }
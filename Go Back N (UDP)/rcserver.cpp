@@ -3,7 +3,30 @@
 
 #include "Server.h"
 #include "Exception.h"
-#include "cpe464.h"
+
+extern "C" {
+    #include "impair.h"
+    #include "log.h"
+}
+
+/* Megabytes from the environment, or def if they're unset, unparsable or
+   not positive */
+static uint64_t env_mb(const char *name, uint64_t def) {
+    const char *v = getenv(name);
+    char *end;
+    long long mb;
+    
+    if (v == NULL || *v == '\0') {
+        return def;
+    }
+    mb = strtoll(v, &end, 10);
+    if (*end != '\0' || mb <= 0 || mb > (long long)(UINT64_MAX >> 21)) {
+        std::cerr << name << "=" << v << " isn't a size in megabytes.  "
+                     "Using " << (def >> 20) << "." << std::endl;
+        return def;
+    }
+    return (uint64_t)mb << 20;
+}
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
@@ -12,10 +35,24 @@ int main(int argc, char *argv[]) {
     }
     
     // Initialize errors
-    sendErr_init(atof(argv[1]), DROP_ON, FLIP_ON, DEBUG_ON, RSEED_OFF);
+    impair_config impair;
+    impair_config_env(&impair, atof(argv[1]));
+    impair_init(&impair);
+    
+    // Logging level and rate limits come from the environment
+    log_init();
+    
+    // So does busy polling, for latency inside a rack: how long each
+    // session spins on its socket before sleeping
+    const char *busy = getenv("RCBUSY_POLL_US");
+    
+    // And how much memory windows may take, all together and each
+    uint64_t pool = env_mb("RCWINDOW_POOL_MB", WINDOW_POOL_BYTES);
+    uint64_t session = env_mb("RCWINDOW_SESSION_MB", WINDOW_SESSION_BYTES);
     
     try {
-        Server server(atof(argv[1]));
+        Server server(atof(argv[1]), busy != NULL ? atol(busy) : 0, pool,
+                      session);
         if (server.Run()) {
             return EXIT_FAILURE;
         }
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "stats.h"
+
+#define DEFAULT_INTERVAL 1.0
+
+/* what a slot looked like at the previous refresh, for rates */
+struct previous {
+    uint32_t pid;
+    uint64_t start_us;
+    uint64_t bytes;
+    uint64_t acked;
+    uint64_t update_us;
+};
+
+static struct previous g_prev[STATS_SLOTS];
+
+static double rate(uint64_t now, uint64_t then, uint64_t dt_us) {
+    return dt_us > 0 && now >= then ? (double)(now - then) / dt_us : 0;
+}
+
+static void refresh(const struct stats_segment *seg, int clear) {
+    uint64_t now = clock_usec();
+    double total_send = 0, total_good = 0;
+    uint64_t packets = 0, retransmits = 0;
+    uint64_t cuts = __atomic_load_n(&seg->pool_cuts, __ATOMIC_RELAXED);
+    int sessions = 0;
+    unsigned int i;
+    char lines[STATS_SLOTS][160];
+
+    for (i = 0; i < STATS_SLOTS; i++) {
+        struct stats_slot slot;
+        struct previous *prev = &g_prev[i];
+        double send = 0, good;
+
+        lines[i][0] = '\0';
+        if (!stats_read(&seg->slot[i], &slot)) {
+            prev->pid = 0;
+            continue;
+        }
+
+        /* rates since the last refresh if we saw this session then, and
+           the session's averages otherwise */
+        if (prev->pid == slot.pid && prev->start_us == slot.start_us) {
+            uint64_t dt = slot.update_us - prev->update_us;
+            send = rate(slot.s.bytes, prev->bytes, dt);
+            good = rate(slot.s.acked, prev->acked, dt);
+        } else {
+            uint64_t dt = slot.update_us - slot.start_us;
+            send = rate(slot.s.bytes, 0, dt);
+            good = slot.s.goodput_bps / 1e6;
+        }
+        prev->pid = slot.pid;
+        prev->start_us = slot.start_us;
+        prev->bytes = slot.s.bytes;
+        prev->acked = slot.s.acked;
+        prev->update_us = slot.update_us;
+
+        sessions++;
+        total_send += send;
+        total_good += good;
+        packets += slot.s.packets;
+        retransmits += slot.s.retransmits;
+
+        snprintf(lines[i], sizeof(lines[i]),
+                 "%7u %-21.21s %-16.16s %9.2f %9.2f %9.2f %7llu %6llu %5llu "
+                 "%8.2f %4llu/%-4llu %6.1f",
+                 slot.pid, slot.peer, slot.file, slot.s.acked / 1e6,
+                 send, good, (unsigned long long)slot.s.retransmits,
+                 (unsigned long long)slot.s.rejs,
+                 (unsigned long long)slot.s.timeouts, slot.s.srtt_us / 1e3,
+                 (unsigned long long)slot.s.window,
+                 (unsigned long long)slot.s.window_max,
+                 (now - slot.start_us) / 1e6);
+    }
+
+    if (clear) {
+        printf("\033[H\033[2J");
+    }
+    printf("rcstat - %d session%s, send %.2f MB/s, goodput %.2f MB/s, "
+           "retransmitted %.2f%%\n", sessions, sessions == 1 ? "" : "s",
+           total_send, total_good,
+           packets > 0 ? 100.0 * retransmits / packets : 0.0);
+    printf("window pool %.2f of %.2f MB, %llu window%s cut\n\n",
+           __atomic_load_n(&seg->pool_used, __ATOMIC_RELAXED) / 1e6,
+           __atomic_load_n(&seg->pool_limit, __ATOMIC_RELAXED) / 1e6,
+           (unsigned long long)cuts, cuts == 1 ? "" : "s");
+    printf("%7s %-21s %-16s %9s %9s %9s %7s %6s %5s %8s %9s %6s\n",
+           "PID", "PEER", "FILE", "ACKED MB", "SEND MB/s", "GOOD MB/s",
+           "RETRANS", "REJS", "TMOS", "SRTT ms", "WINDOW", "AGE s");
+    for (i = 0; i < STATS_SLOTS; i++) {
+        if (lines[i][0] != '\0') {
+            printf("%s\n", lines[i]);
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    const struct stats_segment *seg;
+    double interval = DEFAULT_INTERVAL;
+    int count = 0;
+    int n;
+
+    if (argc > 3) {
+        fprintf(stderr, "usage: %s [interval-seconds] [count]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 1) {
+        interval = atof(argv[1]);
+    }
+    if (argc > 2) {
+        count = atoi(argv[2]);
+    }
+
+    if ((seg = stats_attach(0)) == NULL) {
+        fprintf(stderr, "No statistics segment.  Is the server running?\n");
+        return EXIT_FAILURE;
+    }
+
+    /* like top: redraw in place on a terminal, append otherwise */
+    for (n = 0; count == 0 || n < count; n++) {
+        if (n > 0) {
+            usleep(interval * 1000000);
+        }
+        refresh(seg, isatty(STDOUT_FILENO));
+    }
+
+    return EXIT_SUCCESS;
+}
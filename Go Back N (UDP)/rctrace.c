@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet.h"
+#include "trace.h"
+
+/* Converts binary traces from a TRACE build into the Chrome trace event
+   JSON that chrome://tracing and ui.perfetto.dev load.  Give it every file
+   from one transfer (the rcopy one and the server child's) to see both ends
+   on one timeline. */
+
+static const char *typestr(uint8_t type) {
+    switch (type) {
+    case TRACE_SEND:
+        return "send";
+    case TRACE_RECV:
+        return "recv";
+    case TRACE_RR:
+        return "RR";
+    case TRACE_REJ:
+        return "REJ";
+    case TRACE_TIMEOUT:
+        return "timeout";
+    case TRACE_BADCK:
+        return "bad checksum";
+    case TRACE_SLIDE:
+        return "window slide";
+    default:
+        return "unknown";
+    }
+}
+
+static int first = 1;
+
+static void separator(void) {
+    printf(first ? "\n  " : ",\n  ");
+    first = 0;
+}
+
+static int dump(const char *path) {
+    struct trace_file hdr;
+    struct trace_rec rec;
+    FILE *f;
+    uint64_t i;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        hdr.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(f);
+        return 1;
+    }
+    hdr.role[sizeof(hdr.role) - 1] = '\0';
+    if (hdr.lost > 0) {
+        fprintf(stderr, "%s: %llu older events were overwritten\n", path,
+                (unsigned long long)hdr.lost);
+    }
+
+    separator();
+    printf("{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %u, "
+           "\"args\": {\"name\": \"%s %u\"}}", hdr.pid, hdr.role, hdr.pid);
+
+    for (i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, f) == 1; i++) {
+        double ts = rec.ns / 1000.0;
+
+        separator();
+        switch (rec.type) {
+        case TRACE_SEND:
+        case TRACE_RECV:
+            printf("{\"name\": \"%s %s\", \"ph\": \"i\", \"s\": \"t\", "
+                   "\"ts\": %.3f, \"pid\": %u, \"tid\": %u, "
+                   "\"args\": {\"seq\": %llu}}", typestr(rec.type),
+                   pkttypestr(rec.arg), ts, hdr.pid, hdr.pid,
+                   (unsigned long long)rec.sequence);
+            break;
+        case TRACE_SLIDE:
+            // A counter track shows the window base climbing over time
+            printf("{\"name\": \"window base\", \"ph\": \"C\", \"ts\": %.3f, "
+                   "\"pid\": %u, \"args\": {\"seq\": %llu}}", ts, hdr.pid,
+                   (unsigned long long)rec.sequence);
+            break;
+        default:
+            printf("{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"p\", "
+                   "\"ts\": %.3f, \"pid\": %u, \"tid\": %u, "
+                   "\"args\": {\"seq\": %llu, \"arg\": %u}}",
+                   typestr(rec.type), ts, hdr.pid, hdr.pid,
+                   (unsigned long long)rec.sequence, rec.arg);
+            break;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int err = 0;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace-file... > trace.json\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (i = 1; i < argc; i++) {
+        err |= dump(argv[i]);
+    }
+    printf("\n]}\n");
+
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
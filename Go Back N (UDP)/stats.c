@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "clock.h"
+#include "stats.h"
+
+#define STATS_READ_TRIES 100
+
+static struct stats_segment *g_segment = NULL;
+
+struct stats_segment *stats_attach(int create) {
+    const char *name = getenv("RCSTAT_SHM");
+    struct stats_segment *seg;
+    int fd;
+
+    if (g_segment != NULL) {
+        return g_segment;
+    }
+    if (name == NULL || *name == '\0') {
+        name = STATS_SHM;
+    }
+
+    if ((fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDONLY,
+                       0644)) == -1) {
+        return NULL;
+    }
+    if (create && ftruncate(fd, sizeof(*seg)) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    seg = (struct stats_segment *)mmap(NULL, sizeof(*seg),
+                                       create ? PROT_READ | PROT_WRITE
+                                              : PROT_READ,
+                                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* A fresh segment is zero-filled; stamp it so readers know it's ours.
+       One left by an older server is laid out differently, so start it
+       over. */
+    if (create && (seg->magic != STATS_MAGIC ||
+                   seg->version != STATS_VERSION)) {
+        memset(seg, 0, sizeof(*seg));
+        seg->version = STATS_VERSION;
+        seg->slots = STATS_SLOTS;
+        __atomic_store_n(&seg->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        seg->version != STATS_VERSION) {
+        munmap(seg, sizeof(*seg));
+        return NULL;
+    }
+
+    g_segment = seg;
+    return seg;
+}
+
+static void write_begin(struct stats_slot *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct stats_slot *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int claim(struct stats_slot *slot, uint32_t pid) {
+    uint32_t old = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+
+    /* Take over slots whose owner died without closing them */
+    if (old != 0 && (kill(old, 0) == 0 || errno != ESRCH)) {
+        return 0;
+    }
+    return __atomic_compare_exchange_n(&slot->pid, &old, pid, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+struct stats_slot *stats_open(const char *peer, const char *file) {
+    uint32_t pid = getpid();
+    unsigned int i;
+
+    if (g_segment == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < STATS_SLOTS; i++) {
+        struct stats_slot *slot = &g_segment->slot[i];
+        if (!claim(slot, pid)) {
+            continue;
+        }
+
+        /* A reclaimed slot may have died mid-write; start from even */
+        slot->seq &= ~1u;
+        write_begin(slot);
+        slot->start_us = slot->update_us = clock_usec();
+        strncpy(slot->peer, peer, STATS_NAMELEN - 1);
+        slot->peer[STATS_NAMELEN - 1] = '\0';
+        strncpy(slot->file, file, STATS_NAMELEN - 1);
+        slot->file[STATS_NAMELEN - 1] = '\0';
+        memset(&slot->s, 0, sizeof(slot->s));
+        write_end(slot);
+        return slot;
+    }
+
+    return NULL;
+}
+
+void stats_publish(struct stats_slot *slot, const struct stats_session *s) {
+    uint64_t now = clock_usec();
+
+    if (slot == NULL) {
+        return;
+    }
+
+    write_begin(slot);
+    slot->s = *s;
+    slot->update_us = now;
+    if (now > slot->start_us) {
+        slot->s.goodput_bps = s->acked * 1000000 / (now - slot->start_us);
+    }
+    write_end(slot);
+}
+
+void stats_close(struct stats_slot *slot) {
+    if (slot != NULL) {
+        __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void stats_pool(uint64_t limit, uint64_t used, uint64_t cuts) {
+    if (g_segment == NULL) {
+        return;
+    }
+
+    /* Each is read on its own, so no seq is needed */
+    __atomic_store_n(&g_segment->pool_limit, limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_segment->pool_used, used, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_segment->pool_cuts, cuts, __ATOMIC_RELAXED);
+}
+
+int stats_read(const struct stats_slot *slot, struct stats_slot *out) {
+    int tries;
+
+    memset(out, 0, sizeof(*out));
+    for (tries = 0; tries < STATS_READ_TRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    return out->pid != 0;
+}
+
+void stats_hist_add(struct stats_hist *h, uint64_t value) {
+    unsigned int i = value;
+
+    /* Past the exact buckets, the top STATS_HIST_BITS + 1 bits pick one */
+    if (value >= (1u << STATS_HIST_BITS)) {
+        unsigned int top = 63 - __builtin_clzll(value);
+        unsigned int shift = top - STATS_HIST_BITS;
+        i = ((shift + 1) << STATS_HIST_BITS) +
+            ((value >> shift) & ((1u << STATS_HIST_BITS) - 1));
+    }
+    h->bucket[i]++;
+    h->count++;
+}
+
+uint64_t stats_hist_quantile(const struct stats_hist *h, double q) {
+    uint64_t want = q * h->count + 0.5;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    if (want == 0) {
+        want = 1;
+    }
+    for (i = 0; i < sizeof(h->bucket) / sizeof(h->bucket[0]); i++) {
+        unsigned int shift;
+        uint64_t low;
+
+        if ((seen += h->bucket[i]) < want) {
+            continue;
+        }
+        if (i < (1u << STATS_HIST_BITS)) {
+            return i;
+        }
+        shift = (i >> STATS_HIST_BITS) - 1;
+        low = (uint64_t)((1u << STATS_HIST_BITS) +
+                         (i & ((1u << STATS_HIST_BITS) - 1))) << shift;
+        return low + ((uint64_t)1 << shift) / 2;
+    }
+
+    return 0;
+}
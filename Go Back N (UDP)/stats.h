@@ -0,0 +1,98 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#define STATS_SHM "/rcstat"   // Default segment name; RCSTAT_SHM overrides
+#define STATS_MAGIC 0x72637374
+#define STATS_VERSION 2
+#define STATS_SLOTS 128       // Most sessions shown at once
+#define STATS_NAMELEN 64
+#define STATS_HIST_BITS 4     // Histogram buckets per power of two, as bits
+
+/** Counters a session publishes.  The session keeps its own copy up to date
+ * and copies it into its slot with stats_publish(). */
+struct stats_session {
+    uint64_t bytes;       /* bytes put on the wire, headers included */
+    uint64_t packets;     /* datagrams sent */
+    uint64_t retransmits; /* data packets sent more than once */
+    uint64_t rejs;        /* REJs received */
+    uint64_t timeouts;    /* receive timeouts */
+    uint64_t acked;       /* payload bytes the peer has acknowledged */
+    uint64_t srtt_us;     /* smoothed round trip time */
+    uint64_t window;      /* packets currently in flight */
+    uint64_t window_max;  /* negotiated window */
+    uint64_t goodput_bps; /* acknowledged payload per second since start */
+};
+
+/** One session's place in the segment.  A slot is claimed by swapping its
+ * pid from zero, and only that session writes it after that.  seq is odd
+ * while a write is under way, so readers can retry instead of locking. */
+struct stats_slot {
+    uint32_t pid;
+    uint32_t seq;
+    uint64_t start_us;    /* CLOCK_MONOTONIC, like clock_usec() */
+    uint64_t update_us;
+    char peer[STATS_NAMELEN];
+    char file[STATS_NAMELEN];
+    struct stats_session s;
+} __attribute__((aligned(64)));
+
+struct stats_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    /* The server's pool of window memory, published by the listener */
+    uint64_t pool_limit;
+    uint64_t pool_used;
+    uint64_t pool_cuts;   /* windows cut short by a full pool */
+    struct stats_slot slot[STATS_SLOTS];
+};
+
+/** A distribution of latencies in constant space.  Values below
+ * 2^STATS_HIST_BITS get a bucket each.  Every power of two above that is
+ * split into 2^STATS_HIST_BITS buckets, so a quantile is off by at most
+ * that fraction of itself.  It's kept by the session, not in the segment. */
+struct stats_hist {
+    uint64_t count;
+    uint32_t bucket[(65 - STATS_HIST_BITS) << STATS_HIST_BITS];
+};
+
+/** Maps the segment, creating it if needed.  Forked children share the
+ * parent's mapping, so servers call this once before forking.
+ * @param create nonzero to create the segment if it doesn't exist
+ * @return the segment, or NULL if it couldn't be mapped
+ */
+struct stats_segment *stats_attach(int create);
+
+/** Claims a free slot for a new session.  Slots left behind by processes
+ * that died without closing them are reclaimed.
+ * @return the slot, or NULL if the segment isn't mapped or is full
+ */
+struct stats_slot *stats_open(const char *peer, const char *file);
+
+/** Copies a session's counters into its slot, computing goodput. */
+void stats_publish(struct stats_slot *slot, const struct stats_session *s);
+
+/** Gives a slot back. */
+void stats_close(struct stats_slot *slot);
+
+/** Publishes the window pool's limit, use and cuts, all in bytes but the
+ * cuts. */
+void stats_pool(uint64_t limit, uint64_t used, uint64_t cuts);
+
+/** Counts a sample.  Zero the histogram before the first. */
+void stats_hist_add(struct stats_hist *h, uint64_t value);
+
+/** Estimates a quantile, the middle of the bucket it falls in.
+ * @param q 0 to 1, e.g. 0.99 for the 99th percentile
+ * @return the estimate, or 0 if there are no samples
+ */
+uint64_t stats_hist_quantile(const struct stats_hist *h, double q);
+
+/** Takes a consistent copy of a slot.
+ * @return nonzero if the slot is in use
+ */
+int stats_read(const struct stats_slot *slot, struct stats_slot *out);
+
+#endif
@@ -0,0 +1,55 @@
+#include "trace.h"
+
+#ifdef TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct trace_ring g_trace;
+
+static char g_role[16];
+
+void trace_begin(const char *role) {
+    g_trace.head = 0;
+    strncpy(g_role, role, sizeof(g_role) - 1);
+}
+
+void trace_end(void) {
+    const char *dir = getenv("RCTRACE_DIR");
+    struct trace_file hdr;
+    char path[256];
+    uint64_t first;
+    uint64_t i;
+    FILE *f;
+
+    if (dir == NULL || *dir == '\0') {
+        dir = ".";
+    }
+    snprintf(path, sizeof(path), "%s/rctrace.%d.bin", dir, (int)getpid());
+    if ((f = fopen(path, "wb")) == NULL) {
+        perror(path);
+        return;
+    }
+
+    /* Oldest surviving event first */
+    first = g_trace.head > TRACE_EVENTS ? g_trace.head - TRACE_EVENTS : 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.pid = getpid();
+    hdr.count = g_trace.head - first;
+    hdr.lost = first;
+    memcpy(hdr.role, g_role, sizeof(hdr.role));
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (i = first; i < g_trace.head; i++) {
+        fwrite(&g_trace.rec[i & (TRACE_EVENTS - 1)], sizeof(struct trace_rec),
+               1, f);
+    }
+    fclose(f);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_MAGIC "RCTRACE"
+#define TRACE_VERSION 1
+
+/** What happened.  Send and receive carry the packet type in arg; a window
+ * slide carries the number of packets it moved over. */
+enum trace_type {
+    TRACE_SEND = 1,
+    TRACE_RECV,
+    TRACE_RR,
+    TRACE_REJ,
+    TRACE_TIMEOUT,
+    TRACE_BADCK,
+    TRACE_SLIDE
+};
+
+/** One event, 24 bytes on disk and in memory */
+struct trace_rec {
+    uint64_t ns;        /* CLOCK_MONOTONIC */
+    uint64_t sequence;
+    uint32_t arg;
+    uint8_t type;
+    uint8_t pad[3];
+};
+
+/** Start of a trace file.  The events follow, oldest first. */
+struct trace_file {
+    char magic[8];
+    uint32_t version;
+    uint32_t pid;
+    uint64_t count;     /* events in the file */
+    uint64_t lost;      /* older events overwritten in the ring */
+    char role[16];
+};
+
+#ifdef TRACE
+
+#define TRACE_EVENTS (1 << 16) // Ring size; must be a power of two
+
+struct trace_ring {
+    uint64_t head;
+    struct trace_rec rec[TRACE_EVENTS];
+};
+
+extern struct trace_ring g_trace;
+
+/** Records an event.  Inline so the hot path pays for a clock read and a
+ * few stores, and nothing else. */
+static inline void trace_event(uint8_t type, uint64_t sequence, uint32_t arg) {
+    struct trace_rec *r = &g_trace.rec[g_trace.head++ & (TRACE_EVENTS - 1)];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->sequence = sequence;
+    r->arg = arg;
+    r->type = type;
+}
+
+/** Empties the ring for a new session */
+void trace_begin(const char *role);
+
+/** Writes the ring to rctrace.<pid>.bin in $RCTRACE_DIR (default: the
+ * working directory) */
+void trace_end(void);
+
+#define TRACE_EVENT(type, sequence, arg) trace_event(type, sequence, arg)
+#define TRACE_BEGIN(role) trace_begin(role)
+#define TRACE_END() trace_end()
+
+#else
+
+/* Tracing is compiled out; the arguments aren't even evaluated */
+#define TRACE_EVENT(type, sequence, arg) ((void)0)
+#define TRACE_BEGIN(role) ((void)0)
+#define TRACE_END() ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,164 @@
+#include <string.h>
+
+#include "wheel.h"
+
+#define MASK (WHEEL_SLOTS - 1)
+#define SHIFT(level) (WHEEL_BITS * (level))
+#define SPAN(level) ((uint64_t)1 << SHIFT(level)) /* ticks per slot */
+
+static uint64_t rotr(uint64_t x, unsigned int n) {
+    n &= 63;
+    return n == 0 ? x : (x >> n) | (x << (64 - n));
+}
+
+/* Files a timer by how far off it is: the lowest level whose slots, counted
+   from now, reach that far */
+static void link_timer(struct wheel *w, struct wheel_timer *t) {
+    uint64_t expires = t->expires < w->now ? w->now : t->expires;
+    unsigned int level = 0;
+    unsigned int slot;
+    struct wheel_timer **head;
+
+    if (expires - w->now >= SPAN(WHEEL_LEVELS)) {
+        /* Past the top.  It comes back down when the wheel gets there, and
+           is filed again by its real expiry. */
+        expires = w->now + SPAN(WHEEL_LEVELS) - 1;
+    }
+    while (level < WHEEL_LEVELS - 1 && expires - w->now >= SPAN(level + 1)) {
+        level++;
+    }
+    slot = (expires >> SHIFT(level)) & MASK;
+
+    head = &w->slots[level][slot];
+    t->next = *head;
+    t->pprev = head;
+    if (*head != NULL) {
+        (*head)->pprev = &t->next;
+    }
+    *head = t;
+    t->slot = level * WHEEL_SLOTS + slot;
+    w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void unlink_timer(struct wheel *w, struct wheel_timer *t) {
+    unsigned int level = t->slot / WHEEL_SLOTS;
+    unsigned int slot = t->slot % WHEEL_SLOTS;
+
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    if (w->slots[level][slot] == NULL) {
+        w->occupied[level] &= ~((uint64_t)1 << slot);
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* The wheel has just come round to a multiple of 64 ticks.  Each level's
+   current slot is now close enough to spread over the ones below it.  A
+   level only turns when the level below it has wrapped. */
+static void cascade(struct wheel *w) {
+    unsigned int level;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        unsigned int slot = (w->now >> SHIFT(level)) & MASK;
+        struct wheel_timer *t = w->slots[level][slot];
+
+        w->slots[level][slot] = NULL;
+        w->occupied[level] &= ~((uint64_t)1 << slot);
+        while (t != NULL) {
+            struct wheel_timer *next = t->next;
+            link_timer(w, t);
+            t = next;
+        }
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+void wheel_init(struct wheel *w, uint64_t now_us, uint64_t tick_us) {
+    memset(w, 0, sizeof(*w));
+    w->tick_us = tick_us > 0 ? tick_us : 1;
+    w->now = now_us / w->tick_us;
+}
+
+void wheel_schedule(struct wheel *w, struct wheel_timer *t, uint64_t at_us) {
+    if (t->pprev != NULL) {
+        unlink_timer(w, t);
+    }
+    /* Rounded up, so it never fires early */
+    t->expires = (at_us + w->tick_us - 1) / w->tick_us;
+    link_timer(w, t);
+}
+
+void wheel_cancel(struct wheel *w, struct wheel_timer *t) {
+    if (t->pprev != NULL) {
+        unlink_timer(w, t);
+    }
+}
+
+struct wheel_timer *wheel_expire(struct wheel *w, uint64_t now_us) {
+    uint64_t target = now_us / w->tick_us;
+
+    for (;;) {
+        struct wheel_timer *t = w->slots[0][w->now & MASK];
+        uint64_t later;
+        uint64_t next;
+
+        if (t != NULL) {
+            unlink_timer(w, t);
+            return t;
+        }
+        if (w->now >= target) {
+            return NULL;
+        }
+
+        /* Skip the empty ticks, to the next timer in this turn of level
+           0 or the start of the next turn, whichever's first */
+        next = (w->now | MASK) + 1;
+        later = w->occupied[0] & ~(((uint64_t)2 << (w->now & MASK)) - 1);
+        if (later != 0) {
+            next = (w->now & ~(uint64_t)MASK) + __builtin_ctzll(later);
+        }
+        if (next > target) {
+            w->now = target;
+            continue;
+        }
+        w->now = next;
+        if ((next & MASK) == 0) {
+            cascade(w);
+        }
+    }
+}
+
+uint64_t wheel_next(const struct wheel *w) {
+    uint64_t best = UINT64_MAX;
+    unsigned int level;
+
+    /* Level 0 holds the next 64 ticks, each in the slot for its tick */
+    if (w->occupied[0] != 0) {
+        best = w->now + __builtin_ctzll(rotr(w->occupied[0], w->now & MASK));
+    }
+
+    /* Above that, a slot's timers are due no sooner than the wheel comes
+       round to it.  The current slot has been taken already, so a timer
+       in it waits a whole turn. */
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        uint64_t turn = w->now >> SHIFT(level);
+        uint64_t tick;
+
+        if (w->occupied[level] == 0) {
+            continue;
+        }
+        turn += 1 + __builtin_ctzll(rotr(w->occupied[level],
+                                         (turn & MASK) + 1));
+        tick = turn << SHIFT(level);
+        if (tick < best) {
+            best = tick;
+        }
+    }
+
+    return best == UINT64_MAX ? UINT64_MAX : best * w->tick_us;
+}
@@ -0,0 +1,66 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+/* A hierarchical timer wheel (Varghese and Lauck).  There are four levels
+   of 64 slots.  A level-0 slot is one tick wide, and each level above is
+   64 times coarser.  A timer sits in the slot its expiry falls in.  Each
+   time the wheel comes round to that slot, the timer drops a level.  So
+   scheduling, cancelling and firing cost the same however many timers are
+   pending.  The wheel reads no clock and never waits: the owner passes
+   the time in and sleeps until wheel_next() itself, in poll(2) or on a
+   timerfd. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 2^24 ticks ahead; anything later waits at the top
+
+/** A timer, embedded wherever its owner likes.  A zeroed one isn't
+ * pending. */
+struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev; /* NULL unless pending */
+    uint64_t expires;           /* tick it fires on */
+    unsigned int slot;          /* level * WHEEL_SLOTS + slot */
+};
+
+struct wheel {
+    struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS]; /* a bit per nonempty slot */
+    uint64_t now;                    /* tick being run */
+    uint64_t tick_us;
+};
+
+/** Empties the wheel and starts it at now_us.
+ * @param tick_us resolution; timers fire up to this late, never early
+ */
+void wheel_init(struct wheel *w, uint64_t now_us, uint64_t tick_us);
+
+/** Sets a timer to fire at at_us, cancelling it first if it's pending.  A
+ * time already past fires on the next wheel_expire(). */
+void wheel_schedule(struct wheel *w, struct wheel_timer *t, uint64_t at_us);
+
+/** Stops a timer.  Does nothing if it isn't pending. */
+void wheel_cancel(struct wheel *w, struct wheel_timer *t);
+
+static inline int wheel_pending(const struct wheel_timer *t) {
+    return t->pprev != NULL;
+}
+
+/** Takes one timer that's due by now_us.  Call it until it returns NULL.
+ * The timer comes back cancelled, and anything done with it, or with
+ * any other timer, before the next call is safe.
+ * @return the timer, or NULL once nothing more is due
+ */
+struct wheel_timer *wheel_expire(struct wheel *w, uint64_t now_us);
+
+/** When wheel_expire() might next have something.  This is exact for
+ * timers in the next 64 ticks, unless the wheel has to move timers down a
+ * level first.  Then, and further out, it's when it next does, which is
+ * never later than they're due.
+ * @return the time in microseconds, or UINT64_MAX if nothing's pending
+ */
+uint64_t wheel_next(const struct wheel *w);
+
+#endif
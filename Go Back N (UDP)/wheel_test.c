@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wheel.h"
+
+/* Runs the timer wheel against a model that keeps every timer's tick in an
+   array and scans all of them.  Times are picked to land on and around the
+   turns of each level, where timers cascade down, and the clock is moved
+   by single ticks and by jumps of millions, which wheel_expire skips
+   through.  Run with 'make check'. */
+
+#define TIMERS 64
+#define TRIALS 60
+#define STEPS 2000
+#define LEAP_MAX ((uint64_t)2 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static unsigned long g_checks = 0;
+static unsigned long g_failures = 0;
+
+static uint64_t g_rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void) {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+/* The model.  A timer's tick is the first it may fire on. */
+static struct wheel g_wheel;
+static struct wheel_timer g_timers[TIMERS];
+static uint64_t g_due[TIMERS];
+static int g_pending[TIMERS];
+static int g_near[TIMERS];  /* filed less than a turn out, so on level 0 */
+static uint64_t g_tick_us;
+static uint64_t g_now;      /* tick the wheel was last run to */
+
+static int check(int ok, const char *what, int id) {
+    g_checks++;
+    if (!ok) {
+        g_failures++;
+        printf("FAIL %s: timer %d due %llu, now %llu, tick %llu us\n", what,
+               id, id < 0 ? 0ULL : (unsigned long long)g_due[id],
+               (unsigned long long)g_now, (unsigned long long)g_tick_us);
+    }
+    return ok;
+}
+
+static void schedule(int id, uint64_t at_us) {
+    wheel_schedule(&g_wheel, &g_timers[id], at_us);
+    g_due[id] = (at_us + g_tick_us - 1) / g_tick_us;
+    if (g_due[id] < g_now) {
+        g_due[id] = g_now;
+    }
+    g_pending[id] = 1;
+    g_near[id] = g_due[id] - g_now < WHEEL_SLOTS;
+    check(wheel_pending(&g_timers[id]), "pending after schedule", id);
+}
+
+static void cancel(int id) {
+    wheel_cancel(&g_wheel, &g_timers[id]);
+    g_pending[id] = 0;
+    check(!wheel_pending(&g_timers[id]), "pending after cancel", id);
+}
+
+/* A tick on or beside a turn of some level, or anywhere up to past the
+   top, or already gone */
+static uint64_t pick_tick(void) {
+    unsigned int level = rng_next() % (WHEEL_LEVELS + 1);
+    uint64_t span = (uint64_t)1 << (WHEEL_BITS * level);
+    uint64_t tick;
+
+    switch (rng_next() % 4) {
+    case 0:
+        tick = (g_now | (span - 1)) + 1 + span * (rng_next() % 3);
+        return tick + (rng_next() % 3) - 1;
+    case 1:
+        return g_now + rng_next() % (span * WHEEL_SLOTS);
+    case 2:
+        return g_now + rng_next() % WHEEL_SLOTS;
+    default:
+        return g_now - rng_next() % (g_now < 100 ? g_now + 1 : 100);
+    }
+}
+
+/* The tick as a time the wheel rounds up to it */
+static uint64_t tick_us(uint64_t tick) {
+    return tick == 0 ? 0 : (tick - 1) * g_tick_us + 1 +
+                           rng_next() % g_tick_us;
+}
+
+/* Runs the wheel to tick, firing what the model says is due, and sometimes
+   rescheduling or cancelling timers as they come out */
+static void run(uint64_t tick) {
+    uint64_t at_us = tick * g_tick_us + rng_next() % g_tick_us;
+    struct wheel_timer *t;
+
+    g_now = tick;
+    while ((t = wheel_expire(&g_wheel, at_us)) != NULL) {
+        int id = t - g_timers;
+
+        if (!check(id >= 0 && id < TIMERS && g_pending[id],
+                   "fired a timer that isn't pending", id < 0 ? -1 : id)) {
+            continue;
+        }
+        check(g_due[id] <= tick, "fired early", id);
+        check(!wheel_pending(t), "pending after firing", id);
+        g_pending[id] = 0;
+
+        switch (rng_next() % 8) {
+        case 0:
+            // Already due, so it has to come out again before NULL
+            schedule(id, rng_next() % 2 ? tick_us(tick) : 0);
+            break;
+        case 1:
+            schedule(id, tick_us(pick_tick()));
+            break;
+        case 2:
+            cancel(rng_next() % TIMERS);
+            break;
+        }
+    }
+    for (int i = 0; i < TIMERS; i++) {
+        if (g_pending[i]) {
+            check(g_due[i] > tick, "not fired when due", i);
+        }
+    }
+}
+
+/* wheel_next against the earliest timer: never later, and if it's on
+   level 0, which it is within the wheel's turn of level 0 or if it was
+   filed there, exact unless a turn comes first that cascades */
+static void check_next(void) {
+    uint64_t next = wheel_next(&g_wheel);
+    int first = -1;
+
+    for (int i = 0; i < TIMERS; i++) {
+        if (g_pending[i] && (first < 0 || g_due[i] < g_due[first])) {
+            first = i;
+        }
+    }
+    if (first < 0) {
+        check(next == UINT64_MAX, "wheel_next with nothing pending", -1);
+        return;
+    }
+    for (int i = 0; i < TIMERS; i++) {
+        if (g_pending[i] && g_due[i] == g_due[first] && g_near[i]) {
+            first = i;
+        }
+    }
+    if (g_near[first] || g_due[first] >> WHEEL_BITS == g_now >> WHEEL_BITS) {
+        check(next == g_due[first] * g_tick_us ||
+              (next < g_due[first] * g_tick_us &&
+               (next / g_tick_us) % WHEEL_SLOTS == 0),
+              "wheel_next not exact", first);
+    } else {
+        check(next <= g_due[first] * g_tick_us, "wheel_next late", first);
+    }
+    check(next >= g_now * g_tick_us, "wheel_next before now", first);
+}
+
+static void start(uint64_t now_tick, uint64_t tick) {
+    g_tick_us = tick;
+    g_now = now_tick;
+    memset(g_timers, 0, sizeof(g_timers));
+    memset(g_pending, 0, sizeof(g_pending));
+    wheel_init(&g_wheel, g_now * g_tick_us + rng_next() % g_tick_us,
+               g_tick_us);
+}
+
+/* Random schedules, cancels and runs, from starts either side of turns */
+static void checkModel(void) {
+    static const uint64_t TICKS[] = { 1, 7, 1000 };
+
+    for (int trial = 0; trial < TRIALS; trial++) {
+        uint64_t now = rng_next() % 2 ? rng_next() >> 20 :
+                       ((uint64_t)1 << (WHEEL_BITS * (trial % 5))) - 1;
+
+        start(now, TICKS[trial % 3]);
+        for (int step = 0; step < STEPS; step++) {
+            int id = rng_next() % TIMERS;
+            uint64_t tick;
+
+            switch (rng_next() % 4) {
+            case 0:
+            case 1:
+                schedule(id, tick_us(pick_tick()));
+                break;
+            case 2:
+                cancel(id);
+                break;
+            default:
+                // Single ticks through a turn, or a leap, up to twice the
+                // wheel's reach, past which it's only more of the same
+                tick = rng_next() % 4 ? g_now + 1 : pick_tick();
+                if (tick > g_now + LEAP_MAX) {
+                    tick = g_now + LEAP_MAX;
+                }
+                run(tick < g_now ? g_now : tick);
+                break;
+            }
+            check_next();
+        }
+    }
+}
+
+/* Timers in every slot of level 0, seen from every slot: the ones behind
+   the wheel's position are in its next turn, and wheel_next has to rotate
+   to find them */
+static void checkWrap(void) {
+    for (unsigned int from = 0; from < WHEEL_SLOTS; from++) {
+        for (unsigned int ahead = 1; ahead < WHEEL_SLOTS; ahead++) {
+            start(5 * WHEEL_SLOTS + from, 1);
+            schedule(0, g_now + ahead);
+            schedule(1, g_now + WHEEL_SLOTS - 1);
+            check_next();
+            run(g_now + ahead);
+            check_next();
+        }
+    }
+}
+
+/* One timer per level, far apart, reached in one jump each, so
+   wheel_expire skips the empty ticks and cascades on the way */
+static void checkSparse(void) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t span = (uint64_t)1 << (WHEEL_BITS * (level + 1));
+
+        start(rng_next() >> 24, 3);
+        schedule(0, tick_us(g_now + span - 1));
+        schedule(1, tick_us(g_now + span));
+        schedule(2, tick_us(g_now + span * 2 + 1));
+        for (int jumps = 0; g_pending[0] || g_pending[1] || g_pending[2];
+             jumps++) {
+            if (!check(jumps < 4 * WHEEL_LEVELS * WHEEL_SLOTS,
+                       "wheel_next never reaches the timers", 0)) {
+                break;
+            }
+            check_next();
+            run(wheel_next(&g_wheel) / g_tick_us);
+        }
+        check_next();
+    }
+}
+
+int main(void) {
+    checkWrap();
+    checkSparse();
+    checkModel();
+
+    printf("wheel: %lu checks, %lu failed\n", g_checks, g_failures);
+    return g_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "xxhash.h"
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+/* XXH32's primes, which XXH3 uses too */
+#define Q1 0x9E3779B1U
+#define Q2 0x85EBCA77U
+#define Q3 0xC2B2AE3DU
+
+/* The hash runs over every byte of the transfer, so keep it optimized even
+   in debug builds */
+#if defined(__GNUC__) && !defined(__clang__)
+    #define XXH_HOT __attribute__((optimize("O3")))
+#else
+    #define XXH_HOT
+#endif
+
+/* Helpers the hot functions call on every word.  GCC won't inline them
+   into those by itself when the rest of the file is built without -O. */
+#if defined(__GNUC__)
+    #define XXH_INLINE static inline __attribute__((always_inline))
+#else
+    #define XXH_INLINE static inline
+#endif
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+XXH_INLINE uint64_t read64(const uint8_t *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 |
+           (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 |
+           (uint64_t)p[7] << 56;
+}
+
+XXH_INLINE uint32_t read32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t avalanche64(uint64_t h) {
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * P1 + P4;
+}
+
+void xxh64_init(struct xxh64 *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = seed + P1 + P2;
+    state->v[1] = seed + P2;
+    state->v[2] = seed;
+    state->v[3] = seed - P1;
+}
+
+XXH_HOT
+void xxh64_update(struct xxh64 *state, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    
+    state->total += len;
+    
+    /* not enough for a full stripe yet */
+    if (state->memsize + len < 32) {
+        memcpy(state->mem + state->memsize, p, len);
+        state->memsize += len;
+        return;
+    }
+    
+    /* finish the stripe left over from last time */
+    if (state->memsize > 0) {
+        memcpy(state->mem + state->memsize, p, 32 - state->memsize);
+        p += 32 - state->memsize;
+        state->v[0] = round64(state->v[0], read64(state->mem));
+        state->v[1] = round64(state->v[1], read64(state->mem + 8));
+        state->v[2] = round64(state->v[2], read64(state->mem + 16));
+        state->v[3] = round64(state->v[3], read64(state->mem + 24));
+        state->memsize = 0;
+    }
+    
+    /* four independent lanes, so the rounds pipeline well */
+    if (p + 32 <= end) {
+        uint64_t v1 = state->v[0];
+        uint64_t v2 = state->v[1];
+        uint64_t v3 = state->v[2];
+        uint64_t v4 = state->v[3];
+        
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        
+        state->v[0] = v1;
+        state->v[1] = v2;
+        state->v[2] = v3;
+        state->v[3] = v4;
+    }
+    
+    if (p < end) {
+        memcpy(state->mem, p, end - p);
+        state->memsize = end - p;
+    }
+}
+
+uint64_t xxh64_digest(const struct xxh64 *state) {
+    const uint8_t *p = state->mem;
+    const uint8_t *end = p + state->memsize;
+    uint64_t h;
+    
+    if (state->total >= 32) {
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) +
+            rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        h = merge64(h, state->v[0]);
+        h = merge64(h, state->v[1]);
+        h = merge64(h, state->v[2]);
+        h = merge64(h, state->v[3]);
+    } else {
+        h = state->v[2] + P5;
+    }
+    
+    h += state->total;
+    
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    
+    for (; p < end; p++) {
+        h ^= (uint64_t)*p * P5;
+        h = rotl(h, 11) * P1;
+    }
+    
+    return avalanche64(h);
+}
+
+/* XXH3, as the reference implementation's scalar path has it, with the
+   default secret and no seed.  Input is taken a 64-byte stripe at a time,
+   each stripe mixed into eight accumulators with the secret moved on 8
+   bytes, and the accumulators scrambled every block of 16 stripes, once
+   the secret's used up.  Inputs of up to 240 bytes are hashed whole
+   instead, by one of the short-input functions below. */
+
+#define STRIPE 64
+#define SECRET_SIZE 192
+#define BLOCK_STRIPES ((SECRET_SIZE - STRIPE) / 8)
+#define BUF_STRIPES (sizeof(((struct xxh3 *)0)->buf) / STRIPE)
+#define MID_SIZE_MAX 240
+
+static const uint8_t SECRET[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint64_t avalanche3(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ h >> 32;
+}
+
+/** The full 128-bit product of a and b */
+static inline void mul128(uint64_t a, uint64_t b, uint64_t *low,
+                          uint64_t *high) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    
+    *low = (uint64_t)product;
+    *high = (uint64_t)(product >> 64);
+}
+
+static inline uint64_t mul128_fold(uint64_t a, uint64_t b) {
+    uint64_t low, high;
+    
+    mul128(a, b, &low, &high);
+    return low ^ high;
+}
+
+XXH_HOT
+static void accumulate(uint64_t *acc, const uint8_t *stripe,
+                       const uint8_t *secret) {
+    int i;
+    
+    /* a pair of lanes at a time, each taking the other's input */
+    for (i = 0; i < 8; i += 2) {
+        uint64_t value0 = read64(stripe + 8 * i);
+        uint64_t value1 = read64(stripe + 8 * i + 8);
+        uint64_t key0 = value0 ^ read64(secret + 8 * i);
+        uint64_t key1 = value1 ^ read64(secret + 8 * i + 8);
+        
+        acc[i] += value1 + (key0 & 0xFFFFFFFF) * (key0 >> 32);
+        acc[i + 1] += value0 + (key1 & 0xFFFFFFFF) * (key1 >> 32);
+    }
+}
+
+static inline void scramble(uint64_t *acc) {
+    const uint8_t *secret = SECRET + SECRET_SIZE - STRIPE;
+    int i;
+    
+    for (i = 0; i < 8; i++) {
+        acc[i] = (acc[i] ^ acc[i] >> 47 ^ read64(secret + 8 * i)) * Q1;
+    }
+}
+
+/** Accumulates count stripes, scrambling at the end of each block */
+XXH_HOT
+static unsigned int consume(uint64_t *acc, unsigned int stripes,
+                            const uint8_t *p, size_t count) {
+    while (count > 0) {
+        size_t run = BLOCK_STRIPES - stripes;
+        size_t i;
+        
+        if (run > count) {
+            run = count;
+        }
+        for (i = 0; i < run; i++) {
+            accumulate(acc, p + STRIPE * i, SECRET + 8 * (stripes + i));
+        }
+        p += STRIPE * run;
+        count -= run;
+        stripes += run;
+        if (stripes == BLOCK_STRIPES) {
+            scramble(acc);
+            stripes = 0;
+        }
+    }
+    return stripes;
+}
+
+static uint64_t merge_accs(const uint64_t *acc, const uint8_t *secret,
+                           uint64_t start) {
+    int i;
+    
+    for (i = 0; i < 4; i++) {
+        start += mul128_fold(acc[2 * i] ^ read64(secret + 16 * i),
+                             acc[2 * i + 1] ^ read64(secret + 16 * i + 8));
+    }
+    return avalanche3(start);
+}
+
+static inline uint64_t mix16(const uint8_t *p, const uint8_t *secret) {
+    return mul128_fold(read64(p) ^ read64(secret),
+                       read64(p + 8) ^ read64(secret + 8));
+}
+
+static inline void mix32(uint64_t *low, uint64_t *high, const uint8_t *a,
+                         const uint8_t *b, const uint8_t *secret) {
+    *low += mix16(a, secret);
+    *low ^= read64(b) + read64(b + 8);
+    *high += mix16(b, secret + 16);
+    *high ^= read64(a) + read64(a + 8);
+}
+
+static struct xxh128 short0to16(const uint8_t *p, size_t len) {
+    struct xxh128 h;
+    
+    if (len > 8) {
+        uint64_t flip = read64(SECRET + 48) ^ read64(SECRET + 56);
+        uint64_t last = read64(p + len - 8);
+        uint64_t low, high, rlow, rhigh;
+        
+        mul128(read64(p) ^ last ^ (read64(SECRET + 32) ^ read64(SECRET + 40)),
+               P1, &low, &high);
+        low += (uint64_t)(len - 1) << 54;
+        last ^= flip;
+        high += last + (uint64_t)(uint32_t)last * (Q2 - 1);
+        low ^= __builtin_bswap64(high);
+        mul128(low, P2, &rlow, &rhigh);
+        rhigh += high * P2;
+        h.low = avalanche3(rlow);
+        h.high = avalanche3(rhigh);
+    } else if (len >= 4) {
+        uint64_t value = read32(p) + ((uint64_t)read32(p + len - 4) << 32);
+        uint64_t flip = read64(SECRET + 16) ^ read64(SECRET + 24);
+        uint64_t low, high;
+        
+        mul128(value ^ flip, P1 + ((uint64_t)len << 2), &low, &high);
+        high += low << 1;
+        low ^= high >> 3;
+        low ^= low >> 35;
+        low *= 0x9FB21C651E98DF25ULL;
+        h.low = low ^ low >> 28;
+        h.high = avalanche3(high);
+    } else if (len > 0) {
+        uint32_t low = (uint32_t)p[0] << 16 | (uint32_t)p[len >> 1] << 24 |
+                       p[len - 1] | (uint32_t)len << 8;
+        uint32_t high = __builtin_bswap32(low);
+        
+        high = high << 13 | high >> 19;
+        h.low = avalanche64(low ^ ((uint64_t)read32(SECRET) ^
+                                   read32(SECRET + 4)));
+        h.high = avalanche64(high ^ ((uint64_t)read32(SECRET + 8) ^
+                                     read32(SECRET + 12)));
+    } else {
+        h.low = avalanche64(read64(SECRET + 64) ^ read64(SECRET + 72));
+        h.high = avalanche64(read64(SECRET + 80) ^ read64(SECRET + 88));
+    }
+    return h;
+}
+
+/** The end of the two mid-size functions */
+static struct xxh128 finish128(uint64_t low, uint64_t high, size_t len) {
+    struct xxh128 h;
+    
+    h.low = avalanche3(low + high);
+    h.high = -avalanche3(low * P1 + high * P4 + (uint64_t)len * P2);
+    return h;
+}
+
+static struct xxh128 short17to128(const uint8_t *p, size_t len) {
+    uint64_t low = (uint64_t)len * P1;
+    uint64_t high = 0;
+    
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96) {
+                mix32(&low, &high, p + 48, p + len - 64, SECRET + 96);
+            }
+            mix32(&low, &high, p + 32, p + len - 48, SECRET + 64);
+        }
+        mix32(&low, &high, p + 16, p + len - 32, SECRET + 32);
+    }
+    mix32(&low, &high, p, p + len - 16, SECRET);
+    return finish128(low, high, len);
+}
+
+static struct xxh128 short129to240(const uint8_t *p, size_t len) {
+    uint64_t low = (uint64_t)len * P1;
+    uint64_t high = 0;
+    size_t i;
+    
+    for (i = 0; i < 4; i++) {
+        mix32(&low, &high, p + 32 * i, p + 32 * i + 16, SECRET + 32 * i);
+    }
+    low = avalanche3(low);
+    high = avalanche3(high);
+    for (; i < len / 32; i++) {
+        mix32(&low, &high, p + 32 * i, p + 32 * i + 16,
+              SECRET + 3 + 32 * (i - 4));
+    }
+    mix32(&low, &high, p + len - 16, p + len - 32, SECRET + 136 - 17 - 16);
+    return finish128(low, high, len);
+}
+
+void xxh3_init(struct xxh3 *state) {
+    static const uint64_t ACC[8] = { Q3, P1, P2, P3, P4, Q2, P5, Q1 };
+    
+    memset(state, 0, sizeof(*state));
+    memcpy(state->acc, ACC, sizeof(ACC));
+}
+
+XXH_HOT
+void xxh3_update(struct xxh3 *state, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t size = sizeof(state->buf);
+    
+    state->total += len;
+    
+    /* Input is only consumed once more follows it, since the digest
+       treats the last stripe differently */
+    if (state->bufsize + len <= size) {
+        memcpy(state->buf + state->bufsize, p, len);
+        state->bufsize += len;
+        return;
+    }
+    
+    if (state->bufsize > 0) {
+        size_t fill = size - state->bufsize;
+        
+        memcpy(state->buf + state->bufsize, p, fill);
+        p += fill;
+        len -= fill;
+        state->stripes = consume(state->acc, state->stripes, state->buf,
+                                 BUF_STRIPES);
+        state->bufsize = 0;
+    }
+    
+    /* straight from the input, a buffer's worth at a time, keeping the
+       last stripe consumed for a digest that has less than one left */
+    if (len > size) {
+        do {
+            state->stripes = consume(state->acc, state->stripes, p,
+                                     BUF_STRIPES);
+            p += size;
+            len -= size;
+        } while (len > size);
+        memcpy(state->buf + size - STRIPE, p - STRIPE, STRIPE);
+    }
+    
+    memcpy(state->buf, p, len);
+    state->bufsize = len;
+}
+
+struct xxh128 xxh3_digest(const struct xxh3 *state) {
+    const uint8_t *last = SECRET + SECRET_SIZE - STRIPE - 7;
+    uint64_t acc[8];
+    struct xxh128 h;
+    
+    if (state->total <= 16) {
+        return short0to16(state->buf, state->total);
+    } else if (state->total <= 128) {
+        return short17to128(state->buf, state->total);
+    } else if (state->total <= MID_SIZE_MAX) {
+        return short129to240(state->buf, state->total);
+    }
+    
+    /* the stripes left, the last of them against a secret of its own and
+       made up from the end of what came before if it's short */
+    memcpy(acc, state->acc, sizeof(acc));
+    if (state->bufsize >= STRIPE) {
+        consume(acc, state->stripes, state->buf,
+                (state->bufsize - 1) / STRIPE);
+        accumulate(acc, state->buf + state->bufsize - STRIPE, last);
+    } else {
+        uint8_t stripe[STRIPE];
+        size_t catchup = STRIPE - state->bufsize;
+        
+        memcpy(stripe, state->buf + sizeof(state->buf) - catchup, catchup);
+        memcpy(stripe + catchup, state->buf, state->bufsize);
+        accumulate(acc, stripe, last);
+    }
+    
+    h.low = merge_accs(acc, SECRET + 11, state->total * P1);
+    h.high = merge_accs(acc, SECRET + SECRET_SIZE - sizeof(acc) - 11,
+                        ~(state->total * P2));
+    return h;
+}
+
+void xxh128_put(const struct xxh128 *hash, uint8_t *out) {
+    int i;
+    
+    for (i = 0; i < 8; i++) {
+        out[i] = hash->high >> (56 - 8 * i);
+        out[8 + i] = hash->low >> (56 - 8 * i);
+    }
+}
+
+struct xxh128 xxh128_get(const uint8_t *in) {
+    struct xxh128 h = { 0, 0 };
+    int i;
+    
+    for (i = 0; i < 8; i++) {
+        h.high = h.high << 8 | in[i];
+        h.low = h.low << 8 | in[8 + i];
+    }
+    return h;
+}
+
+void xxh128_hex(const struct xxh128 *hash, char *out) {
+    snprintf(out, 33, "%016llx%016llx", (unsigned long long)hash->high,
+             (unsigned long long)hash->low);
+}
@@ -0,0 +1,52 @@
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Streaming XXH64 state.  Feed the file through xxh64_update() in order and
+ * read the hash with xxh64_digest(). */
+struct xxh64 {
+    uint64_t total;
+    uint64_t v[4];
+    uint8_t mem[32];
+    unsigned int memsize;
+};
+
+void xxh64_init(struct xxh64 *state, uint64_t seed);
+void xxh64_update(struct xxh64 *state, const void *data, size_t len);
+uint64_t xxh64_digest(const struct xxh64 *state);
+
+/** A 128-bit XXH3 digest */
+struct xxh128 {
+    uint64_t high;
+    uint64_t low;
+};
+
+/* bytes in a digest's canonical form, high half first and big-endian,
+   which is how xxh128sum prints it */
+#define XXH128_SIZE 16
+
+/** Streaming XXH3-128 state, unseeded.  Feed the file through
+ * xxh3_update() in order and read the hash with xxh3_digest().  The last
+ * few stripes stay in buf until the digest, which needs them. */
+struct xxh3 {
+    uint64_t acc[8];
+    uint64_t total;
+    unsigned int stripes;   /* accumulated since the last scramble */
+    unsigned int bufsize;
+    uint8_t buf[256];
+};
+
+void xxh3_init(struct xxh3 *state);
+void xxh3_update(struct xxh3 *state, const void *data, size_t len);
+struct xxh128 xxh3_digest(const struct xxh3 *state);
+
+/** Writes a digest out in canonical form, XXH128_SIZE bytes */
+void xxh128_put(const struct xxh128 *hash, uint8_t *out);
+/** Reads a digest back from canonical form */
+struct xxh128 xxh128_get(const uint8_t *in);
+/** Formats a digest as 32 hex digits and a terminator */
+void xxh128_hex(const struct xxh128 *hash, char *out);
+
+#endif
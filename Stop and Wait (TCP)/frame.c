@@ -0,0 +1,191 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+
+static double g_error = 0;
+
+/* xorshift, one per thread, so workers don't share a generator */
+static __thread uint64_t t_rng = 0;
+
+static double rng_next(void) {
+    if (t_rng == 0) {
+        t_rng = (((uint64_t)time(NULL) << 32) ^ (uint64_t)pthread_self()) | 1;
+    }
+    t_rng ^= t_rng << 13;
+    t_rng ^= t_rng >> 7;
+    t_rng ^= t_rng << 17;
+    return (t_rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void frame_error(double rate) {
+    g_error = rate;
+}
+
+void frame_reader_init(struct frame_reader *rd) {
+    rd->start = 0;
+    rd->end = 0;
+}
+
+/* length of the frame at the front of the buffer, or -1 if its prefix
+   hasn't all arrived */
+static int64_t frame_peek(const struct frame_reader *rd) {
+    uint32_t len;
+    
+    if (rd->end - rd->start < FRAME_HDRLEN) {
+        return -1;
+    }
+    memcpy(&len, rd->buf + rd->start, FRAME_HDRLEN);
+    return ntohl(len);
+}
+
+int frame_ready(const struct frame_reader *rd) {
+    int64_t len = frame_peek(rd);
+    
+    return len >= 0 && rd->end - rd->start >= FRAME_HDRLEN + (size_t)len;
+}
+
+ssize_t frame_recv(struct frame_reader *rd, int sockfd, void *body,
+                   size_t max) {
+    int64_t len;
+    ssize_t n;
+    
+    while (1) {
+        if ((len = frame_peek(rd)) >= 0) {
+            if ((size_t)len > max || len > FRAME_MAX) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (rd->end - rd->start >= FRAME_HDRLEN + (size_t)len) {
+                memcpy(body, rd->buf + rd->start + FRAME_HDRLEN, len);
+                rd->start += FRAME_HDRLEN + len;
+                if (rd->start == rd->end) {
+                    rd->start = rd->end = 0;
+                }
+                return len;
+            }
+        }
+    
+        /* make room for the rest of this frame at the end of the buffer */
+        if (rd->start > 0 &&
+            FRAME_BUFSZ - rd->end < FRAME_HDRLEN + FRAME_MAX) {
+            memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+            rd->end -= rd->start;
+            rd->start = 0;
+        }
+    
+        /* take whatever has arrived, not just this frame's bytes, so
+           coalesced frames cost one system call between them */
+        if ((n = recv(sockfd, rd->buf + rd->end, FRAME_BUFSZ - rd->end,
+                      0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (n == 0) {
+            return 0;
+        }
+        rd->end += n;
+    }
+}
+
+/* writes a vector out completely, picking up after short writes */
+static int writev_all(int sockfd, struct iovec *iov, int iovcnt) {
+    ssize_t n;
+    
+    while (iovcnt > 0) {
+        if ((n = writev(sockfd, iov, iovcnt)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+    
+        /* skip what went out, which may end partway through an entry */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    
+    return 0;
+}
+
+void frame_batch_init(struct frame_batch *batch) {
+    batch->count = 0;
+    batch->iovcnt = 0;
+}
+
+int frame_queue(int sockfd, struct frame_batch *batch, const void *body,
+                size_t len) {
+    unsigned int i;
+    struct iovec *iov;
+    
+    if (len > FRAME_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (batch->count == FRAME_BATCH && frame_flush(sockfd, batch) == -1) {
+        return -1;
+    }
+    
+    i = batch->count++;
+    iov = &batch->iov[batch->iovcnt];
+    batch->lens[i] = htonl(len);
+    iov[0].iov_base = &batch->lens[i];
+    iov[0].iov_len = FRAME_HDRLEN;
+    
+    /* a corrupted body goes out in three pieces with the bad byte in the
+       middle, leaving the caller's copy alone */
+    if (g_error > 0 && len > 0 && rng_next() < g_error) {
+        size_t at = (size_t)(rng_next() * len);
+        batch->flips[i] = ((const uint8_t *)body)[at] ^
+                          (1 << (int)(rng_next() * 8));
+        iov[1].iov_base = (void *)body;
+        iov[1].iov_len = at;
+        iov[2].iov_base = &batch->flips[i];
+        iov[2].iov_len = 1;
+        iov[3].iov_base = (uint8_t *)body + at + 1;
+        iov[3].iov_len = len - at - 1;
+        batch->iovcnt += 4;
+    } else {
+        iov[1].iov_base = (void *)body;
+        iov[1].iov_len = len;
+        batch->iovcnt += 2;
+    }
+    
+    return 0;
+}
+
+int frame_flush(int sockfd, struct frame_batch *batch) {
+    int ret = 0;
+    
+    if (batch->iovcnt > 0) {
+        ret = writev_all(sockfd, batch->iov, batch->iovcnt);
+    }
+    frame_batch_init(batch);
+    
+    return ret;
+}
+
+ssize_t frame_send(int sockfd, const void *body, size_t len) {
+    struct frame_batch batch;
+    
+    frame_batch_init(&batch);
+    if (frame_queue(sockfd, &batch, body, len) == -1 ||
+        frame_flush(sockfd, &batch) == -1) {
+        return -1;
+    }
+    
+    return len;
+}
@@ -0,0 +1,67 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* TCP hands us a byte stream, not messages: one recv() can return half a
+   packet, or the tail of one and the start of the next.  Every packet
+   therefore goes out as a frame, a 32-bit big-endian length followed by
+   that many bytes, and the reader below puts them back together. */
+
+#define FRAME_HDRLEN 4
+#define FRAME_MAX 16384          // Longest frame body we accept
+#define FRAME_BUFSZ (1 << 16)    // Reader buffer; holds a few dozen packets
+#define FRAME_BATCH 32           // Frames gathered into one writev
+
+/* bytes received but not yet handed out as frames */
+struct frame_reader {
+    size_t start;
+    size_t end;
+    uint8_t buf[FRAME_BUFSZ];
+};
+
+/* frames waiting to go out together.  The bodies aren't copied, so they
+   must stay put until frame_flush(). */
+struct frame_batch {
+    unsigned int count;
+    int iovcnt;
+    uint32_t lens[FRAME_BATCH];       /* prefixes, big-endian */
+    uint8_t flips[FRAME_BATCH];       /* bytes corrupted by frame_error */
+    struct iovec iov[4 * FRAME_BATCH];
+};
+
+/* readies a reader for a new connection */
+void frame_reader_init(struct frame_reader *rd);
+
+/* receives the next whole frame, reading as much as the socket has so later
+   frames come out of the buffer; returns the body length, 0 if the peer
+   closed, or -1 on error (EMSGSIZE if the body won't fit in max, after
+   which the stream can't be trusted) */
+ssize_t frame_recv(struct frame_reader *rd, int sockfd, void *body,
+                   size_t max);
+
+/* nonzero if a whole frame is already buffered, so frame_recv won't block */
+int frame_ready(const struct frame_reader *rd);
+
+/* sends one frame, prefix and body in a single writev; returns the body
+   length or -1 */
+ssize_t frame_send(int sockfd, const void *body, size_t len);
+
+/* empties a batch */
+void frame_batch_init(struct frame_batch *batch);
+
+/* adds a frame to a batch, flushing first if it's full; returns 0 or -1 */
+int frame_queue(int sockfd, struct frame_batch *batch, const void *body,
+                size_t len);
+
+/* sends everything in a batch and empties it; returns 0 or -1 */
+int frame_flush(int sockfd, struct frame_batch *batch);
+
+/* corrupts one bit in about rate of the frame bodies sent, as sendErr does
+   for plain sends, so checksums still get exercised.  Prefixes are never
+   touched: TCP wouldn't corrupt them, and we couldn't resynchronize. */
+void frame_error(double rate);
+
+#endif
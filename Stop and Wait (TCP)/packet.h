@@ -1,17 +1,26 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #define PKT_TYPE_RR 0xAA  // Receive ready
 #define PKT_TYPE_REJ 0x55 // Reject
 #define PKT_TYPE_BUF 0x99 // Buffer size
 #define PKT_TYPE_FLN 0x33 // Filename
 #define PKT_TYPE_DAT 0xBB // Data
-#define PKT_TYPE_WIN 0xCC // Window size
+#define PKT_TYPE_WIN 0xCC // Pipelined file request, carrying the window size
+#define PKT_TYPE_STM 0x66 // Streamed file request, and the header answering it
 
 #define PKT_DMAX 1400
 #define PKT_TRNSMAX 10
+#define PKT_WINMAX 1024 // Most chunks a pipelined transfer keeps in flight
+
+/* a pipelined request's sequence field is the window, with the ID of the
+   client's ARQ policy in the top byte.  Zero there means go-back-n. */
+#define PKT_WIN_ARQSHIFT 24
+#define PKT_WIN_SIZEMASK 0xFFFFFF
 
 #pragma pack(push, 1)
 struct packet {
@@ -21,12 +30,42 @@ struct packet {
     uint16_t size;
     uint8_t data[PKT_DMAX];
 };
+
+/* precedes a streamed file; the file's bytes follow with no framing */
+struct stream_hdr {
+    uint8_t type;
+    uint64_t length;    /* big-endian */
+};
 #pragma pack(pop)
 
+/* bytes ahead of the data.  Pipelined transfers send only these and the
+   size bytes of data that are in use. */
+#define PKT_HDRLEN offsetof(struct packet, data)
+
+#define STREAM_BUFSZ (1 << 20) // Receive buffer for streamed files
+
 /* returns a retransmission packet */
 struct packet retransmitpkt(uint32_t sequence);
 
 /* returns an acknowledgment packet */
 struct packet ackpkt(const struct packet *src);
 
+/* returns a header-only RR or REJ for pipelined mode; send PKT_HDRLEN bytes
+   of it.  Either acknowledges everything before sequence.  size carries the
+   number of the last frame received (of a REJ, the one that prompted it). */
+struct packet ctlpkt(uint8_t type, uint32_t sequence, uint16_t frame);
+
+/* computes a packet's checksum over its first len bytes */
+void pktseal(struct packet *pkt, size_t len);
+
+/* returns nonzero if a packet's first len bytes match its checksum */
+int pktvalid(struct packet *pkt, size_t len);
+
+/* sends all len bytes, retrying short writes; returns len or -1 */
+ssize_t sendall(int sockfd, const void *buf, size_t len);
+
+/* receives exactly len bytes; returns len, 0 if the peer closed first, or
+   -1 on error */
+ssize_t recvall(int sockfd, void *buf, size_t len);
+
 #endif
@@ -0,0 +1,394 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+extern "C" {
+#include "packet.h"
+#include "frame.h"
+}
+#include "pipeline.h"
+
+#include "Arq.h"
+#include "Link.h"
+
+extern "C" char *g_appname;
+
+/** Socket policy for Link over a framed TCP stream.  Frames are queued into
+ * a batch and go out together in one writev on Flush().  The stream doesn't
+ * lose anything, so Recv waits for good and ignores the timeout. */
+class FrameSocket {
+public:
+    FrameSocket() : mvFd(-1), mvReader(NULL) {
+        frame_batch_init(&mvBatch);
+    }
+
+    FrameSocket(int fd, frame_reader *reader) : mvFd(fd), mvReader(reader) {
+        frame_batch_init(&mvBatch);
+    }
+
+    ssize_t Send(const void *buf, size_t len) {
+        return frame_send(mvFd, buf, len);
+    }
+
+    int Queue(const void *buf, size_t len) {
+        return frame_queue(mvFd, &mvBatch, buf, len);
+    }
+
+    int Flush() {
+        return frame_flush(mvFd, &mvBatch);
+    }
+
+    int Recv(void *buf, size_t max, ssize_t &len, long timeoutUs) {
+        len = frame_recv(mvReader, mvFd, buf, max);
+        return len <= 0 ? -1 : 1;
+    }
+
+    bool Pending() const {
+        return frame_ready(mvReader);
+    }
+
+private:
+    int mvFd;
+    frame_reader *mvReader;
+    frame_batch mvBatch;
+};
+
+typedef Link<packet, FrameSocket, InetChecksum> FrameLink;
+
+/* a chunk in the send window, and the number of the frame that last
+   carried it */
+struct Chunk {
+    struct packet pkt;
+    uint16_t frame;
+};
+
+/* widens a 32-bit sequence from the wire to the one nearest near */
+static uint64_t widen(uint32_t sequence, uint64_t near) {
+    return near + (int32_t)(sequence - (uint32_t)near);
+}
+
+/**Queues chunks [from, to) from the window to be sent, numbering their
+ * frames.
+ * @return 0, or -1 if the connection failed
+ */
+template <class Policy>
+static int queue_chunks(FrameLink &link, SendWindow<Policy, Chunk> &chunks,
+                        uint64_t from, uint64_t to, uint16_t &frames) {
+    for (; from != to; from++) {
+        Chunk &chunk = chunks[from];
+        if (link.Queue(&chunk.pkt, PKT_HDRLEN + chunk.pkt.size) == -1) {
+            perror("send");
+            return -1;
+        }
+        chunk.frame = ++frames;
+    }
+
+    return 0;
+}
+
+/**Runs a pipelined transfer out of an open file; see pipeline_file().
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+template <class Policy>
+static int pipeline_send(FrameLink &link, int fromfd, unsigned int bufsz,
+                         unsigned int window) {
+    SendWindow<Policy, Chunk> chunks;
+    struct packet inpkt;
+    uint64_t sent = 0;      /* first chunk not sent yet */
+    uint64_t ack;
+    uint64_t from, to;
+    uint16_t frames = 0;    /* frames sent, wrapping */
+    int eof = 0;
+    ssize_t rd;
+
+    chunks.Reset(window, 0);
+
+    while (1) {
+        /* top the window up */
+        while (!eof && !chunks.Full()) {
+            Chunk &chunk = chunks.Push();
+
+            if ((rd = read(fromfd, chunk.pkt.data, bufsz)) == -1) {
+                perror("read");
+                return EXIT_FAILURE;
+            }
+            chunk.pkt.type = PKT_TYPE_DAT;
+            chunk.pkt.sequence = htonl(chunks.Next() - 1);
+            chunk.pkt.size = rd;
+            link.Seal(&chunk.pkt, PKT_HDRLEN + rd);
+
+            /* a short chunk, possibly empty, marks the end */
+            eof = (unsigned int)rd < bufsz;
+        }
+
+        /* new chunks and anything queued again go out in one writev */
+        if (queue_chunks(link, chunks, sent, chunks.Next(), frames) == -1) {
+            return EXIT_FAILURE;
+        }
+        if (link.Flush() == -1) {
+            perror("send");
+            return EXIT_FAILURE;
+        }
+        sent = chunks.Next();
+
+        if (eof && chunks.Empty()) {
+            return EXIT_SUCCESS;
+        }
+
+        /* wait for an answer, then take any others already here */
+        do {
+            LinkStatus status = link.Recv(inpkt, rd, -1);
+
+            if (status == LINK_FAILED) {
+                fprintf(stderr, "%s: client hung up with %u chunks "
+                        "unacknowledged\n", g_appname, chunks.Count());
+                return EXIT_FAILURE;
+            }
+
+            /* a garbled answer can't be trusted, and neither can a
+               repeated request.  It may have been a REJ, so send the
+               oldest chunk again as the policy would; the client answers
+               the repeats properly. */
+            if (status != LINK_OK ||
+                (inpkt.type != PKT_TYPE_RR && inpkt.type != PKT_TYPE_REJ)) {
+                chunks.Resend(chunks.Base(), from, to);
+                if (queue_chunks(link, chunks, from, to, frames) == -1) {
+                    return EXIT_FAILURE;
+                }
+                continue;
+            }
+
+            /* anything outside the window is stale */
+            ack = widen(ntohl(inpkt.sequence), chunks.Base());
+            if (ack - chunks.Base() > chunks.Count()) {
+                continue;
+            }
+            while (chunks.Base() != ack) {
+                chunks.PopFront();
+            }
+
+            /* the client has everything before ack, and has seen the
+               frames counted in size.  If the last frame to carry ack is
+               among them, that copy was garbled or dropped, so send it
+               again as the policy says.  Otherwise a copy is still on its
+               way, and this answer is about an older flight. */
+            if (chunks.Contains(ack) &&
+                (int16_t)(inpkt.size - chunks[ack].frame) >= 0) {
+                chunks.Resend(ack, from, to);
+                if (queue_chunks(link, chunks, from, to, frames) == -1) {
+                    return EXIT_FAILURE;
+                }
+            }
+        } while (link.Pending());
+    }
+}
+
+/**Sends a file with up to window chunks in flight.  The client answers with
+ * header-only cumulative RRs, so an acknowledgment costs a few bytes and
+ * slides the window over every chunk before it, instead of echoing each
+ * chunk back.  A REJ means a chunk arrived corrupted; the ARQ policy the
+ * client asked for decides what's sent again, out of the window the chunks
+ * were read into.  Both ends count frames, and every answer carries the
+ * client's count, so the corrupted remainder of a flight we've already
+ * resent doesn't send us back again.
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+template <class Policy>
+static int pipeline_open(int connfd, frame_reader *reader, const char *name,
+                         unsigned int bufsz, unsigned int window) {
+    FrameLink link(FrameSocket(connfd, reader), PKT_HDRLEN);
+    int fromfd;
+    int one = 1;
+    int ret;
+
+    window = Policy::Window(window);
+    if ((fromfd = open(name, O_RDONLY)) == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+
+    /* a lone chunk sent again after a REJ shouldn't wait on Nagle */
+    if (setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one,
+                   sizeof(one)) == -1) {
+        perror("setsockopt");
+    }
+
+    ret = pipeline_send<Policy>(link, fromfd, bufsz, window);
+
+    close(fromfd);
+    return ret;
+}
+
+int pipeline_file(int connfd, struct frame_reader *reader, const char *name,
+                  unsigned int bufsz, uint32_t request) {
+    unsigned int arq = request >> PKT_WIN_ARQSHIFT;
+    unsigned int window = request & PKT_WIN_SIZEMASK;
+
+    if (bufsz == 0 || bufsz > PKT_DMAX || window == 0 ||
+        window > PKT_WINMAX) {
+        fprintf(stderr, "%s: bad pipelined request: buffer %u, window %u\n",
+                g_appname, bufsz, window);
+        return EXIT_FAILURE;
+    }
+
+    /* the policy is picked once per transfer, not per packet */
+    switch (arq) {
+    case 0:
+    case GoBackN::ID:
+        return pipeline_open<GoBackN>(connfd, reader, name, bufsz, window);
+    case StopAndWait::ID:
+        return pipeline_open<StopAndWait>(connfd, reader, name, bufsz,
+                                          window);
+    case SelectiveRepeat::ID:
+        return pipeline_open<SelectiveRepeat>(connfd, reader, name, bufsz,
+                                              window);
+    default:
+        fprintf(stderr, "%s: unknown ARQ policy %u requested\n", g_appname,
+                arq);
+        return EXIT_FAILURE;
+    }
+}
+
+/* writes a chunk to the file; a short one ends it */
+static int write_chunk(int tofd, const struct packet &pkt,
+                       unsigned int bufsz, int &done) {
+    if (write(tofd, pkt.data, pkt.size) == -1) {
+        perror("write");
+        return -1;
+    }
+    done = pkt.size < bufsz;
+    return 0;
+}
+
+/* Fetches a file in pipelined mode.  The server keeps up to window chunks
+   in flight; we acknowledge cumulatively with header-only RRs, once per
+   batch of chunks the stream delivers rather than once per chunk.  A chunk
+   with a bad checksum gets a REJ.  What happens to the chunks after it is
+   up to the ARQ policy: go-back-n drops them until the server goes back,
+   and selective repeat holds them until the gap is filled. */
+int pipeline_recv(int sockfd, int tofd, const char *fromname,
+                  unsigned int bufsz, unsigned int window) {
+    struct frame_reader reader;
+    FrameLink link(FrameSocket(sockfd, &reader), PKT_HDRLEN);
+    RecvWindow<ArqPolicy, struct packet> held;
+    struct packet req = { 0 };
+    struct packet inpkt;
+    struct packet ctl;
+    uint64_t expect = 0;   /* next chunk to write */
+    uint64_t sequence;
+    int rejected = 0;      /* dropped or garbled something since expect */
+    uint16_t frames = 0;   /* frames received, wrapping */
+    int answer = 0;        /* something arrived that needs an answer */
+    int started = 0;       /* a chunk arrived, so the request got through */
+    int valid;
+    int done = 0;
+    int one = 1;
+    ssize_t rd;
+
+    /* acknowledgments are a few bytes each; Nagle would hold them back
+       until the server's delayed ACK, stalling the window */
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one,
+                   sizeof(one)) == -1) {
+        perror("setsockopt");
+    }
+
+    held.Reset(window);
+
+    req.type = PKT_TYPE_WIN;
+    req.sequence = htonl(window | ArqPolicy::ID << PKT_WIN_ARQSHIFT);
+    req.size = bufsz;
+    strncpy((char *)req.data, fromname, PKT_DMAX - 1);
+    link.Seal(&req, sizeof(req));
+    if (link.Send(&req, sizeof(req)) == -1) {
+        perror("send");
+        return EXIT_FAILURE;
+    }
+
+    frame_reader_init(&reader);
+
+    while (!done) {
+        LinkStatus status = link.Recv(inpkt, rd, -1);
+
+        if (status == LINK_FAILED) {
+            fprintf(stderr, "%s: server hung up after %llu chunks\n",
+                    g_appname, (unsigned long long)expect);
+            return EXIT_FAILURE;
+        }
+        frames++;
+
+        valid = status == LINK_OK && inpkt.size == rd - PKT_HDRLEN &&
+                inpkt.type == PKT_TYPE_DAT;
+
+        if (!valid && !started) {
+            /* the server couldn't read our request, and is asking for it
+               again the classroom way */
+            if (link.Send(&req, sizeof(req)) == -1) {
+                perror("send");
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        started = 1;
+        answer = 1;
+
+        /* ask for expect again.  Every time: it may be the resent copy
+           that was garbled this time.  The frame count lets the server
+           tell. */
+        sequence = valid ? widen(ntohl(inpkt.sequence), expect) : expect;
+        switch (valid ? held.Classify(sequence, expect)
+                      : RecvWindow<ArqPolicy, struct packet>::REJECT) {
+        case RecvWindow<ArqPolicy, struct packet>::DELIVER:
+            if (write_chunk(tofd, inpkt, bufsz, done) == -1) {
+                return EXIT_FAILURE;
+            }
+            expect++;
+            rejected = 0;
+
+            /* then whatever was held waiting on it */
+            while (!done && held.Held(expect)) {
+                if (write_chunk(tofd, held[expect], bufsz, done) == -1) {
+                    return EXIT_FAILURE;
+                }
+                held.Unhold(expect++);
+            }
+            break;
+        case RecvWindow<ArqPolicy, struct packet>::HOLD:
+            if (!held.Held(sequence)) {
+                held[sequence] = inpkt;
+                held.Hold(sequence);
+            }
+            break;
+        case RecvWindow<ArqPolicy, struct packet>::REJECT:
+            /* a gap the server may not know about yet */
+            rejected = 1;
+            break;
+        case RecvWindow<ArqPolicy, struct packet>::DUPLICATE:
+            /* a repeat means the server didn't understand our last
+               answer, so give it again */
+            break;
+        }
+
+        /* answer once the stream has nothing more buffered for us */
+        if (answer && (done || !link.Pending())) {
+            ctl = ctlpkt(rejected || held.HeldCount() > 0 ? PKT_TYPE_REJ
+                                                          : PKT_TYPE_RR,
+                         expect, frames);
+            if (link.Send(&ctl, PKT_HDRLEN) == -1) {
+                perror("send");
+                return EXIT_FAILURE;
+            }
+            answer = 0;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
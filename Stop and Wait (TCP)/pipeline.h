@@ -0,0 +1,44 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+
+/* Pipelined transfers, built on the ARQ windows and link in ../Transport.
+   They're C++ underneath, so each ARQ policy gets its own compiled copy of
+   the transfer loop; these are the entry points the C programs call. */
+
+struct frame_reader;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**Sends a file with up to window chunks in flight.
+ * @param connfd connected socket
+ * @param reader frames already buffered from the client
+ * @param name file to send
+ * @param bufsz bytes of file per chunk
+ * @param request the request's sequence field: the window, with the ARQ
+ *        policy's ID in the top byte
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int pipeline_file(int connfd, struct frame_reader *reader, const char *name,
+                  unsigned int bufsz, uint32_t request);
+
+/**Fetches a file in pipelined mode, using the ARQ policy rcopy was built
+ * with.
+ * @param sockfd connected socket
+ * @param tofd local file to write
+ * @param fromname remote file to request
+ * @param bufsz bytes of file per chunk
+ * @param window chunks the server may send ahead
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int pipeline_recv(int sockfd, int tofd, const char *fromname,
+                  unsigned int bufsz, unsigned int window);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
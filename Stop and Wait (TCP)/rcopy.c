@@ -1,3 +1,4 @@
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -15,25 +16,28 @@
 
 #include "select_call.h"
 #include "packet.h"
+#include "frame.h"
+#include "pipeline.h"
 #include "cpe464.h"
 
 #define NUM_ARGS 7
+#define NUM_ARGS_STREAM 8
 #define ARG_FROM 1
 #define ARG_TO 2
 #define ARG_BUFSZ 3
 #define ARG_PERR 4
 #define ARG_REMNAME 5
 #define ARG_REMPORT 6
+#define ARG_MODE 7
 
 #define TIMEOUT_SEC 11
 #define TIMEOUT_USEC 0
 
-enum state_t {
-    TRANSMIT,
-    RECEIVE,
-    EVALUATE,
-    QUIT
-};
+#define QUIT 0
+#define EXPECT_ACK 1
+#define TRANSMIT 2
+#define RECEIVE 3
+#define END 4
 
 char *g_appname;
 
@@ -102,6 +106,105 @@ int connect_to_server(const char *servname, const char *port,
     return tmp;
 }
 
+/**Fetches a file in streaming mode: one request, then the server's
+ * stream_hdr followed by the file's bytes, written out as they arrive.
+ * @param sockfd connected socket
+ * @param tofd local file to write
+ * @param fromname remote file to request
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int stream_recv(int sockfd, int tofd, const char *fromname) {
+    struct packet req = { 0 };
+    struct packet rej;
+    struct frame_reader reader;
+    struct stream_hdr hdr;
+    uint64_t length;
+    uint64_t got = 0;
+    int rcvbuf = STREAM_BUFSZ;
+    int retries;
+    char *buf;
+    ssize_t rd;
+    
+    /* let the window open up as far as our buffer goes */
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                   sizeof(rcvbuf)) == -1) {
+        perror("setsockopt");
+    }
+    
+    req.type = PKT_TYPE_STM;
+    strncpy((char *)req.data, fromname, PKT_DMAX - 1);
+    req.checksum = in_cksum((unsigned short *)&req, sizeof(req));
+    
+    /* A request damaged on the way gets a framed REJ back rather than the
+       header.  A frame opens with the high byte of its length, which is
+       never PKT_TYPE_STM, so one byte tells the two apart. */
+    frame_reader_init(&reader);
+    for (retries = 0; ; retries++) {
+        if (retries >= PKT_TRNSMAX) {
+            fprintf(stderr, "%s: server unreachable\n", g_appname);
+            return EXIT_FAILURE;
+        }
+        if (frame_send(sockfd, &req, sizeof(req)) == -1) {
+            perror("send");
+            return EXIT_FAILURE;
+        }
+        if (recv(sockfd, &hdr.type, 1, MSG_PEEK) <= 0 ||
+            hdr.type == PKT_TYPE_STM ||
+            frame_recv(&reader, sockfd, &rej, sizeof(rej)) <= 0) {
+            break;
+        }
+    }
+    
+    if ((rd = recvall(sockfd, &hdr, sizeof(hdr))) <= 0 ||
+        hdr.type != PKT_TYPE_STM) {
+        fprintf(stderr, "%s: server refused %s\n", g_appname, fromname);
+        return EXIT_FAILURE;
+    }
+    length = be64toh(hdr.length);
+    
+    if ((buf = (char *)malloc(STREAM_BUFSZ)) == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    
+    while (got < length) {
+        size_t want = length - got < STREAM_BUFSZ ? length - got
+                                                  : STREAM_BUFSZ;
+        ssize_t off = 0;
+        
+        if ((rd = recv(sockfd, buf, want, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            break;
+        } else if (rd == 0) {
+            break;
+        }
+        
+        while (off < rd) {
+            ssize_t wr = write(tofd, buf + off, rd - off);
+            if (wr == -1) {
+                perror("write");
+                free(buf);
+                return EXIT_FAILURE;
+            }
+            off += wr;
+        }
+        got += rd;
+    }
+    
+    free(buf);
+    if (got != length) {
+        fprintf(stderr, "%s: connection closed after %llu of %llu bytes\n",
+                g_appname, (unsigned long long)got,
+                (unsigned long long)length);
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
 void printFlags(uint8_t flags) {
     printf("Status flags:\n"
            "\tQuit: %s\n"
@@ -123,28 +226,32 @@ int main(int argc, char *argv[]) {
     struct packet outpkt = { 0 }; /* outgoing packet */
     struct packet inpkt = { 0 };  /* incoming packet */
     struct packet tpkt = { 0 };
+    struct frame_reader reader;   /* reassembles packets from the stream */
     uint16_t bufsz;               /* bytes per packet */
-    float perr;                   /* percent error */
     
     uint32_t sequence = 0; /* current expected sequence number */
     uint16_t checksum = 0;
     uint16_t ck = 0;
     int retries = 0;           /* retransmit count */
-    state_t state;             /* state machine state */
+    uint8_t status = 0;        /* state flags */
     
     /* check arguments */
-    if (argc != NUM_ARGS) {
+    if ((argc != NUM_ARGS && argc != NUM_ARGS_STREAM) ||
+        (argc == NUM_ARGS_STREAM && strcmp(argv[ARG_MODE], "stream") != 0 &&
+         atoi(argv[ARG_MODE]) <= 0)) {
         fprintf(stderr, "usage: %s from-remote-file to-local-file buffer-size "
-                "error-percent remote-machine remote-port\n", argv[0]);
+                "error-percent remote-machine remote-port [stream | window]\n"
+                "\tstream: send the file straight down the connection\n"
+                "\twindow: pipeline up to this many chunks (at most %d)\n",
+                argv[0], PKT_WINMAX);
         return EXIT_FAILURE;
     }
     
     /* initialize corruption */
-    sendErr_init(atof(argv[ARG_PERR]), DROP_OFF, FLIP_ON, DEBUG_ON, RSEED_OFF);
+    frame_error(atof(argv[ARG_PERR]));
     
     g_appname = argv[0];
     bufsz = atoi(argv[ARG_BUFSZ]);
-    perr = atof(argv[ARG_PERR]);
     
     /* build socket hints */
     memset(&hints, 0, sizeof(hints));
@@ -164,36 +271,54 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
     
+    /* streaming mode leaves reliability to TCP; pipelined mode keeps
+       chunks and checksums but not the per-chunk round trip */
+    if (argc == NUM_ARGS_STREAM) {
+        int ret;
+        if (strcmp(argv[ARG_MODE], "stream") == 0) {
+            ret = stream_recv(sockfd, tofd, argv[ARG_FROM]);
+        } else {
+            ret = pipeline_recv(sockfd, tofd, argv[ARG_FROM], bufsz,
+                                atoi(argv[ARG_MODE]));
+        }
+        close(tofd);
+        close(sockfd);
+        return ret;
+    }
+    
     /* request a file from server */
     outpkt.type = PKT_TYPE_FLN;
     memcpy(outpkt.data, argv[ARG_FROM], strlen(argv[ARG_FROM]));
     outpkt.size = bufsz;
     outpkt.checksum = in_cksum((unsigned short *)&outpkt, sizeof(outpkt));
     
+    frame_reader_init(&reader);
+    status |= 1 << TRANSMIT;
+    
+#ifdef DEBUG
     int i = 0;
+#endif
     
-    while (state != QUIT) {
+    while (!(status & (1 << QUIT))) {
+#ifdef DEBUG
         printf("iteration %d\n", i++);
         printf("retries %d\n", retries);
         printf("sequence %d\n", sequence);
         printFlags(status);
-        
-        if (state == TRANSMIT) {
-            sendpacket(sockfd, &outpkt, sizeof(outpkt), 0);
-            state = UPDATE;
-        } e
+#endif
         
         /* check if we've maxed out number of retries */
         if (retries >= PKT_TRNSMAX) {
             close(tofd);
             fprintf(stderr, "%s: server unreachable\n", argv[0]);
-            break;
+            close(sockfd);
+            return EXIT_FAILURE;
         }
         
         /* transmit a packet if needed */
         if (status & (1 << TRANSMIT)) {
             /* Keep trying until send succeeds, up to PKT_DTRNSMAX times */
-            if (sendErr(sockfd, &outpkt, sizeof(outpkt), 0) == -1 &&
+            if (frame_send(sockfd, &outpkt, sizeof(outpkt)) == -1 &&
                 retries < PKT_TRNSMAX)
             {
                 perror("send");
@@ -204,9 +329,9 @@ int main(int argc, char *argv[]) {
             status &= ~(1 << TRANSMIT);
             
             /* expect an ack on next packet received */
-            if (outpkt.type != PKT_TYPE_ACK) {
+            if (outpkt.type != PKT_TYPE_RR) {
                 status |= 1 << RECEIVE;
-                if (outpkt.type != PKT_TYPE_RET) {
+                if (outpkt.type != PKT_TYPE_REJ) {
                     status |= 1 << EXPECT_ACK;
                 }
             } else if (status & (1 << END)) {
@@ -224,8 +349,8 @@ int main(int argc, char *argv[]) {
         //~ }
         
         /* retrieve packet */
-        if (recv(sockfd, &inpkt, sizeof(inpkt), 0) == -1) {
-            /* can't recover from this, so exit */
+        if (frame_recv(&reader, sockfd, &inpkt, sizeof(inpkt)) <= 0) {
+            /* can't recover from this, or the server hung up, so exit */
             close(tofd);
             return EXIT_FAILURE;
         }
@@ -236,7 +361,7 @@ int main(int argc, char *argv[]) {
         if ((ck = in_cksum((unsigned short *)&inpkt, sizeof(inpkt))) != checksum)
         {
             /* request retransmission of packet with current sequence number */
-            if (outpkt.type != PKT_TYPE_RET) {
+            if (outpkt.type != PKT_TYPE_REJ) {
                 tpkt = outpkt;
             }
             outpkt = retransmitpkt(sequence);
@@ -248,13 +373,13 @@ int main(int argc, char *argv[]) {
         
         /* put our last outgoing packet back after sending a retransmit
            request */
-        if (outpkt.type == PKT_TYPE_RET) {
+        if (outpkt.type == PKT_TYPE_REJ) {
             outpkt = tpkt;
         }
         
         /* evaluate packet */
         switch (inpkt.type) {
-            case PKT_TYPE_ACK:
+            case PKT_TYPE_RR:
                 /* if we retrieve an acknowledgment and are expecting one */
                 if (status & (1 << EXPECT_ACK)) {
                     /* acknowledgment packets are identical to the data packet,
@@ -271,7 +396,7 @@ int main(int argc, char *argv[]) {
                             "How embarrassing.\n", argv[0]);
                 }
                 break;
-            case PKT_TYPE_RET:
+            case PKT_TYPE_REJ:
                 /* If we retrieve a retransmission request, we'll just let the
                    loop try again. We'll increment our retry counter, as well.*/
                 status |= 1 << TRANSMIT;
@@ -290,8 +415,10 @@ int main(int argc, char *argv[]) {
                         status |= 1 << END;
                     }
                     
-                    /* increment sequence */
+                    /* increment sequence, and start counting retries
+                       afresh */
                     sequence++;
+                    retries = 0;
                     
                     /* prepare an acknowledgment */
                     outpkt = ackpkt(&inpkt);
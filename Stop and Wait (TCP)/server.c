@@ -1,6 +1,8 @@
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,14 +16,23 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "select_call.h"
 #include "packet.h"
+#include "frame.h"
+#include "pipeline.h"
 #include "cpe464.h"
 
 #define TIMEOUT_SEC 11
 #define TIMEOUT_USEC 0
 
+#define DEFAULT_WORKERS 256         /* transfers served at once */
+#define DEFAULT_BACKLOG 128         /* connections waiting for a worker */
+#define WORKER_STACK (256 * 1024)   /* client_comm's packets and reader */
+
 #define QUIT 0
 #define EXPECT_ACK 1
 #define EXPECT_INFO 2
@@ -131,6 +142,70 @@ int file_to_packet(int filefd, unsigned int sequence, unsigned int bufsz,
     return rd;
 }
 
+/**Sends a whole file down the connection: a stream_hdr with its length, then
+ * its bytes.  TCP already delivers them reliably and in order, so there are
+ * no packets, checksums or acknowledgments in this mode.
+ * @param connfd connected socket
+ * @param name file to send
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int stream_file(int connfd, const char *name) {
+    int fromfd;
+    struct stat fromstat;
+    struct stream_hdr hdr;
+    off_t offset = 0;
+    ssize_t sent;
+    
+    if ((fromfd = open(name, O_RDONLY)) == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    if (fstat(fromfd, &fromstat) == -1) {
+        perror("fstat");
+        close(fromfd);
+        return EXIT_FAILURE;
+    }
+    
+    hdr.type = PKT_TYPE_STM;
+    hdr.length = htobe64(fromstat.st_size);
+    if (sendall(connfd, &hdr, sizeof(hdr)) == -1) {
+        perror("send");
+        close(fromfd);
+        return EXIT_FAILURE;
+    }
+    
+    while (offset < fromstat.st_size) {
+#ifdef __linux__
+        /* the kernel copies straight from the page cache to the socket */
+        sent = sendfile(connfd, fromfd, &offset, fromstat.st_size - offset);
+#else
+        char buf[1 << 16];
+        ssize_t rd = pread(fromfd, buf, sizeof(buf), offset);
+        sent = rd > 0 ? sendall(connfd, buf, rd) : rd;
+        if (sent > 0) {
+            offset += sent;
+        }
+#endif
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendfile");
+            close(fromfd);
+            return EXIT_FAILURE;
+        } else if (sent == 0) {
+            /* the file shrank under us; the client will see it come up
+               short */
+            fprintf(stderr, "%s: %s truncated while sending\n", g_appname,
+                    name);
+            break;
+        }
+    }
+    
+    close(fromfd);
+    return offset == fromstat.st_size ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 void printFlags(uint8_t flags) {
     printf("Status flags:\n"
            "\tQuit: %s\n"
@@ -152,15 +227,15 @@ void printFlags(uint8_t flags) {
 }
 
 int client_comm(int connfd) {
-    int fromfd;
+    int fromfd = -1;              /* closing -1 is harmless; junk isn't */
     char *fromname = NULL;
     struct stat fromstat;
-    unsigned int fromlen = 0;
     
     unsigned int bufsz = 0;
     struct packet outpkt = { 0 };
     struct packet inpkt = { 0 };
     struct packet tpkt = { 0 };
+    struct frame_reader reader;
     
     uint8_t status = 0;
     uint32_t sequence = 0;
@@ -170,21 +245,26 @@ int client_comm(int connfd) {
     ssize_t rd = 0;
     unsigned int offset = 0;
     
+    frame_reader_init(&reader);
+    
     /* set to receive buffer size packet */
     status |= 1 << RECEIVE;
     status |= 1 << EXPECT_INFO;
     
+#ifdef DEBUG
     int i = 0;
+#endif
     
     while (!(status & (1 << QUIT))) {
+#ifdef DEBUG
         printf("iteration %d\n", i++);
         printf("retries %d\n", retries);
         printf("sequence %d\n", sequence);
         printFlags(status);
+#endif
         
         /* check if we've maxed out number of retries */
         if (retries >= PKT_TRNSMAX) {
-            close(fromfd);
             fprintf(stderr, "%s: client unreachable\n", g_appname);
             break;
         }
@@ -192,7 +272,7 @@ int client_comm(int connfd) {
         /* transmit a packet if needed */
         if (status & (1 << TRANSMIT)) {
             /* Keep trying until send succeeds, up to PKT_DTRNSMAX times */
-            if (sendErr(connfd, &outpkt, sizeof(outpkt), 0) == -1 &&
+            if (frame_send(connfd, &outpkt, sizeof(outpkt)) == -1 &&
                    retries < PKT_TRNSMAX)
             {
                 perror("send");
@@ -203,9 +283,9 @@ int client_comm(int connfd) {
             status &= ~(1 << TRANSMIT);
             
             /* expect an ack on next packet received */
-            if (outpkt.type != PKT_TYPE_ACK) {
+            if (outpkt.type != PKT_TYPE_RR) {
                 status |= 1 << RECEIVE;
-                if (outpkt.type != PKT_TYPE_RET) {
+                if (outpkt.type != PKT_TYPE_REJ) {
                     status |= 1 << EXPECT_ACK;
                 }
             } else {
@@ -221,8 +301,15 @@ int client_comm(int connfd) {
                 //~ return EXIT_FAILURE;
             //~ }
         
-            if (recv(connfd, &inpkt, sizeof(inpkt), 0) == -1) {
-                perror("recv");
+            /* one whole packet, however the stream split it up */
+            if ((rd = frame_recv(&reader, connfd, &inpkt,
+                                 sizeof(inpkt))) <= 0) {
+                if (rd == -1) {
+                    perror("recv");
+                } else {
+                    fprintf(stderr, "client_comm: client hung up\n");
+                }
+                free(fromname);
                 close(fromfd);
                 return EXIT_FAILURE;
             }
@@ -235,7 +322,7 @@ int client_comm(int connfd) {
             {
                 /* request retransmission of packet with current sequence
                    number */
-                if (outpkt.type != PKT_TYPE_RET) {
+                if (outpkt.type != PKT_TYPE_REJ) {
                     tpkt = outpkt;
                 }
                 outpkt = retransmitpkt(sequence);
@@ -250,13 +337,13 @@ int client_comm(int connfd) {
             
             /* put our last outgoing packet back after sending a retransmit
                request */
-            if (outpkt.type == PKT_TYPE_RET) {
+            if (outpkt.type == PKT_TYPE_REJ) {
                 outpkt = tpkt;
             }
             
             /* evaluate packet */
             switch (inpkt.type) {
-                case PKT_TYPE_ACK:
+                case PKT_TYPE_RR:
                     /* if we retrieve an acknowledgment and are expecting one */
                     if (status & (1 << EXPECT_ACK)) {
                         /* acknowledgment packets are identical to the data
@@ -280,45 +367,90 @@ int client_comm(int connfd) {
                                 status &= ~(1 << RETRANSMIT);
                                 if (lseek(fromfd, offset, SEEK_SET) == -1) {
                                     perror("lseek");
+                                    free(fromname);
+                                    close(fromfd);
                                     return EXIT_FAILURE;
                                 }
                             }
+                        } else {
+                            /* an acknowledgment of the packet before: the
+                               client hasn't got this one yet */
+                            retries++;
+                            status |= 1 << TRANSMIT;
                         }
                     } else {
                         /* exit if we retrieve an unexpected acknowledgment */
                         fprintf(stderr, "client_conn: unexpected "
                                 "acknowledgment.  How embarrassing.\n");
+                        free(fromname);
                         close(fromfd);
                         return EXIT_FAILURE;
                     }
                     break;
-                case PKT_TYPE_RET:
+                case PKT_TYPE_REJ:
                     fprintf(stderr, "client_conn: received retransmission "
                             "request for packet with sequence number %d\n",
                             ntohl(inpkt.sequence));
                     retries++;
-                    if (ntohl(inpkt.sequence) == sequence) {
+                    if (status & (1 << EXPECT_INFO)) {
+                        /* nothing's gone out yet to send again, and the
+                           file name reached us damaged: ask for it again */
+                        outpkt = retransmitpkt(sequence);
+                        status |= 1 << TRANSMIT;
+                        continue;
+                    } else if (ntohl(inpkt.sequence) == sequence) {
                         status |= 1 << TRANSMIT;
                         continue;
                     } else if (!(status & (1 << INFO_INIT))) {
-                        if (lseek(fromfd, bufsz * ntohl(inpkt.sequence),
-                            SEEK_SET) == -1) {
+                        /* the client's a packet ahead: it got this one,
+                           but its acknowledgment reached us damaged.
+                           Carry on from where it is. */
+                        sequence = ntohl(inpkt.sequence);
+                        offset = bufsz * sequence;
+                        if (lseek(fromfd, offset, SEEK_SET) == -1) {
                             perror("lseek");
+                            free(fromname);
                             close(fromfd);
                             return EXIT_FAILURE;
                         }
-                        status |= (1 << TRANSMIT) | (1 << RETRANSMIT) | (1 << NEXTDATA);
+                        retries = 0;
+                        status &= ~((1 << EXPECT_ACK) | (1 << RETRANSMIT));
+                        status |= 1 << NEXTDATA;
                     }
                     
+                    break;
+                case PKT_TYPE_STM:
+                    /* streamed file request.  Nothing else happens on this
+                       connection afterwards. */
+                    if (status & (1 << EXPECT_INFO)) {
+                        inpkt.data[PKT_DMAX - 1] = '\0';
+                        return stream_file(connfd, (char *)inpkt.data);
+                    }
+                    break;
+                case PKT_TYPE_WIN:
+                    /* pipelined file request: name, chunk size, and the
+                       window in place of a sequence number */
+                    if (status & (1 << EXPECT_INFO)) {
+                        inpkt.data[PKT_DMAX - 1] = '\0';
+                        return pipeline_file(connfd, &reader,
+                                             (char *)inpkt.data, inpkt.size,
+                                             ntohl(inpkt.sequence));
+                    }
                     break;
                 case PKT_TYPE_FLN:
                     /* buffer size packet */
                     if (status & (1 << EXPECT_INFO)) {
-                        int filenamelen = strlen((char *)inpkt.data);
+                        int filenamelen;
                         
-                        /* extract packet size and file name */
+                        /* extract packet size and file name, terminator
+                           and all */
+                        inpkt.data[PKT_DMAX - 1] = '\0';
+                        filenamelen = strlen((char *)inpkt.data) + 1;
                         bufsz = inpkt.size;
-                        fromname = (char *)malloc(filenamelen);
+                        if ((fromname = (char *)malloc(filenamelen)) == NULL) {
+                            perror("malloc");
+                            return EXIT_FAILURE;
+                        }
                         memcpy(fromname, (char *)inpkt.data, filenamelen);
                         
                         status &= ~(1 << EXPECT_INFO);
@@ -329,7 +461,12 @@ int client_comm(int connfd) {
                         status |= 1 << TRANSMIT;
                         continue;
                     }
-                    break;
+                    
+                    /* the file name again: a damaged packet left the client
+                       resending it, so show it where we are */
+                    retries++;
+                    status |= 1 << TRANSMIT;
+                    continue;
             }
         }
         
@@ -339,6 +476,7 @@ int client_comm(int connfd) {
             if (status & (1 << INFO_INIT)) {
                 if ((fromfd = open(fromname, O_RDONLY)) == -1) {
                     perror("open");
+                    free(fromname);
                     return EXIT_FAILURE;
                 }
                 
@@ -348,12 +486,10 @@ int client_comm(int connfd) {
                 /* get file stats */
                 if (fstat(fromfd, &fromstat) == -1) {
                     perror("fstat");
+                    free(fromname);
                     close(fromfd);
                     return EXIT_FAILURE;
                 }
-                /* get file length */
-                fromlen = fromstat.st_size;
-                
                 /* prepare data packet from file */
                 status |= 1 << NEXTDATA;
             }
@@ -362,6 +498,7 @@ int client_comm(int connfd) {
             if (status & (1 << NEXTDATA)) {
                 if ((rd = file_to_packet(fromfd, sequence,
                                          bufsz, &outpkt)) == -1) {
+                    free(fromname);
                     close(fromfd);
                     return EXIT_FAILURE;
                 } else if (rd == 0) {
@@ -392,9 +529,102 @@ int client_comm(int connfd) {
     return EXIT_SUCCESS;
 }
 
+/* accepted connections waiting for a worker */
+struct connqueue {
+    int *fds;
+    unsigned int cap;
+    unsigned int head;
+    unsigned int count;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+};
+
+struct connqueue g_queue = {
+    NULL, 0, 0, 0,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+};
+
+/**Runs transfers one after another for as long as the server runs.  Every
+ * connection's packets and file descriptor live on the worker's own stack
+ * in client_comm(), so workers share nothing but the queue.
+ */
+void *worker(void *arg) {
+    int connfd;
+    
+    while (1) {
+        pthread_mutex_lock(&g_queue.lock);
+        while (g_queue.count == 0) {
+            pthread_cond_wait(&g_queue.nonempty, &g_queue.lock);
+        }
+        connfd = g_queue.fds[g_queue.head];
+        g_queue.head = (g_queue.head + 1) % g_queue.cap;
+        g_queue.count--;
+        pthread_cond_signal(&g_queue.nonfull);
+        pthread_mutex_unlock(&g_queue.lock);
+        
+        client_comm(connfd);
+        close(connfd);
+    }
+    
+    return arg;
+}
+
+/**Starts the worker pool and sizes the queue feeding it.
+ * @return 0 on success, -1 if no worker could be started
+ */
+int start_workers(unsigned int workers, unsigned int backlog) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    unsigned int started = 0;
+    unsigned int i;
+    
+    if ((g_queue.fds = (int *)malloc(backlog * sizeof(int))) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    g_queue.cap = backlog;
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&thread, &attr, worker, NULL) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    
+    if (started < workers) {
+        fprintf(stderr, "%s: only %u of %u workers started\n", g_appname,
+                started, workers);
+    }
+    
+    return started > 0 ? 0 : -1;
+}
+
+/**Hands a connection to the pool.  When the queue is full this waits, so we
+ * stop accepting and the kernel's listen backlog holds the rest.
+ */
+void queue_connection(int connfd) {
+    pthread_mutex_lock(&g_queue.lock);
+    while (g_queue.count == g_queue.cap) {
+        pthread_cond_wait(&g_queue.nonfull, &g_queue.lock);
+    }
+    g_queue.fds[(g_queue.head + g_queue.count) % g_queue.cap] = connfd;
+    g_queue.count++;
+    pthread_cond_signal(&g_queue.nonempty);
+    pthread_mutex_unlock(&g_queue.lock);
+}
+
 int main(int argc, char *argv[]) {
     int sockfd;                /* listening socket */
     int newfd;                 /* connection socket */
+    unsigned int workers = DEFAULT_WORKERS;
+    unsigned int backlog = DEFAULT_BACKLOG;
     
     struct addrinfo hints;
     struct sockaddr_storage peer;
@@ -403,10 +633,20 @@ int main(int argc, char *argv[]) {
     struct sigaction sa;
     char str[INET_ADDRSTRLEN];
     
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s percent-error\n", argv[0]);
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s percent-error [workers] [backlog]\n"
+                "\tworkers: transfers served at once, 0 for one at a time "
+                "(default %d)\n"
+                "\tbacklog: connections queued beyond that (default %d)\n",
+                argv[0], DEFAULT_WORKERS, DEFAULT_BACKLOG);
         return EXIT_FAILURE;
     }
+    if (argc > 2) {
+        workers = atoi(argv[2]);
+    }
+    if (argc > 3 && (backlog = atoi(argv[3])) == 0) {
+        backlog = 1;
+    }
     
     g_appname = argv[0];
     
@@ -423,7 +663,7 @@ int main(int argc, char *argv[]) {
     }
     
     /* listen on socket */
-    if (listen(sockfd, PKT_DMAX) == -1) {
+    if (listen(sockfd, backlog) == -1) {
         perror("listen");
         close(sockfd);
         return EXIT_FAILURE;
@@ -438,6 +678,16 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
     
+    /* a client hanging up mid-transfer shouldn't take the server down */
+    signal(SIGPIPE, SIG_IGN);
+    
+    /* corrupt frame bodies at the requested rate, in every thread */
+    frame_error(atof(argv[1]));
+    
+    if (workers > 0 && start_workers(workers, backlog) == -1) {
+        return EXIT_FAILURE;
+    }
+    
     printf("%s: awaiting connections...\n", argv[0]);
     
     while (1) {
@@ -455,14 +705,14 @@ int main(int argc, char *argv[]) {
                   sizeof(str));
         printf("%s: connection from %s\n", argv[0], str);
         
-        /* each connection is its own process */
-        //if (!fork()) {
-        //    close(sockfd);
-        /* initialize corruption */
-        sendErr_init(atof(argv[1]), DROP_OFF, FLIP_ON, DEBUG_ON, RSEED_OFF);
-        client_comm(newfd);
-        //}
-        close(newfd);
+        /* hand the connection to a worker, or serve it here if there are
+           none */
+        if (workers > 0) {
+            queue_connection(newfd);
+        } else {
+            client_comm(newfd);
+            close(newfd);
+        }
     }
     
     return EXIT_SUCCESS;
@@ -0,0 +1,224 @@
+#ifndef ARQ_H
+#define ARQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/* ARQ strategies, as policies for the windows below.  A policy is a plain
+   struct of constants and static functions, so each window is compiled
+   separately for it and nothing on the per-packet path goes through a
+   virtual call or a runtime flag. */
+
+/** One packet in flight at a time, whatever window was asked for */
+struct StopAndWait {
+    enum { ID = 1, SELECTIVE = 0 };
+    static unsigned int Window(unsigned int requested) { return 1; }
+    static const char *Name() { return "stop-and-wait"; }
+};
+
+/** A reject sends everything from the rejected packet on again, and the
+ * receiver discards whatever arrives out of order */
+struct GoBackN {
+    enum { ID = 2, SELECTIVE = 0 };
+    static unsigned int Window(unsigned int requested) {
+        return requested > 0 ? requested : 1;
+    }
+    static const char *Name() { return "go-back-n"; }
+};
+
+/** A reject sends only the rejected packet again, and the receiver holds
+ * packets that arrive ahead of a gap until it's filled */
+struct SelectiveRepeat {
+    enum { ID = 3, SELECTIVE = 1 };
+    static unsigned int Window(unsigned int requested) {
+        return requested > 0 ? requested : 1;
+    }
+    static const char *Name() { return "selective-repeat"; }
+};
+
+/* the policy both programs are built with: make ARQ=sw, gbn (the default)
+   or sr */
+#if defined(ARQ_SW)
+typedef StopAndWait ArqPolicy;
+#elif defined(ARQ_SR)
+typedef SelectiveRepeat ArqPolicy;
+#else
+typedef GoBackN ArqPolicy;
+#endif
+
+/** Returns the name of the policy with the given ID, or NULL */
+inline const char *ArqName(unsigned int id) {
+    switch (id) {
+    case StopAndWait::ID:
+        return StopAndWait::Name();
+    case GoBackN::ID:
+        return GoBackN::Name();
+    case SelectiveRepeat::ID:
+        return SelectiveRepeat::Name();
+    default:
+        return NULL;
+    }
+}
+
+/** Packets sent but not yet acknowledged, [Base(), Next()).  Slots are
+ * whatever the sender keeps per packet, and are reused as the window
+ * slides; the window never frees anything itself. */
+template <class Policy, class Slot>
+class SendWindow {
+public:
+    SendWindow() : mvSize(1), mvBase(0), mvNext(0) {
+        mvSlots.resize(1);
+    }
+
+    /** Sizes an empty window, as the policy allows, starting at base */
+    void Reset(unsigned int requested, uint64_t base) {
+        mvSize = Policy::Window(requested);
+        mvSlots.assign(mvSize, Slot());
+        mvBase = mvNext = base;
+    }
+
+    /** Empties the window so the next packet pushed is sequence base.  Any
+     * slots still in it should have been released first. */
+    void Restart(uint64_t base) {
+        mvBase = mvNext = base;
+    }
+
+    unsigned int Size() const { return mvSize; }
+    unsigned int Count() const { return mvNext - mvBase; }
+    bool Empty() const { return mvNext == mvBase; }
+    bool Full() const { return mvNext - mvBase >= mvSize; }
+
+    /** Oldest unacknowledged sequence */
+    uint64_t Base() const { return mvBase; }
+    /** Sequence the next packet pushed will get */
+    uint64_t Next() const { return mvNext; }
+
+    /** True if sequence has been sent and not acknowledged */
+    bool Contains(uint64_t sequence) const {
+        return sequence - mvBase < mvNext - mvBase;
+    }
+
+    Slot &operator[](uint64_t sequence) {
+        return mvSlots[sequence % mvSize];
+    }
+
+    /** Takes the slot for sequence Next().  Check Full() first. */
+    Slot &Push() {
+        return mvSlots[mvNext++ % mvSize];
+    }
+
+    Slot &Front() {
+        return mvSlots[mvBase % mvSize];
+    }
+
+    /** Acknowledges the oldest packet.  Release its slot first. */
+    void PopFront() {
+        mvBase++;
+    }
+
+    /** Works out what to send again when the receiver rejects a sequence
+     * in the window: [from, to) */
+    void Resend(uint64_t sequence, uint64_t &from, uint64_t &to) const {
+        from = sequence;
+        to = Policy::SELECTIVE ? sequence + 1 : mvNext;
+    }
+
+private:
+    std::vector<Slot> mvSlots;
+    unsigned int mvSize;
+    uint64_t mvBase;
+    uint64_t mvNext;
+};
+
+/** Decides what to do with each arriving packet, given the sequence the
+ * receiver needs next, and holds early arrivals for policies that keep
+ * them.  Go-back-n never holds anything, so it allocates nothing. */
+template <class Policy, class Slot>
+class RecvWindow {
+public:
+    enum Verdict {
+        DELIVER,    /* the one expected: deliver it */
+        DUPLICATE,  /* delivered already */
+        HOLD,       /* ahead of a gap.  Unless it's Held() already, fill in
+                       its slot and call Hold(). */
+        REJECT      /* ahead of a gap, and not kept */
+    };
+
+    RecvWindow() : mvSize(0), mvHeldCount(0), mvRejected(NO_SEQUENCE) {}
+
+    /** Sizes the window as the policy allows.  Nothing may be held. */
+    void Reset(unsigned int requested) {
+        mvSize = Policy::SELECTIVE ? Policy::Window(requested) : 0;
+        mvSlots.assign(mvSize, Slot());
+        mvHeld.assign(mvSize, NO_SEQUENCE);
+        mvHeldCount = 0;
+        mvRejected = NO_SEQUENCE;
+    }
+
+    Verdict Classify(uint64_t sequence, uint64_t expected) const {
+        if (sequence == expected) {
+            return DELIVER;
+        } else if (sequence < expected) {
+            return DUPLICATE;
+        } else if (sequence - expected < mvSize) {
+            return HOLD;
+        }
+        return REJECT;
+    }
+
+    Slot &operator[](uint64_t sequence) {
+        return mvSlots[sequence % mvSize];
+    }
+
+    /** Marks sequence's slot as filled */
+    void Hold(uint64_t sequence) {
+        mvHeld[sequence % mvSize] = sequence;
+        mvHeldCount++;
+    }
+
+    bool Held(uint64_t sequence) const {
+        return mvSize > 0 && mvHeld[sequence % mvSize] == sequence;
+    }
+
+    /** Clears sequence's slot once its packet has been delivered.  Release
+     * whatever the slot holds first. */
+    void Unhold(uint64_t sequence) {
+        mvHeld[sequence % mvSize] = NO_SEQUENCE;
+        mvHeldCount--;
+    }
+
+    /** Packets held ahead of a gap */
+    unsigned int HeldCount() const { return mvHeldCount; }
+
+    /** Says whether a gap at expected should be rejected now.  Go-back-n
+     * rejects on every out-of-order arrival, since the sender has to start
+     * over from the gap anyway.  Selective repeat rejects each gap once;
+     * every reject would cost a retransmission, and the timeout covers a
+     * lost one. */
+    bool ShouldReject(uint64_t expected) {
+        if (!Policy::SELECTIVE) {
+            return true;
+        }
+        if (mvRejected == expected) {
+            return false;
+        }
+        mvRejected = expected;
+        return true;
+    }
+
+private:
+    static const uint64_t NO_SEQUENCE = ~(uint64_t)0;
+
+    std::vector<Slot> mvSlots;
+    std::vector<uint64_t> mvHeld;
+    unsigned int mvSize;
+    unsigned int mvHeldCount;
+    uint64_t mvRejected;
+};
+
+template <class Policy, class Slot>
+const uint64_t RecvWindow<Policy, Slot>::NO_SEQUENCE;
+
+#endif // ARQ_H
@@ -0,0 +1,70 @@
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Integers kept in a fixed byte order whatever the host's, for packet
+   headers.  Reading one gives a host integer and assigning a host integer
+   stores it, so code using the fields doesn't change, but the bytes on the
+   wire are the same from any machine.  Each access is an unaligned move
+   and, on hosts of the other order, a byte swap: no branches, and nothing
+   at all on a little-endian host.  The types have no constructors, so
+   structs holding them can still be memset, memcpy'd and sent as is. */
+
+template <class T>
+struct LittleEndian;
+
+template <>
+struct LittleEndian<uint16_t> {
+    uint8_t bytes[2];
+
+    operator uint16_t() const {
+        uint16_t v;
+        memcpy(&v, bytes, sizeof(v));
+        return le16toh(v);
+    }
+
+    LittleEndian &operator=(uint16_t value) {
+        value = htole16(value);
+        memcpy(bytes, &value, sizeof(value));
+        return *this;
+    }
+};
+
+template <>
+struct LittleEndian<uint32_t> {
+    uint8_t bytes[4];
+
+    operator uint32_t() const {
+        uint32_t v;
+        memcpy(&v, bytes, sizeof(v));
+        return le32toh(v);
+    }
+
+    LittleEndian &operator=(uint32_t value) {
+        value = htole32(value);
+        memcpy(bytes, &value, sizeof(value));
+        return *this;
+    }
+};
+
+template <>
+struct LittleEndian<uint64_t> {
+    uint8_t bytes[8];
+
+    operator uint64_t() const {
+        uint64_t v;
+        memcpy(&v, bytes, sizeof(v));
+        return le64toh(v);
+    }
+
+    LittleEndian &operator=(uint64_t value) {
+        value = htole64(value);
+        memcpy(bytes, &value, sizeof(value));
+        return *this;
+    }
+};
+
+#endif // BYTEORDER_H
@@ -0,0 +1,47 @@
+#ifndef CHECKSUMS_H
+#define CHECKSUMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Checksum policies for Link.  Both work on any packet struct with a
+   16-bit checksum field, computed with the field zeroed. */
+
+extern "C" unsigned short in_cksum(unsigned short *addr, int len);
+
+/** The Internet checksum from libcpe464 */
+struct InetChecksum {
+    template <class Packet>
+    static void Seal(Packet *pkt, size_t len) {
+        pkt->checksum = 0;
+        pkt->checksum = in_cksum((unsigned short *)pkt, len);
+    }
+
+    /** Leaves the packet as it was */
+    template <class Packet>
+    static bool Valid(Packet *pkt, size_t len) {
+        uint16_t checksum = pkt->checksum;
+        bool ok;
+
+        pkt->checksum = 0;
+        ok = in_cksum((unsigned short *)pkt, len) == checksum;
+        pkt->checksum = checksum;
+        return ok;
+    }
+};
+
+/** No checksum, for links whose lower layer already has one and nothing
+ * corrupts packets on purpose */
+struct NoChecksum {
+    template <class Packet>
+    static void Seal(Packet *pkt, size_t len) {
+        pkt->checksum = 0;
+    }
+
+    template <class Packet>
+    static bool Valid(Packet *pkt, size_t len) {
+        return true;
+    }
+};
+
+#endif // CHECKSUMS_H
@@ -0,0 +1,78 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "Checksums.h"
+#include "Sockets.h"
+
+/* A packet link: a socket policy to move packets and a checksum policy to
+   guard them, both picked at compile time.  With the ARQ windows in Arq.h
+   it's everything the file servers share; packet formats, handshakes and
+   the rest stay with each program. */
+
+enum LinkStatus {
+    LINK_OK,
+    LINK_TIMEOUT,
+    LINK_CORRUPT,   /* too short for a header, or a bad checksum */
+    LINK_FAILED     /* the socket failed, or the peer closed it */
+};
+
+template <class Packet, class Socket, class Checksum>
+class Link {
+public:
+    Link() : mvHeaderLen(0) {}
+
+    /** @param headerLen shortest packet accepted */
+    Link(const Socket &socket, size_t headerLen) :
+    mvSocket(socket),
+    mvHeaderLen(headerLen) {}
+
+    Socket &GetSocket() { return mvSocket; }
+
+    /** Checksums a packet's first len bytes.  Packets are sealed once and
+     * may be sent any number of times. */
+    void Seal(Packet *pkt, size_t len) const {
+        Checksum::Seal(pkt, len);
+    }
+
+    ssize_t Send(const Packet *pkt, size_t len) {
+        return mvSocket.Send(pkt, len);
+    }
+
+    int Queue(const Packet *pkt, size_t len) {
+        return mvSocket.Queue(pkt, len);
+    }
+
+    int Flush() {
+        return mvSocket.Flush();
+    }
+
+    bool Pending() const {
+        return mvSocket.Pending();
+    }
+
+    /** Receives a packet and checks it
+     * @param len set to the bytes received
+     * @param timeoutUs how long to wait, or -1 to wait for good
+     */
+    LinkStatus Recv(Packet &pkt, ssize_t &len, long timeoutUs) {
+        int got = mvSocket.Recv(&pkt, sizeof(pkt), len, timeoutUs);
+
+        if (got < 0) {
+            return LINK_FAILED;
+        } else if (got == 0) {
+            return LINK_TIMEOUT;
+        } else if ((size_t)len < mvHeaderLen || !Checksum::Valid(&pkt, len)) {
+            return LINK_CORRUPT;
+        }
+        return LINK_OK;
+    }
+
+private:
+    Socket mvSocket;
+    size_t mvHeaderLen;
+};
+
+#endif // LINK_H
@@ -0,0 +1,253 @@
+#ifndef SOCKETS_H
+#define SOCKETS_H
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+/* Socket policies for Link.  A policy moves whole messages and provides:
+     ssize_t Send(const void *buf, size_t len)      sends one now
+     int Queue(const void *buf, size_t len)         sends one, maybe later
+     int Flush()                                    sends anything queued
+     int Recv(void *buf, size_t max, ssize_t &len, long timeoutUs)
+                                                    1 if a message came in,
+                                                    0 on timeout, -1 if the
+                                                    socket failed or closed
+     bool Pending() const                           a message is buffered, so
+                                                    Recv won't wait
+   Queued messages must stay put until Flush().  Programs add their own
+   policies next to this one, e.g. for a framed TCP stream. */
+
+typedef ssize_t (*SendToFunc)(int, const void *, size_t, int,
+                              const struct sockaddr *, socklen_t);
+
+#define SOCKET_BATCH 16 // Datagrams taken per recvmmsg(2) while busy polling
+
+/** An unconnected UDP socket talking to one peer at a time.  Every
+ * datagram goes through SendTo, so an impairment layer can stand in for
+ * sendto(2) without costing a call through a pointer. */
+template <SendToFunc SendTo = ::sendto>
+class DatagramSocket {
+public:
+    DatagramSocket() : mvFd(-1), mvPeerLen(0), mvBusyUs(0), mvSlot(0),
+    mvNext(0), mvCount(0) {}
+
+    /** A socket with no peer yet, which takes the first one it hears from */
+    explicit DatagramSocket(int fd) : mvFd(fd), mvPeerLen(0), mvBusyUs(0),
+    mvSlot(0), mvNext(0), mvCount(0) {}
+
+    DatagramSocket(int fd, const sockaddr_storage &peer, socklen_t peerLen) :
+    mvFd(fd),
+    mvPeer(peer),
+    mvPeerLen(peerLen),
+    mvBusyUs(0),
+    mvSlot(0),
+    mvNext(0),
+    mvCount(0) {}
+
+    int Fd() const { return mvFd; }
+
+    /** Where sends go: the peer given, or whoever sent the last datagram */
+    const sockaddr_storage &Peer() const { return mvPeer; }
+    socklen_t PeerLen() const { return mvPeerLen; }
+
+    /** Points sends somewhere else, leaving anything received alone */
+    void SetPeer(const sockaddr_storage &peer, socklen_t peerLen) {
+        mvPeer = peer;
+        mvPeerLen = peerLen;
+    }
+
+    /** Spins for up to budgetUs on an empty socket before sleeping, taking
+     * datagrams a batch at a time.  A wake-up through poll(2) costs tens of
+     * microseconds.  That matters when the answer is due in less.  The
+     * kernel is asked to busy poll the device as well (SO_BUSY_POLL), which
+     * may need CAP_NET_ADMIN.  The spinning doesn't.
+     * @param budgetUs how long to spin, or 0 to always sleep
+     * @return 0, or -1 with errno set if the kernel turned SO_BUSY_POLL down
+     */
+    int BusyPoll(long budgetUs) {
+        int usec = budgetUs > 0 ? budgetUs : 0;
+        mvBusyUs = usec;
+        return setsockopt(mvFd, SOL_SOCKET, SO_BUSY_POLL, &usec,
+                          sizeof(usec));
+    }
+
+    ssize_t Send(const void *buf, size_t len) {
+        return SendTo(mvFd, buf, len, 0, (const sockaddr *)&mvPeer,
+                      mvPeerLen);
+    }
+
+    /** Datagrams aren't batched, so this sends straight away */
+    int Queue(const void *buf, size_t len) {
+        return Send(buf, len) == -1 ? -1 : 0;
+    }
+
+    int Flush() { return 0; }
+
+    /** Receives a datagram from anyone, and makes its sender the peer
+     * @param timeoutUs how long to wait, 0 to take only what's there, as an
+     *        event loop does once poll(2) says it's readable, or -1 to wait
+     *        for good
+     */
+    int Recv(void *buf, size_t max, ssize_t &len, long timeoutUs) {
+        if (mvBusyUs > 0) {
+            return spin(buf, max, len, timeoutUs);
+        }
+        
+        if (timeoutUs > 0) {
+            pollfd pfd = { mvFd, POLLIN, 0 };
+            int ready;
+
+            // A signal handler, like the server's SIGCHLD one, cuts the
+            // wait short; the timeout just starts over
+            while ((ready = poll(&pfd, 1, (timeoutUs + 999) / 1000)) == -1 &&
+                   errno == EINTR) {
+            }
+            if (ready <= 0) {
+                return ready;
+            }
+        }
+
+        socklen_t peerLen = mvPeerLen;
+        do {
+            mvPeerLen = sizeof(mvPeer);
+            len = recvfrom(mvFd, buf, max, timeoutUs == 0 ? MSG_DONTWAIT : 0,
+                           (sockaddr *)&mvPeer, &mvPeerLen);
+        } while (len == -1 && errno == EINTR);
+
+        // Nothing there leaves the peer as it was
+        if (len == -1 && timeoutUs == 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            mvPeerLen = peerLen;
+            return 0;
+        }
+        return len == -1 ? -1 : 1;
+    }
+
+    bool Pending() const { return mvNext < mvCount; }
+
+private:
+    int mvFd;
+    sockaddr_storage mvPeer;
+    socklen_t mvPeerLen;
+    
+    /** Busy polling's spin budget, and the batch it last took: SOCKET_BATCH
+     * slots of mvSlot bytes, mvCount of them filled, mvNext the next to hand
+     * out */
+    long mvBusyUs;
+    std::vector<char> mvBatch;
+    size_t mvSlot;
+    sockaddr_storage mvFrom[SOCKET_BATCH];
+    socklen_t mvFromLen[SOCKET_BATCH];
+    size_t mvLen[SOCKET_BATCH];
+    unsigned int mvNext;
+    unsigned int mvCount;
+
+    static long elapsedUs(const timespec &since) {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - since.tv_sec) * 1000000 +
+               (now.tv_nsec - since.tv_nsec) / 1000;
+    }
+
+    /** Takes whatever's waiting, without waiting for more
+     * @return datagrams taken, 0 if there were none, or -1 if the socket
+     *         failed
+     */
+    int take(size_t max) {
+        mmsghdr msgs[SOCKET_BATCH];
+        iovec iov[SOCKET_BATCH];
+        int got;
+
+        if (mvBatch.size() < SOCKET_BATCH * max) {
+            mvBatch.resize(SOCKET_BATCH * max);
+        }
+        mvSlot = max;
+        memset(msgs, 0, sizeof(msgs));
+        for (unsigned int i = 0; i < SOCKET_BATCH; i++) {
+            iov[i].iov_base = &mvBatch[i * max];
+            iov[i].iov_len = max;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &mvFrom[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(mvFrom[i]);
+        }
+
+        got = recvmmsg(mvFd, msgs, SOCKET_BATCH, MSG_DONTWAIT, NULL);
+        if (got < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ||
+                   errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < got; i++) {
+            mvLen[i] = msgs[i].msg_len;
+            mvFromLen[i] = msgs[i].msg_hdr.msg_namelen;
+        }
+        mvNext = 0;
+        mvCount = got;
+        return got;
+    }
+
+    /** Hands out the next datagram taken, making its sender the peer */
+    int next(void *buf, size_t max, ssize_t &len) {
+        unsigned int i = mvNext++;
+
+        len = mvLen[i] < max ? mvLen[i] : max;
+        memcpy(buf, &mvBatch[i * mvSlot], len);
+        mvPeer = mvFrom[i];
+        mvPeerLen = mvFromLen[i];
+        return 1;
+    }
+
+    /** Recv() for busy polling: what's left of the last batch, then a spin
+     * on the socket, then a sleep for the rest of the timeout */
+    int spin(void *buf, size_t max, ssize_t &len, long timeoutUs) {
+        timespec start;
+        long budget = mvBusyUs;
+        int got;
+
+        if (mvNext < mvCount) {
+            return next(buf, max, len);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (timeoutUs >= 0 && timeoutUs < budget) {
+            budget = timeoutUs;
+        }
+        do {
+            if ((got = take(max)) != 0) {
+                return got < 0 ? -1 : next(buf, max, len);
+            }
+            
+            // Anything else that can run goes first, so a spin never holds
+            // up the very process it's waiting on when they share a CPU
+            sched_yield();
+        } while (elapsedUs(start) < budget);
+
+        // Nothing yet, so sleep like any other socket
+        do {
+            pollfd pfd = { mvFd, POLLIN, 0 };
+            long waitMs = -1;
+            int ready;
+
+            if (timeoutUs >= 0) {
+                long left = timeoutUs - elapsedUs(start);
+                waitMs = left > 0 ? (left + 999) / 1000 : 0;
+            }
+            while ((ready = poll(&pfd, 1, waitMs)) == -1 && errno == EINTR) {
+            }
+            if (ready <= 0) {
+                return ready;
+            }
+        } while ((got = take(max)) == 0 && timeoutUs < 0);
+
+        return got <= 0 ? got : next(buf, max, len);
+    }
+};
+
+#endif // SOCKETS_H